@@ -1,8 +1,13 @@
 import bext
+import ctypes, os
 import time, random, sys
 
 GENERATIONS = 3
 PAUSE = 0.25
+THREADS = os.cpu_count() or 1
+# The native engine built from life/, used when it is there.
+LIFE_LIB = os.environ.get('LIFE_LIB', os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                                   'life', 'build', 'liblife.so'))
 current_things = {}
 next_things = {}
 
@@ -19,8 +24,52 @@ for x in range(WIDTH):
             next_things[x, y] = True
 
 
+def load_life():
+    try:
+        lib = ctypes.CDLL(LIFE_LIB)
+    except OSError:
+        return None
+    lib.life_new.restype = ctypes.c_void_p
+    lib.life_new.argtypes = [ctypes.c_int, ctypes.c_int]
+    lib.life_get_cells.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.life_set_cells.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    lib.life_step.restype = ctypes.c_bool
+    lib.life_step.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+    return lib
+
+
+life = load_life()
+board = None
+if life:
+    board = life.life_new(WIDTH, HEIGHT)
+    cells = ctypes.create_string_buffer(WIDTH * HEIGHT)
+    for x, y in next_things:
+        cells[y * WIDTH + x] = 1
+    life.life_set_cells(board, cells)
+
+
+def read_board():
+    cells = ctypes.create_string_buffer(WIDTH * HEIGHT)
+    life.life_get_cells(board, cells)
+    return {(i % WIDTH, i // WIDTH): True for i, alive in enumerate(cells.raw) if alive}
+
+
+def update_native():
+    # Leaves the same generation in current_things as update() does.
+    global current_things
+    if GENERATIONS > 1:
+        if not life.life_step(board, GENERATIONS - 2, THREADS):
+            raise MemoryError('liblife could not step the board')
+        current_things = read_board()
+        if not life.life_step(board, 1, THREADS):
+            raise MemoryError('liblife could not step the board')
+
+
 def update():
     global current_things, next_things, WIDTH, HEIGHT
+    if board:
+        update_native()
+        return
     for i in range(1, GENERATIONS):
         current_things = next_things
         current_things_loc = current_things
@@ -28,10 +77,10 @@ def update():
         for x in range(WIDTH):
             for y in range(HEIGHT):
                 # Get neighboring coordinates:
-                left_coord = x - 1 % HEIGHT
-                right_coord = x + 1 % HEIGHT
-                top_coord = y - 1 % HEIGHT
-                bottom_coord = y + 1 % HEIGHT
+                left_coord = (x - 1) % WIDTH
+                right_coord = (x + 1) % WIDTH
+                top_coord = (y - 1) % HEIGHT
+                bottom_coord = (y + 1) % HEIGHT
 
                 # Get neighbors:
                 top_left = (left_coord, top_coord) in current_things
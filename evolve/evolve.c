@@ -0,0 +1,472 @@
+// String evolution over a population stored as one byte matrix
+//
+// The candidates are the rows of one contiguous matrix, and the next
+// generation is bred into a second one. Scoring a candidate compares it with
+// the target 32 or 16 bytes at a time, and a popcount of the compare mask
+// counts the matching characters.
+//
+// Selection draws from cumulative sums of the weights rather than an expanded
+// pool or retries. The threads take bands of rows. Each sums the weights of
+// its own band while scoring it, and once the band totals are known, offsets
+// its sums by the bands before it and fills its part of a guide table: one
+// bucket per candidate, each pointing at the first candidate whose sum is
+// past the bucket's share of the total. A draw starts at its bucket and is
+// rarely more than a step or two from the candidate it selects, where a
+// binary search would miss the cache at every level.
+//
+// Every child has its own random stream, seeded from the run's seed, the
+// generation and the child's row. The threads share no generator state, and
+// a run turns out the same on any number of threads.
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "evolve.h"
+
+#define MIN(x, y) ((x) <= (y) ? (x) : (y))
+#define MAX(x, y) ((x) >= (y) ? (x) : (y))
+
+// The bands meet three times a generation. A band of fewer candidates than
+// this would spend more of the generation waiting for the others than
+// scoring and breeding its own.
+#define EVOLVE_MIN_BAND 64
+
+struct Evolver {
+    size_t len;
+    // Bytes from one row of the matrix to the next: len rounded up to 32.
+    size_t stride;
+    size_t population;
+    uint8_t *target;
+    uint8_t *alphabet;
+    size_t alphabet_len;
+    // 1 / log(1 - mutation) for drawing the gaps between mutations, or 0 to
+    // mutate every character; unused without mutation.
+    double mutation;
+    double mutation_scale;
+    uint64_t seed;
+    // The population is rows[current]; breeding writes the other.
+    uint8_t *rows[2];
+    int current;
+    // Per candidate of the population last scored: its matches, the running
+    // sum of the weights, and the guide table into the sums.
+    uint32_t *matches;
+    uint64_t *cumulative;
+    size_t *guide;
+    uint64_t generation;
+    bool done;
+    // The fittest candidate of the population last scored.
+    char *best;
+    size_t best_matches;
+};
+
+// splitmix64, which is good for any seed including 0.
+uint64_t evolve_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// A uniform draw from [0, n), by the high half of a 128-bit product.
+uint64_t evolve_random_below(uint64_t *state, uint64_t n) {
+    return (uint64_t)(((unsigned __int128)evolve_random(state) * n) >> 64);
+}
+
+// The random stream of one row of one generation.
+uint64_t evolve_stream(const Evolver *ev, uint64_t generation, size_t row) {
+    uint64_t state = ev->seed ^ (generation * 0xd1b54a32d192ed03ull);
+    state ^= evolve_random(&state) + row * 0x8cb92ba72f3d8dd7ull;
+    evolve_random(&state);
+    return state;
+}
+
+uint8_t *evolve_row(const Evolver *ev, int buffer, size_t row) {
+    return ev->rows[buffer] + row * ev->stride;
+}
+
+Evolver *evolve_new(const char *target, const char *alphabet, size_t population, double mutation, uint64_t seed) {
+    size_t len = strlen(target);
+    size_t alphabet_len = strlen(alphabet);
+    if (len == 0 || alphabet_len == 0 || population == 0 || len > UINT32_MAX) {
+        return NULL;
+    }
+    Evolver *ev = calloc(1, sizeof(Evolver));
+    if (!ev) {
+        return NULL;
+    }
+    ev->len = len;
+    ev->stride = (len + 31) & ~(size_t)31;
+    ev->population = population;
+    ev->alphabet_len = alphabet_len;
+    ev->mutation = mutation;
+    ev->mutation_scale = mutation < 1 ? 1 / log1p(-mutation) : 0;
+    ev->seed = seed;
+    ev->target = malloc(len);
+    ev->alphabet = malloc(alphabet_len);
+    ev->best = calloc(len + 1, 1);
+    ev->matches = malloc(population * sizeof(uint32_t));
+    ev->cumulative = malloc(population * sizeof(uint64_t));
+    ev->guide = malloc(population * sizeof(size_t));
+    ev->rows[0] = calloc(population, ev->stride);
+    ev->rows[1] = calloc(population, ev->stride);
+    if (!ev->target || !ev->alphabet || !ev->best || !ev->matches || !ev->cumulative || !ev->guide || !ev->rows[0] || !ev->rows[1]) {
+        evolve_free(ev);
+        return NULL;
+    }
+    memcpy(ev->target, target, len);
+    memcpy(ev->alphabet, alphabet, alphabet_len);
+    // Four characters from each 64-bit draw, 16 bits apiece.
+    for (size_t i = 0; i < population; i++) {
+        uint64_t state = evolve_stream(ev, UINT64_MAX, i);
+        uint8_t *row = evolve_row(ev, 0, i);
+        for (size_t c = 0; c < len; c += 4) {
+            uint64_t bits = evolve_random(&state);
+            for (size_t k = c; k < MIN(c + 4, len); k++, bits >>= 16) {
+                row[k] = ev->alphabet[((bits & 0xffff) * alphabet_len) >> 16];
+            }
+        }
+    }
+    return ev;
+}
+
+void evolve_free(Evolver *ev) {
+    if (ev) {
+        free(ev->target);
+        free(ev->alphabet);
+        free(ev->best);
+        free(ev->matches);
+        free(ev->cumulative);
+        free(ev->guide);
+        free(ev->rows[0]);
+        free(ev->rows[1]);
+        free(ev);
+    }
+}
+
+size_t evolve_length(const Evolver *ev) {
+    return ev->len;
+}
+
+uint64_t evolve_generation(const Evolver *ev) {
+    return ev->generation;
+}
+
+size_t evolve_best(const Evolver *ev, char *text) {
+    memcpy(text, ev->best, ev->len + 1);
+    return ev->best_matches;
+}
+
+// Counts the places where a and b hold the same byte.
+size_t evolve_matches(const uint8_t *a, const uint8_t *b, size_t len) {
+    size_t count = 0;
+    size_t i = 0;
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + i));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + i));
+        count += __builtin_popcount((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y)));
+    }
+#endif
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + i));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + i));
+        count += __builtin_popcount((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)));
+    }
+#endif
+    for (; i < len; i++) {
+        count += a[i] == b[i];
+    }
+    return count;
+}
+
+typedef struct EvolveBand EvolveBand;
+
+typedef struct EvolveRun {
+    Evolver *ev;
+    int generations;
+    // The generation of the first population the run scores.
+    uint64_t first_generation;
+    EvolveBand *bands;
+    int num_bands;
+    pthread_barrier_t barrier;
+    // The rows of a band depend on how many bands there are, which is only
+    // settled once every thread that could be started has been. The started
+    // threads wait for that here.
+    pthread_mutex_t lock;
+    pthread_cond_t settled;
+    bool is_settled;
+} EvolveRun;
+
+// A band of rows, and what it tells the other bands about its rows after
+// scoring them.
+struct EvolveBand {
+    EvolveRun *run;
+    int index;
+    // The sum of the weights of its rows, and its fittest candidate.
+    uint64_t total;
+    size_t best;
+};
+
+void evolve_band_rows(const EvolveRun *run, int index, size_t *begin, size_t *end) {
+    size_t population = run->ev->population;
+    *begin = (size_t)((unsigned __int128)population * index / run->num_bands);
+    *end = (size_t)((unsigned __int128)population * (index + 1) / run->num_bands);
+}
+
+// Makes the running sums of rows [begin, end) global by adding offset, the
+// weight of the rows before them, and fills the guide entries that land in
+// the rows: entry k is the first candidate whose sum is past k * total / population.
+void evolve_guide_band(Evolver *ev, size_t begin, size_t end, uint64_t offset, uint64_t total) {
+    for (size_t i = begin; i < end; i++) {
+        ev->cumulative[i] += offset;
+    }
+    if (begin == end) {
+        return;
+    }
+    unsigned __int128 n = ev->population;
+    size_t k = (size_t)((offset * n + total - 1) / total);
+    size_t k_end = (size_t)((ev->cumulative[end - 1] * n + total - 1) / total);
+    for (size_t i = begin; k < k_end; k++) {
+        while (ev->cumulative[i] * n <= k * (unsigned __int128)total) {
+            i++;
+        }
+        ev->guide[k] = i;
+    }
+}
+
+// Finds the candidate that a uniform 64-bit draw u selects: the first whose
+// running sum is past u * total / 2^64. The draw's bucket in the guide table
+// is at or before it.
+size_t evolve_pick(const Evolver *ev, uint64_t total, uint64_t u) {
+    uint64_t r = (uint64_t)(((unsigned __int128)u * total) >> 64);
+    size_t i = ev->guide[(size_t)(((unsigned __int128)u * ev->population) >> 64)];
+    while (ev->cumulative[i] <= r) {
+        i++;
+    }
+    return i;
+}
+
+void evolve_wait(EvolveRun *run) {
+    if (run->num_bands > 1) {
+        pthread_barrier_wait(&run->barrier);
+    }
+}
+
+// Scores and breeds the rows of one band, generation after generation,
+// meeting the other bands at the barrier after scoring, after the guide
+// table and after breeding.
+void evolve_run_band(EvolveRun *run, int index) {
+    Evolver *ev = run->ev;
+    size_t begin, end;
+    evolve_band_rows(run, index, &begin, &end);
+    for (int gen = 0; gen < run->generations; gen++) {
+        int from = (ev->current + gen) & 1;
+        uint64_t sum = 0;
+        size_t best = begin;
+        for (size_t i = begin; i < end; i++) {
+            uint32_t matches = (uint32_t)evolve_matches(evolve_row(ev, from, i), ev->target, ev->len);
+            ev->matches[i] = matches;
+            sum += (uint64_t)matches * matches + 1;
+            ev->cumulative[i] = sum;
+            best = matches > ev->matches[best] ? i : best;
+        }
+        run->bands[index].total = sum;
+        run->bands[index].best = best;
+        evolve_wait(run);
+
+        // Every band works out the same fittest candidate, the first of the
+        // best, and band 0 records it.
+        uint64_t total = 0;
+        uint64_t offset = 0;
+        size_t fittest = run->bands[0].best;
+        for (const EvolveBand *band = run->bands; band != run->bands + run->num_bands; band++) {
+            offset += band->index < index ? band->total : 0;
+            total += band->total;
+            fittest = ev->matches[band->best] > ev->matches[fittest] ? band->best : fittest;
+        }
+        bool done = ev->matches[fittest] == ev->len;
+        if (index == 0) {
+            memcpy(ev->best, evolve_row(ev, from, fittest), ev->len);
+            ev->best_matches = ev->matches[fittest];
+            ev->generation++;
+            ev->done = done;
+        }
+        if (done) {
+            break;
+        }
+        evolve_guide_band(ev, begin, end, offset, total);
+        evolve_wait(run);
+
+        for (size_t i = begin; i < end; i++) {
+            uint64_t state = evolve_stream(ev, run->first_generation + gen, i);
+            const uint8_t *a = evolve_row(ev, from, evolve_pick(ev, total, evolve_random(&state)));
+            const uint8_t *b = evolve_row(ev, from, evolve_pick(ev, total, evolve_random(&state)));
+            size_t midpoint = evolve_random_below(&state, ev->len);
+            if (evolve_random(&state) & 1) {
+                const uint8_t *t = a;
+                a = b;
+                b = t;
+            }
+            uint8_t *child = evolve_row(ev, !from, i);
+            memcpy(child, a, midpoint);
+            memcpy(child + midpoint, b + midpoint, ev->len - midpoint);
+            if (ev->mutation > 0) {
+                // Jump from one mutation to the next by geometric gaps
+                // rather than rolling for every character.
+                for (size_t pos = 0;; pos++) {
+                    double u = ((evolve_random(&state) >> 11) + 1) * 0x1p-53;
+                    double gap = ev->mutation_scale ? log(u) * ev->mutation_scale : 0;
+                    if (gap >= (double)(ev->len - pos)) {
+                        break;
+                    }
+                    pos += (size_t)gap;
+                    child[pos] = ev->alphabet[evolve_random_below(&state, ev->alphabet_len)];
+                }
+            }
+        }
+        evolve_wait(run);
+    }
+}
+
+void *evolve_band_thread(void *arg) {
+    EvolveBand *band = arg;
+    EvolveRun *run = band->run;
+    pthread_mutex_lock(&run->lock);
+    while (!run->is_settled) {
+        pthread_cond_wait(&run->settled, &run->lock);
+    }
+    pthread_mutex_unlock(&run->lock);
+    // A thread whose band did not make it into the run has nothing to do.
+    if (band->index < run->num_bands) {
+        evolve_run_band(run, band->index);
+    }
+    return NULL;
+}
+
+bool evolve_run(Evolver *ev, int generations, int threads) {
+    if (ev->done || generations <= 0) {
+        return ev->done;
+    }
+    uint64_t start_generation = ev->generation;
+    EvolveRun run = {.ev = ev, .generations = generations, .first_generation = start_generation};
+    threads = (int)MAX(1, MIN((size_t)MAX(threads, 1), ev->population / EVOLVE_MIN_BAND));
+    // Band 0 is the calling thread's, and is all there is if the others'
+    // bookkeeping cannot be had.
+    EvolveBand only_band = {&run, 0, 0, 0};
+    pthread_t *handles = threads > 1 ? calloc(threads - 1, sizeof(pthread_t)) : NULL;
+    run.bands = handles ? calloc(threads, sizeof(EvolveBand)) : NULL;
+    if (!run.bands) {
+        run.bands = &only_band;
+        threads = 1;
+    }
+    run.bands[0] = only_band;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.settled, NULL);
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        run.bands[started + 1] = (EvolveBand){&run, started + 1, 0, 0};
+        if (pthread_create(&handles[started], NULL, evolve_band_thread, &run.bands[started + 1]) != 0) {
+            break;
+        }
+    }
+    run.num_bands = started + 1;
+    if (run.num_bands > 1 && pthread_barrier_init(&run.barrier, NULL, run.num_bands) != 0) {
+        run.num_bands = 1;
+    }
+    pthread_mutex_lock(&run.lock);
+    run.is_settled = true;
+    pthread_cond_broadcast(&run.settled);
+    pthread_mutex_unlock(&run.lock);
+    evolve_run_band(&run, 0);
+    for (int i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    if (run.num_bands > 1) {
+        pthread_barrier_destroy(&run.barrier);
+    }
+    pthread_cond_destroy(&run.settled);
+    pthread_mutex_destroy(&run.lock);
+    free(handles);
+    if (run.bands != &only_band) {
+        free(run.bands);
+    }
+    // A run that found the target did not breed from its last population.
+    uint64_t bred = ev->generation - start_generation - ev->done;
+    ev->current = (int)((ev->current + bred) & 1);
+    return ev->done;
+}
+
+// The tests are run from Release builds, so they keep their asserts.
+#undef NDEBUG
+#include <assert.h>
+
+void evolve_test(void) {
+    // Lengths on either side of the vector widths.
+    uint8_t a[1000], b[1000];
+    uint64_t state = 1;
+    for (size_t i = 0; i < sizeof(a); i++) {
+        a[i] = evolve_random(&state) % 3;
+        b[i] = evolve_random(&state) % 3;
+    }
+    const size_t lens[] = {0, 1, 15, 16, 17, 31, 32, 33, 63, 100, 1000};
+    for (size_t i = 0; i < sizeof(lens)/sizeof(*lens); i++) {
+        size_t expected = 0;
+        for (size_t c = 0; c < lens[i]; c++) {
+            expected += a[c] == b[c];
+        }
+        assert(evolve_matches(a, b, lens[i]) == expected);
+        assert(evolve_matches(a + 1, a + 1, lens[i] ? lens[i] - 1 : 0) == (lens[i] ? lens[i] - 1 : 0));
+    }
+
+    // Draws land on the candidate whose share of the weight they fall in,
+    // with the sums and guide table built in two bands.
+    Evolver *ev = evolve_new("ab", "ab", 5, 0, 1);
+    const uint64_t band_sums[5] = {1, 5, 2, 5, 8};
+    const uint64_t global_sums[5] = {1, 5, 7, 10, 13};
+    memcpy(ev->cumulative, band_sums, sizeof(band_sums));
+    evolve_guide_band(ev, 0, 2, 0, 13);
+    evolve_guide_band(ev, 2, 5, 5, 13);
+    assert(memcmp(ev->cumulative, global_sums, sizeof(global_sums)) == 0);
+    for (int draw = 0; draw < 10000; draw++) {
+        uint64_t u = evolve_random(&state);
+        uint64_t r = (uint64_t)(((unsigned __int128)u * 13) >> 64);
+        size_t expected = 0;
+        while (global_sums[expected] <= r) {
+            expected++;
+        }
+        assert(evolve_pick(ev, 13, u) == expected);
+    }
+    assert(evolve_pick(ev, 13, 0) == 0 && evolve_pick(ev, 13, UINT64_MAX) == 4);
+    evolve_free(ev);
+
+    // A run is the same on any number of threads, and reaches the target.
+    const char *target = "to be or not to be that is the question";
+    const char *alphabet = "abcdefghijklmnopqrstuvwxyz ";
+    Evolver *one = evolve_new(target, alphabet, 1000, 0.005, 42);
+    Evolver *many = evolve_new(target, alphabet, 1000, 0.005, 42);
+    char text[2][64];
+    for (int step = 0; step < 4; step++) {
+        evolve_run(one, 5, 1);
+        evolve_run(many, 5, 3);
+        assert(evolve_best(one, text[0]) == evolve_best(many, text[1]));
+        assert(strcmp(text[0], text[1]) == 0 && strlen(text[0]) == strlen(target));
+        assert(evolve_generation(one) == evolve_generation(many));
+    }
+    size_t previous = evolve_best(one, text[0]);
+    bool found = evolve_run(one, 2000, 2);
+    assert(found && evolve_best(one, text[0]) == strlen(target) && strcmp(text[0], target) == 0);
+    assert(previous < strlen(target));
+    // Once found, the population stays put.
+    uint64_t generation = evolve_generation(one);
+    assert(evolve_run(one, 10, 1) && evolve_generation(one) == generation);
+    evolve_free(one);
+    evolve_free(many);
+
+    assert(evolve_new("", "ab", 10, 0, 1) == NULL && evolve_new("ab", "ab", 0, 0, 1) == NULL);
+}
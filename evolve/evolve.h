@@ -0,0 +1,42 @@
+// A genetic algorithm that evolves random strings towards a target string.
+//
+// Every generation scores each candidate by the number of characters it has
+// in the right place, picks parents with probability proportional to the
+// square of that plus one, and breeds each child by single-point crossover of
+// two parents, with optional mutation. This is the scheme of shakespeare.py.
+#ifndef EVOLVE_H
+#define EVOLVE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Evolver Evolver;
+
+// Returns a population of random strings over alphabet, as long as target,
+// or NULL if an argument is empty or the memory cannot be had. mutation is
+// the chance of each character of a child being replaced by a random one.
+// The run is determined by seed, whatever the number of threads.
+Evolver *evolve_new(const char *target, const char *alphabet, size_t population, double mutation, uint64_t seed);
+void evolve_free(Evolver *ev);
+
+size_t evolve_length(const Evolver *ev);
+// Populations scored so far.
+uint64_t evolve_generation(const Evolver *ev);
+
+// Runs up to the given number of generations on up to the given number of
+// threads. Each scores the population, stops if its fittest candidate is the
+// target, and otherwise breeds the next population. Returns true once the
+// target has been found.
+bool evolve_run(Evolver *ev, int generations, int threads);
+
+// Copies the fittest candidate of the last population scored, and a NUL, to
+// text, which has room for evolve_length + 1 bytes, and returns how many of
+// its characters match the target. Before the first run it writes an empty
+// string and returns 0.
+size_t evolve_best(const Evolver *ev, char *text);
+
+// Checks the scoring, selection and breeding; asserts on failure.
+void evolve_test(void);
+
+#endif
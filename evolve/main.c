@@ -0,0 +1,161 @@
+// evolve: runs the engine in evolve.c towards a target string, printing the
+// fittest candidate of each generation, or timed without printing.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "evolve.h"
+
+typedef struct Options {
+    const char *target;
+    const char *alphabet;
+    size_t length;
+    size_t population;
+    int generations;
+    int threads;
+    double mutation;
+    uint64_t seed;
+    bool bench;
+    bool test;
+} Options;
+
+void usage(void) {
+    printf("Usage: evolve [options]\n"
+           "  --target=TEXT       string to evolve towards (default: shakespeare.py's)\n"
+           "  --length=N          evolve towards N random characters of the alphabet instead\n"
+           "  --alphabet=TEXT     characters of the candidates (default: a-z and space)\n"
+           "  --population=N      candidates per generation (default 2000, or 100000 with --bench)\n"
+           "  --generations=N     stop after N generations (default 100000, or 10 with --bench)\n"
+           "  --threads=N         split the population into bands over up to N threads (default: one per core)\n"
+           "  --mutation=R        chance of each character of a child mutating (default 0)\n"
+           "  --seed=N            seed for the run (default 1)\n"
+           "  --bench             time the generations without printing, on one thread and on --threads\n"
+           "  --test              run the built-in tests\n");
+}
+
+double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+// Returns a string of length random characters of the alphabet.
+char *random_target(const Options *options) {
+    char *target = malloc(options->length + 1);
+    size_t alphabet_len = strlen(options->alphabet);
+    srand((unsigned)options->seed);
+    for (size_t i = 0; i < options->length; i++) {
+        target[i] = options->alphabet[rand() % alphabet_len];
+    }
+    target[options->length] = 0;
+    return target;
+}
+
+double bench_run(const Options *options, const char *target, int threads) {
+    Evolver *ev = evolve_new(target, options->alphabet, options->population, options->mutation, options->seed);
+    if (!ev) {
+        printf("Cannot make a population of %zu\n", options->population);
+        exit(1);
+    }
+    double start = now();
+    evolve_run(ev, options->generations, threads);
+    double seconds = now() - start;
+    char *best = malloc(strlen(target) + 1);
+    size_t matches = evolve_best(ev, best);
+    uint64_t generations = evolve_generation(ev);
+    printf("%d thread%s: %.1f ms, %.2f million candidates/s, %.2f GB/s compared, best %zu/%zu\n", threads,
+           threads == 1 ? "" : "s", seconds * 1e3, (double)options->population * generations / seconds * 1e-6,
+           (double)options->population * generations * strlen(target) / seconds * 1e-9, matches, strlen(target));
+    free(best);
+    evolve_free(ev);
+    return seconds;
+}
+
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    Options options = {
+        .target = "what about longer strings such as this",
+        .alphabet = "abcdefghijklmnopqrstuvwxyz ",
+        .threads = cores > 0 ? (int)cores : 1,
+        .seed = 1,
+    };
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strncmp(arg, "--target=", 9) == 0 && arg[9]) {
+            options.target = arg + 9;
+        } else if (strncmp(arg, "--length=", 9) == 0 && atol(arg + 9) > 0) {
+            options.length = atol(arg + 9);
+        } else if (strncmp(arg, "--alphabet=", 11) == 0 && arg[11]) {
+            options.alphabet = arg + 11;
+        } else if (strncmp(arg, "--population=", 13) == 0 && atol(arg + 13) > 0) {
+            options.population = atol(arg + 13);
+        } else if (strncmp(arg, "--generations=", 14) == 0 && atoi(arg + 14) > 0) {
+            options.generations = atoi(arg + 14);
+        } else if (strncmp(arg, "--threads=", 10) == 0 && atoi(arg + 10) > 0) {
+            options.threads = atoi(arg + 10);
+        } else if (strncmp(arg, "--mutation=", 11) == 0) {
+            options.mutation = atof(arg + 11);
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            options.seed = strtoull(arg + 7, NULL, 10);
+        } else if (strcmp(arg, "--bench") == 0) {
+            options.bench = true;
+        } else if (strcmp(arg, "--test") == 0) {
+            options.test = true;
+        } else if (strcmp(arg, "--help") == 0) {
+            usage();
+            return 0;
+        } else {
+            printf("Unknown option '%s'\n", arg);
+            usage();
+            return 1;
+        }
+    }
+    if (options.test) {
+        evolve_test();
+        printf("All tests passed\n");
+        return 0;
+    }
+    if (options.bench) {
+        options.length = options.length ? options.length : 1024;
+        options.population = options.population ? options.population : 100000;
+        options.generations = options.generations ? options.generations : 10;
+    }
+    options.population = options.population ? options.population : 2000;
+    options.generations = options.generations ? options.generations : 100000;
+    char *target = options.length ? random_target(&options) : NULL;
+    if (target) {
+        options.target = target;
+    }
+    if (options.bench) {
+        printf("%zu characters, %zu candidates, %d generations, %ld cores online\n", strlen(options.target),
+               options.population, options.generations, cores);
+        double single = bench_run(&options, options.target, 1);
+        if (options.threads > 1) {
+            double multi = bench_run(&options, options.target, options.threads);
+            printf("speed-up: %.2fx\n", single / multi);
+        }
+        free(target);
+        return 0;
+    }
+
+    Evolver *ev = evolve_new(options.target, options.alphabet, options.population, options.mutation, options.seed);
+    if (!ev) {
+        printf("Cannot make a population of %zu\n", options.population);
+        return 1;
+    }
+    char *best = malloc(strlen(options.target) + 1);
+    bool found = false;
+    for (int generation = 0; generation < options.generations && !found; generation++) {
+        found = evolve_run(ev, 1, options.threads);
+        size_t matches = evolve_best(ev, best);
+        printf("generation %llu, %zu/%zu: %.*s\n", (unsigned long long)evolve_generation(ev), matches,
+               strlen(options.target), 100, best);
+    }
+    printf(found ? "Found the target\n" : "Did not find the target\n");
+    free(best);
+    evolve_free(ev);
+    free(target);
+    return found ? 0 : 1;
+}
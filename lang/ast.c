@@ -1,243 +1,1042 @@
 #include "ast.h"
 
-Typespec *typespec_alloc(TypespecKind kind) {
-    Typespec *t = xcalloc(1, sizeof(Typespec));
+_Thread_local Arena ast_arena = {.tag = ALLOC_AST};
+
+void *ast_alloc(size_t size) {
+    assert(size != 0);
+    void *ptr = arena_alloc(&ast_arena, size);
+    memset(ptr, 0, size);
+    return ptr;
+}
+
+// Node lists are built on the scratch stack and land in the AST arena at their final size.
+void *ast_finish_list(ScratchMark mark) {
+    return scratch_finish(&ast_arena, mark);
+}
+
+Typespec *typespec_alloc(TypespecKind kind, SrcPos pos) {
+    Typespec *t = ast_alloc(sizeof(Typespec));
     t->kind = kind;
+    t->pos = pos;
+    STAT_INC(typespecs[kind]);
     return t;
 }
 
-Typespec *typespec_name(const char *name) {
-    Typespec *t = typespec_alloc(TYPESPEC_NAME);
+Typespec *typespec_name(SrcPos pos, const char *name) {
+    Typespec *t = typespec_alloc(TYPESPEC_NAME, pos);
     t->name = name;
     return t;
 }
 
-Typespec *typespec_ptr(Typespec *elem) {
-    Typespec *t = typespec_alloc(TYPESPEC_PTR);
+Typespec *typespec_ptr(SrcPos pos, Typespec *elem) {
+    Typespec *t = typespec_alloc(TYPESPEC_PTR, pos);
     t->ptr.elem = elem;
     return t;
 }
 
-Typespec *typespec_array(Typespec *elem, Expr *size) {
-    Typespec *t = typespec_alloc(TYPESPEC_ARRAY);
+Typespec *typespec_array(SrcPos pos, Typespec *elem, Expr *size) {
+    Typespec *t = typespec_alloc(TYPESPEC_ARRAY, pos);
     t->array.elem = elem;
     t->array.size = size;
     return t;
 }
 
-Typespec *typespec_func(Typespec **args, size_t num_args, Typespec *ret) {
-    Typespec *t = typespec_alloc(TYPESPEC_FUNC);
+Typespec *typespec_func(SrcPos pos, Typespec **args, size_t num_args, Typespec *ret) {
+    Typespec *t = typespec_alloc(TYPESPEC_FUNC, pos);
     t->func.args = args;
     t->func.num_args = num_args;
     t->func.ret = ret;
     return t;
 }
 
-Expr *expr_alloc(ExprKind kind) {
-    Expr *e = xcalloc(1, sizeof(Expr));
+Expr *expr_alloc(ExprKind kind, SrcPos pos) {
+    Expr *e = ast_alloc(sizeof(Expr));
     e->kind = kind;
+    e->pos = pos;
+    STAT_INC(exprs[kind]);
     return e;
 }
 
-Expr *expr_int(uint64_t int_val) {
-    Expr *e = expr_alloc(EXPR_INT);
+Expr *expr_int(SrcPos pos, uint64_t int_val) {
+    Expr *e = expr_alloc(EXPR_INT, pos);
     e->int_val = int_val;
     return e;
 }
 
-Expr *expr_float(double float_val) {
-    Expr *e = expr_alloc(EXPR_FLOAT);
+Expr *expr_float(SrcPos pos, double float_val) {
+    Expr *e = expr_alloc(EXPR_FLOAT, pos);
     e->float_val = float_val;
     return e;
 }
 
-Expr *expr_str(const char *str_val) {
-    Expr *e = expr_alloc(EXPR_STR);
+Expr *expr_str(SrcPos pos, const char *str_val) {
+    Expr *e = expr_alloc(EXPR_STR, pos);
     e->str_val = str_val;
     return e;
 }
 
-Expr *expr_name(const char *name) {
-    Expr *e = expr_alloc(EXPR_NAME);
+Expr *expr_name(SrcPos pos, const char *name) {
+    Expr *e = expr_alloc(EXPR_NAME, pos);
     e->name = name;
     return e;
 }
 
-Expr *expr_cast(Typespec *type, Expr *expr) {
-    Expr *e = expr_alloc(EXPR_CAST);
+Expr *expr_cast(SrcPos pos, Typespec *type, Expr *expr) {
+    Expr *e = expr_alloc(EXPR_CAST, pos);
     e->cast.type = type;
     e->cast.expr = expr;
     return e;
 }
 
-Expr *expr_call(Expr *expr, Expr **args, size_t num_args) {
-    Expr *e = expr_alloc(EXPR_CALL);
+Expr *expr_compound(SrcPos pos, Typespec *type, Expr **args, size_t num_args) {
+    Expr *e = expr_alloc(EXPR_COMPOUND, pos);
+    e->compound.type = type;
+    e->compound.args = args;
+    e->compound.num_args = num_args;
+    return e;
+}
+
+Expr *expr_call(SrcPos pos, Expr *expr, Expr **args, size_t num_args) {
+    Expr *e = expr_alloc(EXPR_CALL, pos);
     e->call.expr = expr;
     e->call.args = args;
     e->call.num_args = num_args;
     return e;
 }
 
-Expr *expr_index(Expr *expr, Expr *index) {
-    Expr *e = expr_alloc(EXPR_INDEX);
+Expr *expr_index(SrcPos pos, Expr *expr, Expr *index) {
+    Expr *e = expr_alloc(EXPR_INDEX, pos);
     e->index.expr = expr;
     e->index.index = index;
     return e;
 }
 
-Expr *expr_field(Expr *expr, const char *name) {
-    Expr *e = expr_alloc(EXPR_FIELD);
+Expr *expr_field(SrcPos pos, Expr *expr, const char *name) {
+    Expr *e = expr_alloc(EXPR_FIELD, pos);
     e->field.expr = expr;
     e->field.name = name;
     return e;
 }
 
-Expr *expr_unary(TokenKind op, Expr *expr) {
-    Expr *e = expr_alloc(EXPR_UNARY);
+Expr *expr_unary(SrcPos pos, TokenKind op, Expr *expr) {
+    Expr *e = expr_alloc(EXPR_UNARY, pos);
     e->unary.op = op;
     e->unary.expr = expr;
     return e;
 }
 
-Expr *expr_binary(TokenKind op, Expr *left, Expr *right) {
-    Expr *e = expr_alloc(EXPR_BINARY);
+Expr *expr_binary(SrcPos pos, TokenKind op, Expr *left, Expr *right) {
+    Expr *e = expr_alloc(EXPR_BINARY, pos);
     e->binary.op = op;
     e->binary.left = left;
     e->binary.right = right;
     return e;
 }
 
-Expr *expr_ternary(Expr *cond, Expr *if_true, Expr *if_false) {
-    Expr *e = expr_alloc(EXPR_TERNARY);
+Expr *expr_ternary(SrcPos pos, Expr *cond, Expr *if_true, Expr *if_false) {
+    Expr *e = expr_alloc(EXPR_TERNARY, pos);
     e->ternary.cond = cond;
     e->ternary.if_true = if_true;
     e->ternary.if_false = if_false;
     return e;
 }
 
-void print_expr(Expr *expr);
+Stmt *stmt_alloc(StmtKind kind, SrcPos pos) {
+    Stmt *s = ast_alloc(sizeof(Stmt));
+    s->kind = kind;
+    s->pos = pos;
+    STAT_INC(stmts[kind]);
+    return s;
+}
+
+Stmt *stmt_return(SrcPos pos, Expr *expr) {
+    Stmt *s = stmt_alloc(STMT_RETURN, pos);
+    s->expr = expr;
+    return s;
+}
 
-void print_typespec(Typespec *type) {
-    Typespec *t = type;
-    switch (t->kind) {
-    case TYPESPEC_NAME:
-        printf("%s", t->name);
-        break;
-    case TYPESPEC_FUNC:
-        printf("(func (");
-        for (Typespec **it = t->func.args; it != t->func.args + t->func.num_args; it++) {
+Stmt *stmt_break(SrcPos pos) {
+    return stmt_alloc(STMT_BREAK, pos);
+}
+
+Stmt *stmt_continue(SrcPos pos) {
+    return stmt_alloc(STMT_CONTINUE, pos);
+}
+
+Stmt *stmt_block(SrcPos pos, StmtBlock block) {
+    Stmt *s = stmt_alloc(STMT_BLOCK, pos);
+    s->block = block;
+    return s;
+}
+
+Stmt *stmt_if(SrcPos pos, Expr *cond, StmtBlock then_block, ElseIf *elseifs, size_t num_elseifs, StmtBlock else_block) {
+    Stmt *s = stmt_alloc(STMT_IF, pos);
+    s->if_stmt.cond = cond;
+    s->if_stmt.then_block = then_block;
+    s->if_stmt.elseifs = elseifs;
+    s->if_stmt.num_elseifs = num_elseifs;
+    s->if_stmt.else_block = else_block;
+    return s;
+}
+
+Stmt *stmt_while(SrcPos pos, Expr *cond, StmtBlock block) {
+    Stmt *s = stmt_alloc(STMT_WHILE, pos);
+    s->while_stmt.cond = cond;
+    s->while_stmt.block = block;
+    return s;
+}
+
+Stmt *stmt_do_while(SrcPos pos, Expr *cond, StmtBlock block) {
+    Stmt *s = stmt_alloc(STMT_DO, pos);
+    s->while_stmt.cond = cond;
+    s->while_stmt.block = block;
+    return s;
+}
+
+Stmt *stmt_for(SrcPos pos, StmtBlock init, Expr *cond, StmtBlock next, StmtBlock block) {
+    Stmt *s = stmt_alloc(STMT_FOR, pos);
+    s->for_stmt.init = init;
+    s->for_stmt.cond = cond;
+    s->for_stmt.next = next;
+    s->for_stmt.block = block;
+    return s;
+}
+
+Stmt *stmt_switch(SrcPos pos, Expr *expr, SwitchCase *cases, size_t num_cases) {
+    Stmt *s = stmt_alloc(STMT_SWITCH, pos);
+    s->switch_stmt.expr = expr;
+    s->switch_stmt.cases = cases;
+    s->switch_stmt.num_cases = num_cases;
+    return s;
+}
+
+Stmt *stmt_assign(SrcPos pos, TokenKind op, Expr *left, Expr *right) {
+    Stmt *s = stmt_alloc(STMT_ASSIGN, pos);
+    s->assign.op = op;
+    s->assign.left = left;
+    s->assign.right = right;
+    return s;
+}
+
+Stmt *stmt_auto_assign(SrcPos pos, const char *name, Expr *init) {
+    Stmt *s = stmt_alloc(STMT_AUTO_ASSIGN, pos);
+    s->autoassign.name = name;
+    s->autoassign.init = init;
+    return s;
+}
+
+Stmt *stmt_expr(SrcPos pos, Expr *expr) {
+    Stmt *s = stmt_alloc(STMT_EXPR, pos);
+    s->expr = expr;
+    return s;
+}
+
+Decl *decl_alloc(DeclKind kind, SrcPos pos, const char *name) {
+    Decl *d = ast_alloc(sizeof(Decl));
+    d->kind = kind;
+    d->pos = pos;
+    STAT_INC(decls[kind]);
+    d->name = name;
+    return d;
+}
+
+Decl *decl_enum(SrcPos pos, const char *name, EnumItem *items, size_t num_items) {
+    Decl *d = decl_alloc(DECL_ENUM, pos, name);
+    d->enum_decl.items = items;
+    d->enum_decl.num_items = num_items;
+    return d;
+}
+
+Decl *decl_aggregate(SrcPos pos, DeclKind kind, const char *name, AggregateItem *items, size_t num_items) {
+    assert(kind == DECL_STRUCT || kind == DECL_UNION);
+    Decl *d = decl_alloc(kind, pos, name);
+    d->aggregate.items = items;
+    d->aggregate.num_items = num_items;
+    return d;
+}
+
+Decl *decl_var(SrcPos pos, const char *name, Typespec *type, Expr *expr) {
+    Decl *d = decl_alloc(DECL_VAR, pos, name);
+    d->var.type = type;
+    d->var.expr = expr;
+    return d;
+}
+
+Decl *decl_const(SrcPos pos, const char *name, Expr *expr) {
+    Decl *d = decl_alloc(DECL_CONST, pos, name);
+    d->const_decl.expr = expr;
+    return d;
+}
+
+Decl *decl_typedef(SrcPos pos, const char *name, Typespec *type) {
+    Decl *d = decl_alloc(DECL_TYPEDEF, pos, name);
+    d->typedef_decl.type = type;
+    return d;
+}
+
+Decl *decl_func(SrcPos pos, const char *name, FuncParam *params, size_t num_params, Typespec *ret_type, StmtBlock block) {
+    Decl *d = decl_alloc(DECL_FUNC, pos, name);
+    d->func.params = params;
+    d->func.num_params = num_params;
+    d->func.ret_type = ret_type;
+    d->func.block = block;
+    return d;
+}
+
+// AST traversal
+//
+// walk_node visits a tree in depth-first order with an explicit stack on the
+// heap, so arbitrarily deep trees cannot overflow the C stack. Each node gets
+// a pre-order and a post-order visit; returning WALK_SKIP from the pre-order
+// visit skips its children. Children are addressed by slot index, so a node's
+// children are visited in source order. Parts of a node that are lists of
+// records (else-ifs, switch cases, enum and aggregate items, parameters) are
+// nodes of their own, and a missing optional child is a NODE_NONE slot.
+typedef enum NodeKind {
+    NODE_NONE,
+    NODE_TYPESPEC,
+    NODE_EXPR,
+    NODE_STMT,
+    NODE_DECL,
+    NODE_BLOCK,
+    NODE_ELSEIF,
+    NODE_CASE,
+    NODE_ENUM_ITEM,
+    NODE_AGGREGATE_ITEM,
+    NODE_PARAM,
+} NodeKind;
+
+typedef struct Node {
+    NodeKind kind;
+    union {
+        void *ptr;
+        Typespec *typespec;
+        Expr *expr;
+        Stmt *stmt;
+        Decl *decl;
+        StmtBlock *block;
+        ElseIf *elseif;
+        SwitchCase *switch_case;
+        EnumItem *enum_item;
+        AggregateItem *aggregate_item;
+        FuncParam *param;
+    };
+} Node;
+
+#define NODE(k, field, p) ((p) ? (Node){.kind = (k), .field = (p)} : (Node){NODE_NONE})
+
+Node node_typespec(Typespec *type) { return NODE(NODE_TYPESPEC, typespec, type); }
+Node node_expr(Expr *expr) { return NODE(NODE_EXPR, expr, expr); }
+Node node_stmt(Stmt *stmt) { return NODE(NODE_STMT, stmt, stmt); }
+Node node_decl(Decl *decl) { return NODE(NODE_DECL, decl, decl); }
+Node node_block(StmtBlock *block) { return NODE(NODE_BLOCK, block, block); }
+
+size_t node_num_children(Node node) {
+    switch (node.kind) {
+    case NODE_TYPESPEC: {
+        Typespec *t = node.typespec;
+        switch (t->kind) {
+        case TYPESPEC_FUNC:
+            return t->func.num_args + 1;
+        case TYPESPEC_ARRAY:
+            return 2;
+        case TYPESPEC_PTR:
+            return 1;
+        default:
+            return 0;
+        }
+    }
+    case NODE_EXPR: {
+        Expr *e = node.expr;
+        switch (e->kind) {
+        case EXPR_CAST:
+        case EXPR_INDEX:
+        case EXPR_BINARY:
+            return 2;
+        case EXPR_CALL:
+            return 1 + e->call.num_args;
+        case EXPR_FIELD:
+        case EXPR_UNARY:
+            return 1;
+        case EXPR_COMPOUND:
+            return 1 + e->compound.num_args;
+        case EXPR_TERNARY:
+            return 3;
+        default:
+            return 0;
+        }
+    }
+    case NODE_STMT: {
+        Stmt *s = node.stmt;
+        switch (s->kind) {
+        case STMT_RETURN:
+        case STMT_BLOCK:
+        case STMT_AUTO_ASSIGN:
+        case STMT_EXPR:
+            return 1;
+        case STMT_IF:
+            // An empty else block means there is no else.
+            return 2 + s->if_stmt.num_elseifs + (s->if_stmt.else_block.num_stmts != 0);
+        case STMT_WHILE:
+        case STMT_DO:
+        case STMT_ASSIGN:
+            return 2;
+        case STMT_FOR:
+            return 4;
+        case STMT_SWITCH:
+            return 1 + s->switch_stmt.num_cases;
+        default:
+            return 0;
+        }
+    }
+    case NODE_DECL: {
+        Decl *d = node.decl;
+        switch (d->kind) {
+        case DECL_ENUM:
+            return d->enum_decl.num_items;
+        case DECL_STRUCT:
+        case DECL_UNION:
+            return d->aggregate.num_items;
+        case DECL_VAR:
+            return 2;
+        case DECL_CONST:
+        case DECL_TYPEDEF:
+            return 1;
+        case DECL_FUNC:
+            return d->func.num_params + 2;
+        default:
+            return 0;
+        }
+    }
+    case NODE_BLOCK:
+        return node.block->num_stmts;
+    case NODE_ELSEIF:
+        return 2;
+    case NODE_CASE:
+        return node.switch_case->num_exprs + 1;
+    case NODE_ENUM_ITEM:
+    case NODE_AGGREGATE_ITEM:
+    case NODE_PARAM:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+// Returns the child in the given slot, which must be below node_num_children.
+Node node_child(Node node, size_t slot) {
+    assert(slot < node_num_children(node));
+    switch (node.kind) {
+    case NODE_TYPESPEC: {
+        Typespec *t = node.typespec;
+        switch (t->kind) {
+        case TYPESPEC_FUNC:
+            return node_typespec(slot < t->func.num_args ? t->func.args[slot] : t->func.ret);
+        case TYPESPEC_ARRAY:
+            return slot == 0 ? node_typespec(t->array.elem) : node_expr(t->array.size);
+        default:
+            return node_typespec(t->ptr.elem);
+        }
+    }
+    case NODE_EXPR: {
+        Expr *e = node.expr;
+        switch (e->kind) {
+        case EXPR_CAST:
+            return slot == 0 ? node_typespec(e->cast.type) : node_expr(e->cast.expr);
+        case EXPR_CALL:
+            return node_expr(slot == 0 ? e->call.expr : e->call.args[slot - 1]);
+        case EXPR_INDEX:
+            return node_expr(slot == 0 ? e->index.expr : e->index.index);
+        case EXPR_FIELD:
+            return node_expr(e->field.expr);
+        case EXPR_COMPOUND:
+            return slot == 0 ? node_typespec(e->compound.type) : node_expr(e->compound.args[slot - 1]);
+        case EXPR_UNARY:
+            return node_expr(e->unary.expr);
+        case EXPR_BINARY:
+            return node_expr(slot == 0 ? e->binary.left : e->binary.right);
+        default:
+            return node_expr(slot == 0 ? e->ternary.cond : slot == 1 ? e->ternary.if_true : e->ternary.if_false);
+        }
+    }
+    case NODE_STMT: {
+        Stmt *s = node.stmt;
+        switch (s->kind) {
+        case STMT_RETURN:
+        case STMT_EXPR:
+            return node_expr(s->expr);
+        case STMT_BLOCK:
+            return node_block(&s->block);
+        case STMT_IF:
+            if (slot == 0) {
+                return node_expr(s->if_stmt.cond);
+            } else if (slot == 1) {
+                return node_block(&s->if_stmt.then_block);
+            } else if (slot - 2 < s->if_stmt.num_elseifs) {
+                return (Node){NODE_ELSEIF, .elseif = &s->if_stmt.elseifs[slot - 2]};
+            } else {
+                return node_block(&s->if_stmt.else_block);
+            }
+        case STMT_WHILE:
+        case STMT_DO:
+            return slot == 0 ? node_expr(s->while_stmt.cond) : node_block(&s->while_stmt.block);
+        case STMT_FOR:
+            switch (slot) {
+            case 0:
+                return node_block(&s->for_stmt.init);
+            case 1:
+                return node_expr(s->for_stmt.cond);
+            case 2:
+                return node_block(&s->for_stmt.next);
+            default:
+                return node_block(&s->for_stmt.block);
+            }
+        case STMT_SWITCH:
+            if (slot == 0) {
+                return node_expr(s->switch_stmt.expr);
+            }
+            return (Node){NODE_CASE, .switch_case = &s->switch_stmt.cases[slot - 1]};
+        case STMT_ASSIGN:
+            return node_expr(slot == 0 ? s->assign.left : s->assign.right);
+        default:
+            return node_expr(s->autoassign.init);
+        }
+    }
+    case NODE_DECL: {
+        Decl *d = node.decl;
+        switch (d->kind) {
+        case DECL_ENUM:
+            return (Node){NODE_ENUM_ITEM, .enum_item = &d->enum_decl.items[slot]};
+        case DECL_STRUCT:
+        case DECL_UNION:
+            return (Node){NODE_AGGREGATE_ITEM, .aggregate_item = &d->aggregate.items[slot]};
+        case DECL_VAR:
+            return slot == 0 ? node_typespec(d->var.type) : node_expr(d->var.expr);
+        case DECL_CONST:
+            return node_expr(d->const_decl.expr);
+        case DECL_TYPEDEF:
+            return node_typespec(d->typedef_decl.type);
+        default:
+            if (slot < d->func.num_params) {
+                return (Node){NODE_PARAM, .param = &d->func.params[slot]};
+            } else if (slot == d->func.num_params) {
+                return node_typespec(d->func.ret_type);
+            }
+            func_body(d);
+            return node_block(&d->func.block);
+        }
+    }
+    case NODE_BLOCK:
+        return node_stmt(node.block->stmts[slot]);
+    case NODE_ELSEIF:
+        return slot == 0 ? node_expr(node.elseif->cond) : node_block(&node.elseif->block);
+    case NODE_CASE: {
+        SwitchCase *c = node.switch_case;
+        return slot < c->num_exprs ? node_expr(c->exprs[slot]) : node_block(&c->block);
+    }
+    case NODE_ENUM_ITEM:
+        return node_expr(node.enum_item->init);
+    case NODE_AGGREGATE_ITEM:
+        return node_typespec(node.aggregate_item->type);
+    case NODE_PARAM:
+        return node_typespec(node.param->type);
+    default:
+        assert(0);
+        return (Node){NODE_NONE};
+    }
+}
+
+typedef enum WalkEvent {
+    WALK_PRE,
+    WALK_POST,
+} WalkEvent;
+
+typedef enum WalkAction {
+    WALK_CONTINUE,
+    WALK_SKIP,
+} WalkAction;
+
+typedef struct Walk Walk;
+typedef WalkAction (*WalkFunc)(Walk *walk, WalkEvent event, Node node);
+
+typedef struct WalkFrame {
+    Node node;
+    // Slot of the next child to visit.
+    size_t next;
+} WalkFrame;
+
+// The stack is kept between walks, so a Walk that is reused does not allocate.
+struct Walk {
+    WalkFunc visit;
+    void *data;
+    WalkFrame *stack;
+};
+
+#define WALK_DONE SIZE_MAX
+
+// The parent of the node being visited and the slot it occupies there.
+Node walk_parent(Walk *walk) {
+    size_t len = buf_len(walk->stack);
+    return len >= 2 ? walk->stack[len - 2].node : (Node){NODE_NONE};
+}
+
+size_t walk_slot(Walk *walk) {
+    size_t len = buf_len(walk->stack);
+    return len >= 2 ? walk->stack[len - 2].next - 1 : 0;
+}
+
+size_t walk_depth(Walk *walk) {
+    return buf_len(walk->stack);
+}
+
+void walk_enter(Walk *walk, Node node) {
+    buf_push(walk->stack, (WalkFrame){node, 0});
+    if (walk->visit(walk, WALK_PRE, node) == WALK_SKIP) {
+        walk->stack[buf_len(walk->stack) - 1].next = WALK_DONE;
+    }
+}
+
+void walk_node(Walk *walk, Node root) {
+    assert(buf_len(walk->stack) == 0);
+    walk_enter(walk, root);
+    while (buf_len(walk->stack) > 0) {
+        WalkFrame *frame = &walk->stack[buf_len(walk->stack) - 1];
+        if (frame->next != WALK_DONE && frame->next < node_num_children(frame->node)) {
+            Node child = node_child(frame->node, frame->next++);
+            walk_enter(walk, child);
+        } else {
+            walk->visit(walk, WALK_POST, frame->node);
+            buf__hdr(walk->stack)->len--;
+        }
+    }
+}
+
+void walk_free(Walk *walk) {
+    buf_free(walk->stack);
+}
+
+// AST printer
+int indent;
+
+void print_newline(void) {
+    printf("\n%.*s", 2*indent, "                                                                      ");
+}
+
+// Prints what comes between the previous sibling (or the parent's opening) and the node in the given slot.
+void print_before_child(Node parent, size_t slot, Node child) {
+    switch (parent.kind) {
+    case NODE_TYPESPEC:
+        if (parent.typespec->kind == TYPESPEC_FUNC) {
+            printf(slot < parent.typespec->func.num_args ? " " : ") ");
+        } else if (slot > 0) {
             printf(" ");
-            print_typespec(*it);
         }
-        printf(") ");
-        print_typespec(t->func.ret);
-        printf(")");
         break;
-    case TYPESPEC_ARRAY:
-        printf("(array ");
-        print_typespec(t->array.elem);
-        printf(" ");
-        print_expr(t->array.size);
-        printf(")");
+    case NODE_EXPR:
+        if (slot > 0) {
+            printf(" ");
+        }
         break;
-    case TYPESPEC_PTR:
-        printf("(ptr ");
-        print_typespec(t->ptr.elem);
-        printf(")");
+    case NODE_STMT: {
+        Stmt *s = parent.stmt;
+        switch (s->kind) {
+        case STMT_RETURN:
+        case STMT_ASSIGN:
+            if (child.kind != NODE_NONE && slot == (s->kind == STMT_ASSIGN)) {
+                printf(" ");
+            }
+            break;
+        case STMT_IF:
+            if (slot > 0) {
+                print_newline();
+            }
+            if (slot >= 2 + s->if_stmt.num_elseifs) {
+                printf("else");
+                print_newline();
+            }
+            break;
+        case STMT_WHILE:
+        case STMT_DO:
+        case STMT_SWITCH:
+            if (slot > 0) {
+                print_newline();
+            }
+            break;
+        case STMT_FOR:
+            if (slot == 3) {
+                indent++;
+                print_newline();
+            } else if (slot > 0) {
+                printf(" ");
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+    case NODE_DECL: {
+        Decl *d = parent.decl;
+        switch (d->kind) {
+        case DECL_ENUM:
+        case DECL_STRUCT:
+        case DECL_UNION:
+            print_newline();
+            break;
+        case DECL_VAR:
+            if (slot > 0) {
+                printf(" ");
+            }
+            break;
+        case DECL_FUNC:
+            if (slot == d->func.num_params) {
+                printf(" ) ");
+            } else if (slot > d->func.num_params) {
+                indent++;
+                print_newline();
+            }
+            break;
+        default:
+            break;
+        }
+        break;
+    }
+    case NODE_BLOCK:
+        print_newline();
+        break;
+    case NODE_ELSEIF:
+        if (slot > 0) {
+            print_newline();
+        }
+        break;
+    case NODE_CASE: {
+        SwitchCase *c = parent.switch_case;
+        if (slot == c->num_exprs) {
+            printf(")");
+            indent++;
+            print_newline();
+        } else if (slot > 0 || c->is_default) {
+            printf(" ");
+        }
         break;
+    }
     default:
-        assert(0);
         break;
     }
 }
 
-void print_expr(Expr *expr) {
-    Expr *e = expr;
-    switch (e->kind) {
-    case EXPR_INT:
-        printf("%" PRIu64, e->int_val);
+// Missing children print as nil, except a function type's missing return type
+// and the optional parts of return and assignment statements.
+void print_none(Node parent) {
+    if (parent.kind == NODE_TYPESPEC) {
+        printf("void");
+    } else if (parent.kind != NODE_STMT || parent.stmt->kind == STMT_FOR) {
+        printf("nil");
+    }
+}
+
+void print_pre(Node node) {
+    switch (node.kind) {
+    case NODE_TYPESPEC: {
+        Typespec *t = node.typespec;
+        switch (t->kind) {
+        case TYPESPEC_NAME:
+            printf("%s", t->name);
+            break;
+        case TYPESPEC_FUNC:
+            printf("(func (");
+            break;
+        case TYPESPEC_ARRAY:
+            printf("(array ");
+            break;
+        case TYPESPEC_PTR:
+            printf("(ptr ");
+            break;
+        default:
+            assert(0);
+            break;
+        }
         break;
-    case EXPR_FLOAT:
-        printf("%f", e->float_val);
+    }
+    case NODE_EXPR: {
+        Expr *e = node.expr;
+        switch (e->kind) {
+        case EXPR_INT:
+            printf("%" PRIu64, e->int_val);
+            break;
+        case EXPR_FLOAT:
+            printf("%f", e->float_val);
+            break;
+        case EXPR_STR:
+            printf("\"%s\"", e->str_val);
+            break;
+        case EXPR_NAME:
+            printf("%s", e->name);
+            break;
+        case EXPR_CAST:
+            printf("(cast ");
+            break;
+        case EXPR_CALL:
+            printf("(");
+            break;
+        case EXPR_INDEX:
+            printf("(index ");
+            break;
+        case EXPR_FIELD:
+            printf("(field ");
+            break;
+        case EXPR_COMPOUND:
+            printf("(compound ");
+            break;
+        case EXPR_UNARY:
+            printf("(%s ", token_kind_str(e->unary.op));
+            break;
+        case EXPR_BINARY:
+            printf("(%s ", token_kind_str(e->binary.op));
+            break;
+        case EXPR_TERNARY:
+            printf("(if ");
+            break;
+        default:
+            assert(0);
+            break;
+        }
         break;
-    case EXPR_STR:
-        printf("\"%s\"", e->str_val);
+    }
+    case NODE_STMT: {
+        Stmt *s = node.stmt;
+        switch (s->kind) {
+        case STMT_RETURN:
+            printf("(return");
+            break;
+        case STMT_BREAK:
+            printf("(break)");
+            break;
+        case STMT_CONTINUE:
+            printf("(continue)");
+            break;
+        case STMT_IF:
+            printf("(if ");
+            indent++;
+            break;
+        case STMT_WHILE:
+            printf("(while ");
+            indent++;
+            break;
+        case STMT_DO:
+            printf("(do-while ");
+            indent++;
+            break;
+        case STMT_FOR:
+            printf("(for ");
+            break;
+        case STMT_SWITCH:
+            printf("(switch ");
+            indent++;
+            break;
+        case STMT_ASSIGN:
+            printf("(%s ", token_kind_str(s->assign.op));
+            break;
+        case STMT_AUTO_ASSIGN:
+            printf("(:= %s ", s->autoassign.name);
+            break;
+        case STMT_BLOCK:
+        case STMT_EXPR:
+            break;
+        default:
+            assert(0);
+            break;
+        }
         break;
-    case EXPR_NAME:
-        printf("%s", e->name);
+    }
+    case NODE_DECL: {
+        Decl *d = node.decl;
+        switch (d->kind) {
+        case DECL_ENUM:
+            printf("(enum %s", d->name);
+            indent++;
+            break;
+        case DECL_STRUCT:
+            printf("(struct %s", d->name);
+            indent++;
+            break;
+        case DECL_UNION:
+            printf("(union %s", d->name);
+            indent++;
+            break;
+        case DECL_VAR:
+            printf("(var %s ", d->name);
+            break;
+        case DECL_CONST:
+            printf("(const %s ", d->name);
+            break;
+        case DECL_TYPEDEF:
+            printf("(typedef %s ", d->name);
+            break;
+        case DECL_FUNC:
+            printf("(func %s (", d->name);
+            break;
+        default:
+            assert(0);
+            break;
+        }
         break;
-    case EXPR_CAST:
-        printf("(cast ");
-        print_typespec(e->cast.type);
-        printf(" ");
-        print_expr(e->cast.expr);
-        printf(")");
+    }
+    case NODE_BLOCK:
+        printf("(block");
+        indent++;
+        break;
+    case NODE_ELSEIF:
+        printf("elseif ");
+        break;
+    case NODE_CASE:
+        printf("(case (%s", node.switch_case->is_default ? "default" : "");
         break;
-    case EXPR_CALL:
+    case NODE_ENUM_ITEM:
+        printf("(%s ", node.enum_item->name);
+        break;
+    case NODE_AGGREGATE_ITEM:
         printf("(");
-        print_expr(e->call.expr);
-        for (Expr **it = e->call.args; it != e->call.args + e->call.num_args; it++) {
-            printf(" ");
-            print_expr(*it);
+        break;
+    case NODE_PARAM:
+        printf(" %s ", node.param->name);
+        break;
+    default:
+        break;
+    }
+}
+
+void print_post(Node node) {
+    switch (node.kind) {
+    case NODE_TYPESPEC:
+        if (node.typespec->kind != TYPESPEC_NAME) {
+            printf(")");
         }
-        printf(")");
         break;
-    case EXPR_INDEX:
-        printf("(index ");
-        print_expr(e->index.expr);
-        printf(" ");
-        print_expr(e->index.index);
-        printf(")");
+    case NODE_EXPR:
+        switch (node.expr->kind) {
+        case EXPR_INT:
+        case EXPR_FLOAT:
+        case EXPR_STR:
+        case EXPR_NAME:
+            break;
+        case EXPR_FIELD:
+            printf(" %s)", node.expr->field.name);
+            break;
+        default:
+            printf(")");
+            break;
+        }
         break;
-    case EXPR_FIELD:
-        printf("(field ");
-        print_expr(e->field.expr);
-        printf(" %s)", e->field.name);
+    case NODE_STMT:
+        switch (node.stmt->kind) {
+        case STMT_IF:
+        case STMT_WHILE:
+        case STMT_DO:
+        case STMT_FOR:
+        case STMT_SWITCH:
+            indent--;
+            printf(")");
+            break;
+        case STMT_RETURN:
+        case STMT_ASSIGN:
+        case STMT_AUTO_ASSIGN:
+            printf(")");
+            break;
+        default:
+            break;
+        }
         break;
-    case EXPR_COMPOUND:
-        printf("(compound");
-        for (Expr **it = e->compound.args; it != e->compound.args + e->compound.num_args; it++) {
-            printf(" ");
-            print_expr(*it);
+    case NODE_DECL:
+        switch (node.decl->kind) {
+        case DECL_ENUM:
+        case DECL_STRUCT:
+        case DECL_UNION:
+        case DECL_FUNC:
+            indent--;
+            printf(")");
+            break;
+        default:
+            printf(")");
+            break;
         }
+        break;
+    case NODE_BLOCK:
+        indent--;
         printf(")");
         break;
-    case EXPR_UNARY:
-        printf("(%c ", e->unary.op);
-        print_expr(e->unary.expr);
+    case NODE_CASE:
+        indent--;
         printf(")");
         break;
-    case EXPR_BINARY:
-        printf("(%c ", e->binary.op);
-        print_expr(e->binary.left);
-        printf(" ");
-        print_expr(e->binary.right);
+    case NODE_ENUM_ITEM:
         printf(")");
         break;
-    case EXPR_TERNARY:
-        printf("(if ");
-        print_expr(e->ternary.cond);
-        printf(" ");
-        print_expr(e->ternary.if_true);
-        printf(" ");
-        print_expr(e->ternary.if_false);
+    case NODE_AGGREGATE_ITEM: {
+        AggregateItem *item = node.aggregate_item;
+        for (const char **name = item->names; name != item->names + item->num_names; name++) {
+            printf(" %s", *name);
+        }
         printf(")");
         break;
+    }
     default:
-        assert(0);
         break;
     }
 }
 
+WalkAction print_visit(Walk *walk, WalkEvent event, Node node) {
+    if (event == WALK_PRE) {
+        Node parent = walk_parent(walk);
+        if (walk_depth(walk) > 1) {
+            print_before_child(parent, walk_slot(walk), node);
+        }
+        if (node.kind == NODE_NONE) {
+            print_none(parent);
+        } else {
+            print_pre(node);
+        }
+    } else {
+        print_post(node);
+    }
+    return WALK_CONTINUE;
+}
+
+Walk print_walk = {.visit = print_visit};
+
+void print_node(Node node) {
+    walk_node(&print_walk, node);
+}
+
+void print_typespec(Typespec *type) {
+    print_node(node_typespec(type));
+}
+
+void print_expr(Expr *expr) {
+    print_node(node_expr(expr));
+}
+
+void print_stmt(Stmt *stmt) {
+    print_node(node_stmt(stmt));
+}
+
+void print_stmt_block(StmtBlock block) {
+    print_node(node_block(&block));
+}
+
+void print_decl(Decl *decl) {
+    print_node(node_decl(decl));
+}
+
 void expr_test() {
     Expr *exprs[] = {
-        expr_binary('+', expr_int(1), expr_int(2)),
-        expr_unary('-', expr_float(3.14)),
-        expr_ternary(expr_name("flag"), expr_str("true"), expr_str("false")),
-        expr_field(expr_name("person"), "name"),
-        expr_call(expr_name("fact"), (Expr*[]){expr_int(42)}, 1),
-        expr_index(expr_field(expr_name("person"), "siblings"), expr_int(3)),
-        expr_cast(typespec_ptr(typespec_name("int")), expr_name("void_ptr")),
+        expr_binary(0, '+', expr_int(0, 1), expr_int(0, 2)),
+        expr_unary(0, '-', expr_float(0, 3.14)),
+        expr_ternary(0, expr_name(0, "flag"), expr_str(0, "true"), expr_str(0, "false")),
+        expr_field(0, expr_name(0, "person"), "name"),
+        expr_call(0, expr_name(0, "fact"), (Expr*[]){expr_int(0, 42)}, 1),
+        expr_index(0, expr_field(0, expr_name(0, "person"), "siblings"), expr_int(0, 3)),
+        expr_cast(0, typespec_ptr(0, typespec_name(0, "int")), expr_name(0, "void_ptr")),
     };
     for (Expr **it = exprs; it != exprs + sizeof(exprs)/sizeof(*exprs); it++) {
         print_expr(*it);
@@ -245,6 +1044,60 @@ void expr_test() {
     }
 }
 
+typedef struct WalkCounts {
+    size_t pre;
+    size_t post;
+    size_t max_depth;
+    NodeKind kinds[16];
+} WalkCounts;
+
+WalkAction count_visit(Walk *walk, WalkEvent event, Node node) {
+    WalkCounts *counts = walk->data;
+    if (event == WALK_POST) {
+        counts->post++;
+        return WALK_CONTINUE;
+    }
+    if (counts->pre < sizeof(counts->kinds)/sizeof(*counts->kinds)) {
+        counts->kinds[counts->pre] = node.kind == NODE_EXPR ? (NodeKind)(100 + node.expr->kind) : node.kind;
+    }
+    counts->pre++;
+    counts->max_depth = MAX(counts->max_depth, walk_depth(walk));
+    // Unary minus marks a subtree to skip.
+    return node.kind == NODE_EXPR && node.expr->kind == EXPR_UNARY ? WALK_SKIP : WALK_CONTINUE;
+}
+
+void walk_test(void) {
+    Arena outer_arena = ast_arena;
+    ast_arena = (Arena){.tag = ALLOC_AST};
+    WalkCounts counts = {0};
+    Walk walk = {.visit = count_visit, .data = &counts};
+    Expr *skipped = expr_unary(0, '-', expr_name(0, "x"));
+    walk_node(&walk, node_expr(expr_binary(0, '*', expr_binary(0, '+', expr_int(0, 1), expr_int(0, 2)), skipped)));
+    NodeKind order[] = {100 + EXPR_BINARY, 100 + EXPR_BINARY, 100 + EXPR_INT, 100 + EXPR_INT, 100 + EXPR_UNARY};
+    assert(counts.pre == 5 && counts.post == 5 && counts.max_depth == 3);
+    assert(memcmp(counts.kinds, order, sizeof(order)) == 0);
+
+    // A return without a value still has a slot for it.
+    counts = (WalkCounts){0};
+    walk_node(&walk, node_stmt(stmt_return(0, NULL)));
+    assert(counts.pre == 2 && counts.kinds[1] == NODE_NONE);
+
+    // Far deeper than the C stack would allow with one frame per level.
+    size_t depth = 2000000;
+    Expr *leaf = expr_int(0, 1);
+    Expr *expr = leaf;
+    for (size_t i = 0; i < depth; i++) {
+        expr = expr_binary(0, '+', expr, leaf);
+    }
+    counts = (WalkCounts){0};
+    walk_node(&walk, node_expr(expr));
+    assert(counts.pre == 2*depth + 1 && counts.post == counts.pre && counts.max_depth == depth + 1);
+    walk_free(&walk);
+    arena_free(&ast_arena);
+    ast_arena = outer_arena;
+}
+
 void ast_test() {
     expr_test();
+    walk_test();
 }
@@ -3,6 +3,11 @@ typedef struct Stmt Stmt;
 typedef struct Decl Decl;
 typedef struct Typespec Typespec;
 
+typedef struct StmtBlock {
+    Stmt **stmts;
+    size_t num_stmts;
+} StmtBlock;
+
 typedef enum TypespecKind {
     TYPESPEC_NONE,
     TYPESPEC_NAME,
@@ -28,6 +33,7 @@ typedef struct ArrayTypespec {
 
 struct Typespec {
     TypespecKind kind;
+    SrcPos pos;
     union {
         const char *name;
         FuncTypespec func;
@@ -56,11 +62,15 @@ typedef struct FuncDecl {
     FuncParam *params;
     size_t num_params;
     Typespec *ret_type;
+    StmtBlock block;
+    // Start of a body that was skipped rather than parsed. Use func_body.
+    const char *lazy_body;
+    SrcPos lazy_body_pos;
 } FuncDecl;
 
 typedef struct EnumItem {
     const char *name;
-    Typespec *type;
+    Expr *init;
 } EnumItem;
 
 typedef struct EnumDecl {
@@ -94,7 +104,12 @@ typedef struct ConstDecl {
 
 struct Decl {
     DeclKind kind;
+    SrcPos pos;
     const char *name;
+    // The doc comments before the declaration, markers and all, as a slice
+    // of the source text; NULL if there are none.
+    const char *doc;
+    const char *doc_end;
     union {
         EnumDecl enum_decl;
         AggregateDecl aggregate;
@@ -167,6 +182,7 @@ typedef struct FieldExpr {
 
 struct Expr {
     ExprKind kind;
+    SrcPos pos;
     union {
         uint64_t int_val;
         double float_val;
@@ -199,11 +215,6 @@ typedef enum StmtKind {
     STMT_EXPR,
 } StmtKind;
 
-typedef struct StmtBlock {
-    Stmt **stmts;
-    size_t num_stmts;
-} StmtBlock;
-
 typedef struct ElseIf {
     Expr *cond;
     StmtBlock block;
@@ -226,11 +237,13 @@ typedef struct ForStmt {
     StmtBlock init;
     Expr *cond;
     StmtBlock next;
+    StmtBlock block;
 } ForStmt;
 
 typedef struct SwitchCase {
     Expr **exprs;
     size_t num_exprs;
+    bool is_default;
     StmtBlock block;
 } SwitchCase;
 
@@ -253,7 +266,10 @@ typedef struct AutoAssignStmt {
 
 struct Stmt {
     StmtKind kind;
+    SrcPos pos;
     union {
+        Expr *expr;
+        StmtBlock block;
         IfStmt if_stmt;
         WhileStmt while_stmt;
         ForStmt for_stmt;
@@ -262,3 +278,5 @@ struct Stmt {
         AutoAssignStmt autoassign;
     };
 };
+
+StmtBlock func_body(Decl *decl);
@@ -0,0 +1,729 @@
+// Checking
+//
+// The front end has no types yet, so checking is about names: every name
+// must resolve to a local, a parameter or a global of the right kind, every
+// type name to a builtin or a declared type, and a call of a global function
+// must pass as many arguments as it has parameters. Constants, enum items and
+// functions cannot be assigned, and break and continue must be inside
+// something they can leave.
+//
+// Global declarations are collected and checked first, on one thread. After
+// that the symbol table is only read, and each function body is an
+// independent job. Workers take batches of functions and keep their own
+// scope stack, message arena and diagnostics per declaration, so the
+// diagnostics come out in declaration order whatever the number of threads.
+#define CHECK_BATCH 16
+
+typedef enum SymKind {
+    SYM_VAR,
+    SYM_CONST,
+    SYM_FUNC,
+    SYM_TYPE,
+} SymKind;
+
+typedef struct Sym {
+    SymKind kind;
+    // NULL for builtin types.
+    Decl *decl;
+} Sym;
+
+typedef struct CheckDiag {
+    SrcPos pos;
+    const char *msg;
+} CheckDiag;
+
+typedef struct Checker {
+    Map *globals;
+    Walk walk;
+    const char **locals;
+    size_t *scopes;
+    int loops;
+    int switches;
+    // Diagnostics of the declaration being checked.
+    CheckDiag *diags;
+    Arena arena;
+} Checker;
+
+typedef struct CheckWork {
+    Map globals;
+    Sym *syms;
+    Decl **decls;
+    // Indices of the function declarations, checked in batches.
+    size_t *funcs;
+    size_t next_func;
+    // Diagnostics per declaration.
+    CheckDiag **diags;
+    pthread_mutex_t lock;
+    Arena *arenas;
+} CheckWork;
+
+void check_error(Checker *checker, SrcPos pos, const char *fmt, ...) {
+    char buf[256];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    len = MIN(len, (int)sizeof(buf) - 1);
+    char *msg = arena_alloc(&checker->arena, len + 1);
+    memcpy(msg, buf, len + 1);
+    buf_push(checker->diags, (CheckDiag){pos, msg});
+}
+
+bool is_local(Checker *checker, const char *name) {
+    for (size_t i = buf_len(checker->locals); i > 0; i--) {
+        if (checker->locals[i - 1] == name) {
+            return true;
+        }
+    }
+    return false;
+}
+
+void push_scope(Checker *checker) {
+    buf_push(checker->scopes, buf_len(checker->locals));
+}
+
+void pop_scope(Checker *checker) {
+    size_t mark = buf_pop(checker->scopes);
+    buf_truncate(checker->locals, mark);
+}
+
+Sym *check_global(Checker *checker, const char *name) {
+    return is_local(checker, name) ? NULL : map_get(checker->globals, name);
+}
+
+void check_name(Checker *checker, Expr *expr) {
+    if (is_local(checker, expr->name)) {
+        return;
+    }
+    Sym *sym = map_get(checker->globals, expr->name);
+    if (!sym) {
+        check_error(checker, expr->pos, "Unresolved name '%s'", expr->name);
+    } else if (sym->kind == SYM_TYPE) {
+        check_error(checker, expr->pos, "'%s' is a type, not a value", expr->name);
+    }
+}
+
+void check_call(Checker *checker, Expr *expr) {
+    Expr *callee = expr->call.expr;
+    Sym *sym = callee->kind == EXPR_NAME ? check_global(checker, callee->name) : NULL;
+    if (sym && sym->kind == SYM_FUNC && expr->call.num_args != sym->decl->func.num_params) {
+        check_error(checker, expr->pos, "'%s' takes %zu argument%s, not %zu", callee->name,
+                    sym->decl->func.num_params, sym->decl->func.num_params == 1 ? "" : "s", expr->call.num_args);
+    }
+}
+
+void check_assign(Checker *checker, Stmt *stmt) {
+    Expr *left = stmt->assign.left;
+    Sym *sym = left->kind == EXPR_NAME ? check_global(checker, left->name) : NULL;
+    if (sym && (sym->kind == SYM_CONST || sym->kind == SYM_FUNC)) {
+        check_error(checker, left->pos, "Cannot assign to %s '%s'", sym->kind == SYM_FUNC ? "function" : "constant",
+                    left->name);
+    }
+}
+
+void check_stmt(Checker *checker, WalkEvent event, Stmt *stmt) {
+    int step = event == WALK_PRE ? 1 : -1;
+    switch (stmt->kind) {
+    case STMT_FOR:
+        // The init statements are in scope in the rest of the loop.
+        if (event == WALK_PRE) {
+            push_scope(checker);
+        } else {
+            pop_scope(checker);
+        }
+        checker->loops += step;
+        break;
+    case STMT_WHILE:
+    case STMT_DO:
+        checker->loops += step;
+        break;
+    case STMT_SWITCH:
+        checker->switches += step;
+        break;
+    case STMT_BREAK:
+        if (event == WALK_PRE && !checker->loops && !checker->switches) {
+            check_error(checker, stmt->pos, "'break' outside of a loop or switch");
+        }
+        break;
+    case STMT_CONTINUE:
+        if (event == WALK_PRE && !checker->loops) {
+            check_error(checker, stmt->pos, "'continue' outside of a loop");
+        }
+        break;
+    case STMT_ASSIGN:
+        if (event == WALK_PRE) {
+            check_assign(checker, stmt);
+        }
+        break;
+    case STMT_AUTO_ASSIGN:
+        // Declared after its initializer.
+        if (event == WALK_POST) {
+            buf_push(checker->locals, stmt->autoassign.name);
+        }
+        break;
+    default:
+        break;
+    }
+}
+
+WalkAction check_visit(Walk *walk, WalkEvent event, Node node) {
+    Checker *checker = walk->data;
+    switch (node.kind) {
+    case NODE_DECL:
+        if (node.decl->kind == DECL_FUNC) {
+            if (event == WALK_PRE) {
+                push_scope(checker);
+            } else {
+                pop_scope(checker);
+            }
+        }
+        break;
+    case NODE_PARAM:
+        if (event == WALK_POST) {
+            buf_push(checker->locals, node.param->name);
+        }
+        break;
+    case NODE_BLOCK: {
+        Node parent = walk_parent(walk);
+        if (parent.kind != NODE_STMT || parent.stmt->kind != STMT_FOR) {
+            if (event == WALK_PRE) {
+                push_scope(checker);
+            } else {
+                pop_scope(checker);
+            }
+        }
+        break;
+    }
+    case NODE_STMT:
+        check_stmt(checker, event, node.stmt);
+        break;
+    case NODE_EXPR:
+        if (event == WALK_PRE && node.expr->kind == EXPR_NAME) {
+            check_name(checker, node.expr);
+        } else if (event == WALK_PRE && node.expr->kind == EXPR_CALL) {
+            check_call(checker, node.expr);
+        }
+        break;
+    case NODE_TYPESPEC:
+        if (event == WALK_PRE && node.typespec->kind == TYPESPEC_NAME) {
+            Sym *sym = map_get(checker->globals, node.typespec->name);
+            if (!sym || sym->kind != SYM_TYPE) {
+                check_error(checker, node.typespec->pos, "Unknown type '%s'", node.typespec->name);
+            }
+        }
+        break;
+    default:
+        break;
+    }
+    return WALK_CONTINUE;
+}
+
+void check_decl(Checker *checker, Decl *decl) {
+    checker->loops = checker->switches = 0;
+    walk_node(&checker->walk, node_decl(decl));
+    assert(buf_len(checker->locals) == 0 && buf_len(checker->scopes) == 0);
+}
+
+Checker new_checker(CheckWork *work) {
+    return (Checker){.globals = &work->globals, .walk = {.visit = check_visit}, .arena = {.tag = ALLOC_MISC}};
+}
+
+void free_checker(Checker *checker) {
+    walk_free(&checker->walk);
+    buf_free(checker->locals);
+    buf_free(checker->scopes);
+}
+
+void *check_worker(void *arg) {
+    CheckWork *work = arg;
+    Checker checker = new_checker(work);
+    checker.walk.data = &checker;
+    for (;;) {
+        pthread_mutex_lock(&work->lock);
+        size_t first = work->next_func;
+        work->next_func = MIN(first + CHECK_BATCH, buf_len(work->funcs));
+        size_t last = work->next_func;
+        pthread_mutex_unlock(&work->lock);
+        if (first == last) {
+            break;
+        }
+        for (size_t i = first; i < last; i++) {
+            size_t index = work->funcs[i];
+            checker.diags = NULL;
+            check_decl(&checker, work->decls[index]);
+            work->diags[index] = checker.diags;
+        }
+    }
+    free_checker(&checker);
+    pthread_mutex_lock(&work->lock);
+    buf_push(work->arenas, checker.arena);
+    pthread_mutex_unlock(&work->lock);
+    return NULL;
+}
+
+void declare_global(Checker *checker, CheckWork *work, const char *name, SymKind kind, Decl *decl) {
+    if (map_get(&work->globals, name)) {
+        check_error(checker, decl->pos, "'%s' is already defined", name);
+        return;
+    }
+    Sym *sym = &work->syms[buf_len(work->syms)];
+    buf_push(work->syms, (Sym){kind, decl});
+    map_put(&work->globals, name, sym);
+}
+
+// Functions reached from the roots
+//
+// With lazily parsed bodies only the functions a program can reach are
+// parsed, checked and lowered. The roots are main, lazy_root, every function
+// whose body was parsed anyway and every function named outside a function
+// body; a file with neither main nor lazy_root is a library, and all of its
+// functions are roots. The rest are reached through the names in the bodies
+// of reached functions, whether or not a local shadows them.
+const char *lazy_root;
+
+typedef struct Reach {
+    // Declaration number plus one of each function, by name.
+    Map funcs;
+    bool *reached;
+    size_t *work;
+} Reach;
+
+void reach_func(Reach *reach, const char *name) {
+    size_t index = (size_t)map_get_uint64(&reach->funcs, (uint64_t)(uintptr_t)name);
+    if (index && !reach->reached[index - 1]) {
+        reach->reached[index - 1] = true;
+        buf_push(reach->work, index - 1);
+    }
+}
+
+WalkAction reach_visit(Walk *walk, WalkEvent event, Node node) {
+    if (event == WALK_PRE && node.kind == NODE_EXPR && node.expr->kind == EXPR_NAME) {
+        reach_func(walk->data, node.expr->name);
+    }
+    return WALK_CONTINUE;
+}
+
+// Flags the reachable functions among decls and parses their bodies, on this
+// thread. The flags are allocated with ALLOC_MISC, one per declaration.
+bool *reach_funcs(Decl **decls, size_t num_decls) {
+    Reach reach = {.reached = xcalloc(num_decls ? num_decls : 1, sizeof(bool), ALLOC_MISC)};
+    bool library = true;
+    bool lazy = false;
+    for (size_t i = 0; i < num_decls; i++) {
+        if (decls[i]->kind == DECL_FUNC) {
+            reach.reached[i] = true;
+            lazy |= decls[i]->func.lazy_body != NULL;
+            library &= decls[i]->name != str_intern("main") && decls[i]->name != lazy_root;
+        }
+    }
+    if (!lazy || library) {
+        for (size_t i = 0; i < num_decls; i++) {
+            if (decls[i]->kind == DECL_FUNC) {
+                func_body(decls[i]);
+            }
+        }
+        return reach.reached;
+    }
+    for (size_t i = 0; i < num_decls; i++) {
+        if (decls[i]->kind == DECL_FUNC) {
+            reach.reached[i] = false;
+            map_put_uint64(&reach.funcs, (uint64_t)(uintptr_t)decls[i]->name, i + 1);
+        }
+    }
+    Walk walk = {.visit = reach_visit, .data = &reach, .stack = NULL};
+    for (size_t i = 0; i < num_decls; i++) {
+        Decl *decl = decls[i];
+        if (decl->kind != DECL_FUNC) {
+            walk_node(&walk, node_decl(decl));
+        } else if (!decl->func.lazy_body || decl->name == str_intern("main") || decl->name == lazy_root) {
+            reach_func(&reach, decl->name);
+        }
+    }
+    while (buf_len(reach.work)) {
+        walk_node(&walk, node_decl(decls[buf_pop(reach.work)]));
+    }
+    walk_free(&walk);
+    buf_free(reach.work);
+    map_free(&reach.funcs);
+    return reach.reached;
+}
+
+// Checks the declarations of a file with up to num_threads threads and
+// returns the diagnostics in declaration order. Their messages are allocated
+// in arena, whose tag must be ALLOC_MISC.
+CheckDiag *check_decls(Decl **decls, size_t num_decls, int num_threads, Arena *arena) {
+    // The builtin types follow the keywords in the startup snapshot.
+    size_t num_builtins = SNAPSHOT_NUM_NAMES - SNAPSHOT_NUM_KEYWORDS;
+    size_t num_syms = num_builtins;
+    for (size_t i = 0; i < num_decls; i++) {
+        num_syms += 1 + (decls[i]->kind == DECL_ENUM ? decls[i]->enum_decl.num_items : 0);
+    }
+    CheckWork work = {.decls = decls};
+    work.diags = xcalloc(num_decls ? num_decls : 1, sizeof(CheckDiag *), ALLOC_MISC);
+    // Reserved up front so that symbols do not move once they are in the map.
+    buf_reserve(work.syms, num_syms);
+
+    // The global phase: declare everything, then check what is not a function body.
+    // Declaring is the name resolution pass, timed on its own.
+    STATS_PHASE_BEGIN(resolve);
+    Checker checker = new_checker(&work);
+    checker.walk.data = &checker;
+    // Skipped bodies are parsed here, on this thread, if they can be reached.
+    bool *reached = reach_funcs(decls, num_decls);
+    for (size_t i = 0; i < num_builtins; i++) {
+        buf_push(work.syms, (Sym){SYM_TYPE, NULL});
+        map_put(&work.globals, snapshot_text + snapshot_offsets[SNAPSHOT_NUM_KEYWORDS + i], &work.syms[i]);
+    }
+    for (size_t i = 0; i < num_decls; i++) {
+        Decl *decl = decls[i];
+        checker.diags = NULL;
+        switch (decl->kind) {
+        case DECL_VAR:
+            declare_global(&checker, &work, decl->name, SYM_VAR, decl);
+            break;
+        case DECL_CONST:
+            declare_global(&checker, &work, decl->name, SYM_CONST, decl);
+            break;
+        case DECL_FUNC:
+            declare_global(&checker, &work, decl->name, SYM_FUNC, decl);
+            if (reached[i]) {
+                buf_push(work.funcs, i);
+            }
+            break;
+        case DECL_ENUM:
+            declare_global(&checker, &work, decl->name, SYM_TYPE, decl);
+            for (size_t j = 0; j < decl->enum_decl.num_items; j++) {
+                declare_global(&checker, &work, decl->enum_decl.items[j].name, SYM_CONST, decl);
+            }
+            break;
+        default:
+            declare_global(&checker, &work, decl->name, SYM_TYPE, decl);
+            break;
+        }
+        work.diags[i] = checker.diags;
+    }
+    STATS_PHASE_END(resolve, PHASE_RESOLVE);
+    for (size_t i = 0; i < num_decls; i++) {
+        if (decls[i]->kind != DECL_FUNC) {
+            checker.diags = work.diags[i];
+            check_decl(&checker, decls[i]);
+            work.diags[i] = checker.diags;
+        }
+    }
+    free_checker(&checker);
+    arena_adopt(arena, &checker.arena);
+
+    // The parallel phase: function bodies. With one thread they are checked right here.
+    pthread_mutex_init(&work.lock, NULL);
+    num_threads = (int)MIN((size_t)MAX(num_threads, 1), (buf_len(work.funcs) + CHECK_BATCH - 1) / CHECK_BATCH);
+    pthread_t *threads = NULL;
+    int started = 0;
+    if (num_threads > 1) {
+        threads = xcalloc(num_threads, sizeof(pthread_t), ALLOC_MISC);
+        threads_active = true;
+        for (; started < num_threads; started++) {
+            if (pthread_create(&threads[started], NULL, check_worker, &work) != 0) {
+                break;
+            }
+        }
+    }
+    // Whatever the started threads leave, including everything if none started.
+    check_worker(&work);
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    threads_active = false;
+    if (threads) {
+        xfree(threads, num_threads * sizeof(pthread_t), ALLOC_MISC);
+    }
+    pthread_mutex_destroy(&work.lock);
+    for (Arena *it = work.arenas; it != buf_end(work.arenas); it++) {
+        arena_adopt(arena, it);
+    }
+
+    CheckDiag *diags = NULL;
+    for (size_t i = 0; i < num_decls; i++) {
+        if (work.diags[i]) {
+            buf_pushn(diags, work.diags[i], buf_len(work.diags[i]));
+            buf_free(work.diags[i]);
+        }
+    }
+    xfree(work.diags, (num_decls ? num_decls : 1) * sizeof(CheckDiag *), ALLOC_MISC);
+    xfree(reached, (num_decls ? num_decls : 1) * sizeof(bool), ALLOC_MISC);
+    buf_free(work.arenas);
+    buf_free(work.funcs);
+    buf_free(work.syms);
+    map_free(&work.globals);
+    return diags;
+}
+
+void report_diags(CheckDiag *diags) {
+    for (CheckDiag *it = diags; it != buf_end(diags); it++) {
+        error_at(it->pos, "%s", it->msg);
+    }
+}
+
+// Checks and reports. Returns the number of errors.
+size_t check_file(Decl **decls, size_t num_decls, int num_threads) {
+    Arena arena = {.tag = ALLOC_MISC};
+    CheckDiag *diags = check_decls(decls, num_decls, num_threads, &arena);
+    report_diags(diags);
+    size_t num_errors = buf_len(diags);
+    buf_free(diags);
+    arena_free(&arena);
+    return num_errors;
+}
+
+// The diagnostics of a checked file, kept by the compile server's file cache
+// for as long as the file's AST.
+typedef struct CheckResult {
+    bool checked;
+    CheckDiag *diags;
+    Arena arena;
+} CheckResult;
+
+// Like check_file, but only checks the first time and reports the kept
+// diagnostics after that.
+size_t check_file_cached(Decl **decls, size_t num_decls, int num_threads, CheckResult *result) {
+    if (result->checked) {
+        STAT_INC(checks_cached);
+    } else {
+        result->arena = (Arena){.tag = ALLOC_MISC};
+        result->diags = check_decls(decls, num_decls, num_threads, &result->arena);
+        result->checked = true;
+    }
+    report_diags(result->diags);
+    return buf_len(result->diags);
+}
+
+void check_result_free(CheckResult *result) {
+    buf_free(result->diags);
+    arena_free(&result->arena);
+    result->checked = false;
+}
+
+// Functions with locals, loops, calls and a few globals to resolve, as in a
+// larger codebase.
+char *check_source(size_t num_funcs) {
+    char *src = NULL;
+    char line[512];
+    int n = snprintf(line, sizeof(line), "const N = 64;\nenum Color { RED, GREEN }\nvar table: int[N];\n"
+                                         "struct Point { x, y: int; }\n");
+    buf_pushn(src, line, n);
+    for (size_t i = 0; i < num_funcs; i++) {
+        n = snprintf(line, sizeof(line),
+                     "func f%zu(a: int, b: int): int {\n"
+                     "    s := a;\n"
+                     "    for (i := 0; i < N; i++) { t := table[i] * b; if (t > s) { s = t; continue; } s += i; }\n"
+                     "    while (s > 100) { switch (s %% 4) { case 0: s = s / 2; break; default: s--; } }\n"
+                     "    p := Point{a, b};\n"
+                     "    return s + p.x + %s(s, GREEN);\n"
+                     "}\n",
+                     i, i ? "f0" : "f1");
+        buf_pushn(src, line, n);
+    }
+    buf_push(src, 0);
+    return src;
+}
+
+bool check_diags_equal(CheckDiag *a, CheckDiag *b) {
+    if (buf_len(a) != buf_len(b)) {
+        return false;
+    }
+    for (size_t i = 0; i < buf_len(a); i++) {
+        if (a[i].pos != b[i].pos || strcmp(a[i].msg, b[i].msg) != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Times checking one large file with more and more threads.
+void check_bench(void) {
+    char *src = check_source(20000);
+    init_stream("bench", src);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    printf("%zu declarations, %ld cores online\n", num_decls, cores);
+    double base = 0;
+    for (int threads = 1; threads <= MAX(4, cores); threads *= 2) {
+        double best = 1e9;
+        for (int run = 0; run < 5; run++) {
+            Arena arena = {.tag = ALLOC_MISC};
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            CheckDiag *diags = check_decls(decls, num_decls, threads, &arena);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            best = MIN(best, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+            assert(buf_len(diags) == 0);
+            buf_free(diags);
+            arena_free(&arena);
+        }
+        base = threads == 1 ? best : base;
+        printf("%2d thread%s %8.2f ms  %.2fx\n", threads, threads == 1 ? ": " : "s:", best * 1e3, base / best);
+    }
+
+    // A program that calls into a few of the functions, parsed and checked
+    // with every body and with the reachable bodies only.
+    buf__hdr(src)->len--;
+    const char *main_func = "func main(): int { return f7(1, 2); }\n";
+    buf_pushn(src, main_func, strlen(main_func) + 1);
+    double times[2];
+    for (int lazy = 0; lazy < 2; lazy++) {
+        double best = 1e9;
+        size_t parsed = 0;
+        for (int run = 0; run < 5; run++) {
+            Arena arena = {.tag = ALLOC_MISC};
+            Arena outer_arena = ast_arena;
+            ast_arena = (Arena){.tag = ALLOC_AST};
+            struct timespec start, end;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            lazy_func_bodies = lazy;
+            init_stream("bench", src);
+            decls = parse_file(&num_decls);
+            lazy_func_bodies = false;
+            CheckDiag *diags = check_decls(decls, num_decls, 1, &arena);
+            clock_gettime(CLOCK_MONOTONIC, &end);
+            best = MIN(best, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9);
+            assert(buf_len(diags) == 0);
+            parsed = 0;
+            for (size_t i = 0; i < num_decls; i++) {
+                parsed += decls[i]->kind == DECL_FUNC && !decls[i]->func.lazy_body;
+            }
+            buf_free(diags);
+            arena_free(&arena);
+            arena_free(&ast_arena);
+            ast_arena = outer_arena;
+        }
+        times[lazy] = best;
+        if (lazy) {
+            printf("lazy bodies:  %8.2f ms  %.2fx  (%zu of %zu bodies parsed)\n", best * 1e3, times[0] / best, parsed,
+                   num_decls - 4);
+        } else {
+            printf("all bodies:   %8.2f ms  (parse and check, 1 thread)\n", best * 1e3);
+        }
+    }
+    buf_free(src);
+}
+
+void check_test(void) {
+    const char *src =
+        "const K = 1;\n"
+        "enum E { A, B = A + K }\n"
+        "struct S { s: S*; t: T; }\n"
+        "var g: S = {0};\n"
+        "var g: int = missing;\n"
+        "func f(a: int, b: int): int { return a + b + K + B + g.s; }\n"
+        "func h(x: int): int {\n"
+        "    K = 2;\n"
+        "    f = h;\n"
+        "    y := f(x) + f(x, x) + h(1, 2) + S;\n"
+        "    for (i := 0; i < y; i++) { z := i; continue; }\n"
+        "    switch (x) { case 1: break; }\n"
+        "    if (x) { w := 1; }\n"
+        "    x = i + z + w + cast(U, x);\n"
+        "    continue;\n"
+        "    break;\n"
+        "    K := 3; K = 4;\n"
+        "    return y;\n"
+        "}\n"
+        "func k(f: int): int { return f(1); }\n"
+        "func m() { if (K) { return; } }\n";
+    const char *expected[] = {
+        "Unknown type 'T'",
+        "'g' is already defined",
+        "Unresolved name 'missing'",
+        "Cannot assign to constant 'K'",
+        "Cannot assign to function 'f'",
+        "'f' takes 2 arguments, not 1",
+        "'h' takes 1 argument, not 2",
+        "'S' is a type, not a value",
+        "Unresolved name 'i'",
+        "Unresolved name 'z'",
+        "Unresolved name 'w'",
+        "Unknown type 'U'",
+        "'continue' outside of a loop",
+        "'break' outside of a loop or switch",
+    };
+    size_t num_expected = sizeof(expected) / sizeof(*expected);
+    init_stream(NULL, src);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    Arena arena = {.tag = ALLOC_MISC};
+    CheckDiag *diags = check_decls(decls, num_decls, 1, &arena);
+    assert(buf_len(diags) == num_expected);
+    for (size_t i = 0; i < num_expected; i++) {
+        assert(strcmp(diags[i].msg, expected[i]) == 0);
+    }
+    assert(srcpos_loc(diags[0].pos).line == 3 && srcpos_loc(diags[3].pos).line == 8);
+    buf_free(diags);
+
+    // Many functions on several threads give the same diagnostics, in the same order.
+    char *big = check_source(500);
+    char *bad = NULL;
+    buf_pushn(bad, big, buf_len(big) - 1);
+    for (int i = 0; i < 100; i++) {
+        char line[128];
+        int n = snprintf(line, sizeof(line), "func e%d(): int { return f%d(1) + nope%d; }\n", i, i * 3, i);
+        buf_pushn(bad, line, n);
+    }
+    buf_push(bad, 0);
+    init_stream(NULL, big);
+    decls = parse_file(&num_decls);
+    diags = check_decls(decls, num_decls, 4, &arena);
+    assert(buf_len(diags) == 0);
+    buf_free(diags);
+    init_stream(NULL, bad);
+    decls = parse_file(&num_decls);
+    CheckDiag *serial = check_decls(decls, num_decls, 1, &arena);
+    assert(buf_len(serial) == 200);
+    for (int threads = 2; threads <= 8; threads *= 2) {
+        diags = check_decls(decls, num_decls, threads, &arena);
+        assert(check_diags_equal(diags, serial));
+        buf_free(diags);
+    }
+    buf_free(serial);
+    buf_free(bad);
+    buf_free(big);
+
+    // With lazy bodies only what main, the --run function and the global
+    // declarations reach is parsed and checked; a file without either entry
+    // point is checked whole.
+    const char *program =
+        "var p = used_by_var;\n"
+        "func used_by_var(): int { return nope1; }\n"
+        "func called(): int { return nope2; }\n"
+        "func unused(): int { return nope3 + unused_too(); }\n"
+        "func unused_too(): int { return nope4; }\n"
+        "func run_me(): int { return nope5; }\n"
+        "func main(): int { return called(); }\n";
+    struct {
+        bool lazy;
+        const char *root;
+        const char *program;
+        int errors;
+    } reaches[] = {
+        {false, NULL, program, 5},
+        {true, NULL, program, 2},
+        {true, "run_me", program, 3},
+        {true, NULL, "func a(): int { return nope1; } func b(): int { return nope2; }", 2},
+    };
+    for (size_t i = 0; i < sizeof(reaches)/sizeof(*reaches); i++) {
+        lazy_func_bodies = reaches[i].lazy;
+        lazy_root = reaches[i].root ? str_intern(reaches[i].root) : NULL;
+        init_stream(NULL, reaches[i].program);
+        decls = parse_file(&num_decls);
+        diags = check_decls(decls, num_decls, 1, &arena);
+        assert(buf_len(diags) == (size_t)reaches[i].errors);
+        buf_free(diags);
+        bool *reached = reach_funcs(decls, num_decls);
+        for (size_t j = 0; j < num_decls; j++) {
+            assert(decls[j]->kind != DECL_FUNC || reached[j] == !decls[j]->func.lazy_body);
+        }
+        xfree(reached, num_decls * sizeof(bool), ALLOC_MISC);
+    }
+    lazy_func_bodies = false;
+    lazy_root = NULL;
+    arena_free(&arena);
+}
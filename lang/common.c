@@ -2,55 +2,245 @@
 // Created by David Clements on 2019-05-11.
 //
 
+#define MIN(x, y) ((x) <= (y) ? (x) : (y))
 #define MAX(x, y) ((x) >= (y) ? (x) : (y))
+#define ALIGN_DOWN(n, a) ((n) & ~((a) - 1))
+#define ALIGN_UP(n, a) ALIGN_DOWN((n) + (a) - 1, (a))
+#define ALIGN_DOWN_PTR(p, a) ((void *)ALIGN_DOWN((uintptr_t)(p), (a)))
+#define ALIGN_UP_PTR(p, a) ((void *)ALIGN_UP((uintptr_t)(p), (a)))
 
-void *xrealloc(void * ptr, size_t size) {
+// Allocation telemetry
+//
+// Every heap allocation is tagged with the subsystem that owns it. Callers
+// pass the old size to xrealloc and xfree since every owner already knows
+// it, so no per-block header is needed. Accounting only happens while
+// alloc_telemetry is set; when it is off the cost is one predictable branch.
+// Frees of blocks allocated before telemetry was switched on are clamped,
+// so enable it before the work being measured.
+typedef enum AllocTag {
+    ALLOC_MISC,
+    ALLOC_SRC,
+    ALLOC_INTERN,
+    ALLOC_STR,
+    ALLOC_BUF,
+    ALLOC_SCRATCH,
+    ALLOC_AST,
+    ALLOC_ARENA,
+    ALLOC_IR,
+    NUM_ALLOC_TAGS,
+} AllocTag;
+
+const char *alloc_tag_names[NUM_ALLOC_TAGS] = {
+    [ALLOC_MISC] = "misc",
+    [ALLOC_SRC] = "source",
+    [ALLOC_INTERN] = "intern",
+    [ALLOC_STR] = "strlit",
+    [ALLOC_BUF] = "buf",
+    [ALLOC_SCRATCH] = "scratch",
+    [ALLOC_AST] = "ast",
+    [ALLOC_ARENA] = "arena",
+    [ALLOC_IR] = "ir",
+};
+
+#define ALLOC_SIZE_CLASSES 48
+
+typedef struct AllocCounts {
+    uint64_t allocs;
+    uint64_t reallocs;
+    uint64_t frees;
+    uint64_t bytes;
+    uint64_t live;
+    uint64_t peak;
+} AllocCounts;
+
+typedef struct AllocStats {
+    AllocCounts tags[NUM_ALLOC_TAGS];
+    uint64_t live;
+    uint64_t peak;
+    // Requested sizes of fresh allocations, by power-of-two size class.
+    uint64_t sizes[ALLOC_SIZE_CLASSES];
+    // Reallocs by the size class they grow into; a growth chain shows up as one step per class.
+    uint64_t realloc_steps[ALLOC_SIZE_CLASSES];
+    uint64_t reallocs_in_place;
+    uint64_t reallocs_moved;
+    uint64_t realloc_bytes_copied;
+} AllocStats;
+
+bool alloc_telemetry;
+AllocStats alloc_stats;
+pthread_mutex_t alloc_stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Set while worker threads run. Shared tables are only locked then, so
+// single-threaded runs pay nothing for it.
+bool threads_active;
+
+#define SHARED_LOCK(mutex) (threads_active ? pthread_mutex_lock(mutex) : 0)
+#define SHARED_UNLOCK(mutex) (threads_active ? pthread_mutex_unlock(mutex) : 0)
+#define ALLOC_NOTE(note) \
+    do { \
+        if (alloc_telemetry) { \
+            SHARED_LOCK(&alloc_stats_lock); \
+            note; \
+            SHARED_UNLOCK(&alloc_stats_lock); \
+        } \
+    } while (0)
+
+int alloc_size_class(size_t size) {
+    int size_class = 0;
+    while (size > 1 && size_class < ALLOC_SIZE_CLASSES - 1) {
+        size = (size + 1) >> 1;
+        size_class++;
+    }
+    return size_class;
+}
+
+void alloc_note_live(AllocTag tag, size_t old_size, size_t new_size) {
+    AllocCounts *counts = &alloc_stats.tags[tag];
+    uint64_t old_live = MIN(old_size, counts->live);
+    counts->live += new_size - old_live;
+    counts->peak = MAX(counts->peak, counts->live);
+    alloc_stats.live += new_size - MIN(old_size, alloc_stats.live);
+    alloc_stats.peak = MAX(alloc_stats.peak, alloc_stats.live);
+}
+
+void alloc_note_malloc(AllocTag tag, size_t size) {
+    alloc_stats.tags[tag].allocs++;
+    alloc_stats.tags[tag].bytes += size;
+    alloc_stats.sizes[alloc_size_class(size)]++;
+    alloc_note_live(tag, 0, size);
+}
+
+// Takes addresses rather than pointers, since the old block is gone by now.
+void alloc_note_realloc(AllocTag tag, uintptr_t old_addr, size_t old_size, uintptr_t new_addr, size_t new_size) {
+    if (!old_addr) {
+        alloc_note_malloc(tag, new_size);
+        return;
+    }
+    alloc_stats.tags[tag].reallocs++;
+    if (new_size > old_size) {
+        alloc_stats.tags[tag].bytes += new_size - old_size;
+    }
+    alloc_stats.realloc_steps[alloc_size_class(new_size)]++;
+    if (new_addr == old_addr) {
+        alloc_stats.reallocs_in_place++;
+    } else {
+        alloc_stats.reallocs_moved++;
+        alloc_stats.realloc_bytes_copied += MIN(old_size, new_size);
+    }
+    alloc_note_live(tag, old_size, new_size);
+}
+
+void alloc_note_free(AllocTag tag, size_t size) {
+    alloc_stats.tags[tag].frees++;
+    alloc_note_live(tag, size, 0);
+}
+
+void *xrealloc(void *ptr, size_t old_size, size_t size, AllocTag tag) {
+    // Read before realloc, since ptr is invalid afterwards if the block moved.
+    uintptr_t old_addr = alloc_telemetry ? (uintptr_t)ptr : 0;
     void * buf = realloc(ptr, size);
     if (!buf)
     {
         perror("xrealloc failed");
         exit(1);
     }
+    ALLOC_NOTE(alloc_note_realloc(tag, old_addr, old_size, (uintptr_t)buf, size));
     return buf;
 }
 
-void *xmalloc(size_t size) {
+void *xmalloc(size_t size, AllocTag tag) {
     void * buf = malloc(size);
     if (!buf)
     {
         perror("xmalloc failed");
         exit(1);
     }
+    ALLOC_NOTE(alloc_note_malloc(tag, size));
     return buf;
 }
 
-void *xcalloc(size_t num, size_t size) {
+void *xcalloc(size_t num, size_t size, AllocTag tag) {
     void * buf = calloc(num, size);
     if (!buf)
     {
         perror("xcalloc failed");
         exit(1);
     }
+    ALLOC_NOTE(alloc_note_malloc(tag, num * size));
     return buf;
 }
 
-void fatal(const char *fmt, ...) {
-    va_list args;
-    va_start(args, fmt);
-    printf("FATAL: ");
-    vprintf(fmt, args);
-    printf("\n");
-    va_end(args);
+void xfree(void *ptr, size_t size, AllocTag tag) {
+    if (ptr) {
+        ALLOC_NOTE(alloc_note_free(tag, size));
+    }
+    free(ptr);
+}
+
+void print_alloc_stats(bool json) {
+    if (json) {
+        printf("{\"live\": %" PRIu64 ", \"peak\": %" PRIu64 ", \"tags\": {", alloc_stats.live, alloc_stats.peak);
+        for (int i = 0; i < NUM_ALLOC_TAGS; i++) {
+            AllocCounts *c = &alloc_stats.tags[i];
+            printf("%s\"%s\": {\"allocs\": %" PRIu64 ", \"reallocs\": %" PRIu64 ", \"frees\": %" PRIu64
+                   ", \"bytes\": %" PRIu64 ", \"live\": %" PRIu64 ", \"peak\": %" PRIu64 "}",
+                   i ? ", " : "", alloc_tag_names[i], c->allocs, c->reallocs, c->frees, c->bytes, c->live, c->peak);
+        }
+        printf("},\n \"sizes\": [");
+        for (int i = 0; i < ALLOC_SIZE_CLASSES; i++) {
+            printf("%s%" PRIu64, i ? ", " : "", alloc_stats.sizes[i]);
+        }
+        printf("],\n \"realloc_steps\": [");
+        for (int i = 0; i < ALLOC_SIZE_CLASSES; i++) {
+            printf("%s%" PRIu64, i ? ", " : "", alloc_stats.realloc_steps[i]);
+        }
+        printf("],\n \"reallocs_in_place\": %" PRIu64 ", \"reallocs_moved\": %" PRIu64
+               ", \"realloc_bytes_copied\": %" PRIu64 "}\n",
+               alloc_stats.reallocs_in_place, alloc_stats.reallocs_moved, alloc_stats.realloc_bytes_copied);
+        return;
+    }
+    printf("heap: %" PRIu64 " bytes live, %" PRIu64 " peak\n", alloc_stats.live, alloc_stats.peak);
+    printf("%-8s %10s %10s %10s %14s %14s %14s\n", "tag", "allocs", "reallocs", "frees", "bytes", "live", "peak");
+    for (int i = 0; i < NUM_ALLOC_TAGS; i++) {
+        AllocCounts *c = &alloc_stats.tags[i];
+        printf("%-8s %10" PRIu64 " %10" PRIu64 " %10" PRIu64 " %14" PRIu64 " %14" PRIu64 " %14" PRIu64 "\n",
+               alloc_tag_names[i], c->allocs, c->reallocs, c->frees, c->bytes, c->live, c->peak);
+    }
+    printf("%-12s %12s %12s\n", "size class", "allocs", "realloc to");
+    for (int i = 0; i < ALLOC_SIZE_CLASSES; i++) {
+        if (alloc_stats.sizes[i] || alloc_stats.realloc_steps[i]) {
+            printf("<= %-9" PRIu64 " %12" PRIu64 " %12" PRIu64 "\n",
+                   (uint64_t)1 << i, alloc_stats.sizes[i], alloc_stats.realloc_steps[i]);
+        }
+    }
+    printf("reallocs: %" PRIu64 " in place, %" PRIu64 " moved, %" PRIu64 " bytes copied\n",
+           alloc_stats.reallocs_in_place, alloc_stats.reallocs_moved, alloc_stats.realloc_bytes_copied);
+}
+
+// Drivers that keep going after a failed input point this at a recovery point.
+// Each thread has its own.
+_Thread_local jmp_buf *fatal_jmp;
+
+// Parser worker threads do not report errors. They only note that one
+// happened, and the input is reparsed on the main thread to report it in order.
+_Thread_local bool defer_errors;
+_Thread_local bool deferred_error;
+
+void fatal_exit(void) {
+    if (fatal_jmp) {
+        longjmp(*fatal_jmp, 1);
+    }
     exit(1);
 }
 
-void syntax_error(const char *fmt, ...) {
+void fatal(const char *fmt, ...) {
     va_list args;
     va_start(args, fmt);
-    printf("Syntax Error: ");
+    printf("FATAL: ");
     vprintf(fmt, args);
     printf("\n");
     va_end(args);
+    fatal_exit();
 }
 
 //Stretchy buffers
@@ -70,8 +260,13 @@ typedef struct BufHdr {
 #define buf_len(b) ((b) ? buf__hdr(b)->len : 0)
 #define buf_cap(b) ((b) ? buf__hdr(b)->cap : 0)
 #define buf_push(b, ...) (buf__fit(b, 1), (b)[buf__hdr(b)->len++] = (__VA_ARGS__))
-#define buf_free(b) ((b) ? (free(buf__hdr(b)), (b) = NULL) : 0)
+#define buf_reserve(b, n) buf__fit(b, n)
+#define buf_pushn(b, items, n) \
+    (buf__fit(b, n), memcpy((b) + buf_len(b), (items), (n) * sizeof(*(b))), buf__hdr(b)->len += (n))
+#define buf_free(b) ((b) ? (buf__free(b, sizeof(*(b))), (b) = NULL) : 0)
 #define buf_end(b) ((b) + buf_len(b))
+#define buf_truncate(b, n) ((b) ? (void)(buf__hdr(b)->len = (n)) : (void)0)
+#define buf_pop(b) ((b)[--buf__hdr(b)->len])
 
 void *buf__grow(const void *buf, size_t new_len, size_t elem_size) {
     assert(buf_cap(buf) <= (SIZE_MAX - 1)/2);
@@ -81,15 +276,19 @@ void *buf__grow(const void *buf, size_t new_len, size_t elem_size) {
     size_t new_size = offsetof(BufHdr, buf) + new_cap * elem_size;
     BufHdr *new_hdr;
     if (buf){
-        new_hdr = xrealloc(buf__hdr(buf), new_size);
+        new_hdr = xrealloc(buf__hdr(buf), offsetof(BufHdr, buf) + buf_cap(buf) * elem_size, new_size, ALLOC_BUF);
     } else {
-        new_hdr = xmalloc(new_size);
+        new_hdr = xmalloc(new_size, ALLOC_BUF);
         new_hdr->len = 0;
     }
     new_hdr->cap = new_cap;
     return new_hdr->buf;
 }
 
+void buf__free(void *buf, size_t elem_size) {
+    xfree(buf__hdr(buf), offsetof(BufHdr, buf) + buf_cap(buf) * elem_size, ALLOC_BUF);
+}
+
 void buf_test(void)
 {
     int *buf = 0;
@@ -107,27 +306,544 @@ void buf_test(void)
     buf_free(buf);
     assert(buf == NULL);
     assert(buf_len(buf) == 0);
+
+    int items[] = {1, 2, 3};
+    buf_reserve(buf, 100);
+    assert(buf_len(buf) == 0 && buf_cap(buf) >= 100);
+    int *reserved = buf;
+    for (int i = 0; i < 33; ++i) {
+        buf_pushn(buf, items, 3);
+    }
+    assert(buf == reserved);
+    assert(buf_len(buf) == 99);
+    for (int i = 0; i < 99; ++i) {
+        assert(buf[i] == i % 3 + 1);
+    }
+    buf_free(buf);
 }
 
+// Arena allocator
+typedef struct ArenaBlock {
+    char *base;
+    size_t size;
+} ArenaBlock;
+
+typedef struct Arena {
+    char *ptr;
+    char *end;
+    ArenaBlock *blocks;
+    AllocTag tag;
+} Arena;
+
+#define ARENA_ALIGNMENT 8
+#define ARENA_BLOCK_SIZE (1024 * 1024)
+
+void arena_grow(Arena *arena, size_t min_size) {
+    size_t size = ALIGN_UP(MAX(ARENA_BLOCK_SIZE, min_size), ARENA_ALIGNMENT);
+    arena->ptr = xmalloc(size, arena->tag == ALLOC_MISC ? ALLOC_ARENA : arena->tag);
+    arena->end = arena->ptr + size;
+    STAT_ADD(arena_reserved, size);
+    buf_push(arena->blocks, (ArenaBlock){arena->ptr, size});
+}
+
+void *arena_alloc(Arena *arena, size_t size) {
+    if (size > (size_t)(arena->end - arena->ptr)) {
+        arena_grow(arena, size);
+        assert(size <= (size_t)(arena->end - arena->ptr));
+    }
+    void *ptr = arena->ptr;
+    arena->ptr = ALIGN_UP_PTR(arena->ptr + size, ARENA_ALIGNMENT);
+    STAT_ADD(arena_used, size);
+    assert(arena->ptr <= arena->end);
+    assert(ptr == ALIGN_DOWN_PTR(ptr, ARENA_ALIGNMENT));
+    return ptr;
+}
+
+// Keeps the first block for reuse and releases the rest.
+void arena_reset(Arena *arena) {
+    if (!arena->blocks) {
+        return;
+    }
+    for (ArenaBlock *it = arena->blocks + 1; it != buf_end(arena->blocks); it++) {
+        xfree(it->base, it->size, arena->tag == ALLOC_MISC ? ALLOC_ARENA : arena->tag);
+    }
+    buf__hdr(arena->blocks)->len = 1;
+    arena->ptr = arena->blocks[0].base;
+    arena->end = arena->ptr + arena->blocks[0].size;
+}
+
+// Moves the blocks of another arena with the same tag into this one. Allocation
+// continues in the current block of the receiving arena.
+void arena_adopt(Arena *arena, Arena *other) {
+    assert(arena->tag == other->tag);
+    if (!other->blocks) {
+        return;
+    }
+    if (!arena->blocks) {
+        *arena = *other;
+    } else {
+        ArenaBlock current = arena->blocks[buf_len(arena->blocks) - 1];
+        buf__hdr(arena->blocks)->len--;
+        buf_pushn(arena->blocks, other->blocks, buf_len(other->blocks));
+        buf_push(arena->blocks, current);
+        buf_free(other->blocks);
+    }
+    other->blocks = NULL;
+    other->ptr = other->end = NULL;
+}
+
+void arena_free(Arena *arena) {
+    for (ArenaBlock *it = arena->blocks; it != buf_end(arena->blocks); it++) {
+        xfree(it->base, it->size, arena->tag == ALLOC_MISC ? ALLOC_ARENA : arena->tag);
+    }
+    buf_free(arena->blocks);
+    arena->ptr = arena->end = NULL;
+}
+
+// Scratch lists
+//
+// Variable-length lists are built on a single stack-like scratch buffer and
+// copied once into an arena at their exact final size. Lists nest the way a
+// recursive descent parser does: a list opened while another is being built
+// must be finished before the outer list is pushed to again. Pointers into the
+// scratch buffer are only valid until the next push.
+typedef size_t ScratchMark;
+
+#define SCRATCH_ALIGNMENT 16
+
+static _Thread_local char *scratch_base;
+static _Thread_local size_t scratch_len;
+static _Thread_local size_t scratch_cap;
+
+// A mark remembers the unaligned top so releasing it also drops the alignment padding.
+ScratchMark scratch_mark(void) {
+    ScratchMark mark = scratch_len;
+    scratch_len = ALIGN_UP(scratch_len, SCRATCH_ALIGNMENT);
+    return mark;
+}
+
+void scratch_release(ScratchMark mark) {
+    assert(mark <= scratch_len);
+    scratch_len = mark;
+}
+
+// Releases the calling thread's scratch buffer.
+void scratch_free(void) {
+    assert(scratch_len == 0);
+    xfree(scratch_base, scratch_cap, ALLOC_SCRATCH);
+    scratch_base = NULL;
+    scratch_cap = 0;
+}
+
+void *scratch_alloc(size_t size) {
+    if (scratch_len + size > scratch_cap) {
+        size_t new_cap = MAX(2 * scratch_cap, scratch_len + size);
+        scratch_base = xrealloc(scratch_base, scratch_cap, new_cap, ALLOC_SCRATCH);
+        scratch_cap = new_cap;
+    }
+    void *ptr = scratch_base + scratch_len;
+    scratch_len += size;
+    return ptr;
+}
+
+void *scratch_data(ScratchMark mark) {
+    return scratch_base + ALIGN_UP(mark, SCRATCH_ALIGNMENT);
+}
+
+size_t scratch_size(ScratchMark mark) {
+    assert(ALIGN_UP(mark, SCRATCH_ALIGNMENT) <= scratch_len);
+    return scratch_len - ALIGN_UP(mark, SCRATCH_ALIGNMENT);
+}
+
+// Copies the list started at mark into the arena and pops it off the scratch
+// stack. Returns NULL for an empty list.
+void *scratch_finish(Arena *arena, ScratchMark mark) {
+    size_t size = scratch_size(mark);
+    void *ptr = NULL;
+    if (size) {
+        ptr = arena_alloc(arena, size);
+        memcpy(ptr, scratch_data(mark), size);
+    }
+    scratch_release(mark);
+    return ptr;
+}
+
+#define scratch_push(T, x) do { T scratch__val = (x); *(T *)scratch_alloc(sizeof(T)) = scratch__val; } while (0)
+#define scratch_count(T, mark) (scratch_size(mark) / sizeof(T))
+
+void scratch_test(void) {
+    Arena arena = {0};
+    ScratchMark outer = scratch_mark();
+    scratch_push(int, 1);
+    scratch_push(int, 2);
+    ScratchMark inner = scratch_mark();
+    for (int i = 0; i < 10000; ++i) {
+        scratch_push(int, i);
+    }
+    assert(scratch_count(int, inner) == 10000);
+    int *inner_list = scratch_finish(&arena, inner);
+    for (int i = 0; i < 10000; ++i) {
+        assert(inner_list[i] == i);
+    }
+    scratch_push(int, 3);
+    assert(scratch_count(int, outer) == 3);
+    int *outer_list = scratch_finish(&arena, outer);
+    assert(outer_list[0] == 1 && outer_list[1] == 2 && outer_list[2] == 3);
+    assert(scratch_finish(&arena, scratch_mark()) == NULL);
+    assert(scratch_len == outer);
+    arena_free(&arena);
+}
+
+// Source positions
+//
+// A SrcPos packs a file id and a byte offset into 32 bits. Each registered file
+// owns a contiguous range of one global offset space, so the file is recovered
+// by binary search over the range bases. Lines and columns are only needed for
+// diagnostics, so a file's line-start table is built on first use instead of
+// counting newlines in the lexer. Position 0 means "no position".
+typedef uint32_t SrcPos;
+
+typedef struct SrcFile {
+    const char *name;
+    const char *text;
+    uint32_t len;
+    SrcPos base;
+    uint32_t *line_starts;
+} SrcFile;
+
+typedef struct SrcLoc {
+    const char *name;
+    int line;
+    int col;
+} SrcLoc;
+
+typedef struct SrcRange {
+    SrcPos begin;
+    SrcPos end;
+} SrcRange;
+
+static SrcFile *src_files;
+static SrcPos src_next_base = 1;
+// Positions of removed files below src_next_base, sorted and merged.
+static SrcRange *src_free_ranges;
+// While set, new files may go into free ranges and their bases are pushed
+// here. Files added otherwise always go on top, so that a session can roll
+// the table back to where it began.
+SrcPos **src_owner;
+
+void src_free_range_delete(size_t index) {
+    memmove(src_free_ranges + index, src_free_ranges + index + 1,
+            (buf_len(src_free_ranges) - index - 1) * sizeof(SrcRange));
+    buf__hdr(src_free_ranges)->len--;
+}
+
+// The text must stay alive for as long as positions into it are reported.
+SrcPos src_file_add(const char *name, const char *text, size_t len) {
+    // One extra position per file so that end of file has a distinct position.
+    SrcPos base = 0;
+    for (size_t i = 0; src_owner && i < buf_len(src_free_ranges); i++) {
+        SrcRange *range = &src_free_ranges[i];
+        if (range->end - range->begin > len) {
+            base = range->begin;
+            range->begin += (uint32_t)len + 1;
+            if (range->begin == range->end) {
+                src_free_range_delete(i);
+            }
+            break;
+        }
+    }
+    if (!base) {
+        if (len >= UINT32_MAX - src_next_base) {
+            fatal("Source position space exhausted by '%s'", name);
+        }
+        base = src_next_base;
+        src_next_base += (uint32_t)len + 1;
+    }
+    size_t index = buf_len(src_files);
+    while (index > 0 && src_files[index - 1].base > base) {
+        index--;
+    }
+    buf_push(src_files, (SrcFile){0});
+    memmove(src_files + index + 1, src_files + index, (buf_len(src_files) - index - 1) * sizeof(SrcFile));
+    src_files[index] = (SrcFile){name, text, (uint32_t)len, base, NULL};
+    if (src_owner) {
+        buf_push(*src_owner, base);
+    }
+    return base;
+}
+
+SrcFile *srcpos_file(SrcPos pos) {
+    if (pos == 0 || pos >= src_next_base || !buf_len(src_files)) {
+        return NULL;
+    }
+    size_t lo = 0;
+    size_t hi = buf_len(src_files);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo)/2;
+        if (src_files[mid].base <= pos) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    // Positions of a removed file fall in a gap.
+    SrcFile *file = &src_files[lo];
+    return pos >= file->base && pos - file->base <= file->len ? file : NULL;
+}
+
+// Drops a file and gives its positions back, to the top of the space when
+// they are the last ones handed out and to the free ranges otherwise.
+void src_file_remove(SrcPos base) {
+    SrcFile *file = srcpos_file(base);
+    assert(file && file->base == base);
+    SrcRange range = {base, base + file->len + 1};
+    buf_free(file->line_starts);
+    memmove(file, file + 1, (buf_end(src_files) - file - 1) * sizeof(SrcFile));
+    buf__hdr(src_files)->len--;
+    size_t index = 0;
+    while (index < buf_len(src_free_ranges) && src_free_ranges[index].begin < range.begin) {
+        index++;
+    }
+    if (index > 0 && src_free_ranges[index - 1].end == range.begin) {
+        range.begin = src_free_ranges[--index].begin;
+        src_free_range_delete(index);
+    }
+    if (index < buf_len(src_free_ranges) && src_free_ranges[index].begin == range.end) {
+        range.end = src_free_ranges[index].end;
+        src_free_range_delete(index);
+    }
+    if (range.end == src_next_base) {
+        src_next_base = range.begin;
+    } else {
+        buf_push(src_free_ranges, (SrcRange){0});
+        memmove(src_free_ranges + index + 1, src_free_ranges + index,
+                (buf_len(src_free_ranges) - index - 1) * sizeof(SrcRange));
+        src_free_ranges[index] = range;
+    }
+}
+
+void src_file_build_lines(SrcFile *file) {
+    buf_push(file->line_starts, 0);
+    const char *end = file->text + file->len;
+    for (const char *p = file->text; (p = memchr(p, '\n', end - p)) != NULL;) {
+        ++p;
+        buf_push(file->line_starts, (uint32_t)(p - file->text));
+    }
+}
+
+SrcLoc srcpos_loc(SrcPos pos) {
+    SrcFile *file = srcpos_file(pos);
+    if (!file) {
+        return (SrcLoc){NULL, 0, 0};
+    }
+    if (!file->line_starts) {
+        src_file_build_lines(file);
+    }
+    uint32_t offset = pos - file->base;
+    size_t lo = 0;
+    size_t hi = buf_len(file->line_starts);
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo)/2;
+        if (file->line_starts[mid] <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return (SrcLoc){file->name, (int)lo + 1, (int)(offset - file->line_starts[lo]) + 1};
+}
+
+void verror_at(SrcPos pos, const char *kind, const char *fmt, va_list args) {
+    if (defer_errors) {
+        deferred_error = true;
+        return;
+    }
+    SrcLoc loc = srcpos_loc(pos);
+    if (loc.name) {
+        printf("%s:%d:%d: ", loc.name, loc.line, loc.col);
+    }
+    printf("%s: ", kind);
+    vprintf(fmt, args);
+    printf("\n");
+}
+
+void error_at(SrcPos pos, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    verror_at(pos, "Error", fmt, args);
+    va_end(args);
+}
+
+void fatal_at(SrcPos pos, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    verror_at(pos, "FATAL", fmt, args);
+    va_end(args);
+    fatal_exit();
+}
+
+void srcpos_test(void) {
+    const char *text = "ab\n\n  cd\n";
+    SrcPos first = src_file_add("first", "x", 1);
+    SrcPos base = src_file_add("second", text, strlen(text));
+    assert(srcpos_file(first)->base == first);
+    assert(srcpos_file(first + 1)->base == first);
+    assert(srcpos_file(base + 4) == srcpos_file(base));
+    assert(srcpos_file(0) == NULL);
+    SrcLoc loc = srcpos_loc(base);
+    assert(loc.line == 1 && loc.col == 1 && strcmp(loc.name, "second") == 0);
+    loc = srcpos_loc(base + 3);
+    assert(loc.line == 2 && loc.col == 1);
+    loc = srcpos_loc(base + 6);
+    assert(loc.line == 3 && loc.col == 3);
+    loc = srcpos_loc(base + (SrcPos)strlen(text));
+    assert(loc.line == 4 && loc.col == 1);
+}
+
+// String interning
+//
+// Interned strings live in two tiers. The global tier holds keywords and
+// anything interned outside a compilation session and lives for the whole
+// process. While a session is active, names not already in the global tier
+// go into the session's own tier, which is thrown away with the session.
+// Both tiers are open addressing hash tables with the strings in an arena.
+// The global tier starts out as the snapshot generated from names.def, whose
+// slots and strings are static data; the slots move to the heap the first
+// time the table grows.
 typedef struct Intern {
-    int len;
-    const char * str;
+    const char *str;
+    size_t len;
+    uint64_t hash;
 } Intern;
 
-static Intern *interns;
+typedef struct InternMap {
+    Intern *slots;
+    size_t cap;
+    size_t len;
+    Arena arena;
+    // The slots are the snapshot's static array rather than heap memory.
+    bool snapshot;
+} InternMap;
 
-const char *str_intern_range(const char *start, const char *end) {
-    size_t len = end - start;
-    for (Intern *it = interns; it != buf_end(interns); ++it) {
-        if (it->len == len && strncmp(it->str, start, len) == 0) {
-            return it->str;
+#include "snapshot.h"
+
+InternMap global_interns = {
+    .slots = snapshot_slots,
+    .cap = SNAPSHOT_CAP,
+    .len = SNAPSHOT_NUM_NAMES,
+    .arena = {.tag = ALLOC_INTERN},
+    .snapshot = true,
+};
+InternMap *session_interns;
+
+uint64_t hash_bytes(const char *buf, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)buf[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+Intern *intern_map_slot(InternMap *map, const char *start, size_t len, uint64_t hash) {
+    if (!map->cap) {
+        return NULL;
+    }
+    for (size_t i = hash & (map->cap - 1);; i = (i + 1) & (map->cap - 1)) {
+        Intern *slot = &map->slots[i];
+        if (!slot->str || (slot->hash == hash && slot->len == len && memcmp(slot->str, start, len) == 0)) {
+            return slot;
+        }
+    }
+}
+
+void intern_map_grow(InternMap *map) {
+    InternMap new_map = {
+        .slots = xcalloc(MAX(16, 2 * map->cap), sizeof(Intern), ALLOC_INTERN),
+        .cap = MAX(16, 2 * map->cap),
+    };
+    for (Intern *it = map->slots; it != map->slots + map->cap; it++) {
+        if (it->str) {
+            *intern_map_slot(&new_map, it->str, it->len, it->hash) = *it;
         }
     }
-    char *str = xmalloc(len+1);
+    if (!map->snapshot) {
+        xfree(map->slots, map->cap * sizeof(Intern), ALLOC_INTERN);
+    }
+    map->slots = new_map.slots;
+    map->cap = new_map.cap;
+    map->snapshot = false;
+}
+
+// Empties the map but keeps its slots and the first block of its arena.
+void intern_map_reset(InternMap *map) {
+    assert(!map->snapshot);
+    if (map->slots) {
+        memset(map->slots, 0, map->cap * sizeof(Intern));
+    }
+    arena_reset(&map->arena);
+    map->len = 0;
+}
+
+void intern_map_free(InternMap *map) {
+    assert(!map->snapshot);
+    xfree(map->slots, map->cap * sizeof(Intern), ALLOC_INTERN);
+    arena_free(&map->arena);
+    map->slots = NULL;
+    map->cap = map->len = 0;
+}
+
+const char *str_intern_hashed(const char *start, size_t len, uint64_t hash) {
+    STATS_INTERN_BEGIN(timer);
+    STAT_INC(intern_lookups);
+    Intern *slot = intern_map_slot(&global_interns, start, len, hash);
+    InternMap *map = &global_interns;
+    if (session_interns && !(slot && slot->str)) {
+        map = session_interns;
+        slot = intern_map_slot(map, start, len, hash);
+    }
+    if (slot && slot->str) {
+        STAT_INC(intern_hits);
+        STATS_INTERN_END(timer);
+        return slot->str;
+    }
+    if (2 * (map->len + 1) > map->cap) {
+        intern_map_grow(map);
+        slot = intern_map_slot(map, start, len, hash);
+    }
+    char *str = arena_alloc(&map->arena, len + 1);
     memcpy(str, start, len);
     str[len] = 0;
-    Intern istr = (Intern) {len, str};
-    buf_push(interns, istr);
+    *slot = (Intern){str, len, hash};
+    map->len++;
+    STAT_INC(intern_entries);
+    STATS_INTERN_END(timer);
+    return str;
+}
+
+// Worker threads share the interner behind a lock. Most names repeat, so each
+// thread keeps a small cache of the names it interned in front of it.
+#define INTERN_CACHE_SIZE 256
+
+_Thread_local Intern intern_cache[INTERN_CACHE_SIZE];
+pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+const char *str_intern_range(const char *start, const char *end) {
+    size_t len = end - start;
+    uint64_t hash = hash_bytes(start, len);
+    if (!threads_active) {
+        return str_intern_hashed(start, len, hash);
+    }
+    Intern *cached = &intern_cache[hash & (INTERN_CACHE_SIZE - 1)];
+    if (cached->str && cached->hash == hash && cached->len == len && memcmp(cached->str, start, len) == 0) {
+        STAT_INC(intern_lookups);
+        STAT_INC(intern_hits);
+        return cached->str;
+    }
+    pthread_mutex_lock(&intern_lock);
+    const char *str = str_intern_hashed(start, len, hash);
+    pthread_mutex_unlock(&intern_lock);
+    *cached = (Intern){str, len, hash};
     return str;
 }
 
@@ -135,16 +851,244 @@ const char *str_intern(const char *str) {
     return str_intern_range(str, str + strlen(str));
 }
 
+// Hash maps
+//
+// Maps nonzero 64-bit keys, usually pointers such as interned names, to 64-bit
+// values. Open addressing with linear probing; entries are never removed.
+typedef struct Map {
+    uint64_t *keys;
+    uint64_t *vals;
+    size_t len;
+    size_t cap;
+} Map;
+
+uint64_t hash_uint64(uint64_t x) {
+    x *= 0xff51afd7ed558ccdull;
+    x ^= x >> 32;
+    return x;
+}
+
+uint64_t map_get_uint64(Map *map, uint64_t key) {
+    if (map->len == 0) {
+        return 0;
+    }
+    assert(key);
+    for (size_t i = hash_uint64(key) & (map->cap - 1);; i = (i + 1) & (map->cap - 1)) {
+        if (map->keys[i] == key) {
+            return map->vals[i];
+        } else if (!map->keys[i]) {
+            return 0;
+        }
+    }
+}
+
+void map_put_uint64(Map *map, uint64_t key, uint64_t val);
+
+void map_grow(Map *map, size_t new_cap) {
+    new_cap = MAX(16, new_cap);
+    Map new_map = {
+        .keys = xcalloc(new_cap, sizeof(uint64_t), ALLOC_MISC),
+        .vals = xmalloc(new_cap * sizeof(uint64_t), ALLOC_MISC),
+        .cap = new_cap,
+    };
+    for (size_t i = 0; i < map->cap; i++) {
+        if (map->keys[i]) {
+            map_put_uint64(&new_map, map->keys[i], map->vals[i]);
+        }
+    }
+    xfree(map->keys, map->cap * sizeof(uint64_t), ALLOC_MISC);
+    xfree(map->vals, map->cap * sizeof(uint64_t), ALLOC_MISC);
+    *map = new_map;
+}
+
+void map_put_uint64(Map *map, uint64_t key, uint64_t val) {
+    assert(key);
+    if (2 * map->len >= map->cap) {
+        map_grow(map, 2 * map->cap);
+    }
+    for (size_t i = hash_uint64(key) & (map->cap - 1);; i = (i + 1) & (map->cap - 1)) {
+        if (!map->keys[i]) {
+            map->len++;
+            map->keys[i] = key;
+            map->vals[i] = val;
+            return;
+        } else if (map->keys[i] == key) {
+            map->vals[i] = val;
+            return;
+        }
+    }
+}
+
+void *map_get(Map *map, const void *key) {
+    return (void *)(uintptr_t)map_get_uint64(map, (uint64_t)(uintptr_t)key);
+}
+
+void map_put(Map *map, const void *key, void *val) {
+    map_put_uint64(map, (uint64_t)(uintptr_t)key, (uint64_t)(uintptr_t)val);
+}
+
+void map_free(Map *map) {
+    xfree(map->keys, map->cap * sizeof(uint64_t), ALLOC_MISC);
+    xfree(map->vals, map->cap * sizeof(uint64_t), ALLOC_MISC);
+    *map = (Map){0};
+}
+
+char *read_stream(FILE *file, size_t *len) {
+    size_t size = 0;
+    size_t cap = 64 * 1024;
+    char *buf = xmalloc(cap, ALLOC_SRC);
+    size_t n;
+    while ((n = fread(buf + size, 1, cap - size - 1, file)) > 0) {
+        size += n;
+        if (cap - size == 1) {
+            buf = xrealloc(buf, cap, 2 * cap, ALLOC_SRC);
+            cap *= 2;
+        }
+    }
+    if (ferror(file)) {
+        xfree(buf, cap, ALLOC_SRC);
+        return NULL;
+    }
+    buf = xrealloc(buf, cap, size + 1, ALLOC_SRC);
+    buf[size] = 0;
+    *len = size;
+    return buf;
+}
+
+char *read_file(const char *path, size_t *len) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        return NULL;
+    }
+    fseek(file, 0, SEEK_END);
+    long size = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (size < 0) {
+        fclose(file);
+        return NULL;
+    }
+    char *buf = xmalloc(size + 1, ALLOC_SRC);
+    if (size && fread(buf, size, 1, file) != 1) {
+        fclose(file);
+        xfree(buf, size + 1, ALLOC_SRC);
+        return NULL;
+    }
+    fclose(file);
+    buf[size] = 0;
+    *len = size;
+    return buf;
+}
+
 void str_intern_test(void) {
+    // The names of the startup snapshot are found in it, with the hashes
+    // hash_bytes gives, and keep their pointers into the snapshot text.
+    for (Intern *it = snapshot_slots; it != snapshot_slots + SNAPSHOT_CAP; it++) {
+        if (it->str) {
+            char copy[64];
+            snprintf(copy, sizeof(copy), "%s", it->str);
+            assert(it->len == strlen(copy) && it->hash == hash_bytes(copy, it->len));
+            assert(str_intern(copy) == it->str);
+        }
+    }
+    for (size_t i = 0; i < SNAPSHOT_NUM_NAMES; i++) {
+        assert(str_intern(snapshot_text + snapshot_offsets[i]) == snapshot_text + snapshot_offsets[i]);
+    }
+
     char z [] = "hello1";
     char x [] = "hello";
     char y [] = "hello";
     assert(x != y);
     assert(str_intern(x) == str_intern(y));
     assert(str_intern(x) != str_intern(z));
+
+    char name[32];
+    const char *names[1000];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "name%d", i);
+        names[i] = str_intern(name);
+    }
+    for (int i = 0; i < 1000; i++) {
+        snprintf(name, sizeof(name), "name%d", i);
+        assert(str_intern(name) == names[i]);
+    }
+
+    InternMap session_map = {.arena = {.tag = ALLOC_INTERN}};
+    session_interns = &session_map;
+    const char *session_name = str_intern("only_in_session");
+    assert(str_intern("hello") == str_intern(x));
+    assert(str_intern("only_in_session") == session_name);
+    assert(session_map.len == 1);
+    session_interns = NULL;
+    intern_map_free(&session_map);
+}
+
+void alloc_test(void) {
+    bool enabled = alloc_telemetry;
+    AllocStats saved = alloc_stats;
+    alloc_telemetry = true;
+    alloc_stats = (AllocStats){0};
+    char *a = xmalloc(100, ALLOC_MISC);
+    char *b = xcalloc(10, 10, ALLOC_STR);
+    a = xrealloc(a, 100, 1000, ALLOC_MISC);
+    assert(alloc_stats.live == 1100 && alloc_stats.peak == 1100);
+    assert(alloc_stats.tags[ALLOC_MISC].live == 1000 && alloc_stats.tags[ALLOC_MISC].reallocs == 1);
+    assert(alloc_stats.sizes[alloc_size_class(100)] == 2);
+    assert(alloc_size_class(100) == 7 && alloc_size_class(128) == 7 && alloc_size_class(129) == 8);
+    assert(alloc_stats.realloc_steps[alloc_size_class(1000)] == 1);
+    xfree(a, 1000, ALLOC_MISC);
+    xfree(b, 100, ALLOC_STR);
+    assert(alloc_stats.live == 0 && alloc_stats.peak == 1100);
+    assert(alloc_stats.tags[ALLOC_STR].peak == 100 && alloc_stats.tags[ALLOC_STR].frees == 1);
+
+    int *buf = NULL;
+    for (int i = 0; i < 100; i++) {
+        buf_push(buf, i);
+    }
+    assert(alloc_stats.tags[ALLOC_BUF].live == offsetof(BufHdr, buf) + buf_cap(buf) * sizeof(int));
+    buf_free(buf);
+    assert(alloc_stats.tags[ALLOC_BUF].live == 0);
+    alloc_stats = saved;
+    alloc_telemetry = enabled;
+}
+
+void arena_test(void) {
+    Arena arena = {0};
+    char *first = arena_alloc(&arena, 16);
+    arena_alloc(&arena, ARENA_BLOCK_SIZE);
+    arena_alloc(&arena, 3 * ARENA_BLOCK_SIZE);
+    assert(buf_len(arena.blocks) == 3);
+    arena_reset(&arena);
+    assert(buf_len(arena.blocks) == 1);
+    assert(arena_alloc(&arena, 16) == first);
+    arena_free(&arena);
+    assert(arena.blocks == NULL);
+}
+
+void map_test(void) {
+    Map map = {0};
+    assert(map_get(&map, "missing") == NULL);
+    for (uint64_t i = 1; i < 1000; i++) {
+        map_put_uint64(&map, i, i + 1);
+    }
+    assert(map.len == 999);
+    for (uint64_t i = 1; i < 1000; i++) {
+        assert(map_get_uint64(&map, i) == i + 1);
+    }
+    assert(map_get_uint64(&map, 1000) == 0);
+    map_put_uint64(&map, 7, 70);
+    assert(map.len == 999 && map_get_uint64(&map, 7) == 70);
+    const char *name = str_intern("mapped");
+    map_put(&map, name, (void *)name);
+    assert(map_get(&map, str_intern("mapped")) == name);
+    map_free(&map);
 }
 
 void common_test(void) {
     buf_test();
+    alloc_test();
+    arena_test();
+    scratch_test();
+    srcpos_test();
     str_intern_test();
+    map_test();
 }
@@ -0,0 +1,313 @@
+// Compile server
+//
+// `DaveLang --daemon SOCKET` listens on a Unix domain socket and runs compile
+// requests in one long-lived process, so the interner, keyword table and
+// parsed files stay warm between requests. Files whose contents hash the same
+// as last time are not parsed or checked again (see compile_cached).
+//
+// `DaveLang --client SOCKET args...` is a thin client that behaves like the
+// normal command line. A request is a 4-byte big-endian payload length and
+// then the client's working directory and its arguments, each terminated by a
+// NUL. The reply is everything the request printed followed by a 4-byte
+// big-endian exit status. Requests are served one at a time.
+#define DAEMON_MAX_REQUEST (1 << 20)
+
+bool write_all(int fd, const void *data, size_t size) {
+    const char *ptr = data;
+    while (size > 0) {
+        ssize_t n = write(fd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, void *data, size_t size) {
+    char *ptr = data;
+    while (size > 0) {
+        ssize_t n = read(fd, ptr, size);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        ptr += n;
+        size -= n;
+    }
+    return true;
+}
+
+void put_u32(unsigned char *buf, uint32_t x) {
+    buf[0] = x >> 24;
+    buf[1] = x >> 16;
+    buf[2] = x >> 8;
+    buf[3] = x;
+}
+
+uint32_t get_u32(const unsigned char *buf) {
+    return (uint32_t)buf[0] << 24 | (uint32_t)buf[1] << 16 | (uint32_t)buf[2] << 8 | buf[3];
+}
+
+struct sockaddr_un socket_addr(const char *path) {
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fatal("Socket path '%s' is too long", path);
+    }
+    strcpy(addr.sun_path, path);
+    return addr;
+}
+
+volatile sig_atomic_t daemon_stopping;
+
+void daemon_stop(int sig) {
+    (void)sig;
+    daemon_stopping = 1;
+}
+
+// The arguments of a request, which follow its working directory.
+char **daemon_args(char *payload, size_t size, bool *shutdown) {
+    char **args = NULL;
+    for (char *arg = payload + strlen(payload) + 1; arg < payload + size; arg += strlen(arg) + 1) {
+        if (strcmp(arg, "--shutdown") == 0) {
+            *shutdown = true;
+        }
+        buf_push(args, arg);
+    }
+    return args;
+}
+
+// Runs one request with stdout redirected to the connection and returns its exit status.
+int daemon_run(int conn, char *payload, size_t size, bool *shutdown) {
+    const char *cwd = payload;
+    char **args = daemon_args(payload, size, shutdown);
+    if (*shutdown) {
+        buf_free(args);
+        return 0;
+    }
+    char *daemon_cwd = getcwd(NULL, 0);
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    dup2(conn, STDOUT_FILENO);
+    int status = 1;
+    jmp_buf *outer = fatal_jmp;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    if (setjmp(recover) == 0) {
+        if (chdir(cwd) != 0) {
+            fatal("Could not change to directory '%s'", cwd);
+        }
+        options = DEFAULT_OPTIONS;
+#if STATS
+        stats = (Stats){0};
+#endif
+        DriverMode mode;
+        const char **inputs = NULL;
+        if (parse_options((int)buf_len(args), args, &mode, &inputs)) {
+            // Failed inputs must not take the server down, and unchanged files come from the cache.
+            options.batch = true;
+            options.use_cache = true;
+            status = run_driver(mode, inputs);
+        } else {
+            usage();
+        }
+        buf_free(inputs);
+    }
+    fatal_jmp = outer;
+    fflush(stdout);
+    dup2(saved_stdout, STDOUT_FILENO);
+    close(saved_stdout);
+    if (daemon_cwd && chdir(daemon_cwd) != 0) {
+        printf("Could not return to '%s'\n", daemon_cwd);
+    }
+    free(daemon_cwd);
+    buf_free(args);
+    return status;
+}
+
+int daemon_serve(const char *path) {
+    struct sockaddr_un addr = socket_addr(path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) {
+        fatal("Could not create socket: %s", strerror(errno));
+    }
+    unlink(path);
+    if (bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 64) != 0) {
+        fatal("Could not listen on '%s': %s", path, strerror(errno));
+    }
+    // A client that goes away mid-reply must not kill the server.
+    signal(SIGPIPE, SIG_IGN);
+    struct sigaction stop = {.sa_handler = daemon_stop};
+    sigaction(SIGINT, &stop, NULL);
+    sigaction(SIGTERM, &stop, NULL);
+    printf("Listening on %s\n", path);
+    fflush(stdout);
+    bool shutdown = false;
+    while (!shutdown && !daemon_stopping) {
+        int conn = accept(sock, NULL, NULL);
+        if (conn < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fatal("Could not accept connection: %s", strerror(errno));
+        }
+        unsigned char header[4];
+        if (read_all(conn, header, sizeof(header))) {
+            uint32_t size = get_u32(header);
+            char *payload = size > 0 && size <= DAEMON_MAX_REQUEST ? xmalloc(size + 1, ALLOC_BUF) : NULL;
+            if (payload && read_all(conn, payload, size)) {
+                payload[size] = 0;
+                int status = daemon_run(conn, payload, size, &shutdown);
+                unsigned char trailer[4];
+                put_u32(trailer, (uint32_t)status);
+                write_all(conn, trailer, sizeof(trailer));
+            }
+            if (payload) {
+                xfree(payload, size + 1, ALLOC_BUF);
+            }
+        }
+        close(conn);
+    }
+    close(sock);
+    unlink(path);
+    return 0;
+}
+
+int daemon_client(const char *path, int argc, char **argv) {
+    struct sockaddr_un addr = socket_addr(path);
+    int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0 || connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        printf("Could not connect to '%s': %s\n", path, strerror(errno));
+        return 1;
+    }
+    char *cwd = getcwd(NULL, 0);
+    if (!cwd) {
+        fatal("Could not get the working directory: %s", strerror(errno));
+    }
+    char *payload = NULL;
+    buf_pushn(payload, cwd, strlen(cwd) + 1);
+    free(cwd);
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-") == 0 || strcmp(argv[i], "@-") == 0) {
+            printf("The compile server cannot read from the client's stdin\n");
+            return 1;
+        }
+        buf_pushn(payload, argv[i], strlen(argv[i]) + 1);
+    }
+    unsigned char header[4];
+    put_u32(header, (uint32_t)buf_len(payload));
+    if (!write_all(sock, header, sizeof(header)) || !write_all(sock, payload, buf_len(payload))) {
+        printf("Could not send request to '%s'\n", path);
+        return 1;
+    }
+    buf_free(payload);
+    // Everything but the last four bytes is output; hold those back until the connection closes.
+    unsigned char tail[4];
+    size_t tail_len = 0;
+    char chunk[64 * 1024];
+    for (;;) {
+        ssize_t n = read(sock, chunk, sizeof(chunk));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        size_t len = (size_t)n;
+        size_t keep = MIN(tail_len + len, sizeof(tail));
+        size_t emit = tail_len + len - keep;
+        size_t emit_tail = MIN(emit, tail_len);
+        fwrite(tail, 1, emit_tail, stdout);
+        fwrite(chunk, 1, emit - emit_tail, stdout);
+        memmove(tail, tail + emit_tail, tail_len - emit_tail);
+        tail_len -= emit_tail;
+        memcpy(tail + tail_len, chunk + (emit - emit_tail), len - (emit - emit_tail));
+        tail_len += len - (emit - emit_tail);
+    }
+    close(sock);
+    if (tail_len != sizeof(tail)) {
+        printf("Connection to '%s' closed before the request finished\n", path);
+        return 1;
+    }
+    return (int)get_u32(tail);
+}
+
+// Runs a request the way the server does and returns its exit status, with
+// what it printed in out, which has room for size bytes.
+int daemon_test_request(const char **args, int num_args, char *out, size_t size) {
+    char *cwd = getcwd(NULL, 0);
+    char *payload = NULL;
+    buf_pushn(payload, cwd, strlen(cwd) + 1);
+    free(cwd);
+    for (int i = 0; i < num_args; i++) {
+        buf_pushn(payload, args[i], strlen(args[i]) + 1);
+    }
+    int pipe_fds[2];
+    if (pipe(pipe_fds) != 0) {
+        fatal("Could not create pipe: %s", strerror(errno));
+    }
+    bool shutdown = false;
+    int status = daemon_run(pipe_fds[1], payload, buf_len(payload), &shutdown);
+    close(pipe_fds[1]);
+    ssize_t n = read(pipe_fds[0], out, size - 1);
+    out[n > 0 ? n : 0] = 0;
+    close(pipe_fds[0]);
+    buf_free(payload);
+    return status;
+}
+
+void write_test_file(const char *path, const char *text) {
+    FILE *file = fopen(path, "w");
+    assert(file);
+    fputs(text, file);
+    fclose(file);
+}
+
+void daemon_test(void) {
+    DriverOptions outer_options = options;
+    char a[] = "/tmp/davelang_test_a_XXXXXX";
+    char b[] = "/tmp/davelang_test_b_XXXXXX";
+    close(mkstemp(a));
+    close(mkstemp(b));
+    write_test_file(a, "func f(): int {\n    return g();\n}\n");
+    write_test_file(b, "func main(): int { return 7; }\n");
+    char first[1024], second[1024];
+    const char *check_a[] = {"--check", a};
+    const char *check_b[] = {"--check", b};
+    const char *run_b[] = {"--ir", "--run=main", b};
+
+    // The second check of an unchanged file reuses its AST and diagnostics,
+    // and reports them at the same positions even after other files were
+    // compiled in between.
+    assert(daemon_test_request(check_a, 2, first, sizeof(first)) == 1);
+    assert(strstr(first, ":2:12: Error: Unresolved name 'g'"));
+    assert(daemon_test_request(check_b, 2, second, sizeof(second)) == 0);
+    assert(daemon_test_request(check_a, 2, second, sizeof(second)) == 1);
+    assert(strcmp(first, second) == 0);
+#if STATS
+    assert(stats.files_cached == 1 && stats.checks_cached == 1);
+#endif
+
+    // Lowering starts from the cached AST too, and a changed file is parsed
+    // and checked again.
+    assert(daemon_test_request(run_b, 3, first, sizeof(first)) == 0);
+    assert(strstr(first, "main() = 7"));
+#if STATS
+    assert(stats.files_cached == 1 && stats.checks_cached == 1);
+#endif
+    write_test_file(a, "func f(): int { return 1; }\n");
+    assert(daemon_test_request(check_a, 2, first, sizeof(first)) == 0);
+#if STATS
+    assert(stats.files_cached == 0 && stats.checks_cached == 0);
+#endif
+
+    unlink(a);
+    unlink(b);
+    options = outer_options;
+}
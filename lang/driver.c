@@ -0,0 +1,537 @@
+typedef enum StopAfter {
+    STOP_AFTER_LEX,
+    STOP_AFTER_PARSE,
+    STOP_AFTER_CHECK,
+    STOP_AFTER_IR,
+} StopAfter;
+
+typedef enum DriverMode {
+    MODE_COMPILE,
+    MODE_TEST,
+    MODE_BENCH_LEX,
+    MODE_BENCH_OPT,
+    MODE_BENCH_SWITCH,
+    MODE_BENCH_INLINE,
+    MODE_BENCH_LOOPS,
+    MODE_BENCH_PIPELINE,
+    MODE_BENCH_CHECK,
+    MODE_HELP,
+} DriverMode;
+
+typedef struct DriverOptions {
+    StopAfter stop_after;
+    bool dump;
+    bool batch;
+    bool phase_stats;
+    bool alloc_stats;
+    bool json;
+    // Reuse the parsed declarations of files whose contents have not changed.
+    bool use_cache;
+    // Threads used to parse and check a single file.
+    int jobs;
+    // Scan tokens on a second thread while a single-threaded parse runs.
+    bool pipeline;
+    // Parse function bodies only when something asks for them.
+    bool lazy_bodies;
+    OptLevel opt_level;
+    int inline_threshold;
+    bool tail_calls;
+    bool loop_opts;
+    // Function to run in the IR interpreter after lowering.
+    const char *run;
+    // Profile the run, sampling stacks into profile_stacks if it is set.
+    bool profile;
+    const char *profile_stacks;
+} DriverOptions;
+
+#define DEFAULT_OPTIONS ((DriverOptions){.stop_after = STOP_AFTER_PARSE, .jobs = 1, .opt_level = OPT_FULL, \
+                                         .inline_threshold = INLINE_THRESHOLD, .tail_calls = true, \
+                                         .loop_opts = true})
+// Files are only split into chunks of at least this size.
+#define PARALLEL_MIN_CHUNK (64 * 1024)
+
+DriverOptions options = DEFAULT_OPTIONS;
+
+void dump_tokens(void) {
+    while (!is_token(TOKEN_EOF)) {
+        SrcLoc loc = srcpos_loc(token.pos);
+        printf("%d:%d %s %.*s\n", loc.line, loc.col, token_kind_str(token.kind),
+               (int)(token.end - token.start), token.start);
+        next_token();
+    }
+}
+
+void dump_decls(Decl **decls, size_t num_decls) {
+    if (options.dump) {
+        for (size_t i = 0; i < num_decls; i++) {
+            print_decl(decls[i]);
+            printf("\n");
+        }
+    }
+}
+
+Decl **parse_source(const char *name, const char *src, size_t len, size_t *num_decls) {
+    STAT_INC(files);
+    STAT_ADD(bytes, len);
+#if STATS
+    // Lexing happens on demand while parsing, so it is timed by sampling
+    // tokens and reported as part of parse.
+    if (options.phase_stats) {
+        stats_timing_begin();
+    }
+#endif
+    STATS_PHASE_BEGIN(parse);
+    init_stream(name, src);
+    Decl **decls;
+    if (options.pipeline && options.jobs <= 1) {
+        decls = parse_file_pipelined(TOKEN_RING_SIZE, num_decls);
+    } else {
+        decls = parse_file_parallel(options.jobs, PARALLEL_MIN_CHUNK, num_decls);
+    }
+    STATS_PHASE_END(parse, PHASE_PARSE);
+#if STATS
+    stats_timing = false;
+#endif
+    return decls;
+}
+
+void lex_source(const char *name, const char *src, size_t len) {
+    STAT_INC(files);
+    STAT_ADD(bytes, len);
+    init_stream(name, src);
+    if (options.dump) {
+        dump_tokens();
+        return;
+    }
+    STATS_PHASE_BEGIN(lex);
+    while (!is_token(TOKEN_EOF)) {
+        next_token();
+    }
+    STATS_PHASE_END(lex, PHASE_LEX);
+}
+
+void run_ir(IrModule *module, const char *name) {
+    IrRun run;
+    IrProfile profile = {.sampling = options.profile_stacks != NULL};
+    int64_t result = options.profile ? profile_run(module, name, &run, &profile) : ir_run(module, name, &run);
+    printf("%s() = %" PRId64 "  (%" PRIu64 " instructions, %" PRIu64 " calls, %.3f ms)\n",
+           name, result, run.instrs, run.calls, run.seconds * 1e3);
+    if (options.profile) {
+        printf("\n");
+        profile_report(&profile, &run);
+        if (options.profile_stacks) {
+            profile_write_stacks(&profile, options.profile_stacks);
+        }
+        profile_free(&profile);
+    }
+}
+
+// Returns the number of errors found while lowering, which stop it there.
+size_t lower_source(Decl **decls, size_t num_decls) {
+    STATS_PHASE_BEGIN(lower);
+    IrModule *module = lower_module(decls, num_decls);
+    STATS_PHASE_END(lower, PHASE_LOWER);
+    size_t num_errors = module->num_errors;
+    if (num_errors) {
+        ir_free(module);
+        xfree(module, sizeof(IrModule), ALLOC_IR);
+        return num_errors;
+    }
+    STATS_PHASE_BEGIN(opt);
+    optimize_module(module, options.opt_level);
+    STATS_PHASE_END(opt, PHASE_OPT);
+    if (options.dump) {
+        ir_dump_module(module);
+    }
+    if (options.run) {
+        run_ir(module, options.run);
+    }
+    ir_free(module);
+    xfree(module, sizeof(IrModule), ALLOC_IR);
+    return 0;
+}
+
+// Checks parsed declarations, failing the input on errors, and then lowers or
+// dumps them. A cached file passes its kept check result.
+void compile_decls(const char *name, Decl **decls, size_t num_decls, CheckResult *cached_check) {
+    size_t num_errors = 0;
+    if (options.stop_after >= STOP_AFTER_CHECK) {
+        STATS_PHASE_BEGIN(check);
+        num_errors = cached_check ? check_file_cached(decls, num_decls, options.jobs, cached_check)
+                                  : check_file(decls, num_decls, options.jobs);
+        STATS_PHASE_END(check, PHASE_CHECK);
+    }
+    if (!num_errors && options.stop_after == STOP_AFTER_IR) {
+        num_errors = lower_source(decls, num_decls);
+    } else if (!num_errors) {
+        dump_decls(decls, num_decls);
+    }
+    if (num_errors) {
+        fatal("%zu error%s in '%s'", num_errors, num_errors == 1 ? "" : "s", name);
+    }
+}
+
+void compile_source(const char *name, const char *src, size_t len) {
+    if (options.stop_after == STOP_AFTER_LEX) {
+        lex_source(name, src, len);
+    } else {
+        size_t num_decls;
+        Decl **decls = parse_source(name, src, len, &num_decls);
+        compile_decls(name, decls, num_decls, NULL);
+    }
+}
+
+// Parsed files kept across requests, keyed by interned absolute path. Each
+// entry owns a session holding its AST; names go to the global interner tier
+// so that they stay shared between files and warm between requests, and the
+// session keeps its source file entry so that positions in the AST can still
+// be reported. The diagnostics of checking the AST are kept with it.
+typedef struct CachedFile {
+    const char *path;
+    uint64_t hash;
+    Session session;
+    Decl **decls;
+    size_t num_decls;
+    CheckResult check;
+} CachedFile;
+
+CachedFile **cached_files;
+
+CachedFile *get_cached_file(const char *path) {
+    for (CachedFile **it = cached_files; it != buf_end(cached_files); it++) {
+        if ((*it)->path == path) {
+            return *it;
+        }
+    }
+    CachedFile *file = xcalloc(1, sizeof(CachedFile), ALLOC_MISC);
+    file->path = path;
+    buf_push(cached_files, file);
+    return file;
+}
+
+// Parses src into file, replacing what it held. Returns false on errors.
+bool parse_cached(CachedFile *file, const char *name, const char *src, size_t len) {
+    session_free(&file->session);
+    check_result_free(&file->check);
+    file->session = (Session){.shared_interns = true, .keep_src_files = true};
+    file->decls = NULL;
+    file->num_decls = 0;
+    bool ok = true;
+    session_begin(&file->session);
+    // Cached files do not keep their source text, so bodies cannot be parsed later.
+    lazy_func_bodies = false;
+    jmp_buf *outer = fatal_jmp;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    if (setjmp(recover) == 0) {
+        file->decls = parse_source(name, src, len, &file->num_decls);
+    } else {
+        scratch_release(0);
+        ok = false;
+    }
+    fatal_jmp = outer;
+    lazy_func_bodies = options.lazy_bodies;
+    session_end(&file->session);
+    if (!ok) {
+        session_free(&file->session);
+        file->session = (Session){0};
+        file->decls = NULL;
+    }
+    return ok;
+}
+
+bool compile_cached(const char *path, const char *src, size_t len) {
+    uint64_t hash = hash_bytes(src, len);
+    char *full_path = realpath(path, NULL);
+    CachedFile *file = get_cached_file(str_intern(full_path ? full_path : path));
+    free(full_path);
+    // Interned so that it outlives the request, for the kept source file entry.
+    const char *name = str_intern(path);
+    if (file->decls && file->hash == hash) {
+        STAT_INC(files_cached);
+        srcpos_file(file->session.src_bases[0])->name = name;
+    } else if (parse_cached(file, name, src, len)) {
+        file->hash = hash;
+    } else {
+        return false;
+    }
+    bool ok = true;
+    jmp_buf *outer = fatal_jmp;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    if (setjmp(recover) == 0) {
+        compile_decls(name, file->decls, file->num_decls, &file->check);
+    } else {
+        scratch_release(0);
+        ok = false;
+    }
+    fatal_jmp = outer;
+    return ok;
+}
+
+// Shared by the inputs of a --batch run and freed when the run ends.
+Session batch_session;
+
+// Returns false if the input could not be read or failed to compile.
+bool compile_input(const char *path) {
+    STATS_PHASE_BEGIN(load);
+    bool is_stdin = strcmp(path, "-") == 0;
+    const char *name = is_stdin ? "<stdin>" : path;
+    size_t len;
+    char *src = is_stdin ? read_stream(stdin, &len) : read_file(path, &len);
+    STATS_PHASE_END(load, PHASE_LOAD);
+    if (!src) {
+        printf("FATAL: Could not read '%s'\n", name);
+        return false;
+    }
+    bool ok = true;
+    if (options.use_cache && options.stop_after != STOP_AFTER_LEX && !is_stdin) {
+        ok = compile_cached(path, src, len);
+        xfree(src, len + 1, ALLOC_SRC);
+    } else if (options.batch) {
+        // Each input runs in the batch session, which is rewound once it is
+        // done, so the next input allocates from the same blocks. A failed
+        // input is reported and skipped.
+        session_begin(&batch_session);
+        jmp_buf *outer = fatal_jmp;
+        jmp_buf recover;
+        fatal_jmp = &recover;
+        if (setjmp(recover) == 0) {
+            compile_source(name, src, len);
+        } else {
+            scratch_release(0);
+            ok = false;
+        }
+        fatal_jmp = outer;
+        session_end(&batch_session);
+        session_reset(&batch_session);
+        xfree(src, len + 1, ALLOC_SRC);
+    } else {
+        compile_source(name, src, len);
+    }
+    return ok;
+}
+
+// Reads newline separated paths and compiles each as soon as its name arrives.
+int compile_file_list(const char *list_path) {
+    FILE *list = strcmp(list_path, "-") == 0 ? stdin : fopen(list_path, "r");
+    if (!list) {
+        fatal("Could not open file list '%s'", list_path);
+    }
+    int failures = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), list)) {
+        size_t len = strcspn(line, "\r\n");
+        if (len == 0) {
+            continue;
+        }
+        line[len] = 0;
+        failures += !compile_input(line);
+    }
+    if (list != stdin) {
+        fclose(list);
+    }
+    return failures;
+}
+
+void usage(void) {
+    printf("Usage: DaveLang [options] [file | - | @list]...\n"
+           "       DaveLang --daemon SOCKET\n"
+           "       DaveLang --client SOCKET [options] [file | @list]...\n"
+           "  -                   read a source file from stdin\n"
+           "  @list               compile the files named in list, one per line ('@-' reads names from stdin)\n"
+           "  --lex               stop after lexing\n"
+           "  --parse             stop after parsing (default)\n"
+           "  --check             stop after resolving names and checking calls\n"
+           "  --ir                check, lower to SSA and optimize\n"
+           "  -O0, -O1            optimization level for --ir (default -O1)\n"
+           "  --inline-threshold=N inline callees up to cost N at -O1, 0 for none (default 40)\n"
+           "  --no-tail-calls     keep tail calls as calls at -O1\n"
+           "  --no-loop-opts      skip invariant code motion and strength reduction at -O1\n"
+           "  --run=NAME          with --ir, run function NAME in the IR interpreter\n"
+           "  --profile           with --run, report calls and time per function and counts per opcode and statement\n"
+           "  --profile-stacks=FILE with --run, also sample the call stack and write it to FILE for flame graphs\n"
+           "  --dump              print the tokens, AST or IR of the last phase run\n"
+           "  --batch             keep going after failed inputs and reuse memory between them\n"
+           "  --stats[=json]      report per-phase timing and throughput\n"
+           "  --alloc-stats[=json] report heap usage by subsystem\n"
+           "  --jobs=N            parse and check each file with up to N threads\n"
+           "  --pipeline          lex on a second thread while parsing (ignored with --jobs)\n"
+           "  --lazy-bodies       skip function bodies until something needs them; --check\n"
+           "                      and --ir only use the ones reachable from main or --run\n"
+           "  --daemon SOCKET     serve compile requests on a Unix socket with warm caches\n"
+           "  --client SOCKET     send the remaining arguments to a daemon ('--shutdown' stops it)\n"
+           "  --test              run the built-in tests\n"
+           "  --bench-lex         benchmark operator scanning against the hand-written reference\n"
+           "  --bench-opt         benchmark generated programs with the optimizer off and on\n"
+           "  --bench-switch      benchmark switch dispatch as compare chains against clustered lowering\n"
+           "  --bench-inline      benchmark call-heavy programs without and with inlining and tail calls\n"
+           "  --bench-loops       benchmark array-walking loops without and with the loop optimizations\n"
+           "  --bench-pipeline    benchmark parsing one large file with the lexer inline and on its own thread\n"
+           "  --bench-check       benchmark checking one large file on more and more threads\n");
+}
+
+// In daemon.c, which needs the driver.
+void daemon_test(void);
+
+void run_tests(void) {
+    common_test();
+    lex_test();
+    ast_test();
+    parse_test();
+    session_test();
+    parallel_test();
+    pipeline_test();
+    check_test();
+    ir_test();
+    profile_test();
+    daemon_test();
+}
+
+// Fills in options and the list of inputs. Returns false on an unknown option.
+bool parse_options(int argc, char **argv, DriverMode *mode, const char ***inputs) {
+    *mode = MODE_COMPILE;
+    for (int i = 0; i < argc; i++) {
+        const char *arg = argv[i];
+        if (arg[0] != '-' || arg[1] == 0) {
+            buf_push(*inputs, arg);
+        } else if (strcmp(arg, "--lex") == 0) {
+            options.stop_after = STOP_AFTER_LEX;
+        } else if (strcmp(arg, "--parse") == 0) {
+            options.stop_after = STOP_AFTER_PARSE;
+        } else if (strcmp(arg, "--check") == 0) {
+            options.stop_after = STOP_AFTER_CHECK;
+        } else if (strcmp(arg, "--ir") == 0) {
+            options.stop_after = STOP_AFTER_IR;
+        } else if (strcmp(arg, "-O0") == 0) {
+            options.opt_level = OPT_NONE;
+        } else if (strcmp(arg, "-O1") == 0) {
+            options.opt_level = OPT_FULL;
+        } else if (strncmp(arg, "--inline-threshold=", 19) == 0 && arg[19]) {
+            options.inline_threshold = atoi(arg + 19);
+        } else if (strcmp(arg, "--no-tail-calls") == 0) {
+            options.tail_calls = false;
+        } else if (strcmp(arg, "--no-loop-opts") == 0) {
+            options.loop_opts = false;
+        } else if (strncmp(arg, "--run=", 6) == 0 && arg[6]) {
+            options.stop_after = STOP_AFTER_IR;
+            options.run = arg + 6;
+        } else if (strcmp(arg, "--profile") == 0) {
+            options.profile = true;
+        } else if (strncmp(arg, "--profile-stacks=", 17) == 0 && arg[17]) {
+            options.profile = true;
+            options.profile_stacks = arg + 17;
+        } else if (strcmp(arg, "--dump") == 0) {
+            options.dump = true;
+        } else if (strcmp(arg, "--batch") == 0) {
+            options.batch = true;
+        } else if (strcmp(arg, "--stats") == 0) {
+            options.phase_stats = true;
+        } else if (strcmp(arg, "--stats=json") == 0) {
+            options.phase_stats = options.json = true;
+        } else if (strcmp(arg, "--alloc-stats") == 0) {
+            options.alloc_stats = true;
+        } else if (strcmp(arg, "--alloc-stats=json") == 0) {
+            options.alloc_stats = options.json = true;
+        } else if (strncmp(arg, "--jobs=", 7) == 0 && atoi(arg + 7) > 0) {
+            options.jobs = atoi(arg + 7);
+        } else if (strcmp(arg, "--pipeline") == 0) {
+            options.pipeline = true;
+        } else if (strcmp(arg, "--lazy-bodies") == 0) {
+            options.lazy_bodies = true;
+        } else if (strcmp(arg, "--test") == 0) {
+            *mode = MODE_TEST;
+        } else if (strcmp(arg, "--bench-lex") == 0) {
+            *mode = MODE_BENCH_LEX;
+        } else if (strcmp(arg, "--bench-opt") == 0) {
+            *mode = MODE_BENCH_OPT;
+        } else if (strcmp(arg, "--bench-switch") == 0) {
+            *mode = MODE_BENCH_SWITCH;
+        } else if (strcmp(arg, "--bench-inline") == 0) {
+            *mode = MODE_BENCH_INLINE;
+        } else if (strcmp(arg, "--bench-loops") == 0) {
+            *mode = MODE_BENCH_LOOPS;
+        } else if (strcmp(arg, "--bench-pipeline") == 0) {
+            *mode = MODE_BENCH_PIPELINE;
+        } else if (strcmp(arg, "--bench-check") == 0) {
+            *mode = MODE_BENCH_CHECK;
+        } else if (strcmp(arg, "--help") == 0) {
+            *mode = MODE_HELP;
+        } else {
+            printf("Unknown option '%s'\n", arg);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Runs everything but the option parsing and returns the exit status.
+int run_driver(DriverMode mode, const char **inputs) {
+    lazy_func_bodies = options.lazy_bodies;
+    lazy_root = options.run ? str_intern(options.run) : NULL;
+    inline_threshold = options.inline_threshold;
+    tail_call_elim = options.tail_calls;
+    loop_opts = options.loop_opts;
+    switch (mode) {
+    case MODE_TEST:
+        run_tests();
+        return 0;
+    case MODE_BENCH_LEX:
+        lex_bench();
+        return 0;
+    case MODE_BENCH_OPT:
+        opt_bench();
+        return 0;
+    case MODE_BENCH_SWITCH:
+        switch_bench();
+        return 0;
+    case MODE_BENCH_INLINE:
+        inline_bench();
+        return 0;
+    case MODE_BENCH_LOOPS:
+        loop_bench();
+        return 0;
+    case MODE_BENCH_PIPELINE:
+        pipeline_bench();
+        return 0;
+    case MODE_BENCH_CHECK:
+        check_bench();
+        return 0;
+    case MODE_HELP:
+        usage();
+        return 0;
+    default:
+        break;
+    }
+#if !STATS
+    if (options.phase_stats) {
+        printf("This build has no statistics support; rebuild with -DSTATS=1\n");
+        return 1;
+    }
+#endif
+    if (!inputs) {
+        usage();
+        return 1;
+    }
+    int failures = 0;
+    for (const char **it = inputs; it != buf_end(inputs); it++) {
+        if ((*it)[0] == '@') {
+            failures += compile_file_list(*it + 1);
+        } else {
+            failures += !compile_input(*it);
+        }
+    }
+    session_free(&batch_session);
+#if STATS
+    if (options.phase_stats) {
+        print_stats(options.json);
+    }
+#endif
+    if (options.alloc_stats) {
+        print_alloc_stats(options.json);
+    }
+    if (failures) {
+        printf("%d input(s) failed\n", failures);
+    }
+    return failures ? 1 : 0;
+}
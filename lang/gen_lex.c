@@ -0,0 +1,142 @@
+// Build-time generator for the operator DFA in lex_tables.h.
+//
+// Usage: gen_lex tokens.def lex_tables.h
+//
+// Reads the TOKEN_OP(kind, "spelling") entries of tokens.def and emits a
+// dense transition table over bytes plus the token accepted in each state.
+// State 0 is the start state and doubles as the "no transition" marker,
+// since no operator leads back to it.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_STATES 256
+#define MAX_NAME 64
+
+typedef struct State {
+    int next[256];
+    // Token kind accepted in this state, or empty if the state only continues a longer operator.
+    char accept[MAX_NAME];
+} State;
+
+State states[MAX_STATES];
+int num_states = 1;
+
+void fatal(const char *msg, const char *detail, int line) {
+    fprintf(stderr, "gen_lex: %s '%s' on line %d\n", msg, detail, line);
+    exit(1);
+}
+
+void add_token(const char *kind, const char *text, int line) {
+    if (strlen(text) < 2) {
+        fatal("Operators must be at least two characters; single characters are always tokens:", text, line);
+    }
+    int state = 0;
+    for (const unsigned char *c = (const unsigned char *)text; *c; c++) {
+        if (!states[state].next[*c]) {
+            if (num_states == MAX_STATES) {
+                fatal("Too many DFA states at", kind, line);
+            }
+            int next = num_states++;
+            if (state == 0) {
+                snprintf(states[next].accept, MAX_NAME, "%d", *c);
+            }
+            states[state].next[*c] = next;
+        }
+        state = states[state].next[*c];
+    }
+    if (states[state].accept[0]) {
+        fatal("Duplicate operator", text, line);
+    }
+    snprintf(states[state].accept, MAX_NAME, "%s", kind);
+}
+
+// Parses one TOKEN_OP(kind, "text") entry. Returns 0 for lines without one.
+int parse_line(const char *line, char *kind, char *text, int line_num) {
+    const char *p = strstr(line, "TOKEN_OP(");
+    if (!p || strncmp(line, "//", 2) == 0) {
+        return 0;
+    }
+    p += strlen("TOKEN_OP(");
+    size_t n = strcspn(p, ", ");
+    if (n == 0 || n >= MAX_NAME) {
+        fatal("Bad token kind in", line, line_num);
+    }
+    memcpy(kind, p, n);
+    kind[n] = 0;
+    p = strchr(p, '"');
+    if (!p) {
+        fatal("Missing spelling in", line, line_num);
+    }
+    p++;
+    size_t len = 0;
+    while (*p && *p != '"') {
+        if (*p == '\\' && p[1]) {
+            p++;
+        }
+        if (len + 1 >= MAX_NAME) {
+            fatal("Spelling too long in", line, line_num);
+        }
+        text[len++] = *p++;
+    }
+    if (*p != '"') {
+        fatal("Unterminated spelling in", line, line_num);
+    }
+    text[len] = 0;
+    return 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: gen_lex tokens.def lex_tables.h\n");
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "r");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    char line[256];
+    int line_num = 0;
+    while (fgets(line, sizeof(line), in)) {
+        line_num++;
+        char kind[MAX_NAME];
+        char text[MAX_NAME];
+        if (parse_line(line, kind, text, line_num)) {
+            add_token(kind, text, line_num);
+        }
+    }
+    fclose(in);
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    fprintf(out, "// Generated by gen_lex from tokens.def. Do not edit.\n\n");
+    fprintf(out, "#define LEX_NUM_STATES %d\n\n", num_states);
+    fprintf(out, "static const uint8_t lex_transitions[LEX_NUM_STATES][256] = {\n");
+    for (int s = 0; s < num_states; s++) {
+        fprintf(out, "    [%d] = {", s);
+        int first = 1;
+        for (int c = 0; c < 256; c++) {
+            if (states[s].next[c]) {
+                fprintf(out, "%s[%d] = %d", first ? "" : ", ", c, states[s].next[c]);
+                first = 0;
+            }
+        }
+        fprintf(out, "},\n");
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "// Token kind accepted in each state, or -1 if the state does not end a token.\n");
+    fprintf(out, "static const int lex_accepts[LEX_NUM_STATES] = {\n");
+    for (int s = 0; s < num_states; s++) {
+        fprintf(out, "    [%d] = %s,\n", s, states[s].accept[0] ? states[s].accept : "-1");
+    }
+    fprintf(out, "};\n");
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    return 0;
+}
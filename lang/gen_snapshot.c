@@ -0,0 +1,167 @@
+// Build-time generator for the startup snapshot in snapshot.h.
+//
+// Usage: gen_snapshot names.def snapshot.h
+//
+// Reads the KEYWORD(name) and BUILTIN_TYPE(name) entries of names.def and
+// emits the global intern table as it would be after interning them in
+// order: the text of every name in one static string, and a static slot
+// array laid out exactly as intern_map_slot probes it. The slots point into
+// the text, so the table is relocated with the binary like any other static
+// data, and each name's pointer is its identity from the first instruction on.
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MAX_NAMES 256
+#define MAX_NAME 64
+
+typedef struct Name {
+    char text[MAX_NAME];
+    size_t len;
+    size_t offset;
+    uint64_t hash;
+} Name;
+
+Name names[MAX_NAMES];
+int num_names;
+int num_keywords;
+
+void fatal(const char *msg, const char *detail, int line) {
+    fprintf(stderr, "gen_snapshot: %s '%s' on line %d\n", msg, detail, line);
+    exit(1);
+}
+
+// Must match hash_bytes in common.c; str_intern_test checks that it does.
+uint64_t hash_bytes(const char *buf, size_t len) {
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)buf[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+// Parses one KEYWORD(name) or BUILTIN_TYPE(name) entry. Returns 0 for lines
+// without one, 1 for a keyword and 2 for a builtin type.
+int parse_line(const char *line, char *name, int line_num) {
+    int kind = strncmp(line, "KEYWORD(", 8) == 0 ? 1 : strncmp(line, "BUILTIN_TYPE(", 13) == 0 ? 2 : 0;
+    if (!kind) {
+        return 0;
+    }
+    const char *p = strchr(line, '(') + 1;
+    size_t n = strcspn(p, ")");
+    if (n == 0 || n >= MAX_NAME || p[n] != ')') {
+        fatal("Bad entry", line, line_num);
+    }
+    for (size_t i = 0; i < n; i++) {
+        char c = p[i];
+        if (!(c == '_' || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (i > 0 && c >= '0' && c <= '9'))) {
+            fatal("Not a name in", line, line_num);
+        }
+    }
+    memcpy(name, p, n);
+    name[n] = 0;
+    return kind;
+}
+
+int main(int argc, char **argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: gen_snapshot names.def snapshot.h\n");
+        return 1;
+    }
+    FILE *in = fopen(argv[1], "r");
+    if (!in) {
+        perror(argv[1]);
+        return 1;
+    }
+    char line[256];
+    int line_num = 0;
+    size_t offset = 0;
+    while (fgets(line, sizeof(line), in)) {
+        line_num++;
+        char text[MAX_NAME];
+        int kind = parse_line(line, text, line_num);
+        if (!kind) {
+            continue;
+        }
+        if (kind == 1 && num_keywords != num_names) {
+            fatal("Keywords must come before builtin types, but got", text, line_num);
+        }
+        for (int i = 0; i < num_names; i++) {
+            if (strcmp(names[i].text, text) == 0) {
+                fatal("Duplicate name", text, line_num);
+            }
+        }
+        if (num_names == MAX_NAMES) {
+            fatal("Too many names at", text, line_num);
+        }
+        Name *name = &names[num_names++];
+        num_keywords += kind == 1;
+        snprintf(name->text, MAX_NAME, "%s", text);
+        name->len = strlen(text);
+        name->offset = offset;
+        name->hash = hash_bytes(text, name->len);
+        offset += name->len + 1;
+    }
+    fclose(in);
+
+    // Room for four times the names, so the first names of an input do not grow the table.
+    size_t cap = 16;
+    while (cap < 4 * (size_t)num_names) {
+        cap *= 2;
+    }
+    int *slots = malloc(cap * sizeof(int));
+    for (size_t i = 0; i < cap; i++) {
+        slots[i] = -1;
+    }
+    for (int n = 0; n < num_names; n++) {
+        size_t i = names[n].hash & (cap - 1);
+        while (slots[i] >= 0) {
+            i = (i + 1) & (cap - 1);
+        }
+        slots[i] = n;
+    }
+
+    FILE *out = fopen(argv[2], "w");
+    if (!out) {
+        perror(argv[2]);
+        return 1;
+    }
+    fprintf(out, "// Generated by gen_snapshot from names.def. Do not edit.\n\n");
+    fprintf(out, "#define SNAPSHOT_NUM_NAMES %d\n", num_names);
+    fprintf(out, "#define SNAPSHOT_NUM_KEYWORDS %d\n", num_keywords);
+    fprintf(out, "#define SNAPSHOT_CAP %zu\n", cap);
+    fprintf(out, "// The keywords are the names below this offset.\n");
+    fprintf(out, "#define SNAPSHOT_KEYWORDS_END %zu\n\n",
+            num_keywords < num_names ? names[num_keywords].offset : offset);
+    fprintf(out, "static const char snapshot_text[] =\n");
+    for (int n = 0; n < num_names; n++) {
+        fprintf(out, "    \"%s\\0\"\n", names[n].text);
+    }
+    fprintf(out, "    ;\n\n");
+    for (int n = 0; n < num_names; n++) {
+        fprintf(out, "#define SNAPSHOT_OFFSET_%s %zu\n", names[n].text, names[n].offset);
+    }
+    fprintf(out, "\n// Offsets of the names in names.def order.\n");
+    fprintf(out, "static const uint32_t snapshot_offsets[SNAPSHOT_NUM_NAMES] = {\n");
+    for (int n = 0; n < num_names; n++) {
+        fprintf(out, "    %zu,\n", names[n].offset);
+    }
+    fprintf(out, "};\n\n");
+    fprintf(out, "static Intern snapshot_slots[SNAPSHOT_CAP] = {\n");
+    for (size_t i = 0; i < cap; i++) {
+        if (slots[i] >= 0) {
+            Name *name = &names[slots[i]];
+            fprintf(out, "    [%zu] = {snapshot_text + %zu, %zu, 0x%016llxull},\n", i, name->offset, name->len,
+                    (unsigned long long)name->hash);
+        }
+    }
+    fprintf(out, "};\n");
+    free(slots);
+    if (fclose(out) != 0) {
+        perror(argv[2]);
+        return 1;
+    }
+    return 0;
+}
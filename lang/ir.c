@@ -0,0 +1,975 @@
+// Intermediate representation
+//
+// Function bodies are lowered (lower.c) to a control-flow graph of basic
+// blocks in SSA form, which the passes in opt.c optimize and ir_run can
+// execute. The IR is untyped: a value is one 64-bit word, and integer
+// arithmetic wraps like two's complement. Operations whose meaning depends on
+// types the front end does not check yet (memory, casts, floats, strings,
+// aggregates) are opaque instructions that passes treat conservatively.
+//
+// A block holds its phis first and its terminator last. A phi has one
+// argument per predecessor, in the order of the block's preds. A pass that
+// replaces an instruction points its `forward` at the replacement, and
+// ir_cleanup later rewrites the uses and drops it.
+typedef enum Op {
+    OP_NONE,
+    OP_CONST,
+    OP_FCONST,
+    OP_STR,
+    OP_UNDEF,
+    OP_PARAM,
+    OP_PHI,
+    OP_COPY,
+    OP_NEG,
+    OP_NOT,
+    OP_BNOT,
+    OP_ADD,
+    OP_SUB,
+    OP_MUL,
+    OP_DIV,
+    OP_MOD,
+    OP_AND,
+    OP_OR,
+    OP_XOR,
+    OP_SHL,
+    OP_SHR,
+    OP_EQ,
+    OP_NE,
+    OP_LT,
+    OP_LE,
+    OP_GT,
+    OP_GE,
+    OP_ULE,
+    OP_CAST,
+    OP_COMPOUND,
+    OP_GLOBAL,
+    OP_LOCAL,
+    OP_FIELD,
+    OP_INDEX,
+    OP_LOAD,
+    OP_STORE,
+    OP_CALL,
+    OP_JUMP,
+    OP_BRANCH,
+    OP_SWITCH,
+    OP_RET,
+    OP_TAILCALL,
+    NUM_OPS,
+} Op;
+
+enum {
+    // Depends only on its arguments, so equal instructions can be merged.
+    OPF_PURE = 1 << 0,
+    // Has no effect and can be dropped when unused.
+    OPF_REMOVABLE = 1 << 1,
+    OPF_COMMUTATIVE = 1 << 2,
+    // Integer operation that ir_eval computes.
+    OPF_FOLDABLE = 1 << 3,
+    OPF_TERMINATOR = 1 << 4,
+};
+
+#define OPF_VALUE (OPF_PURE | OPF_REMOVABLE)
+#define OPF_ARITH (OPF_VALUE | OPF_FOLDABLE)
+
+typedef struct OpInfo {
+    const char *name;
+    int flags;
+} OpInfo;
+
+OpInfo op_info[NUM_OPS] = {
+    [OP_NONE] = {"none", 0},
+    [OP_CONST] = {"const", OPF_VALUE},
+    [OP_FCONST] = {"fconst", OPF_VALUE},
+    [OP_STR] = {"str", OPF_VALUE},
+    [OP_UNDEF] = {"undef", OPF_VALUE},
+    [OP_PARAM] = {"param", OPF_VALUE},
+    [OP_PHI] = {"phi", OPF_REMOVABLE},
+    [OP_COPY] = {"copy", OPF_VALUE},
+    [OP_NEG] = {"neg", OPF_ARITH},
+    [OP_NOT] = {"not", OPF_ARITH},
+    [OP_BNOT] = {"bnot", OPF_ARITH},
+    [OP_ADD] = {"add", OPF_ARITH | OPF_COMMUTATIVE},
+    [OP_SUB] = {"sub", OPF_ARITH},
+    [OP_MUL] = {"mul", OPF_ARITH | OPF_COMMUTATIVE},
+    [OP_DIV] = {"div", OPF_ARITH},
+    [OP_MOD] = {"mod", OPF_ARITH},
+    [OP_AND] = {"and", OPF_ARITH | OPF_COMMUTATIVE},
+    [OP_OR] = {"or", OPF_ARITH | OPF_COMMUTATIVE},
+    [OP_XOR] = {"xor", OPF_ARITH | OPF_COMMUTATIVE},
+    [OP_SHL] = {"shl", OPF_ARITH},
+    [OP_SHR] = {"shr", OPF_ARITH},
+    [OP_EQ] = {"eq", OPF_ARITH | OPF_COMMUTATIVE},
+    [OP_NE] = {"ne", OPF_ARITH | OPF_COMMUTATIVE},
+    [OP_LT] = {"lt", OPF_ARITH},
+    [OP_LE] = {"le", OPF_ARITH},
+    [OP_GT] = {"gt", OPF_ARITH},
+    [OP_GE] = {"ge", OPF_ARITH},
+    [OP_ULE] = {"ule", OPF_ARITH},
+    [OP_CAST] = {"cast", OPF_VALUE},
+    // Builds an aggregate in fresh storage, so it is neither merged nor dropped.
+    [OP_COMPOUND] = {"compound", 0},
+    [OP_GLOBAL] = {"global", OPF_VALUE},
+    // Every execution yields a fresh slot, so two locals are never equal.
+    [OP_LOCAL] = {"local", OPF_REMOVABLE},
+    [OP_FIELD] = {"field", OPF_VALUE},
+    [OP_INDEX] = {"index", OPF_VALUE},
+    [OP_LOAD] = {"load", OPF_REMOVABLE},
+    [OP_STORE] = {"store", 0},
+    [OP_CALL] = {"call", 0},
+    [OP_JUMP] = {"jump", OPF_TERMINATOR},
+    [OP_BRANCH] = {"branch", OPF_TERMINATOR},
+    // Jump table: value - imm selects succs[1 + i], and values out of range go to succs[0].
+    [OP_SWITCH] = {"switch", OPF_TERMINATOR},
+    [OP_RET] = {"ret", OPF_TERMINATOR},
+    // A call whose result the function returns; it replaces the caller's frame.
+    [OP_TAILCALL] = {"tailcall", OPF_TERMINATOR},
+};
+
+typedef struct Instr Instr;
+typedef struct Block Block;
+
+struct Instr {
+    Op op;
+    uint32_t id;
+    Block *block;
+    Instr **args;
+    union {
+        int64_t imm;
+        double fimm;
+        // String, global, local, field or callee name; NULL for indirect calls.
+        const char *name;
+        // Cast or compound type.
+        Typespec *type;
+    };
+    Instr *forward;
+    // Statement the instruction was lowered from, for the profiler; 0 for
+    // instructions that passes create.
+    SrcPos pos;
+};
+
+struct Block {
+    uint32_t id;
+    Instr **instrs;
+    Block **preds;
+    // A branch's true target comes first.
+    Block **succs;
+    // Dominator tree, filled in by ir_dominators. rpo is UINT32_MAX for
+    // unreachable blocks, and a block dominates the blocks whose dom_pre
+    // falls within its [dom_pre, dom_last].
+    Block *idom;
+    Block **dom_children;
+    uint32_t rpo;
+    uint32_t dom_pre;
+    uint32_t dom_last;
+    // SSA construction state, see lower.c.
+    Instr **defs;
+    Instr **incomplete_phis;
+    size_t *incomplete_vars;
+    bool sealed;
+};
+
+typedef struct IrFunc {
+    const char *name;
+    Decl *decl;
+    size_t num_params;
+    // The entry block comes first.
+    Block **blocks;
+    // Reachable blocks in reverse postorder, filled in by ir_dominators.
+    Block **rpo;
+    uint32_t next_instr_id;
+    uint32_t next_block_id;
+} IrFunc;
+
+typedef struct IrGlobal {
+    const char *name;
+    int64_t init;
+    // Memory words: the element count for arrays, 1 otherwise.
+    int64_t size;
+} IrGlobal;
+
+#define IR_MAX_GLOBAL_SIZE (1 << 24)
+
+typedef struct IrModule {
+    IrFunc **funcs;
+    Map funcs_by_name;
+    IrGlobal *globals;
+    // Switch dispatch clusters by kind (range, table, bits), see lower_switch.
+    uint32_t switch_clusters[3];
+    // Errors reported while lowering. A module with any is only fit to be freed.
+    size_t num_errors;
+    Arena arena;
+} IrModule;
+
+bool ir_is_terminator(Instr *instr) {
+    return op_info[instr->op].flags & OPF_TERMINATOR;
+}
+
+Instr *ir_value(Instr *instr) {
+    while (instr->forward) {
+        instr = instr->forward;
+    }
+    return instr;
+}
+
+Instr *ir_terminator(Block *block) {
+    size_t len = buf_len(block->instrs);
+    return len && ir_is_terminator(block->instrs[len - 1]) ? block->instrs[len - 1] : NULL;
+}
+
+Instr *ir_new_instr(IrModule *module, IrFunc *func, Op op) {
+    Instr *instr = arena_alloc(&module->arena, sizeof(Instr));
+    memset(instr, 0, sizeof(Instr));
+    instr->op = op;
+    instr->id = func->next_instr_id++;
+    return instr;
+}
+
+Block *ir_new_block(IrModule *module, IrFunc *func) {
+    Block *block = arena_alloc(&module->arena, sizeof(Block));
+    memset(block, 0, sizeof(Block));
+    block->id = func->next_block_id++;
+    block->rpo = UINT32_MAX;
+    buf_push(func->blocks, block);
+    return block;
+}
+
+void ir_append(Block *block, Instr *instr) {
+    assert(!ir_terminator(block));
+    instr->block = block;
+    buf_push(block->instrs, instr);
+}
+
+void ir_insert_after(Instr *pos, Instr *instr) {
+    Block *block = pos->block;
+    size_t index = 0;
+    while (block->instrs[index] != pos) {
+        index++;
+    }
+    instr->block = block;
+    buf_push(block->instrs, instr);
+    memmove(block->instrs + index + 2, block->instrs + index + 1, (buf_len(block->instrs) - index - 2) * sizeof(Instr *));
+    block->instrs[index + 1] = instr;
+}
+
+// Inserts before the terminator, or at the end of a block that has none yet.
+void ir_insert_before_terminator(Block *block, Instr *instr) {
+    Instr *term = ir_terminator(block);
+    instr->block = block;
+    buf_push(block->instrs, instr);
+    if (term) {
+        size_t len = buf_len(block->instrs);
+        block->instrs[len - 2] = instr;
+        block->instrs[len - 1] = term;
+    }
+}
+
+void ir_insert_phi(Block *block, Instr *phi) {
+    assert(phi->op == OP_PHI);
+    phi->block = block;
+    buf_push(block->instrs, phi);
+    memmove(block->instrs + 1, block->instrs, (buf_len(block->instrs) - 1) * sizeof(Instr *));
+    block->instrs[0] = phi;
+}
+
+void ir_add_edge(Block *from, Block *to) {
+    buf_push(from->succs, to);
+    buf_push(to->preds, from);
+}
+
+size_t ir_pred_index(Block *block, Block *pred) {
+    for (size_t i = 0; i < buf_len(block->preds); i++) {
+        if (block->preds[i] == pred) {
+            return i;
+        }
+    }
+    assert(0);
+    return 0;
+}
+
+// Removes one edge from pred to block, along with the phi arguments for it.
+// Phis are not always first here: a pass may have rewritten one in place, and
+// ir_cleanup only moves them back to the front afterwards.
+void ir_remove_pred(Block *block, Block *pred) {
+    size_t index = ir_pred_index(block, pred);
+    size_t num_preds = buf_len(block->preds);
+    memmove(block->preds + index, block->preds + index + 1, (num_preds - index - 1) * sizeof(Block *));
+    buf__hdr(block->preds)->len--;
+    for (Instr **it = block->instrs; it != buf_end(block->instrs); it++) {
+        Instr *phi = *it;
+        if (phi->op != OP_PHI) {
+            continue;
+        }
+        memmove(phi->args + index, phi->args + index + 1, (num_preds - index - 1) * sizeof(Instr *));
+        buf__hdr(phi->args)->len--;
+    }
+}
+
+void ir_remove_succ(Block *block, Block *succ) {
+    for (size_t i = 0; i < buf_len(block->succs); i++) {
+        if (block->succs[i] == succ) {
+            memmove(block->succs + i, block->succs + i + 1, (buf_len(block->succs) - i - 1) * sizeof(Block *));
+            buf__hdr(block->succs)->len--;
+            return;
+        }
+    }
+    assert(0);
+}
+
+// The successor a branch or switch takes for the given value.
+size_t ir_successor(Instr *term, int64_t value) {
+    if (term->op == OP_BRANCH) {
+        return value ? 0 : 1;
+    }
+    assert(term->op == OP_SWITCH);
+    uint64_t index = (uint64_t)value - (uint64_t)term->imm;
+    return index < buf_len(term->block->succs) - 1 ? 1 + index : 0;
+}
+
+// Turns a block's terminator into a jump to its successor with the given index.
+void ir_fold_terminator(Block *block, size_t keep) {
+    Instr *term = ir_terminator(block);
+    Block *target = block->succs[keep];
+    for (size_t i = 0; i < buf_len(block->succs); i++) {
+        if (i != keep) {
+            ir_remove_pred(block->succs[i], block);
+        }
+    }
+    buf_truncate(block->succs, 0);
+    buf_push(block->succs, target);
+    term->op = OP_JUMP;
+    buf_free(term->args);
+}
+
+// Computes reverse postorder and the dominator tree with the iterative
+// algorithm of Cooper, Harvey and Kennedy.
+Block *ir_intersect(Block *a, Block *b) {
+    while (a != b) {
+        while (a->rpo > b->rpo) {
+            a = a->idom;
+        }
+        while (b->rpo > a->rpo) {
+            b = b->idom;
+        }
+    }
+    return a;
+}
+
+typedef struct BlockFrame {
+    Block *block;
+    size_t next;
+} BlockFrame;
+
+void ir_dominators(IrFunc *func) {
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        (*it)->rpo = UINT32_MAX;
+        (*it)->idom = NULL;
+        buf_free((*it)->dom_children);
+    }
+    // Iterative depth-first search for the postorder. rpo doubles as the visited mark.
+    Block **postorder = NULL;
+    BlockFrame *stack = NULL;
+    Block *entry = func->blocks[0];
+    entry->rpo = 0;
+    buf_push(stack, (BlockFrame){entry, 0});
+    while (buf_len(stack)) {
+        BlockFrame *frame = &stack[buf_len(stack) - 1];
+        if (frame->next < buf_len(frame->block->succs)) {
+            Block *succ = frame->block->succs[frame->next++];
+            if (succ->rpo == UINT32_MAX) {
+                succ->rpo = 0;
+                buf_push(stack, (BlockFrame){succ, 0});
+            }
+        } else {
+            buf_push(postorder, frame->block);
+            buf__hdr(stack)->len--;
+        }
+    }
+    size_t num_reachable = buf_len(postorder);
+    buf_free(func->rpo);
+    for (size_t i = 0; i < num_reachable; i++) {
+        Block *block = postorder[num_reachable - 1 - i];
+        block->rpo = (uint32_t)i;
+        buf_push(func->rpo, block);
+    }
+    buf_free(postorder);
+
+    entry->idom = entry;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (size_t i = 1; i < num_reachable; i++) {
+            Block *block = func->rpo[i];
+            Block *idom = NULL;
+            for (Block **pred = block->preds; pred != buf_end(block->preds); pred++) {
+                if ((*pred)->idom) {
+                    idom = idom ? ir_intersect(*pred, idom) : *pred;
+                }
+            }
+            if (idom != block->idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+    entry->idom = NULL;
+    for (size_t i = 1; i < num_reachable; i++) {
+        Block *block = func->rpo[i];
+        buf_push(block->idom->dom_children, block);
+    }
+    // Preorder numbering of the dominator tree.
+    uint32_t next_pre = 0;
+    buf_push(stack, (BlockFrame){entry, 0});
+    entry->dom_pre = next_pre++;
+    while (buf_len(stack)) {
+        BlockFrame *frame = &stack[buf_len(stack) - 1];
+        if (frame->next < buf_len(frame->block->dom_children)) {
+            Block *child = frame->block->dom_children[frame->next++];
+            child->dom_pre = next_pre++;
+            buf_push(stack, (BlockFrame){child, 0});
+        } else {
+            frame->block->dom_last = next_pre - 1;
+            buf__hdr(stack)->len--;
+        }
+    }
+    buf_free(stack);
+}
+
+bool ir_dominates(Block *a, Block *b) {
+    return a->dom_pre <= b->dom_pre && b->dom_pre <= a->dom_last;
+}
+
+void ir_free_block(Block *block) {
+    for (Instr **it = block->instrs; it != buf_end(block->instrs); it++) {
+        buf_free((*it)->args);
+    }
+    buf_free(block->instrs);
+    buf_free(block->preds);
+    buf_free(block->succs);
+    buf_free(block->dom_children);
+    buf_free(block->defs);
+    buf_free(block->incomplete_phis);
+    buf_free(block->incomplete_vars);
+}
+
+// Drops unreachable blocks, replaced and deleted instructions, and renumbers
+// what is left in block order.
+void ir_cleanup(IrFunc *func) {
+    ir_dominators(func);
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        Block *block = *it;
+        if (block->rpo != UINT32_MAX) {
+            continue;
+        }
+        for (Block **succ = block->succs; succ != buf_end(block->succs); succ++) {
+            if ((*succ)->rpo != UINT32_MAX) {
+                ir_remove_pred(*succ, block);
+            }
+        }
+    }
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        if ((*it)->rpo == UINT32_MAX) {
+            continue;
+        }
+        for (Instr **instr = (*it)->instrs; instr != buf_end((*it)->instrs); instr++) {
+            for (Instr **arg = (*instr)->args; arg != buf_end((*instr)->args); arg++) {
+                *arg = ir_value(*arg);
+            }
+        }
+    }
+    Block **blocks = func->blocks;
+    size_t num_blocks = buf_len(blocks);
+    func->blocks = NULL;
+    uint32_t next_id = 0;
+    for (size_t i = 0; i < num_blocks; i++) {
+        Block *block = blocks[i];
+        if (block->rpo == UINT32_MAX) {
+            ir_free_block(block);
+            continue;
+        }
+        block->id = (uint32_t)buf_len(func->blocks);
+        buf_push(func->blocks, block);
+        // Keep phis first: a pass may have turned a phi into another instruction.
+        Instr **instrs = block->instrs;
+        size_t num_instrs = buf_len(instrs);
+        block->instrs = NULL;
+        for (int pass = 0; pass < 2; pass++) {
+            for (size_t j = 0; j < num_instrs; j++) {
+                Instr *instr = instrs[j];
+                if (instr->op == OP_NONE || instr->forward) {
+                    if (pass == 1) {
+                        buf_free(instr->args);
+                    }
+                } else if ((instr->op == OP_PHI) == (pass == 0)) {
+                    buf_push(block->instrs, instr);
+                }
+            }
+        }
+        buf_free(instrs);
+        for (Instr **instr = block->instrs; instr != buf_end(block->instrs); instr++) {
+            (*instr)->id = next_id++;
+        }
+    }
+    buf_free(blocks);
+    func->next_instr_id = next_id;
+    func->next_block_id = (uint32_t)buf_len(func->blocks);
+    ir_dominators(func);
+}
+
+// Checks the structural and SSA invariants, reporting the first violation.
+// The function must have been through ir_cleanup.
+bool ir_verify(IrFunc *func) {
+    ir_dominators(func);
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        Block *block = *it;
+        size_t num_instrs = buf_len(block->instrs);
+        Instr *term = ir_terminator(block);
+        if (!term) {
+            printf("%s: b%u has no terminator\n", func->name, block->id);
+            return false;
+        }
+        size_t num_succs = term->op == OP_RET || term->op == OP_TAILCALL ? 0 : term->op == OP_JUMP ? 1 : 2;
+        if (term->op == OP_SWITCH ? buf_len(block->succs) < 2 : buf_len(block->succs) != num_succs) {
+            printf("%s: b%u has %zu successors for a %s\n", func->name, block->id, buf_len(block->succs),
+                   op_info[term->op].name);
+            return false;
+        }
+        for (Block **succ = block->succs; succ != buf_end(block->succs); succ++) {
+            size_t edges = 0;
+            size_t preds = 0;
+            for (Block **it2 = block->succs; it2 != buf_end(block->succs); it2++) {
+                edges += *it2 == *succ;
+            }
+            for (Block **pred = (*succ)->preds; pred != buf_end((*succ)->preds); pred++) {
+                preds += *pred == block;
+            }
+            if (edges != preds) {
+                printf("%s: edge b%u -> b%u is missing from the predecessors\n", func->name, block->id, (*succ)->id);
+                return false;
+            }
+        }
+        bool phis_done = false;
+        for (size_t i = 0; i < num_instrs; i++) {
+            Instr *instr = block->instrs[i];
+            if (instr->op == OP_NONE || instr->forward || instr->block != block) {
+                printf("%s: v%u in b%u is deleted or misplaced\n", func->name, instr->id, block->id);
+                return false;
+            }
+            if (ir_is_terminator(instr) && i + 1 != num_instrs) {
+                printf("%s: terminator v%u is not last in b%u\n", func->name, instr->id, block->id);
+                return false;
+            }
+            if (instr->op == OP_PHI) {
+                if (phis_done) {
+                    printf("%s: phi v%u follows other instructions in b%u\n", func->name, instr->id, block->id);
+                    return false;
+                }
+                if (buf_len(instr->args) != buf_len(block->preds)) {
+                    printf("%s: phi v%u has %zu arguments for %zu predecessors\n", func->name, instr->id,
+                           buf_len(instr->args), buf_len(block->preds));
+                    return false;
+                }
+            } else {
+                phis_done = true;
+            }
+            for (size_t j = 0; j < buf_len(instr->args); j++) {
+                Instr *arg = instr->args[j];
+                Block *use_block = instr->op == OP_PHI ? block->preds[j] : block;
+                bool ok = arg->op != OP_NONE && !arg->forward && arg->block && arg->block->rpo != UINT32_MAX;
+                if (ok && arg->block == use_block && instr->op != OP_PHI) {
+                    // ir_cleanup numbers instructions in block order.
+                    ok = arg->id < instr->id;
+                } else if (ok) {
+                    ok = ir_dominates(arg->block, use_block);
+                }
+                if (!ok) {
+                    printf("%s: v%u uses v%u, whose definition does not dominate it\n", func->name, instr->id,
+                           arg->id);
+                    return false;
+                }
+            }
+        }
+    }
+    return true;
+}
+
+void ir_dump_instr(Instr *instr) {
+    printf("    ");
+    if (!ir_is_terminator(instr) && instr->op != OP_STORE) {
+        printf("v%u = ", instr->id);
+    }
+    printf("%s", op_info[instr->op].name);
+    switch (instr->op) {
+    case OP_CONST:
+    case OP_PARAM:
+        printf(" %" PRId64, instr->imm);
+        break;
+    case OP_SWITCH:
+        printf(" v%u - %" PRId64 ", default b%u, [", instr->args[0]->id, instr->imm, instr->block->succs[0]->id);
+        for (size_t i = 1; i < buf_len(instr->block->succs); i++) {
+            printf("%sb%u", i > 1 ? " " : "", instr->block->succs[i]->id);
+        }
+        printf("]\n");
+        return;
+    case OP_FCONST:
+        printf(" %f", instr->fimm);
+        break;
+    case OP_STR:
+        printf(" \"%s\"", instr->name);
+        break;
+    case OP_GLOBAL:
+    case OP_LOCAL:
+        printf(" %s", instr->name);
+        break;
+    case OP_FIELD:
+        printf(" .%s", instr->name);
+        break;
+    case OP_CALL:
+    case OP_TAILCALL:
+        if (instr->name) {
+            printf(" %s", instr->name);
+        }
+        break;
+    case OP_CAST:
+    case OP_COMPOUND:
+        if (instr->type) {
+            printf(" ");
+            print_typespec(instr->type);
+        }
+        break;
+    default:
+        break;
+    }
+    for (size_t i = 0; i < buf_len(instr->args); i++) {
+        printf("%s", i == 0 ? " " : ", ");
+        if (instr->op == OP_PHI) {
+            printf("[v%u, b%u]", instr->args[i]->id, instr->block->preds[i]->id);
+        } else {
+            printf("v%u", instr->args[i]->id);
+        }
+    }
+    Block **succs = instr->block->succs;
+    if (instr->op == OP_JUMP) {
+        printf(" b%u", succs[0]->id);
+    } else if (instr->op == OP_BRANCH) {
+        printf(", b%u, b%u", succs[0]->id, succs[1]->id);
+    }
+    printf("\n");
+}
+
+void ir_dump_func(IrFunc *func) {
+    printf("func %s(", func->name);
+    for (size_t i = 0; i < func->num_params; i++) {
+        printf("%s%s", i ? ", " : "", func->decl->func.params[i].name);
+    }
+    printf(")\n");
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        Block *block = *it;
+        printf("  b%u:", block->id);
+        if (buf_len(block->preds)) {
+            printf(" ; preds");
+            for (Block **pred = block->preds; pred != buf_end(block->preds); pred++) {
+                printf(" b%u", (*pred)->id);
+            }
+        }
+        printf("\n");
+        for (Instr **instr = block->instrs; instr != buf_end(block->instrs); instr++) {
+            ir_dump_instr(*instr);
+        }
+    }
+}
+
+void ir_dump_module(IrModule *module) {
+    for (IrFunc **it = module->funcs; it != buf_end(module->funcs); it++) {
+        ir_dump_func(*it);
+        printf("\n");
+    }
+}
+
+size_t ir_num_instrs(IrFunc *func) {
+    size_t n = 0;
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        n += buf_len((*it)->instrs);
+    }
+    return n;
+}
+
+void ir_free(IrModule *module) {
+    for (IrFunc **func = module->funcs; func != buf_end(module->funcs); func++) {
+        for (Block **block = (*func)->blocks; block != buf_end((*func)->blocks); block++) {
+            ir_free_block(*block);
+        }
+        buf_free((*func)->blocks);
+        buf_free((*func)->rpo);
+    }
+    buf_free(module->funcs);
+    buf_free(module->globals);
+    map_free(&module->funcs_by_name);
+    arena_free(&module->arena);
+}
+
+// Integer semantics shared by constant folding and the interpreter. Returns
+// false when the result is undefined (division by zero).
+bool ir_eval(Op op, int64_t a, int64_t b, int64_t *result) {
+    uint64_t x = (uint64_t)a;
+    uint64_t y = (uint64_t)b;
+    switch (op) {
+    case OP_NEG: *result = (int64_t)(0 - x); break;
+    case OP_NOT: *result = a == 0; break;
+    case OP_BNOT: *result = (int64_t)~x; break;
+    case OP_ADD: *result = (int64_t)(x + y); break;
+    case OP_SUB: *result = (int64_t)(x - y); break;
+    case OP_MUL: *result = (int64_t)(x * y); break;
+    case OP_DIV:
+    case OP_MOD:
+        if (b == 0) {
+            return false;
+        }
+        if (a == INT64_MIN && b == -1) {
+            *result = op == OP_DIV ? INT64_MIN : 0;
+        } else {
+            *result = op == OP_DIV ? a / b : a % b;
+        }
+        break;
+    case OP_AND: *result = (int64_t)(x & y); break;
+    case OP_OR: *result = (int64_t)(x | y); break;
+    case OP_XOR: *result = (int64_t)(x ^ y); break;
+    case OP_SHL: *result = (int64_t)(x << (y & 63)); break;
+    case OP_SHR: *result = a >> (y & 63); break;
+    case OP_EQ: *result = a == b; break;
+    case OP_NE: *result = a != b; break;
+    case OP_LT: *result = a < b; break;
+    case OP_LE: *result = a <= b; break;
+    case OP_GT: *result = a > b; break;
+    case OP_GE: *result = a >= b; break;
+    case OP_ULE: *result = x <= y; break;
+    default:
+        assert(0);
+        return false;
+    }
+    return true;
+}
+
+typedef struct IrProfile IrProfile;
+typedef struct ProfileFunc ProfileFunc;
+ProfileFunc *profile_enter(IrProfile *profile, IrFunc *func);
+void profile_exit(IrProfile *profile);
+void profile_block(IrProfile *profile, ProfileFunc *func, Block *block);
+
+// IR interpreter
+//
+// Runs functions that stay within integers, calls to functions of the same
+// module and loads and stores of globals and address-taken locals. Memory is
+// word-addressed: every array element is one cell, so indexing adds the index
+// to the address. It is there to check that passes preserve behavior and to
+// measure what they save.
+typedef struct IrRun {
+    IrModule *module;
+    uint64_t instrs;
+    uint64_t calls;
+    double seconds;
+    int depth;
+    int max_depth;
+    // Memory cells for globals and address-taken locals; an address is a cell index.
+    int64_t *cells;
+    Map global_cells;
+    int64_t *phi_values;
+    // Attached by ir_run_profiled; see profile.c.
+    IrProfile *profile;
+} IrRun;
+
+#define IR_RUN_MAX_DEPTH 10000
+
+int64_t ir_global_cell(IrRun *run, const char *name) {
+    uint64_t cell = map_get_uint64(&run->global_cells, (uint64_t)(uintptr_t)name);
+    if (!cell) {
+        IrGlobal global = {name, 0, 1};
+        for (IrGlobal *it = run->module->globals; it != buf_end(run->module->globals); it++) {
+            if (it->name == name) {
+                global = *it;
+            }
+        }
+        cell = buf_len(run->cells) + 1;
+        buf_push(run->cells, global.init);
+        for (int64_t i = 1; i < global.size; i++) {
+            buf_push(run->cells, 0);
+        }
+        map_put_uint64(&run->global_cells, (uint64_t)(uintptr_t)name, cell);
+    }
+    return (int64_t)cell - 1;
+}
+
+int64_t ir_run_func(IrRun *run, IrFunc *func, int64_t *args, size_t num_args);
+
+#define IR_RUN_MAX_ARGS 16
+
+// Looks up the callee of a call or tail call and evaluates its arguments into args.
+IrFunc *ir_run_callee(IrRun *run, Instr *instr, int64_t *values, int64_t *args) {
+    IrFunc *callee = instr->name ? map_get(&run->module->funcs_by_name, instr->name) : NULL;
+    if (!callee) {
+        fatal("IR interpreter: call to unknown function '%s'", instr->name ? instr->name : "<indirect>");
+    }
+    size_t num_args = buf_len(instr->args);
+    if (num_args > IR_RUN_MAX_ARGS || num_args != callee->num_params) {
+        fatal("IR interpreter: bad call to '%s'", callee->name);
+    }
+    for (size_t i = 0; i < num_args; i++) {
+        args[i] = values[instr->args[i]->id];
+    }
+    return callee;
+}
+
+int64_t ir_run_call(IrRun *run, Instr *instr, int64_t *values) {
+    int64_t call_args[IR_RUN_MAX_ARGS];
+    IrFunc *callee = ir_run_callee(run, instr, values, call_args);
+    return ir_run_func(run, callee, call_args, buf_len(instr->args));
+}
+
+// A tail call reuses the frame: the callee runs in this invocation, at the same depth.
+int64_t ir_run_func(IrRun *run, IrFunc *func, int64_t *args, size_t num_args) {
+    if (++run->depth > IR_RUN_MAX_DEPTH) {
+        fatal("IR interpreter: call depth exceeds %d", IR_RUN_MAX_DEPTH);
+    }
+    run->max_depth = MAX(run->max_depth, run->depth);
+    int64_t tail_args[IR_RUN_MAX_ARGS];
+    int64_t result = 0;
+    ProfileFunc *profiled = NULL;
+enter:
+    run->calls++;
+    if (run->profile) {
+        profiled = profile_enter(run->profile, func);
+    }
+    size_t values_size = func->next_instr_id * sizeof(int64_t);
+    int64_t *values = xcalloc(func->next_instr_id, sizeof(int64_t), ALLOC_IR);
+    Block *block = func->blocks[0];
+    Block *prev = NULL;
+    for (;;) {
+        if (profiled) {
+            profile_block(run->profile, profiled, block);
+        }
+        Instr **instrs = block->instrs;
+        size_t num_instrs = buf_len(instrs);
+        size_t i = 0;
+        if (prev) {
+            // Phis read their arguments before any of them is assigned.
+            size_t pred = ir_pred_index(block, prev);
+            buf_truncate(run->phi_values, 0);
+            for (size_t j = 0; j < num_instrs && instrs[j]->op == OP_PHI; j++) {
+                buf_push(run->phi_values, values[instrs[j]->args[pred]->id]);
+            }
+            for (; i < num_instrs && instrs[i]->op == OP_PHI; i++) {
+                values[instrs[i]->id] = run->phi_values[i];
+            }
+            run->instrs += i;
+        }
+        Block *next = NULL;
+        for (; i < num_instrs && !next; i++) {
+            Instr *instr = instrs[i];
+            int64_t a = buf_len(instr->args) > 0 ? values[instr->args[0]->id] : 0;
+            int64_t b = buf_len(instr->args) > 1 ? values[instr->args[1]->id] : 0;
+            int64_t *value = &values[instr->id];
+            run->instrs++;
+            switch (instr->op) {
+            case OP_CONST:
+            case OP_PARAM:
+                *value = instr->op == OP_CONST ? instr->imm : instr->imm < (int64_t)num_args ? args[instr->imm] : 0;
+                break;
+            case OP_UNDEF:
+                *value = 0;
+                break;
+            case OP_COPY:
+                *value = a;
+                break;
+            case OP_GLOBAL:
+                *value = ir_global_cell(run, instr->name);
+                break;
+            case OP_INDEX:
+                *value = (int64_t)((uint64_t)a + (uint64_t)b);
+                break;
+            case OP_LOCAL:
+                buf_push(run->cells, 0);
+                *value = (int64_t)buf_len(run->cells) - 1;
+                break;
+            case OP_LOAD:
+            case OP_STORE:
+                if (a < 0 || a >= (int64_t)buf_len(run->cells)) {
+                    fatal("IR interpreter: bad address %" PRId64 " in %s", a, func->name);
+                }
+                if (instr->op == OP_LOAD) {
+                    *value = run->cells[a];
+                } else {
+                    run->cells[a] = b;
+                }
+                break;
+            case OP_CALL:
+                *value = ir_run_call(run, instr, values);
+                break;
+            case OP_JUMP:
+                next = block->succs[0];
+                break;
+            case OP_BRANCH:
+            case OP_SWITCH:
+                next = block->succs[ir_successor(instr, a)];
+                break;
+            case OP_RET:
+                result = a;
+                goto done;
+            case OP_TAILCALL:
+                func = ir_run_callee(run, instr, values, tail_args);
+                args = tail_args;
+                num_args = buf_len(instr->args);
+                xfree(values, values_size, ALLOC_IR);
+                if (profiled) {
+                    profile_exit(run->profile);
+                }
+                goto enter;
+            default:
+                if (!(op_info[instr->op].flags & OPF_FOLDABLE)) {
+                    fatal("IR interpreter: cannot run '%s' in %s", op_info[instr->op].name, func->name);
+                }
+                if (!ir_eval(instr->op, a, b, value)) {
+                    fatal("IR interpreter: division by zero in %s", func->name);
+                }
+                break;
+            }
+        }
+        if (!next) {
+            fatal("IR interpreter: fell off the end of b%u in %s", block->id, func->name);
+        }
+        prev = block;
+        block = next;
+    }
+done:
+    xfree(values, values_size, ALLOC_IR);
+    if (profiled) {
+        profile_exit(run->profile);
+    }
+    run->depth--;
+    return result;
+}
+
+// Frees the memory of a run, keeping its counters.
+void ir_run_free(IrRun *run) {
+    buf_free(run->cells);
+    buf_free(run->phi_values);
+    map_free(&run->global_cells);
+}
+
+// Runs a function of the module with no arguments, reporting to profile
+// unless it is NULL.
+int64_t ir_run_profiled(IrModule *module, const char *name, IrRun *run, IrProfile *profile) {
+    *run = (IrRun){.module = module, .profile = profile};
+    IrFunc *func = map_get(&module->funcs_by_name, str_intern(name));
+    if (!func) {
+        fatal("No function named '%s' to run", name);
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int64_t result = ir_run_func(run, func, NULL, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    run->seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+    ir_run_free(run);
+    return result;
+}
+
+int64_t ir_run(IrModule *module, const char *name, IrRun *run) {
+    return ir_run_profiled(module, name, run, NULL);
+}
@@ -0,0 +1,341 @@
+// Loop optimizations
+//
+// Natural loops are found from back edges, edges whose target (the header)
+// dominates their source (a latch). Every loop gets a preheader: a block
+// outside the loop that is its only way in, where invariant code is hoisted
+// and new induction variables start. Loops are handled innermost first, so
+// code hoisted out of an inner loop can leave the outer one too.
+typedef struct Loop {
+    Block *header;
+    Block *preheader;
+    // Member blocks in reverse postorder, header first.
+    Block **blocks;
+    // Indexed by block id.
+    bool *contains;
+} Loop;
+
+// Loop optimizations run as part of -O1 unless switched off.
+bool loop_opts = true;
+
+bool is_loop_header(Block *block) {
+    for (Block **pred = block->preds; pred != buf_end(block->preds); pred++) {
+        if ((*pred)->rpo != UINT32_MAX && ir_dominates(block, *pred)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Routes all edges into the header from outside the loop through a new block.
+// The header's phis keep one argument for it, merged there by a phi when
+// several outside edges came in.
+void insert_preheader(IrModule *module, IrFunc *func, Block *header) {
+    Block **outside = NULL;
+    Block **inside = NULL;
+    for (Block **pred = header->preds; pred != buf_end(header->preds); pred++) {
+        if (ir_dominates(header, *pred)) {
+            buf_push(inside, *pred);
+        } else {
+            buf_push(outside, *pred);
+        }
+    }
+    if (buf_len(outside) == 1 && buf_len(outside[0]->succs) == 1) {
+        buf_free(outside);
+        buf_free(inside);
+        return;
+    }
+    Block *preheader = ir_new_block(module, func);
+    for (Instr **it = header->instrs; it != buf_end(header->instrs) && (*it)->op == OP_PHI; it++) {
+        Instr *phi = *it;
+        Instr *entry = ir_new_instr(module, func, OP_PHI);
+        Instr **args = phi->args;
+        phi->args = NULL;
+        for (size_t i = 0; i < buf_len(header->preds); i++) {
+            if (ir_dominates(header, header->preds[i])) {
+                buf_push(phi->args, args[i]);
+            } else {
+                buf_push(entry->args, args[i]);
+            }
+        }
+        buf_push(phi->args, entry);
+        buf_free(args);
+        ir_append(preheader, entry);
+    }
+    for (Block **pred = outside; pred != buf_end(outside); pred++) {
+        buf_push(preheader->preds, *pred);
+        for (Block **succ = (*pred)->succs; succ != buf_end((*pred)->succs); succ++) {
+            if (*succ == header) {
+                *succ = preheader;
+                break;
+            }
+        }
+    }
+    buf_free(header->preds);
+    header->preds = inside;
+    ir_append(preheader, ir_new_instr(module, func, OP_JUMP));
+    ir_add_edge(preheader, header);
+    buf_free(outside);
+}
+
+int loop_cmp(const void *a, const void *b) {
+    size_t x = buf_len(((Loop *)a)->blocks);
+    size_t y = buf_len(((Loop *)b)->blocks);
+    return x < y ? -1 : x > y;
+}
+
+// Finds the loops of a function, innermost first, adding preheaders as needed.
+Loop *find_loops(IrModule *module, IrFunc *func) {
+    ir_dominators(func);
+    Block **headers = NULL;
+    for (Block **it = func->rpo; it != buf_end(func->rpo); it++) {
+        if (is_loop_header(*it)) {
+            buf_push(headers, *it);
+        }
+    }
+    if (!headers) {
+        return NULL;
+    }
+    for (Block **header = headers; header != buf_end(headers); header++) {
+        insert_preheader(module, func, *header);
+    }
+    // Renumbers the blocks and recomputes the dominator tree.
+    ir_cleanup(func);
+    size_t num_blocks = buf_len(func->blocks);
+    Loop *loops = NULL;
+    Block **work = NULL;
+    for (Block **it = headers; it != buf_end(headers); it++) {
+        Block *header = *it;
+        Loop loop = {header, NULL, NULL, xcalloc(num_blocks, sizeof(bool), ALLOC_IR)};
+        loop.contains[header->id] = true;
+        for (Block **pred = header->preds; pred != buf_end(header->preds); pred++) {
+            if (ir_dominates(header, *pred)) {
+                buf_push(work, *pred);
+            } else {
+                loop.preheader = *pred;
+            }
+        }
+        while (buf_len(work)) {
+            Block *block = buf_pop(work);
+            if (!loop.contains[block->id]) {
+                loop.contains[block->id] = true;
+                buf_pushn(work, block->preds, buf_len(block->preds));
+            }
+        }
+        for (Block **block = func->rpo; block != buf_end(func->rpo); block++) {
+            if (loop.contains[(*block)->id]) {
+                buf_push(loop.blocks, *block);
+            }
+        }
+        buf_push(loops, loop);
+    }
+    buf_free(work);
+    buf_free(headers);
+    qsort(loops, buf_len(loops), sizeof(Loop), loop_cmp);
+    return loops;
+}
+
+void free_loops(Loop *loops, size_t num_blocks) {
+    for (Loop *loop = loops; loop != buf_end(loops); loop++) {
+        buf_free(loop->blocks);
+        xfree(loop->contains, num_blocks * sizeof(bool), ALLOC_IR);
+    }
+    buf_free(loops);
+}
+
+bool is_invariant(Loop *loop, Instr *instr) {
+    return !loop->contains[instr->block->id];
+}
+
+// Pure instructions whose arguments come from outside the loop move to the
+// preheader. They may then run when the loop body would not have, so
+// division only moves with a constant, nonzero divisor. Loads stay: without
+// alias analysis any store or call in the loop could change memory.
+bool can_hoist(Loop *loop, Instr *instr) {
+    if (!(op_info[instr->op].flags & OPF_PURE) || ir_is_terminator(instr)) {
+        return false;
+    }
+    if ((instr->op == OP_DIV || instr->op == OP_MOD) && (instr->args[1]->op != OP_CONST || instr->args[1]->imm == 0)) {
+        return false;
+    }
+    for (Instr **arg = instr->args; arg != buf_end(instr->args); arg++) {
+        if (!is_invariant(loop, *arg)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Loop-invariant code motion. Blocks are visited in reverse postorder, so the
+// arguments of an instruction have been hoisted by the time it is looked at.
+bool hoist_invariants(Loop *loop) {
+    bool changed = false;
+    for (Block **it = loop->blocks; it != buf_end(loop->blocks); it++) {
+        Block *block = *it;
+        size_t kept = 0;
+        for (size_t i = 0; i < buf_len(block->instrs); i++) {
+            Instr *instr = block->instrs[i];
+            if (can_hoist(loop, instr)) {
+                ir_insert_before_terminator(loop->preheader, instr);
+                changed = true;
+            } else {
+                block->instrs[kept++] = instr;
+            }
+        }
+        buf_truncate(block->instrs, kept);
+    }
+    return changed;
+}
+
+// An induction variable is a value that starts at init in the first
+// iteration and advances by a loop-invariant step in every iteration after
+// that. Basic ones are header phis, phi = [init, phi + step], and their
+// increments; derived ones are new header phis, kept up by a bump placed
+// after pos: an addition, or for pointers, indexing step elements further.
+typedef struct InductionVar {
+    Instr *value;
+    Instr *init;
+    Instr *step;
+    Instr *pos;
+    Op bump;
+} InductionVar;
+
+Instr *loop_preheader_instr(IrModule *module, IrFunc *func, Loop *loop, Op op, Instr *a, Instr *b) {
+    Instr *instr = ir_new_instr(module, func, op);
+    buf_push(instr->args, a);
+    if (b) {
+        buf_push(instr->args, b);
+    }
+    ir_insert_before_terminator(loop->preheader, instr);
+    return instr;
+}
+
+void find_basic_ivs(IrModule *module, IrFunc *func, Loop *loop, InductionVar **ivs) {
+    Block *header = loop->header;
+    size_t entry = ir_pred_index(header, loop->preheader);
+    for (Instr **it = header->instrs; it != buf_end(header->instrs) && (*it)->op == OP_PHI; it++) {
+        Instr *phi = *it;
+        Instr *next = NULL;
+        bool same = true;
+        for (size_t i = 0; i < buf_len(phi->args); i++) {
+            if (i != entry) {
+                same &= !next || phi->args[i] == next;
+                next = phi->args[i];
+            }
+        }
+        if (!same || !next || (next->op != OP_ADD && next->op != OP_SUB)) {
+            continue;
+        }
+        Instr *step = NULL;
+        if (next->args[0] == phi && is_invariant(loop, next->args[1])) {
+            step = next->args[1];
+        } else if (next->op == OP_ADD && next->args[1] == phi && is_invariant(loop, next->args[0])) {
+            step = next->args[0];
+        }
+        if (!step) {
+            continue;
+        }
+        if (next->op == OP_SUB) {
+            step = loop_preheader_instr(module, func, loop, OP_NEG, step, NULL);
+        }
+        Instr *init = phi->args[entry];
+        buf_push(*ivs, ((InductionVar){phi, init, step, next, OP_ADD}));
+        // Loops that step their counter first, like do { i--; ... }, use the increment.
+        Instr *next_init = loop_preheader_instr(module, func, loop, OP_ADD, init, step);
+        buf_push(*ivs, ((InductionVar){next, next_init, step, next, OP_ADD}));
+    }
+}
+
+// Adds an induction variable that steps along with base and replaces instr.
+InductionVar new_iv(IrModule *module, IrFunc *func, Loop *loop, InductionVar *base, Instr *instr, Instr *init,
+                    Instr *step, Op bump) {
+    Instr *phi = ir_new_instr(module, func, OP_PHI);
+    Instr *next = ir_new_instr(module, func, bump);
+    buf_push(next->args, phi);
+    buf_push(next->args, step);
+    ir_insert_after(base->pos, next);
+    Block *header = loop->header;
+    for (Block **pred = header->preds; pred != buf_end(header->preds); pred++) {
+        buf_push(phi->args, *pred == loop->preheader ? init : next);
+    }
+    ir_insert_phi(header, phi);
+    instr->forward = phi;
+    return (InductionVar){phi, init, step, next, bump};
+}
+
+// Strength reduction. An induction variable times, shifted by or plus an
+// invariant is an induction variable too, kept up by an addition instead of
+// recomputed; indexing with one becomes a pointer advanced each iteration.
+// a[i * 4] thus turns into a pointer bumped by 4. Derived variables that end
+// up unused are left for dead code elimination.
+bool reduce_strength(IrModule *module, IrFunc *func, Loop *loop) {
+    InductionVar *ivs = NULL;
+    find_basic_ivs(module, func, loop, &ivs);
+    if (!ivs) {
+        return false;
+    }
+    Instr **candidates = NULL;
+    for (Block **block = loop->blocks; block != buf_end(loop->blocks); block++) {
+        for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+            Op op = (*it)->op;
+            if (op == OP_ADD || op == OP_SUB || op == OP_MUL || op == OP_SHL || op == OP_INDEX) {
+                buf_push(candidates, *it);
+            }
+        }
+    }
+    bool changed = false;
+    for (Instr **it = candidates; it != buf_end(candidates); it++) {
+        Instr *instr = *it;
+        Instr *a = ir_value(instr->args[0]);
+        Instr *b = ir_value(instr->args[1]);
+        bool commutes = instr->op == OP_ADD || instr->op == OP_MUL;
+        InductionVar *iv = NULL;
+        Instr *other = NULL;
+        for (InductionVar *v = ivs; v != buf_end(ivs) && !iv; v++) {
+            // The increment of a basic variable is one already.
+            if (v->bump != OP_ADD || v->pos == instr) {
+                continue;
+            }
+            if (v->value == a && is_invariant(loop, b) && instr->op != OP_INDEX) {
+                iv = v, other = b;
+            } else if (v->value == b && is_invariant(loop, a) && (commutes || instr->op == OP_INDEX)) {
+                iv = v, other = a;
+            }
+        }
+        if (!iv) {
+            continue;
+        }
+        InductionVar base = *iv;
+        Instr *init;
+        Instr *step = base.step;
+        Op bump = OP_ADD;
+        if (instr->op == OP_INDEX) {
+            init = loop_preheader_instr(module, func, loop, OP_INDEX, other, base.init);
+            bump = OP_INDEX;
+        } else {
+            init = loop_preheader_instr(module, func, loop, instr->op, base.init, other);
+            if (instr->op == OP_MUL || instr->op == OP_SHL) {
+                step = loop_preheader_instr(module, func, loop, instr->op, base.step, other);
+            }
+        }
+        buf_push(ivs, new_iv(module, func, loop, &base, instr, init, step, bump));
+        changed = true;
+    }
+    buf_free(candidates);
+    buf_free(ivs);
+    return changed;
+}
+
+bool optimize_loops(IrModule *module, IrFunc *func) {
+    Loop *loops = find_loops(module, func);
+    size_t num_blocks = buf_len(func->blocks);
+    bool changed = false;
+    for (Loop *loop = loops; loop != buf_end(loops); loop++) {
+        changed |= hoist_invariants(loop);
+        changed |= reduce_strength(module, func, loop);
+    }
+    free_loops(loops, num_blocks);
+    if (changed) {
+        ir_cleanup(func);
+    }
+    return changed;
+}
@@ -0,0 +1,1085 @@
+// Lowering of function bodies to SSA
+//
+// SSA form is built while the CFG is, with the algorithm of Braun et al.,
+// "Simple and Efficient Construction of Static Single Assignment Form": every
+// local is a variable number, the defining instruction of each variable is
+// tracked per block, and a read in a block whose predecessors are not all
+// known yet (a loop header) gets a placeholder phi that is completed once the
+// block is sealed. Phis that turn out to merge a single value are forwarded to
+// it on the spot.
+//
+// Locals whose address is taken, or that are assigned through a field or an
+// index, live in memory instead (OP_LOCAL with loads and stores), as do
+// globals. Constants and enum items become OP_CONST where they evaluate to
+// integers.
+typedef struct LowerLocal {
+    const char *name;
+    // SSA variable number, or the slot for locals in memory.
+    size_t var;
+    Instr *addr;
+} LowerLocal;
+
+typedef struct LowerConst {
+    Expr *expr;
+    int64_t value;
+    bool evaluated;
+    bool is_const;
+} LowerConst;
+
+typedef struct Lower {
+    IrModule *module;
+    IrFunc *func;
+    Block *block;
+    size_t num_vars;
+    LowerLocal *locals;
+    // Names kept in memory in the function being lowered.
+    Map memory_names;
+    // Global constants and enum items.
+    Map consts;
+    Block *break_target;
+    Block *continue_target;
+    Walk prescan;
+    // Position of the statement being lowered, stamped on its instructions.
+    SrcPos pos;
+} Lower;
+
+Instr *lower_instr(Lower *lower, Op op) {
+    Instr *instr = ir_new_instr(lower->module, lower->func, op);
+    instr->pos = lower->pos;
+    ir_append(lower->block, instr);
+    return instr;
+}
+
+Instr *lower_const(Lower *lower, int64_t value) {
+    Instr *instr = lower_instr(lower, OP_CONST);
+    instr->imm = value;
+    return instr;
+}
+
+Instr *lower_unary(Lower *lower, Op op, Instr *arg) {
+    Instr *instr = lower_instr(lower, op);
+    buf_push(instr->args, arg);
+    return instr;
+}
+
+Instr *lower_binary(Lower *lower, Op op, Instr *left, Instr *right) {
+    Instr *instr = lower_instr(lower, op);
+    buf_push(instr->args, left);
+    buf_push(instr->args, right);
+    return instr;
+}
+
+void lower_store(Lower *lower, Instr *addr, Instr *value) {
+    lower_binary(lower, OP_STORE, addr, value);
+}
+
+void lower_jump(Lower *lower, Block *target) {
+    lower_instr(lower, OP_JUMP);
+    ir_add_edge(lower->block, target);
+}
+
+void lower_branch(Lower *lower, Instr *cond, Block *if_true, Block *if_false) {
+    lower_unary(lower, OP_BRANCH, cond);
+    ir_add_edge(lower->block, if_true);
+    ir_add_edge(lower->block, if_false);
+}
+
+// Code after a return, break or continue goes to a block nothing jumps to.
+void lower_unreachable(Lower *lower) {
+    lower->block = ir_new_block(lower->module, lower->func);
+    lower->block->sealed = true;
+}
+
+// SSA construction
+Instr *read_var(Lower *lower, Block *block, size_t var);
+
+void write_var(Block *block, size_t var, Instr *value) {
+    while (buf_len(block->defs) <= var) {
+        buf_push(block->defs, NULL);
+    }
+    block->defs[var] = value;
+}
+
+Instr *new_phi(Lower *lower, Block *block) {
+    Instr *phi = ir_new_instr(lower->module, lower->func, OP_PHI);
+    ir_insert_phi(block, phi);
+    return phi;
+}
+
+Instr *lower_undef(Lower *lower, Block *block) {
+    Instr *undef = ir_new_instr(lower->module, lower->func, OP_UNDEF);
+    ir_insert_before_terminator(block, undef);
+    return undef;
+}
+
+Instr *try_remove_trivial_phi(Lower *lower, Instr *phi) {
+    Instr *same = NULL;
+    for (Instr **it = phi->args; it != buf_end(phi->args); it++) {
+        Instr *arg = ir_value(*it);
+        if (arg == same || arg == phi) {
+            continue;
+        }
+        if (same) {
+            return phi;
+        }
+        same = arg;
+    }
+    if (!same) {
+        // Only reachable through itself, or not at all.
+        same = lower_undef(lower, lower->func->blocks[0]);
+    }
+    phi->forward = same;
+    return same;
+}
+
+Instr *add_phi_operands(Lower *lower, size_t var, Instr *phi) {
+    for (Block **pred = phi->block->preds; pred != buf_end(phi->block->preds); pred++) {
+        buf_push(phi->args, read_var(lower, *pred, var));
+    }
+    return try_remove_trivial_phi(lower, phi);
+}
+
+Instr *read_var(Lower *lower, Block *block, size_t var) {
+    if (var < buf_len(block->defs) && block->defs[var]) {
+        return ir_value(block->defs[var]);
+    }
+    Instr *value;
+    if (!block->sealed) {
+        value = new_phi(lower, block);
+        buf_push(block->incomplete_phis, value);
+        buf_push(block->incomplete_vars, var);
+    } else if (buf_len(block->preds) == 0) {
+        value = lower_undef(lower, block);
+    } else if (buf_len(block->preds) == 1) {
+        value = read_var(lower, block->preds[0], var);
+    } else {
+        // Break cycles through loops with an operandless phi.
+        Instr *phi = new_phi(lower, block);
+        write_var(block, var, phi);
+        value = add_phi_operands(lower, var, phi);
+    }
+    write_var(block, var, value);
+    return value;
+}
+
+void seal_block(Lower *lower, Block *block) {
+    assert(!block->sealed);
+    block->sealed = true;
+    for (size_t i = 0; i < buf_len(block->incomplete_phis); i++) {
+        add_phi_operands(lower, block->incomplete_vars[i], block->incomplete_phis[i]);
+    }
+    buf_free(block->incomplete_phis);
+    buf_free(block->incomplete_vars);
+}
+
+// Constants
+bool eval_const_expr(Lower *lower, Expr *expr, int64_t *value, int depth);
+LowerLocal *find_local(Lower *lower, const char *name);
+
+bool eval_const_name(Lower *lower, const char *name, int64_t *value, int depth) {
+    LowerConst *c = map_get(&lower->consts, name);
+    if (!c || find_local(lower, name)) {
+        return false;
+    }
+    if (!c->evaluated) {
+        // Cyclic definitions stay unevaluated.
+        c->evaluated = true;
+        c->is_const = eval_const_expr(lower, c->expr, &c->value, depth + 1);
+    }
+    *value = c->value;
+    return c->is_const;
+}
+
+Op binary_op(TokenKind op) {
+    switch ((int)op) {
+    case '+': case TOKEN_ADD_ASSIGN: case TOKEN_INC: return OP_ADD;
+    case '-': case TOKEN_SUB_ASSIGN: case TOKEN_DEC: return OP_SUB;
+    case '*': case TOKEN_MUL_ASSIGN: return OP_MUL;
+    case '/': case TOKEN_DIV_ASSIGN: return OP_DIV;
+    case '%': case TOKEN_MOD_ASSIGN: return OP_MOD;
+    case '&': case TOKEN_AND_ASSIGN: return OP_AND;
+    case '|': case TOKEN_OR_ASSIGN: return OP_OR;
+    case '^': case TOKEN_XOR_ASSIGN: return OP_XOR;
+    case TOKEN_LSHIFT: case TOKEN_LSHIFT_ASSIGN: return OP_SHL;
+    case TOKEN_RSHIFT: case TOKEN_RSHIFT_ASSIGN: return OP_SHR;
+    case TOKEN_EQ: return OP_EQ;
+    case TOKEN_NOTEQ: return OP_NE;
+    case '<': return OP_LT;
+    case TOKEN_LTEQ: return OP_LE;
+    case '>': return OP_GT;
+    case TOKEN_GTEQ: return OP_GE;
+    default: return OP_NONE;
+    }
+}
+
+Op unary_op(TokenKind op) {
+    switch ((int)op) {
+    case '-': return OP_NEG;
+    case '!': return OP_NOT;
+    case '~': return OP_BNOT;
+    default: return OP_NONE;
+    }
+}
+
+bool eval_const_expr(Lower *lower, Expr *expr, int64_t *value, int depth) {
+    if (!expr || depth > 100) {
+        return false;
+    }
+    int64_t a, b;
+    switch (expr->kind) {
+    case EXPR_INT:
+        *value = (int64_t)expr->int_val;
+        return true;
+    case EXPR_NAME:
+        return eval_const_name(lower, expr->name, value, depth);
+    case EXPR_UNARY:
+        if (expr->unary.op == '+') {
+            return eval_const_expr(lower, expr->unary.expr, value, depth + 1);
+        }
+        return unary_op(expr->unary.op) && eval_const_expr(lower, expr->unary.expr, &a, depth + 1) &&
+               ir_eval(unary_op(expr->unary.op), a, 0, value);
+    case EXPR_BINARY:
+        if (expr->binary.op == TOKEN_AND || expr->binary.op == TOKEN_OR) {
+            if (!eval_const_expr(lower, expr->binary.left, &a, depth + 1) ||
+                !eval_const_expr(lower, expr->binary.right, &b, depth + 1)) {
+                return false;
+            }
+            *value = expr->binary.op == TOKEN_AND ? a && b : a || b;
+            return true;
+        }
+        return binary_op(expr->binary.op) && eval_const_expr(lower, expr->binary.left, &a, depth + 1) &&
+               eval_const_expr(lower, expr->binary.right, &b, depth + 1) &&
+               ir_eval(binary_op(expr->binary.op), a, b, value);
+    case EXPR_TERNARY:
+        if (!eval_const_expr(lower, expr->ternary.cond, &a, depth + 1)) {
+            return false;
+        }
+        return eval_const_expr(lower, a ? expr->ternary.if_true : expr->ternary.if_false, value, depth + 1);
+    default:
+        return false;
+    }
+}
+
+// Finds the locals that must live in memory.
+const char *lvalue_base_name(Expr *expr) {
+    while (expr->kind == EXPR_FIELD || expr->kind == EXPR_INDEX) {
+        expr = expr->kind == EXPR_FIELD ? expr->field.expr : expr->index.expr;
+    }
+    return expr->kind == EXPR_NAME ? expr->name : NULL;
+}
+
+WalkAction prescan_visit(Walk *walk, WalkEvent event, Node node) {
+    Lower *lower = walk->data;
+    if (event != WALK_PRE) {
+        return WALK_CONTINUE;
+    }
+    const char *name = NULL;
+    if (node.kind == NODE_EXPR && node.expr->kind == EXPR_UNARY && node.expr->unary.op == '&') {
+        name = lvalue_base_name(node.expr->unary.expr);
+    } else if (node.kind == NODE_STMT && node.stmt->kind == STMT_ASSIGN) {
+        Expr *left = node.stmt->assign.left;
+        if (left->kind == EXPR_FIELD || left->kind == EXPR_INDEX) {
+            name = lvalue_base_name(left);
+        }
+    }
+    if (name) {
+        map_put(&lower->memory_names, name, (void *)1);
+    }
+    return WALK_CONTINUE;
+}
+
+// Locals and names
+LowerLocal *find_local(Lower *lower, const char *name) {
+    for (size_t i = buf_len(lower->locals); i > 0; i--) {
+        if (lower->locals[i - 1].name == name) {
+            return &lower->locals[i - 1];
+        }
+    }
+    return NULL;
+}
+
+void declare_local(Lower *lower, const char *name, Instr *init) {
+    LowerLocal local = {name, lower->num_vars++, NULL};
+    if (map_get(&lower->memory_names, name)) {
+        local.addr = lower_instr(lower, OP_LOCAL);
+        local.addr->name = name;
+        lower_store(lower, local.addr, init);
+    } else {
+        write_var(lower->block, local.var, init);
+    }
+    buf_push(lower->locals, local);
+}
+
+Instr *lower_global_addr(Lower *lower, const char *name) {
+    Instr *instr = lower_instr(lower, OP_GLOBAL);
+    instr->name = name;
+    return instr;
+}
+
+Instr *lower_expr(Lower *lower, Expr *expr);
+
+// Returns the address of an lvalue, or NULL for a local held in SSA form.
+Instr *lower_addr(Lower *lower, Expr *expr) {
+    switch (expr->kind) {
+    case EXPR_NAME: {
+        LowerLocal *local = find_local(lower, expr->name);
+        if (local) {
+            return local->addr;
+        }
+        return lower_global_addr(lower, expr->name);
+    }
+    case EXPR_FIELD:
+    case EXPR_INDEX: {
+        Expr *base = expr->kind == EXPR_FIELD ? expr->field.expr : expr->index.expr;
+        // Fields and elements of named objects are addressed within them;
+        // anything else is taken to be a pointer to the object.
+        Instr *base_addr = NULL;
+        if (base->kind == EXPR_NAME || base->kind == EXPR_FIELD || base->kind == EXPR_INDEX) {
+            base_addr = lower_addr(lower, base);
+        }
+        if (!base_addr) {
+            base_addr = lower_expr(lower, base);
+        }
+        Instr *instr;
+        if (expr->kind == EXPR_FIELD) {
+            instr = lower_unary(lower, OP_FIELD, base_addr);
+            instr->name = expr->field.name;
+        } else {
+            instr = lower_binary(lower, OP_INDEX, base_addr, lower_expr(lower, expr->index.index));
+        }
+        return instr;
+    }
+    case EXPR_UNARY:
+        if (expr->unary.op == '*') {
+            return lower_expr(lower, expr->unary.expr);
+        }
+        break;
+    default:
+        break;
+    }
+    fatal_at(expr->pos, "Expression is not assignable");
+    return NULL;
+}
+
+Instr *lower_name(Lower *lower, Expr *expr) {
+    LowerLocal *local = find_local(lower, expr->name);
+    if (local && !local->addr) {
+        return read_var(lower, lower->block, local->var);
+    }
+    int64_t value;
+    if (!local && eval_const_name(lower, expr->name, &value, 0)) {
+        return lower_const(lower, value);
+    }
+    if (!local && map_get(&lower->module->funcs_by_name, expr->name)) {
+        return lower_global_addr(lower, expr->name);
+    }
+    return lower_unary(lower, OP_LOAD, lower_addr(lower, expr));
+}
+
+// Lowers a && b, a || b and c ? a : b through a fresh variable so that SSA
+// construction places the phi.
+Instr *lower_logic(Lower *lower, Expr *expr) {
+    size_t var = lower->num_vars++;
+    Block *if_true = ir_new_block(lower->module, lower->func);
+    Block *if_false = ir_new_block(lower->module, lower->func);
+    Block *join = ir_new_block(lower->module, lower->func);
+    Expr *cond = expr->kind == EXPR_TERNARY ? expr->ternary.cond : expr->binary.left;
+    lower_branch(lower, lower_expr(lower, cond), if_true, if_false);
+    seal_block(lower, if_true);
+    seal_block(lower, if_false);
+    Block *blocks[] = {if_true, if_false};
+    for (int i = 0; i < 2; i++) {
+        lower->block = blocks[i];
+        Instr *value;
+        if (expr->kind == EXPR_TERNARY) {
+            value = lower_expr(lower, i == 0 ? expr->ternary.if_true : expr->ternary.if_false);
+        } else if ((expr->binary.op == TOKEN_AND) == (i == 0)) {
+            value = lower_binary(lower, OP_NE, lower_expr(lower, expr->binary.right), lower_const(lower, 0));
+        } else {
+            value = lower_const(lower, expr->binary.op == TOKEN_OR);
+        }
+        write_var(lower->block, var, value);
+        lower_jump(lower, join);
+    }
+    seal_block(lower, join);
+    lower->block = join;
+    return read_var(lower, join, var);
+}
+
+bool is_arith_binary(Expr *expr) {
+    return expr->kind == EXPR_BINARY && expr->binary.op != TOKEN_AND && expr->binary.op != TOKEN_OR;
+}
+
+// Operators are left associative, so long sums nest down the left operands.
+// Walking that spine with a loop keeps deep expressions off the C stack.
+Instr *lower_binary_chain(Lower *lower, Expr *expr) {
+    Expr **spine = NULL;
+    for (; is_arith_binary(expr); expr = expr->binary.left) {
+        buf_push(spine, expr);
+    }
+    Instr *value = lower_expr(lower, expr);
+    for (size_t i = buf_len(spine); i > 0; i--) {
+        Expr *node = spine[i - 1];
+        value = lower_binary(lower, binary_op(node->binary.op), value, lower_expr(lower, node->binary.right));
+    }
+    buf_free(spine);
+    return value;
+}
+
+Instr *lower_call(Lower *lower, Expr *expr) {
+    Expr *callee = expr->call.expr;
+    Instr **args = NULL;
+    const char *name = NULL;
+    if (callee->kind == EXPR_NAME && !find_local(lower, callee->name)) {
+        name = callee->name;
+    } else {
+        buf_push(args, lower_expr(lower, callee));
+    }
+    for (size_t i = 0; i < expr->call.num_args; i++) {
+        buf_push(args, lower_expr(lower, expr->call.args[i]));
+    }
+    Instr *call = lower_instr(lower, OP_CALL);
+    call->name = name;
+    call->args = args;
+    return call;
+}
+
+Instr *lower_expr(Lower *lower, Expr *expr) {
+    switch (expr->kind) {
+    case EXPR_INT:
+        return lower_const(lower, (int64_t)expr->int_val);
+    case EXPR_FLOAT: {
+        Instr *instr = lower_instr(lower, OP_FCONST);
+        instr->fimm = expr->float_val;
+        return instr;
+    }
+    case EXPR_STR: {
+        Instr *instr = lower_instr(lower, OP_STR);
+        instr->name = expr->str_val;
+        return instr;
+    }
+    case EXPR_NAME:
+        return lower_name(lower, expr);
+    case EXPR_CAST: {
+        Instr *instr = lower_unary(lower, OP_CAST, lower_expr(lower, expr->cast.expr));
+        instr->type = expr->cast.type;
+        return instr;
+    }
+    case EXPR_CALL:
+        return lower_call(lower, expr);
+    case EXPR_INDEX:
+    case EXPR_FIELD:
+        return lower_unary(lower, OP_LOAD, lower_addr(lower, expr));
+    case EXPR_COMPOUND: {
+        Instr **args = NULL;
+        for (size_t i = 0; i < expr->compound.num_args; i++) {
+            buf_push(args, lower_expr(lower, expr->compound.args[i]));
+        }
+        Instr *instr = lower_instr(lower, OP_COMPOUND);
+        instr->type = expr->compound.type;
+        instr->args = args;
+        return instr;
+    }
+    case EXPR_UNARY:
+        switch ((int)expr->unary.op) {
+        case '+':
+            return lower_expr(lower, expr->unary.expr);
+        case '*':
+            return lower_unary(lower, OP_LOAD, lower_expr(lower, expr->unary.expr));
+        case '&': {
+            Instr *addr = lower_addr(lower, expr->unary.expr);
+            assert(addr);
+            return addr;
+        }
+        default:
+            return lower_unary(lower, unary_op(expr->unary.op), lower_expr(lower, expr->unary.expr));
+        }
+    case EXPR_BINARY:
+        if (expr->binary.op == TOKEN_AND || expr->binary.op == TOKEN_OR) {
+            return lower_logic(lower, expr);
+        }
+        return lower_binary_chain(lower, expr);
+    case EXPR_TERNARY:
+        return lower_logic(lower, expr);
+    default:
+        assert(0);
+        return NULL;
+    }
+}
+
+// Statements
+void lower_stmt(Lower *lower, Stmt *stmt);
+void lower_stmt_block(Lower *lower, StmtBlock block);
+
+void lower_assign(Lower *lower, Stmt *stmt) {
+    Expr *left = stmt->assign.left;
+    LowerLocal *local = left->kind == EXPR_NAME ? find_local(lower, left->name) : NULL;
+    if (local && !local->addr) {
+        Instr *value;
+        if (stmt->assign.op == '=') {
+            value = lower_expr(lower, stmt->assign.right);
+        } else {
+            Instr *old = read_var(lower, lower->block, local->var);
+            Instr *right = stmt->assign.right ? lower_expr(lower, stmt->assign.right) : lower_const(lower, 1);
+            value = lower_binary(lower, binary_op(stmt->assign.op), old, right);
+        }
+        write_var(lower->block, local->var, value);
+        return;
+    }
+    Instr *addr = lower_addr(lower, left);
+    Instr *value;
+    if (stmt->assign.op == '=') {
+        value = lower_expr(lower, stmt->assign.right);
+    } else {
+        Instr *old = lower_unary(lower, OP_LOAD, addr);
+        Instr *right = stmt->assign.right ? lower_expr(lower, stmt->assign.right) : lower_const(lower, 1);
+        value = lower_binary(lower, binary_op(stmt->assign.op), old, right);
+    }
+    lower_store(lower, addr, value);
+}
+
+void lower_if(Lower *lower, Stmt *stmt) {
+    IfStmt *if_stmt = &stmt->if_stmt;
+    Block *join = ir_new_block(lower->module, lower->func);
+    for (size_t i = 0; i <= if_stmt->num_elseifs; i++) {
+        Expr *cond = i == 0 ? if_stmt->cond : if_stmt->elseifs[i - 1].cond;
+        StmtBlock body = i == 0 ? if_stmt->then_block : if_stmt->elseifs[i - 1].block;
+        Block *then_block = ir_new_block(lower->module, lower->func);
+        Block *else_block = ir_new_block(lower->module, lower->func);
+        lower_branch(lower, lower_expr(lower, cond), then_block, else_block);
+        seal_block(lower, then_block);
+        seal_block(lower, else_block);
+        lower->block = then_block;
+        lower_stmt_block(lower, body);
+        lower_jump(lower, join);
+        lower->block = else_block;
+    }
+    lower_stmt_block(lower, if_stmt->else_block);
+    lower_jump(lower, join);
+    seal_block(lower, join);
+    lower->block = join;
+}
+
+// Lowers a loop body with the given break and continue targets.
+void lower_loop_body(Lower *lower, StmtBlock body, Block *break_target, Block *continue_target) {
+    Block *outer_break = lower->break_target;
+    Block *outer_continue = lower->continue_target;
+    lower->break_target = break_target;
+    lower->continue_target = continue_target;
+    lower_stmt_block(lower, body);
+    lower->break_target = outer_break;
+    lower->continue_target = outer_continue;
+}
+
+void lower_while(Lower *lower, Stmt *stmt) {
+    Block *header = ir_new_block(lower->module, lower->func);
+    Block *body = ir_new_block(lower->module, lower->func);
+    Block *exit = ir_new_block(lower->module, lower->func);
+    lower_jump(lower, header);
+    lower->block = header;
+    lower_branch(lower, lower_expr(lower, stmt->while_stmt.cond), body, exit);
+    seal_block(lower, body);
+    lower->block = body;
+    lower_loop_body(lower, stmt->while_stmt.block, exit, header);
+    lower_jump(lower, header);
+    seal_block(lower, header);
+    seal_block(lower, exit);
+    lower->block = exit;
+}
+
+void lower_do_while(Lower *lower, Stmt *stmt) {
+    Block *body = ir_new_block(lower->module, lower->func);
+    Block *test = ir_new_block(lower->module, lower->func);
+    Block *exit = ir_new_block(lower->module, lower->func);
+    lower_jump(lower, body);
+    lower->block = body;
+    lower_loop_body(lower, stmt->while_stmt.block, exit, test);
+    lower_jump(lower, test);
+    seal_block(lower, test);
+    lower->block = test;
+    lower_branch(lower, lower_expr(lower, stmt->while_stmt.cond), body, exit);
+    seal_block(lower, body);
+    seal_block(lower, exit);
+    lower->block = exit;
+}
+
+void lower_for(Lower *lower, Stmt *stmt) {
+    ForStmt *for_stmt = &stmt->for_stmt;
+    // The init statements declare into the scope of the whole loop.
+    size_t scope = buf_len(lower->locals);
+    for (size_t i = 0; i < for_stmt->init.num_stmts; i++) {
+        lower_stmt(lower, for_stmt->init.stmts[i]);
+    }
+    Block *header = ir_new_block(lower->module, lower->func);
+    Block *body = ir_new_block(lower->module, lower->func);
+    Block *next = ir_new_block(lower->module, lower->func);
+    Block *exit = ir_new_block(lower->module, lower->func);
+    lower_jump(lower, header);
+    lower->block = header;
+    if (for_stmt->cond) {
+        lower_branch(lower, lower_expr(lower, for_stmt->cond), body, exit);
+    } else {
+        lower_jump(lower, body);
+    }
+    seal_block(lower, body);
+    lower->block = body;
+    lower_loop_body(lower, for_stmt->block, exit, next);
+    lower_jump(lower, next);
+    seal_block(lower, next);
+    lower->block = next;
+    for (size_t i = 0; i < for_stmt->next.num_stmts; i++) {
+        lower_stmt(lower, for_stmt->next.stmts[i]);
+    }
+    lower_jump(lower, header);
+    seal_block(lower, header);
+    seal_block(lower, exit);
+    lower->block = exit;
+    buf_truncate(lower->locals, scope);
+}
+
+// Switch dispatch
+//
+// When every case value is a constant, the values are sorted, runs that go to
+// the same case are merged into ranges, and the ranges are grouped into
+// clusters from left to right:
+//
+// - a jump table (OP_SWITCH) for the longest run of at least
+//   SWITCH_TABLE_MIN_RANGES ranges that fills at least
+//   SWITCH_TABLE_MIN_DENSITY percent of its span;
+// - otherwise a bit test for the longest run of at least SWITCH_BITS_MIN_RANGES
+//   ranges within 64 values and going to at most SWITCH_BITS_MAX_TARGETS cases,
+//   testing 1 << (value - low) against one mask per case;
+// - otherwise the range on its own, tested with one compare.
+//
+// The clusters are then searched with a balanced binary tree of compares
+// that ends in short linear runs. Case values that are not constants fall
+// back to comparing them one by one in source order.
+typedef enum SwitchLowering {
+    SWITCH_AUTO,
+    SWITCH_LINEAR,
+} SwitchLowering;
+
+SwitchLowering switch_lowering = SWITCH_AUTO;
+
+#define SWITCH_TABLE_MIN_RANGES 4
+#define SWITCH_TABLE_MIN_DENSITY 40
+#define SWITCH_TABLE_MAX_SIZE 4096
+#define SWITCH_BITS_MIN_RANGES 3
+#define SWITCH_BITS_MAX_TARGETS 3
+#define SWITCH_MAX_LINEAR 3
+
+typedef struct CaseRange {
+    int64_t lo;
+    int64_t hi;
+    Block *target;
+    SrcPos pos;
+} CaseRange;
+
+typedef enum ClusterKind {
+    CLUSTER_RANGE,
+    CLUSTER_TABLE,
+    CLUSTER_BITS,
+} ClusterKind;
+
+typedef struct CaseCluster {
+    ClusterKind kind;
+    // Ranges [first, last] of the sorted list.
+    size_t first;
+    size_t last;
+} CaseCluster;
+
+typedef struct SwitchDispatch {
+    Instr *value;
+    CaseRange *ranges;
+    CaseCluster *clusters;
+    Block *default_block;
+} SwitchDispatch;
+
+int case_range_cmp(const void *a, const void *b) {
+    const CaseRange *x = a;
+    const CaseRange *y = b;
+    // Equal values stay in source order, so the later one is the duplicate.
+    if (x->lo != y->lo) {
+        return x->lo < y->lo ? -1 : 1;
+    }
+    return (x->pos > y->pos) - (x->pos < y->pos);
+}
+
+uint64_t range_span(CaseRange *first, CaseRange *last) {
+    return (uint64_t)last->hi - (uint64_t)first->lo;
+}
+
+// Sorts the case values and merges neighbors that go to the same case.
+CaseRange *merge_case_ranges(IrModule *module, CaseRange *values) {
+    qsort(values, buf_len(values), sizeof(CaseRange), case_range_cmp);
+    CaseRange *ranges = NULL;
+    for (CaseRange *it = values; it != buf_end(values); it++) {
+        CaseRange *last = buf_len(ranges) ? &ranges[buf_len(ranges) - 1] : NULL;
+        if (last && last->hi == it->lo) {
+            error_at(it->pos, "Duplicate case value %" PRId64, it->lo);
+            module->num_errors++;
+            continue;
+        }
+        if (last && last->target == it->target && last->hi != INT64_MAX && last->hi + 1 == it->lo) {
+            last->hi = it->lo;
+        } else {
+            buf_push(ranges, *it);
+        }
+    }
+    return ranges;
+}
+
+CaseCluster *cluster_case_ranges(CaseRange *ranges) {
+    CaseCluster *clusters = NULL;
+    size_t num_ranges = buf_len(ranges);
+    for (size_t i = 0; i < num_ranges;) {
+        CaseCluster cluster = {CLUSTER_RANGE, i, i};
+        uint64_t covered = 0;
+        for (size_t j = i; j < num_ranges; j++) {
+            uint64_t span = range_span(&ranges[i], &ranges[j]);
+            if (span >= SWITCH_TABLE_MAX_SIZE) {
+                break;
+            }
+            covered += range_span(&ranges[j], &ranges[j]) + 1;
+            if (j + 1 - i >= SWITCH_TABLE_MIN_RANGES && covered * 100 >= (span + 1) * SWITCH_TABLE_MIN_DENSITY) {
+                cluster = (CaseCluster){CLUSTER_TABLE, i, j};
+            }
+        }
+        if (cluster.kind == CLUSTER_RANGE) {
+            Block *targets[SWITCH_BITS_MAX_TARGETS];
+            size_t num_targets = 0;
+            for (size_t j = i; j < num_ranges && range_span(&ranges[i], &ranges[j]) < 64; j++) {
+                size_t k = 0;
+                while (k < num_targets && targets[k] != ranges[j].target) {
+                    k++;
+                }
+                if (k == num_targets) {
+                    if (num_targets == SWITCH_BITS_MAX_TARGETS) {
+                        break;
+                    }
+                    targets[num_targets++] = ranges[j].target;
+                }
+                if (j + 1 - i >= SWITCH_BITS_MIN_RANGES) {
+                    cluster = (CaseCluster){CLUSTER_BITS, i, j};
+                }
+            }
+        }
+        buf_push(clusters, cluster);
+        i = cluster.last + 1;
+    }
+    return clusters;
+}
+
+// Branches to next when the value lies outside [lo, lo + span], and leaves
+// lower->block at the in-range side. Returns value - lo.
+Instr *lower_range_check(Lower *lower, Instr *value, int64_t lo, uint64_t span, Block *next) {
+    Instr *offset = lower_binary(lower, OP_SUB, value, lower_const(lower, lo));
+    Block *in_range = ir_new_block(lower->module, lower->func);
+    lower_branch(lower, lower_binary(lower, OP_ULE, offset, lower_const(lower, (int64_t)span)), in_range, next);
+    seal_block(lower, in_range);
+    lower->block = in_range;
+    return offset;
+}
+
+// Dispatches on one cluster, going to next if the value is outside it.
+void lower_cluster(Lower *lower, SwitchDispatch *dispatch, CaseCluster *cluster, Block *next) {
+    CaseRange *first = &dispatch->ranges[cluster->first];
+    CaseRange *last = &dispatch->ranges[cluster->last];
+    uint64_t span = range_span(first, last);
+    Instr *value = dispatch->value;
+    switch (cluster->kind) {
+    case CLUSTER_RANGE:
+        if (span == 0) {
+            lower_branch(lower, lower_binary(lower, OP_EQ, value, lower_const(lower, first->lo)), first->target, next);
+        } else {
+            lower_range_check(lower, value, first->lo, span, next);
+            lower_jump(lower, first->target);
+        }
+        break;
+    case CLUSTER_TABLE: {
+        Instr *instr = lower_unary(lower, OP_SWITCH, value);
+        instr->imm = first->lo;
+        ir_add_edge(lower->block, next);
+        CaseRange *range = first;
+        for (uint64_t i = 0; i <= span; i++) {
+            int64_t v = (int64_t)((uint64_t)first->lo + i);
+            if (v > range->hi) {
+                range++;
+            }
+            ir_add_edge(lower->block, v >= range->lo ? range->target : dispatch->default_block);
+        }
+        break;
+    }
+    case CLUSTER_BITS: {
+        Instr *offset = lower_range_check(lower, value, first->lo, span, next);
+        Instr *bit = lower_binary(lower, OP_SHL, lower_const(lower, 1), offset);
+        for (CaseRange *range = first; range <= last; range++) {
+            bool seen = false;
+            for (CaseRange *prev = first; prev < range; prev++) {
+                seen |= prev->target == range->target;
+            }
+            if (seen) {
+                continue;
+            }
+            uint64_t mask = 0;
+            for (CaseRange *it = range; it <= last; it++) {
+                if (it->target == range->target) {
+                    for (uint64_t v = (uint64_t)it->lo - (uint64_t)first->lo; v <= (uint64_t)it->hi - (uint64_t)first->lo; v++) {
+                        mask |= (uint64_t)1 << v;
+                    }
+                }
+            }
+            Instr *hit = lower_binary(lower, OP_AND, bit, lower_const(lower, (int64_t)mask));
+            Block *miss = ir_new_block(lower->module, lower->func);
+            lower_branch(lower, lower_binary(lower, OP_NE, hit, lower_const(lower, 0)), range->target, miss);
+            seal_block(lower, miss);
+            lower->block = miss;
+        }
+        lower_jump(lower, dispatch->default_block);
+        break;
+    }
+    }
+}
+
+// Dispatches on clusters [first, last), split in half at each level of the tree.
+void lower_cluster_tree(Lower *lower, SwitchDispatch *dispatch, size_t first, size_t last) {
+    if (last - first <= SWITCH_MAX_LINEAR) {
+        for (size_t i = first; i < last; i++) {
+            Block *next = ir_new_block(lower->module, lower->func);
+            lower_cluster(lower, dispatch, &dispatch->clusters[i], next);
+            seal_block(lower, next);
+            lower->block = next;
+        }
+        lower_jump(lower, dispatch->default_block);
+        return;
+    }
+    size_t mid = first + (last - first) / 2;
+    int64_t pivot = dispatch->ranges[dispatch->clusters[mid].first].lo;
+    Block *left = ir_new_block(lower->module, lower->func);
+    Block *right = ir_new_block(lower->module, lower->func);
+    lower_branch(lower, lower_binary(lower, OP_LT, dispatch->value, lower_const(lower, pivot)), left, right);
+    seal_block(lower, left);
+    seal_block(lower, right);
+    lower->block = left;
+    lower_cluster_tree(lower, dispatch, first, mid);
+    lower->block = right;
+    lower_cluster_tree(lower, dispatch, mid, last);
+}
+
+// Cases do not fall through, and break leaves the switch.
+void lower_switch(Lower *lower, Stmt *stmt) {
+    SwitchStmt *switch_stmt = &stmt->switch_stmt;
+    Instr *value = lower_expr(lower, switch_stmt->expr);
+    Block *exit = ir_new_block(lower->module, lower->func);
+    Block *default_block = exit;
+    Block **bodies = NULL;
+    CaseRange *values = NULL;
+    bool all_const = true;
+    for (size_t i = 0; i < switch_stmt->num_cases; i++) {
+        SwitchCase *switch_case = &switch_stmt->cases[i];
+        Block *body = ir_new_block(lower->module, lower->func);
+        buf_push(bodies, body);
+        if (switch_case->is_default) {
+            default_block = body;
+        }
+        for (size_t j = 0; j < switch_case->num_exprs; j++) {
+            int64_t v;
+            if (eval_const_expr(lower, switch_case->exprs[j], &v, 0)) {
+                buf_push(values, ((CaseRange){v, v, body, switch_case->exprs[j]->pos}));
+            } else {
+                all_const = false;
+            }
+        }
+    }
+    // Merging finds duplicate constant values, whichever way the switch is lowered.
+    CaseRange *ranges = merge_case_ranges(lower->module, values);
+    if (all_const && switch_lowering == SWITCH_AUTO) {
+        SwitchDispatch dispatch = {value, ranges, NULL, default_block};
+        dispatch.clusters = cluster_case_ranges(dispatch.ranges);
+        for (CaseCluster *it = dispatch.clusters; it != buf_end(dispatch.clusters); it++) {
+            lower->module->switch_clusters[it->kind]++;
+        }
+        lower_cluster_tree(lower, &dispatch, 0, buf_len(dispatch.clusters));
+        buf_free(dispatch.ranges);
+        buf_free(dispatch.clusters);
+    } else {
+        // Compare against each value in source order.
+        for (size_t i = 0; i < switch_stmt->num_cases; i++) {
+            SwitchCase *switch_case = &switch_stmt->cases[i];
+            for (size_t j = 0; j < switch_case->num_exprs; j++) {
+                Block *next_test = ir_new_block(lower->module, lower->func);
+                Instr *cond = lower_binary(lower, OP_EQ, value, lower_expr(lower, switch_case->exprs[j]));
+                lower_branch(lower, cond, bodies[i], next_test);
+                seal_block(lower, next_test);
+                lower->block = next_test;
+            }
+        }
+        lower_jump(lower, default_block);
+        buf_free(ranges);
+    }
+    buf_free(values);
+    Block *outer_break = lower->break_target;
+    lower->break_target = exit;
+    for (size_t i = 0; i < switch_stmt->num_cases; i++) {
+        seal_block(lower, bodies[i]);
+        lower->block = bodies[i];
+        lower_stmt_block(lower, switch_stmt->cases[i].block);
+        lower_jump(lower, exit);
+    }
+    lower->break_target = outer_break;
+    buf_free(bodies);
+    seal_block(lower, exit);
+    lower->block = exit;
+}
+
+void lower_stmt(Lower *lower, Stmt *stmt) {
+    SrcPos outer_pos = lower->pos;
+    lower->pos = stmt->pos;
+    switch (stmt->kind) {
+    case STMT_RETURN:
+        if (stmt->expr) {
+            lower_unary(lower, OP_RET, lower_expr(lower, stmt->expr));
+        } else {
+            lower_instr(lower, OP_RET);
+        }
+        lower_unreachable(lower);
+        break;
+    case STMT_BREAK:
+    case STMT_CONTINUE: {
+        Block *target = stmt->kind == STMT_BREAK ? lower->break_target : lower->continue_target;
+        if (!target) {
+            fatal_at(stmt->pos, "'%s' outside of a loop", stmt->kind == STMT_BREAK ? "break" : "continue");
+        }
+        lower_jump(lower, target);
+        lower_unreachable(lower);
+        break;
+    }
+    case STMT_BLOCK:
+        lower_stmt_block(lower, stmt->block);
+        break;
+    case STMT_IF:
+        lower_if(lower, stmt);
+        break;
+    case STMT_WHILE:
+        lower_while(lower, stmt);
+        break;
+    case STMT_DO:
+        lower_do_while(lower, stmt);
+        break;
+    case STMT_FOR:
+        lower_for(lower, stmt);
+        break;
+    case STMT_SWITCH:
+        lower_switch(lower, stmt);
+        break;
+    case STMT_ASSIGN:
+        lower_assign(lower, stmt);
+        break;
+    case STMT_AUTO_ASSIGN:
+        declare_local(lower, stmt->autoassign.name, lower_expr(lower, stmt->autoassign.init));
+        break;
+    case STMT_EXPR:
+        lower_expr(lower, stmt->expr);
+        break;
+    default:
+        assert(0);
+        break;
+    }
+    lower->pos = outer_pos;
+}
+
+void lower_stmt_block(Lower *lower, StmtBlock block) {
+    size_t scope = buf_len(lower->locals);
+    for (size_t i = 0; i < block.num_stmts; i++) {
+        lower_stmt(lower, block.stmts[i]);
+    }
+    buf_truncate(lower->locals, scope);
+}
+
+void lower_func(Lower *lower, IrFunc *func) {
+    Decl *decl = func->decl;
+    StmtBlock body = func_body(decl);
+    lower->func = func;
+    lower->num_vars = 0;
+    lower->break_target = lower->continue_target = NULL;
+    map_free(&lower->memory_names);
+    walk_node(&lower->prescan, node_block(&body));
+    lower->pos = decl->pos;
+    lower->block = ir_new_block(lower->module, func);
+    lower->block->sealed = true;
+    for (size_t i = 0; i < decl->func.num_params; i++) {
+        Instr *param = lower_instr(lower, OP_PARAM);
+        param->imm = (int64_t)i;
+        declare_local(lower, decl->func.params[i].name, param);
+    }
+    lower_stmt_block(lower, body);
+    lower_instr(lower, OP_RET);
+    buf_truncate(lower->locals, 0);
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        assert((*it)->sealed);
+        buf_free((*it)->defs);
+    }
+    ir_cleanup(func);
+}
+
+// Lowers the functions of a file that reach_funcs finds. Constants are evaluated and global
+// variables with constant initializers recorded for the interpreter.
+IrModule *lower_module(Decl **decls, size_t num_decls) {
+    IrModule *module = xcalloc(1, sizeof(IrModule), ALLOC_IR);
+    module->arena.tag = ALLOC_IR;
+    Lower lower = {.module = module, .prescan = {.visit = prescan_visit}};
+    lower.prescan.data = &lower;
+    LowerConst *consts = xcalloc(num_decls ? num_decls : 1, sizeof(LowerConst), ALLOC_IR);
+    bool *reached = reach_funcs(decls, num_decls);
+    for (size_t i = 0; i < num_decls; i++) {
+        Decl *decl = decls[i];
+        if (decl->kind == DECL_CONST) {
+            consts[i].expr = decl->const_decl.expr;
+            map_put(&lower.consts, decl->name, &consts[i]);
+        } else if (decl->kind == DECL_FUNC && reached[i]) {
+            IrFunc *func = arena_alloc(&module->arena, sizeof(IrFunc));
+            *func = (IrFunc){.name = decl->name, .decl = decl, .num_params = decl->func.num_params};
+            buf_push(module->funcs, func);
+            map_put(&module->funcs_by_name, decl->name, func);
+        }
+    }
+    for (size_t i = 0; i < num_decls; i++) {
+        Decl *decl = decls[i];
+        if (decl->kind == DECL_ENUM) {
+            int64_t value = 0;
+            bool is_const = true;
+            for (size_t j = 0; j < decl->enum_decl.num_items; j++) {
+                EnumItem *item = &decl->enum_decl.items[j];
+                if (item->init) {
+                    is_const = eval_const_expr(&lower, item->init, &value, 0);
+                }
+                LowerConst *c = arena_alloc(&module->arena, sizeof(LowerConst));
+                *c = (LowerConst){.value = value, .evaluated = true, .is_const = is_const};
+                map_put(&lower.consts, item->name, c);
+                value++;
+            }
+        } else if (decl->kind == DECL_VAR) {
+            IrGlobal global = {decl->name, 0, 1};
+            eval_const_expr(&lower, decl->var.expr, &global.init, 0);
+            // Sizes that are not integer constants (sizeof, say) count as 1.
+            for (Typespec *type = decl->var.type; type && type->kind == TYPESPEC_ARRAY; type = type->array.elem) {
+                int64_t size;
+                if (type->array.size && eval_const_expr(&lower, type->array.size, &size, 0) && size > 0 &&
+                    size <= IR_MAX_GLOBAL_SIZE / global.size) {
+                    global.size *= size;
+                }
+            }
+            buf_push(module->globals, global);
+        }
+    }
+    for (IrFunc **it = module->funcs; it != buf_end(module->funcs); it++) {
+        lower_func(&lower, *it);
+    }
+    xfree(consts, (num_decls ? num_decls : 1) * sizeof(LowerConst), ALLOC_IR);
+    xfree(reached, (num_decls ? num_decls : 1) * sizeof(bool), ALLOC_MISC);
+    buf_free(lower.locals);
+    map_free(&lower.memory_names);
+    map_free(&lower.consts);
+    walk_free(&lower.prescan);
+    return module;
+}
@@ -10,14 +10,55 @@
 #include <limits.h>
 #include <math.h>
 #include <inttypes.h>
+#include <time.h>
+#include <setjmp.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
 
+#include "stats.h"
 #include "common.c"
 #include "lex.c"
 #include "ast.c"
+#include "parse.c"
+#include "session.c"
+#include "parallel.c"
+#include "pipeline.c"
+#include "check.c"
+#include "ir.c"
+#include "lower.c"
+#include "loop.c"
+#include "opt.c"
+#include "profile.c"
+#include "stats.c"
+
+#include "driver.c"
+#include "daemon.c"
 
 int main(int argc, char **argv) {
-    common_test();
-    lex_test();
-    ast_test();
-    return 0;
+    if (argc >= 3 && strcmp(argv[1], "--client") == 0) {
+        return daemon_client(argv[2], argc - 3, argv + 3);
+    }
+    bool serve = argc == 3 && strcmp(argv[1], "--daemon") == 0;
+    DriverMode mode = MODE_COMPILE;
+    const char **inputs = NULL;
+    if (!serve && !parse_options(argc - 1, argv + 1, &mode, &inputs)) {
+        usage();
+        return 1;
+    }
+    // Switched on before anything is allocated so that live and peak bytes are exact.
+    // The server always tracks them, since any request may ask for a report.
+    alloc_telemetry = options.alloc_stats || serve;
+    if (serve) {
+        return daemon_serve(argv[2]);
+    }
+    int status = run_driver(mode, inputs);
+    buf_free(inputs);
+    return status;
 }
@@ -0,0 +1,1518 @@
+// SSA optimizations
+//
+// Each pass works on one function and leaves it cleaned up: replaced
+// instructions are forwarded and then dropped by ir_cleanup, so instruction
+// ids are dense again when the next pass starts and can index side tables.
+Instr ***ir_users(IrFunc *func) {
+    Instr ***users = xcalloc(func->next_instr_id, sizeof(Instr **), ALLOC_IR);
+    for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+        for (Instr **instr = (*block)->instrs; instr != buf_end((*block)->instrs); instr++) {
+            for (Instr **arg = (*instr)->args; arg != buf_end((*instr)->args); arg++) {
+                buf_push(users[(*arg)->id], *instr);
+            }
+        }
+    }
+    return users;
+}
+
+void ir_free_users(IrFunc *func, Instr ***users) {
+    for (uint32_t i = 0; i < func->next_instr_id; i++) {
+        buf_free(users[i]);
+    }
+    xfree(users, func->next_instr_id * sizeof(Instr **), ALLOC_IR);
+}
+
+// Copy propagation: copies, and phis that merge a single value, are replaced
+// by that value.
+bool copy_prop(IrFunc *func) {
+    bool any = false;
+    for (bool changed = true; changed;) {
+        changed = false;
+        for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+            for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+                Instr *instr = *it;
+                if (instr->forward || (instr->op != OP_COPY && instr->op != OP_PHI)) {
+                    continue;
+                }
+                Instr *same = NULL;
+                bool trivial = true;
+                for (Instr **arg = instr->args; arg != buf_end(instr->args) && trivial; arg++) {
+                    Instr *value = ir_value(*arg);
+                    if (value != instr && value != same) {
+                        trivial = !same;
+                        same = value;
+                    }
+                }
+                if (trivial && same) {
+                    instr->forward = same;
+                    changed = any = true;
+                }
+            }
+        }
+    }
+    ir_cleanup(func);
+    return any;
+}
+
+// Sparse conditional constant propagation (Wegman and Zadeck). Values start
+// out unknown and only move down the lattice, to a constant and then to
+// overdefined; only blocks reached through executable edges are evaluated,
+// so constants flowing around a loop and branches on them are both found.
+typedef enum Lattice {
+    LATTICE_UNKNOWN,
+    LATTICE_CONST,
+    LATTICE_OVERDEFINED,
+} Lattice;
+
+typedef struct SccpValue {
+    Lattice lattice;
+    int64_t value;
+} SccpValue;
+
+typedef struct SccpEdge {
+    Block *from;
+    Block *to;
+} SccpEdge;
+
+typedef struct Sccp {
+    IrFunc *func;
+    SccpValue *values;
+    Instr ***users;
+    // Per block: whether it has been reached, and which incoming edges are executable.
+    bool *visited;
+    bool **executable;
+    bool *edges;
+    SccpEdge *flow_work;
+    Instr **ssa_work;
+} Sccp;
+
+SccpValue sccp_meet(SccpValue a, SccpValue b) {
+    if (a.lattice == LATTICE_UNKNOWN) {
+        return b;
+    } else if (b.lattice == LATTICE_UNKNOWN) {
+        return a;
+    } else if (a.lattice == LATTICE_CONST && b.lattice == LATTICE_CONST && a.value == b.value) {
+        return a;
+    }
+    return (SccpValue){LATTICE_OVERDEFINED, 0};
+}
+
+SccpValue sccp_eval(Sccp *sccp, Instr *instr) {
+    SccpValue *values = sccp->values;
+    Op op = instr->op;
+    if (op == OP_CONST) {
+        return (SccpValue){LATTICE_CONST, instr->imm};
+    } else if (op == OP_PHI) {
+        SccpValue result = {LATTICE_UNKNOWN, 0};
+        for (size_t i = 0; i < buf_len(instr->args); i++) {
+            if (sccp->executable[instr->block->id][i]) {
+                result = sccp_meet(result, values[instr->args[i]->id]);
+            }
+        }
+        return result;
+    } else if (op == OP_COPY) {
+        return values[instr->args[0]->id];
+    } else if (!(op_info[op].flags & OPF_FOLDABLE)) {
+        return (SccpValue){LATTICE_OVERDEFINED, 0};
+    }
+    int64_t args[2] = {0};
+    for (size_t i = 0; i < buf_len(instr->args); i++) {
+        SccpValue arg = values[instr->args[i]->id];
+        if (arg.lattice != LATTICE_CONST) {
+            return arg;
+        }
+        args[i] = arg.value;
+    }
+    SccpValue result = {LATTICE_CONST, 0};
+    if (!ir_eval(op, args[0], args[1], &result.value)) {
+        return (SccpValue){LATTICE_OVERDEFINED, 0};
+    }
+    return result;
+}
+
+void sccp_visit(Sccp *sccp, Instr *instr) {
+    Block *block = instr->block;
+    if (instr->op == OP_JUMP) {
+        buf_push(sccp->flow_work, ((SccpEdge){block, block->succs[0]}));
+    } else if (instr->op == OP_BRANCH || instr->op == OP_SWITCH) {
+        SccpValue cond = sccp->values[instr->args[0]->id];
+        if (cond.lattice == LATTICE_CONST) {
+            buf_push(sccp->flow_work, ((SccpEdge){block, block->succs[ir_successor(instr, cond.value)]}));
+        } else if (cond.lattice == LATTICE_OVERDEFINED) {
+            for (Block **succ = block->succs; succ != buf_end(block->succs); succ++) {
+                buf_push(sccp->flow_work, ((SccpEdge){block, *succ}));
+            }
+        }
+    } else if (!ir_is_terminator(instr)) {
+        SccpValue *value = &sccp->values[instr->id];
+        SccpValue result = sccp_eval(sccp, instr);
+        if (result.lattice != value->lattice) {
+            *value = result;
+            Instr **users = sccp->users[instr->id];
+            for (Instr **user = users; user != buf_end(users); user++) {
+                buf_push(sccp->ssa_work, *user);
+            }
+        }
+    }
+}
+
+bool sccp(IrFunc *func) {
+    size_t num_blocks = buf_len(func->blocks);
+    Sccp sccp = {
+        .func = func,
+        .values = xcalloc(func->next_instr_id, sizeof(SccpValue), ALLOC_IR),
+        .users = ir_users(func),
+        .visited = xcalloc(num_blocks, sizeof(bool), ALLOC_IR),
+        .executable = xcalloc(num_blocks, sizeof(bool *), ALLOC_IR),
+    };
+    size_t num_edges = 0;
+    for (size_t i = 0; i < num_blocks; i++) {
+        num_edges += buf_len(func->blocks[i]->preds);
+    }
+    sccp.edges = xcalloc(MAX(num_edges, 1), sizeof(bool), ALLOC_IR);
+    for (size_t i = 0, edge = 0; i < num_blocks; i++) {
+        sccp.executable[i] = sccp.edges + edge;
+        edge += buf_len(func->blocks[i]->preds);
+    }
+    Block *entry = func->blocks[0];
+    buf_push(sccp.flow_work, ((SccpEdge){NULL, entry}));
+    while (buf_len(sccp.flow_work) || buf_len(sccp.ssa_work)) {
+        if (buf_len(sccp.flow_work)) {
+            SccpEdge edge = buf_pop(sccp.flow_work);
+            Block *to = edge.to;
+            bool new_edge = false;
+            for (size_t i = 0; i < buf_len(to->preds); i++) {
+                if (to->preds[i] == edge.from && !sccp.executable[to->id][i]) {
+                    sccp.executable[to->id][i] = new_edge = true;
+                }
+            }
+            if (!new_edge && edge.from) {
+                continue;
+            }
+            bool first_visit = !sccp.visited[to->id];
+            sccp.visited[to->id] = true;
+            for (Instr **it = to->instrs; it != buf_end(to->instrs); it++) {
+                if (first_visit || (*it)->op == OP_PHI) {
+                    sccp_visit(&sccp, *it);
+                }
+            }
+        } else {
+            Instr *instr = buf_pop(sccp.ssa_work);
+            if (sccp.visited[instr->block->id]) {
+                sccp_visit(&sccp, instr);
+            }
+        }
+    }
+    // Rewrite constants in place, so that their users need no update, and fold decided branches.
+    bool changed = false;
+    for (size_t i = 0; i < num_blocks; i++) {
+        Block *block = func->blocks[i];
+        if (!sccp.visited[i]) {
+            continue;
+        }
+        for (Instr **it = block->instrs; it != buf_end(block->instrs); it++) {
+            Instr *instr = *it;
+            SccpValue value = sccp.values[instr->id];
+            if (instr->op == OP_BRANCH || instr->op == OP_SWITCH) {
+                SccpValue cond = sccp.values[instr->args[0]->id];
+                if (cond.lattice == LATTICE_CONST) {
+                    ir_fold_terminator(block, ir_successor(instr, cond.value));
+                    changed = true;
+                }
+            } else if (value.lattice == LATTICE_CONST && instr->op != OP_CONST) {
+                instr->op = OP_CONST;
+                instr->imm = value.value;
+                buf_free(instr->args);
+                changed = true;
+            }
+        }
+    }
+    xfree(sccp.edges, MAX(num_edges, 1) * sizeof(bool), ALLOC_IR);
+    xfree(sccp.values, func->next_instr_id * sizeof(SccpValue), ALLOC_IR);
+    xfree(sccp.visited, num_blocks * sizeof(bool), ALLOC_IR);
+    xfree(sccp.executable, num_blocks * sizeof(bool *), ALLOC_IR);
+    ir_free_users(func, sccp.users);
+    buf_free(sccp.flow_work);
+    buf_free(sccp.ssa_work);
+    ir_cleanup(func);
+    return changed;
+}
+
+// Global value numbering. Blocks are visited in dominator tree preorder with
+// one table of pure instructions; an instruction equal to an entry whose
+// block dominates it is replaced by that entry. An entry from a block that
+// does not dominate the current one is stale and simply overwritten.
+// Algebraic identities are applied on the way.
+typedef struct GvnTable {
+    Instr **slots;
+    size_t cap;
+    size_t len;
+} GvnTable;
+
+uint64_t gvn_hash(Instr *instr) {
+    uint64_t hash = hash_uint64((uint64_t)instr->op + 1) ^ hash_uint64((uint64_t)instr->imm);
+    for (Instr **arg = instr->args; arg != buf_end(instr->args); arg++) {
+        hash = hash_uint64(hash ^ ((uint64_t)(*arg)->id + 1));
+    }
+    return hash;
+}
+
+bool gvn_equal(Instr *a, Instr *b) {
+    if (a->op != b->op || a->imm != b->imm || buf_len(a->args) != buf_len(b->args)) {
+        return false;
+    }
+    for (size_t i = 0; i < buf_len(a->args); i++) {
+        if (a->args[i] != b->args[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+Instr **gvn_slot(GvnTable *table, Instr *instr) {
+    for (size_t i = gvn_hash(instr) & (table->cap - 1);; i = (i + 1) & (table->cap - 1)) {
+        if (!table->slots[i] || gvn_equal(table->slots[i], instr)) {
+            return &table->slots[i];
+        }
+    }
+}
+
+// Operations with a constant operand that yield one of their operands:
+// x + 0, x * 1, x * 0 and the like. Strength reduction leaves many behind.
+Instr *gvn_identity(Instr *instr) {
+    if (buf_len(instr->args) != 2) {
+        return NULL;
+    }
+    Instr *a = instr->args[0];
+    Instr *b = instr->args[1];
+    if ((op_info[instr->op].flags & OPF_COMMUTATIVE) && a->op == OP_CONST) {
+        Instr *tmp = a;
+        a = b;
+        b = tmp;
+    }
+    if (b->op != OP_CONST) {
+        return NULL;
+    }
+    switch (instr->op) {
+    case OP_ADD:
+    case OP_SUB:
+    case OP_OR:
+    case OP_XOR:
+    case OP_SHL:
+    case OP_SHR:
+    case OP_INDEX:
+        return b->imm == 0 ? a : NULL;
+    case OP_MUL:
+        return b->imm == 1 ? a : b->imm == 0 ? b : NULL;
+    case OP_DIV:
+        return b->imm == 1 ? a : NULL;
+    case OP_AND:
+        return b->imm == -1 ? a : b->imm == 0 ? b : NULL;
+    default:
+        return NULL;
+    }
+}
+
+bool gvn(IrFunc *func) {
+    size_t num_instrs = ir_num_instrs(func);
+    GvnTable table = {.cap = 16};
+    while (table.cap < 2 * num_instrs) {
+        table.cap *= 2;
+    }
+    table.slots = xcalloc(table.cap, sizeof(Instr *), ALLOC_IR);
+    bool changed = false;
+    BlockFrame *stack = NULL;
+    buf_push(stack, ((BlockFrame){func->blocks[0], 0}));
+    while (buf_len(stack)) {
+        BlockFrame *frame = &stack[buf_len(stack) - 1];
+        Block *block = frame->block;
+        if (frame->next == 0) {
+            for (Instr **it = block->instrs; it != buf_end(block->instrs); it++) {
+                Instr *instr = *it;
+                if (!(op_info[instr->op].flags & OPF_PURE)) {
+                    continue;
+                }
+                for (Instr **arg = instr->args; arg != buf_end(instr->args); arg++) {
+                    *arg = ir_value(*arg);
+                }
+                Instr *same = gvn_identity(instr);
+                if (same) {
+                    instr->forward = same;
+                    changed = true;
+                    continue;
+                }
+                if ((op_info[instr->op].flags & OPF_COMMUTATIVE) && instr->args[0]->id > instr->args[1]->id) {
+                    Instr *tmp = instr->args[0];
+                    instr->args[0] = instr->args[1];
+                    instr->args[1] = tmp;
+                }
+                Instr **slot = gvn_slot(&table, instr);
+                if (*slot && ir_dominates((*slot)->block, block)) {
+                    instr->forward = *slot;
+                    changed = true;
+                } else {
+                    table.len += !*slot;
+                    *slot = instr;
+                }
+            }
+        }
+        if (frame->next < buf_len(block->dom_children)) {
+            Block *child = block->dom_children[frame->next++];
+            buf_push(stack, ((BlockFrame){child, 0}));
+        } else {
+            buf__hdr(stack)->len--;
+        }
+    }
+    buf_free(stack);
+    xfree(table.slots, table.cap * sizeof(Instr *), ALLOC_IR);
+    ir_cleanup(func);
+    return changed;
+}
+
+// Dead code elimination: everything not needed by an effect or a terminator goes.
+bool dce(IrFunc *func) {
+    bool *live = xcalloc(func->next_instr_id, sizeof(bool), ALLOC_IR);
+    Instr **work = NULL;
+    for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+        for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+            if (!(op_info[(*it)->op].flags & OPF_REMOVABLE)) {
+                live[(*it)->id] = true;
+                buf_push(work, *it);
+            }
+        }
+    }
+    while (buf_len(work)) {
+        Instr *instr = buf_pop(work);
+        for (Instr **arg = instr->args; arg != buf_end(instr->args); arg++) {
+            if (!live[(*arg)->id]) {
+                live[(*arg)->id] = true;
+                buf_push(work, *arg);
+            }
+        }
+    }
+    buf_free(work);
+    bool changed = false;
+    for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+        for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+            if (!live[(*it)->id]) {
+                (*it)->op = OP_NONE;
+                changed = true;
+            }
+        }
+    }
+    xfree(live, func->next_instr_id * sizeof(bool), ALLOC_IR);
+    ir_cleanup(func);
+    return changed;
+}
+
+// Merges a block into its only predecessor when that ends in a jump to it.
+// Folded branches leave many such chains behind.
+bool merge_blocks(IrFunc *func) {
+    bool changed = false;
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        Block *block = *it;
+        if (buf_len(block->preds) != 1 || block == func->blocks[0]) {
+            continue;
+        }
+        Block *pred = block->preds[0];
+        Instr *jump = ir_terminator(pred);
+        if (pred == block || jump->op != OP_JUMP) {
+            continue;
+        }
+        jump->op = OP_NONE;
+        buf__hdr(pred->instrs)->len--;
+        for (Instr **instr = block->instrs; instr != buf_end(block->instrs); instr++) {
+            if ((*instr)->op == OP_PHI) {
+                (*instr)->forward = (*instr)->args[0];
+                buf_free((*instr)->args);
+            } else {
+                (*instr)->block = pred;
+                buf_push(pred->instrs, *instr);
+            }
+        }
+        buf__hdr(block->instrs)->len = 0;
+        buf_free(pred->succs);
+        for (Block **succ = block->succs; succ != buf_end(block->succs); succ++) {
+            buf_push(pred->succs, *succ);
+            for (Block **p = (*succ)->preds; p != buf_end((*succ)->preds); p++) {
+                if (*p == block) {
+                    *p = pred;
+                }
+            }
+        }
+        buf_free(block->succs);
+        buf__hdr(block->preds)->len = 0;
+        changed = true;
+    }
+    if (changed) {
+        ir_cleanup(func);
+    }
+    return changed;
+}
+
+// Interprocedural optimization
+//
+// The call graph links functions through direct calls by name. Tarjan's
+// algorithm emits its strongly connected components callees first, so a
+// function is inlined into its callers only after it has been optimized, in
+// its smallest form. Calls within a component are never inlined, which keeps
+// recursion from unrolling; tail calls take care of the recursive ones.
+#define INLINE_THRESHOLD 40
+// Callers stop growing once they reach this many instructions.
+#define INLINE_MAX_CALLER_SIZE 4000
+
+// Largest inline cost a callee may have; 0 turns inlining off.
+int inline_threshold = INLINE_THRESHOLD;
+bool tail_call_elim = true;
+
+typedef struct CallGraph {
+    // Functions are numbered as in module->funcs.
+    size_t **callees;
+    uint32_t *component;
+    // Components in bottom-up order, each a list of function numbers.
+    size_t **components;
+    // Function number plus one, by IrFunc pointer.
+    Map numbers;
+} CallGraph;
+
+typedef struct TarjanFrame {
+    size_t func;
+    size_t next;
+} TarjanFrame;
+
+IrFunc *ir_callee(IrModule *module, Instr *call) {
+    IrFunc *callee = call->name ? map_get(&module->funcs_by_name, call->name) : NULL;
+    return callee && callee->num_params == buf_len(call->args) ? callee : NULL;
+}
+
+size_t call_graph_number(CallGraph *graph, IrFunc *func) {
+    return map_get_uint64(&graph->numbers, (uint64_t)(uintptr_t)func) - 1;
+}
+
+void call_graph_build(CallGraph *graph, IrModule *module) {
+    size_t num_funcs = buf_len(module->funcs);
+    *graph = (CallGraph){
+        .callees = xcalloc(MAX(num_funcs, 1), sizeof(size_t *), ALLOC_IR),
+        .component = xcalloc(MAX(num_funcs, 1), sizeof(uint32_t), ALLOC_IR),
+    };
+    for (size_t i = 0; i < num_funcs; i++) {
+        map_put_uint64(&graph->numbers, (uint64_t)(uintptr_t)module->funcs[i], i + 1);
+    }
+    for (size_t i = 0; i < num_funcs; i++) {
+        IrFunc *func = module->funcs[i];
+        for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+            for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+                IrFunc *callee = (*it)->op == OP_CALL || (*it)->op == OP_TAILCALL ? ir_callee(module, *it) : NULL;
+                if (callee) {
+                    buf_push(graph->callees[i], call_graph_number(graph, callee));
+                }
+            }
+        }
+    }
+    // Iterative Tarjan. index 0 means unvisited.
+    uint32_t *index = xcalloc(MAX(num_funcs, 1), sizeof(uint32_t), ALLOC_IR);
+    uint32_t *low = xcalloc(MAX(num_funcs, 1), sizeof(uint32_t), ALLOC_IR);
+    bool *on_stack = xcalloc(MAX(num_funcs, 1), sizeof(bool), ALLOC_IR);
+    size_t *stack = NULL;
+    TarjanFrame *frames = NULL;
+    uint32_t next_index = 1;
+    for (size_t root = 0; root < num_funcs; root++) {
+        if (index[root]) {
+            continue;
+        }
+        index[root] = low[root] = next_index++;
+        on_stack[root] = true;
+        buf_push(stack, root);
+        buf_push(frames, (TarjanFrame){root, 0});
+        while (buf_len(frames)) {
+            TarjanFrame *frame = &frames[buf_len(frames) - 1];
+            size_t v = frame->func;
+            if (frame->next < buf_len(graph->callees[v])) {
+                size_t w = graph->callees[v][frame->next++];
+                if (!index[w]) {
+                    index[w] = low[w] = next_index++;
+                    on_stack[w] = true;
+                    buf_push(stack, w);
+                    buf_push(frames, (TarjanFrame){w, 0});
+                } else if (on_stack[w]) {
+                    low[v] = MIN(low[v], index[w]);
+                }
+                continue;
+            }
+            buf__hdr(frames)->len--;
+            if (buf_len(frames)) {
+                size_t parent = frames[buf_len(frames) - 1].func;
+                low[parent] = MIN(low[parent], low[v]);
+            }
+            if (low[v] == index[v]) {
+                size_t *component = NULL;
+                size_t w;
+                do {
+                    w = buf_pop(stack);
+                    on_stack[w] = false;
+                    graph->component[w] = (uint32_t)buf_len(graph->components);
+                    buf_push(component, w);
+                } while (w != v);
+                buf_push(graph->components, component);
+            }
+        }
+    }
+    buf_free(stack);
+    buf_free(frames);
+    xfree(index, MAX(num_funcs, 1) * sizeof(uint32_t), ALLOC_IR);
+    xfree(low, MAX(num_funcs, 1) * sizeof(uint32_t), ALLOC_IR);
+    xfree(on_stack, MAX(num_funcs, 1) * sizeof(bool), ALLOC_IR);
+}
+
+void call_graph_free(CallGraph *graph, size_t num_funcs) {
+    for (size_t i = 0; i < num_funcs; i++) {
+        buf_free(graph->callees[i]);
+    }
+    for (size_t i = 0; i < buf_len(graph->components); i++) {
+        buf_free(graph->components[i]);
+    }
+    buf_free(graph->components);
+    map_free(&graph->numbers);
+    xfree(graph->callees, MAX(num_funcs, 1) * sizeof(size_t *), ALLOC_IR);
+    xfree(graph->component, MAX(num_funcs, 1) * sizeof(uint32_t), ALLOC_IR);
+}
+
+// Estimated growth of inlining callee at a call: its instructions, less the
+// call sequence that goes away and the uses of parameters that get constants,
+// which later fold. Parameters, constants and jumps cost nothing.
+int inline_cost(IrFunc *callee, Instr *call) {
+    int cost = -1 - (int)buf_len(call->args);
+    for (Block **block = callee->blocks; block != buf_end(callee->blocks); block++) {
+        for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+            Instr *instr = *it;
+            if (instr->op != OP_PARAM && instr->op != OP_CONST && instr->op != OP_JUMP) {
+                cost++;
+            }
+            for (Instr **arg = instr->args; arg != buf_end(instr->args); arg++) {
+                if ((*arg)->op == OP_PARAM && call->args[(*arg)->imm]->op == OP_CONST) {
+                    cost--;
+                }
+            }
+        }
+    }
+    return cost;
+}
+
+// Replaces a call with a copy of the callee's body. The caller's block is
+// split after the call; returns jump to the second half, where a phi merges
+// the returned values. A tail call in the callee becomes a call and a return.
+void inline_call(IrModule *module, IrFunc *caller, Instr *call, IrFunc *callee) {
+    Block *block = call->block;
+    size_t pos = 0;
+    while (block->instrs[pos] != call) {
+        pos++;
+    }
+    Block *cont = ir_new_block(module, caller);
+    for (size_t i = pos + 1; i < buf_len(block->instrs); i++) {
+        block->instrs[i]->block = cont;
+        buf_push(cont->instrs, block->instrs[i]);
+    }
+    buf_truncate(block->instrs, pos);
+    cont->succs = block->succs;
+    block->succs = NULL;
+    for (Block **succ = cont->succs; succ != buf_end(cont->succs); succ++) {
+        for (Block **pred = (*succ)->preds; pred != buf_end((*succ)->preds); pred++) {
+            if (*pred == block) {
+                *pred = cont;
+            }
+        }
+    }
+
+    // The callee has been cleaned up, so its block and instruction ids are dense.
+    size_t num_blocks = buf_len(callee->blocks);
+    Block **blocks = xcalloc(num_blocks, sizeof(Block *), ALLOC_IR);
+    Instr **values = xcalloc(callee->next_instr_id, sizeof(Instr *), ALLOC_IR);
+    for (size_t i = 0; i < num_blocks; i++) {
+        blocks[i] = ir_new_block(module, caller);
+    }
+    Instr **results = NULL;
+    for (size_t i = 0; i < num_blocks; i++) {
+        Block *from = callee->blocks[i];
+        Block *to = blocks[i];
+        for (Block **pred = from->preds; pred != buf_end(from->preds); pred++) {
+            buf_push(to->preds, blocks[(*pred)->id]);
+        }
+        for (Block **succ = from->succs; succ != buf_end(from->succs); succ++) {
+            buf_push(to->succs, blocks[(*succ)->id]);
+        }
+        for (Instr **it = from->instrs; it != buf_end(from->instrs); it++) {
+            Instr *instr = *it;
+            if (instr->op == OP_PARAM) {
+                values[instr->id] = call->args[instr->imm];
+                continue;
+            }
+            Instr *copy = ir_new_instr(module, caller, instr->op == OP_RET ? OP_JUMP : OP_CALL);
+            if (instr->op != OP_RET) {
+                uint32_t id = copy->id;
+                *copy = *instr;
+                copy->id = id;
+                copy->args = NULL;
+            }
+            values[instr->id] = copy;
+            copy->block = to;
+            buf_push(to->instrs, copy);
+            if (instr->op == OP_RET || instr->op == OP_TAILCALL) {
+                buf_push(results, instr->op == OP_RET ? (buf_len(instr->args) ? instr->args[0] : NULL) : instr);
+                if (instr->op == OP_TAILCALL) {
+                    copy->op = OP_CALL;
+                    ir_append(to, ir_new_instr(module, caller, OP_JUMP));
+                }
+                ir_add_edge(to, cont);
+            }
+        }
+    }
+    for (size_t i = 0; i < num_blocks; i++) {
+        Block *from = callee->blocks[i];
+        for (Instr **it = from->instrs; it != buf_end(from->instrs); it++) {
+            if ((*it)->op != OP_PARAM && (*it)->op != OP_RET) {
+                for (Instr **arg = (*it)->args; arg != buf_end((*it)->args); arg++) {
+                    buf_push(values[(*it)->id]->args, values[(*arg)->id]);
+                }
+            }
+        }
+    }
+    Instr *undef = NULL;
+    for (size_t i = 0; i < buf_len(results); i++) {
+        if (!results[i]) {
+            if (!undef) {
+                undef = ir_new_instr(module, caller, OP_UNDEF);
+                ir_append(block, undef);
+            }
+            results[i] = undef;
+        } else {
+            results[i] = values[results[i]->id];
+        }
+    }
+    if (buf_len(results) == 1) {
+        call->forward = results[0];
+    } else if (buf_len(results) > 1) {
+        Instr *phi = ir_new_instr(module, caller, OP_PHI);
+        buf_pushn(phi->args, results, buf_len(results));
+        ir_insert_phi(cont, phi);
+        call->forward = phi;
+    } else {
+        // The callee never returns, so neither does the rest of the block.
+        call->forward = undef = ir_new_instr(module, caller, OP_UNDEF);
+        ir_append(block, undef);
+    }
+    ir_append(block, ir_new_instr(module, caller, OP_JUMP));
+    ir_add_edge(block, blocks[0]);
+    buf_free(call->args);
+    buf_free(results);
+    xfree(blocks, num_blocks * sizeof(Block *), ALLOC_IR);
+    xfree(values, callee->next_instr_id * sizeof(Instr *), ALLOC_IR);
+}
+
+// Inlines the calls in func to functions of lower components that the cost
+// model accepts. Calls that come in with inlined bodies are left alone.
+bool inline_calls(IrModule *module, CallGraph *graph, size_t func_index) {
+    IrFunc *func = module->funcs[func_index];
+    Instr **calls = NULL;
+    for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+        for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+            if ((*it)->op == OP_CALL && ir_callee(module, *it)) {
+                buf_push(calls, *it);
+            }
+        }
+    }
+    size_t size = ir_num_instrs(func);
+    bool changed = false;
+    for (Instr **it = calls; it != buf_end(calls) && size < INLINE_MAX_CALLER_SIZE; it++) {
+        IrFunc *callee = ir_callee(module, *it);
+        size_t callee_index = call_graph_number(graph, callee);
+        if (graph->component[callee_index] == graph->component[func_index] ||
+            inline_cost(callee, *it) > inline_threshold) {
+            continue;
+        }
+        size += ir_num_instrs(callee);
+        inline_call(module, func, *it, callee);
+        changed = true;
+    }
+    buf_free(calls);
+    if (changed) {
+        ir_cleanup(func);
+    }
+    return changed;
+}
+
+// Tail calls: a call whose result is returned right away needs no frame of
+// its own. Self tail calls become a loop back to a header after the entry
+// block, with a phi per parameter; other direct tail calls become
+// OP_TAILCALL, which replaces the caller's frame. Either way recursion
+// through tail calls runs in constant stack.
+// The call that ends a block when the block returns its result, or reaches a
+// bare return of a function without a result.
+Instr *tail_call(IrModule *module, IrFunc *func, Block *block) {
+    size_t len = buf_len(block->instrs);
+    if (len < 2 || block->instrs[len - 2]->op != OP_CALL || !ir_callee(module, block->instrs[len - 2])) {
+        return NULL;
+    }
+    Instr *call = block->instrs[len - 2];
+    Instr *term = block->instrs[len - 1];
+    if (term->op == OP_JUMP && !func->decl->func.ret_type) {
+        Block *succ = block->succs[0];
+        term = buf_len(succ->instrs) == 1 ? succ->instrs[0] : term;
+    }
+    if (term->op != OP_RET || (buf_len(term->args) ? term->args[0] != call : func->decl->func.ret_type != NULL)) {
+        return NULL;
+    }
+    return call;
+}
+
+// Deletes the return or jump after a tail call.
+void drop_return(Block *block) {
+    Instr *term = buf_pop(block->instrs);
+    if (term->op == OP_JUMP) {
+        ir_remove_pred(block->succs[0], block);
+        buf_truncate(block->succs, 0);
+    }
+    term->op = OP_NONE;
+    buf_free(term->args);
+}
+
+bool eliminate_tail_calls(IrModule *module, IrFunc *func) {
+    // The callee could be handed the address of a local, which must outlive the call.
+    for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+        for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+            if ((*it)->op == OP_LOCAL) {
+                return false;
+            }
+        }
+    }
+    Instr **self_calls = NULL;
+    bool changed = false;
+    for (Block **it = func->blocks; it != buf_end(func->blocks); it++) {
+        Block *block = *it;
+        Instr *call = tail_call(module, func, block);
+        if (call && call->name == func->name) {
+            buf_push(self_calls, call);
+        } else if (call) {
+            drop_return(block);
+            call->op = OP_TAILCALL;
+            changed = true;
+        }
+    }
+    if (buf_len(self_calls)) {
+        // Everything but the parameters moves from the entry to a new loop header.
+        Block *entry = func->blocks[0];
+        Block *header = ir_new_block(module, func);
+        Instr **params = NULL;
+        Instr **phis = NULL;
+        for (Instr **it = entry->instrs; it != buf_end(entry->instrs); it++) {
+            if ((*it)->op == OP_PARAM) {
+                buf_push(params, *it);
+            } else {
+                (*it)->block = header;
+                buf_push(header->instrs, *it);
+            }
+        }
+        buf_free(entry->instrs);
+        buf_pushn(entry->instrs, params, buf_len(params));
+        header->succs = entry->succs;
+        entry->succs = NULL;
+        for (Block **succ = header->succs; succ != buf_end(header->succs); succ++) {
+            for (Block **pred = (*succ)->preds; pred != buf_end((*succ)->preds); pred++) {
+                if (*pred == entry) {
+                    *pred = header;
+                }
+            }
+        }
+        ir_append(entry, ir_new_instr(module, func, OP_JUMP));
+        ir_add_edge(entry, header);
+        // Uses of a parameter now see its value in the current iteration.
+        for (Instr **param = params; param != buf_end(params); param++) {
+            Instr *phi = ir_new_instr(module, func, OP_PHI);
+            buf_push(phis, phi);
+            for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+                for (Instr **it = (*block)->instrs; it != buf_end((*block)->instrs); it++) {
+                    for (Instr **arg = (*it)->args; arg != buf_end((*it)->args); arg++) {
+                        if (*arg == *param) {
+                            *arg = phi;
+                        }
+                    }
+                }
+            }
+            buf_push(phi->args, *param);
+            ir_insert_phi(header, phi);
+        }
+        for (Instr **it = self_calls; it != buf_end(self_calls); it++) {
+            Instr *call = *it;
+            Block *block = call->block;
+            drop_return(block);
+            (void)buf_pop(block->instrs);
+            for (size_t i = 0; i < buf_len(params); i++) {
+                buf_push(phis[i]->args, call->args[params[i]->imm]);
+            }
+            call->op = OP_NONE;
+            buf_free(call->args);
+            ir_append(block, ir_new_instr(module, func, OP_JUMP));
+            ir_add_edge(block, header);
+        }
+        buf_free(params);
+        buf_free(phis);
+        changed = true;
+    }
+    buf_free(self_calls);
+    if (changed) {
+        ir_cleanup(func);
+    }
+    return changed;
+}
+
+typedef enum OptLevel {
+    OPT_NONE,
+    OPT_FULL,
+} OptLevel;
+
+void simplify_func(IrFunc *func) {
+    for (int round = 0; round < 4; round++) {
+        bool changed = copy_prop(func);
+        changed |= sccp(func);
+        changed |= copy_prop(func);
+        changed |= gvn(func);
+        changed |= dce(func);
+        changed |= merge_blocks(func);
+        if (!changed) {
+            break;
+        }
+    }
+}
+
+void optimize_func(IrModule *module, IrFunc *func) {
+    simplify_func(func);
+    if (loop_opts && optimize_loops(module, func)) {
+        simplify_func(func);
+    }
+}
+
+// Optimizes functions bottom-up through the call graph: each is simplified,
+// takes in its callees, is simplified again and then has its tail calls
+// eliminated.
+void optimize_module(IrModule *module, OptLevel level) {
+    if (level >= OPT_FULL) {
+        CallGraph graph;
+        call_graph_build(&graph, module);
+        for (size_t **component = graph.components; component != buf_end(graph.components); component++) {
+            for (size_t *it = *component; it != buf_end(*component); it++) {
+                IrFunc *func = module->funcs[*it];
+                optimize_func(module, func);
+                if (inline_threshold > 0 && inline_calls(module, &graph, *it)) {
+                    optimize_func(module, func);
+                }
+                if (tail_call_elim && eliminate_tail_calls(module, func)) {
+                    optimize_func(module, func);
+                }
+            }
+        }
+        call_graph_free(&graph, buf_len(module->funcs));
+    }
+    for (IrFunc **it = module->funcs; it != buf_end(module->funcs); it++) {
+        if (!ir_verify(*it)) {
+            fatal("IR verification failed for '%s'", (*it)->name);
+        }
+    }
+}
+
+// Generates a program with the redundancy that lowering straight from the
+// AST leaves behind: repeated subexpressions, constants folded only at run
+// time, branches on constants and values computed but never used.
+char *opt_bench_source(int num_kernels, int trip_count) {
+    char *src = NULL;
+    char line[2048];
+#define EMIT(...) (snprintf(line, sizeof(line), __VA_ARGS__), buf_pushn(src, line, strlen(line)))
+    EMIT("const SCALE = 4;\nenum Mode { MODE_SLOW, MODE_FAST, MODE_CHECKED }\nvar total = 0;\n");
+    EMIT("func mix(x: int, y: int): int {\n"
+         "    a := x * SCALE + y;\n"
+         "    b := x * SCALE + y;\n"
+         "    t := (a + b) / 2;\n"
+         "    if (SCALE > 2) { t = t + 1; } else if (SCALE > 1) { t = t - 1; } else { t = 0; }\n"
+         "    unused := a * b * 3;\n"
+         "    return t ^ (a - b);\n"
+         "}\n");
+    for (int k = 0; k < num_kernels; k++) {
+        EMIT("func kernel%d(n: int): int {\n"
+             "    sum := 0;\n"
+             "    mode := MODE_FAST;\n"
+             "    step := %d;\n"
+             "    for (i := 0; i < n; i++) {\n"
+             "        j := step * 2 + 1;\n"
+             "        sum = sum + mix(i, j) + (i * j) %% 7 + (i * j) %% 7;\n"
+             "        if (mode == MODE_CHECKED && sum < 0) { sum = 0; }\n"
+             "        switch (mode) {\n"
+             "        case MODE_SLOW: sum = sum - j;\n"
+             "        case MODE_FAST: sum = sum + step;\n"
+             "        default: sum = sum * 2;\n"
+             "        }\n"
+             "        dead := sum * step + j;\n"
+             "        k := 0;\n"
+             "        while (k < step) { k++; if (k == step * 100) { break; } }\n"
+             "        sum = sum + k;\n"
+             "    }\n"
+             "    return sum;\n"
+             "}\n", k, k % 5 + 1);
+    }
+    EMIT("func main(): int {\n    sum := 0;\n");
+    for (int k = 0; k < num_kernels; k++) {
+        EMIT("    sum = sum + kernel%d(%d);\n", k, trip_count);
+    }
+    EMIT("    total = sum;\n    return sum;\n}\n");
+#undef EMIT
+    buf_push(src, 0);
+    return src;
+}
+
+// Runs the generated program in the IR interpreter with and without the
+// optimizer. With no code generator yet, executed IR instructions and
+// interpreter time stand in for the speed of generated code.
+typedef struct IrBench {
+    int64_t result;
+    uint64_t instrs;
+    double seconds;
+    size_t static_instrs;
+    int max_depth;
+} IrBench;
+
+// Lowers, optimizes and runs main, printing one line of results under label.
+IrBench ir_bench_run(Decl **decls, size_t num_decls, OptLevel level, const char *label) {
+    IrModule *module = lower_module(decls, num_decls);
+    optimize_module(module, level);
+    IrBench bench = {0};
+    for (IrFunc **it = module->funcs; it != buf_end(module->funcs); it++) {
+        bench.static_instrs += ir_num_instrs(*it);
+    }
+    IrRun run;
+    bench.result = ir_run(module, "main", &run);
+    bench.instrs = run.instrs;
+    bench.seconds = run.seconds;
+    bench.max_depth = run.max_depth;
+    printf("%s: %zu instructions in the IR, %" PRIu64 " executed, %.1f ms, result %" PRId64 "\n",
+           label, bench.static_instrs, bench.instrs, bench.seconds * 1e3, bench.result);
+    ir_free(module);
+    xfree(module, sizeof(IrModule), ALLOC_IR);
+    return bench;
+}
+
+void ir_bench_compare(IrBench before, IrBench after) {
+    if (before.result != after.result) {
+        printf("MISMATCH: the programs compute different results\n");
+    }
+    printf("speed-up: %.2fx fewer instructions executed, %.2fx faster\n",
+           (double)before.instrs / after.instrs, before.seconds / after.seconds);
+}
+
+void opt_bench(void) {
+    char *src = opt_bench_source(32, 2000);
+    init_stream("bench", src);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    IrBench before = ir_bench_run(decls, num_decls, OPT_NONE, "-O0");
+    IrBench after = ir_bench_run(decls, num_decls, OPT_FULL, "-O1");
+    ir_bench_compare(before, after);
+    buf_free(src);
+}
+
+// Dispatch-heavy programs: a bytecode interpreter with dense opcodes, a
+// state machine with sparse state numbers and a character classifier.
+const char *switch_bench_source =
+    "func vm(steps: int): int {\n"
+    "    acc := 1;\n"
+    "    pc := 0;\n"
+    "    for (i := 0; i < steps; i++) {\n"
+    "        op := (pc * 7 + (acc & 15)) % 40;\n"
+    "        switch (op) {\n"
+    "        case 0: acc = acc + 1;\n"
+    "        case 1: acc = acc - 1;\n"
+    "        case 2: acc = acc * 3;\n"
+    "        case 3: acc = acc / 2;\n"
+    "        case 4, 5: acc = acc ^ pc;\n"
+    "        case 6: acc = acc + pc;\n"
+    "        case 7: acc = acc - pc;\n"
+    "        case 8: pc = pc + 2;\n"
+    "        case 9: pc = pc + 3;\n"
+    "        case 10, 11, 12: acc = acc | 1;\n"
+    "        case 13: acc = acc & 1023;\n"
+    "        case 14: acc = acc << 1;\n"
+    "        case 15: acc = acc >> 1;\n"
+    "        case 16: acc = -acc;\n"
+    "        case 17: acc = ~acc;\n"
+    "        case 18: acc = acc + 17;\n"
+    "        case 19: acc = acc - 17;\n"
+    "        case 20: pc = pc + acc % 5;\n"
+    "        case 21: pc = pc - 1;\n"
+    "        case 22: acc = acc % 1000 + 1;\n"
+    "        case 23: acc = acc * 5;\n"
+    "        case 24: acc = acc + 24;\n"
+    "        case 25: acc = acc - 25;\n"
+    "        case 26: acc = acc ^ 26;\n"
+    "        case 27: acc = acc | 27;\n"
+    "        case 28: acc = acc & 28;\n"
+    "        case 29: acc = acc + 29;\n"
+    "        case 30: acc = acc - 30;\n"
+    "        case 31: acc = acc ^ 31;\n"
+    "        case 32: acc = acc | 32;\n"
+    "        case 33: acc = acc & 33;\n"
+    "        case 34: acc = acc + 34;\n"
+    "        case 35: acc = acc - 35;\n"
+    "        case 36: acc = acc * 2 + 1;\n"
+    "        case 37: acc = acc / 3;\n"
+    "        default: acc = acc + 1;\n"
+    "        }\n"
+    "        acc = acc & 1048575;\n"
+    "        pc = pc + 1;\n"
+    "    }\n"
+    "    return acc + pc;\n"
+    "}\n"
+    "func machine(steps: int): int {\n"
+    "    state := 100;\n"
+    "    count := 0;\n"
+    "    for (i := 0; i < steps; i++) {\n"
+    "        switch (state) {\n"
+    "        case 100: state = 250;\n"
+    "        case 250: state = 1000;\n"
+    "        case 1000: state = i % 3 == 0 ? 7000 : 1001;\n"
+    "        case 1001: state = 1002;\n"
+    "        case 1002: state = 4096;\n"
+    "        case 4096: state = 9999; count++;\n"
+    "        case 7000: state = 12345;\n"
+    "        case 9999: state = 65536;\n"
+    "        case 12345: state = 20000;\n"
+    "        case 20000: state = 30000; count = count + 2;\n"
+    "        case 30000: state = 40000;\n"
+    "        case 40000: state = 50000;\n"
+    "        case 50000: state = 65536;\n"
+    "        case 65536: state = 100000;\n"
+    "        case 100000: state = 100; count = count + 3;\n"
+    "        default: state = 100;\n"
+    "        }\n"
+    "    }\n"
+    "    return count;\n"
+    "}\n"
+    "func classify(c: int): int {\n"
+    "    switch (c) {\n"
+    "    case ' ', '\\t', '\\n', '\\r': return 0;\n"
+    "    case '(', ')', '[', ']': return 1;\n"
+    "    case '+', '-', '*', '/', '%', '<', '>', '=': return 2;\n"
+    "    case '0', '1', '2', '3', '4', '5', '6', '7', '8', '9': return 3;\n"
+    "    }\n"
+    "    return 4;\n"
+    "}\n"
+    "func text(n: int): int {\n"
+    "    sum := 0;\n"
+    "    for (i := 0; i < n; i++) {\n"
+    "        sum = sum + classify(i * 31 % 96 + 8);\n"
+    "    }\n"
+    "    return sum;\n"
+    "}\n"
+    "func main(): int {\n"
+    "    return vm(200000) + machine(200000) * 3 + text(200000) * 7;\n"
+    "}\n";
+
+// Runs the dispatch-heavy programs with switches lowered to compare chains
+// and with the per-switch strategy.
+void switch_bench(void) {
+    init_stream("bench", switch_bench_source);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    switch_lowering = SWITCH_LINEAR;
+    IrBench before = ir_bench_run(decls, num_decls, OPT_FULL, "compare chains");
+    switch_lowering = SWITCH_AUTO;
+    IrBench after = ir_bench_run(decls, num_decls, OPT_FULL, "clustered");
+    IrModule *module = lower_module(decls, num_decls);
+    printf("clusters: %u jump tables, %u bit tests, %u ranges\n", module->switch_clusters[CLUSTER_TABLE],
+           module->switch_clusters[CLUSTER_BITS], module->switch_clusters[CLUSTER_RANGE]);
+    ir_free(module);
+    xfree(module, sizeof(IrModule), ALLOC_IR);
+    ir_bench_compare(before, after);
+}
+
+// Call-heavy programs: small helpers called from a hot loop, tail-recursive
+// gcd and summation, and mutually recursive parity.
+const char *inline_bench_source =
+    "func sq(x: int): int { return x * x; }\n"
+    "func clamp(x: int, lo: int, hi: int): int { if (x < lo) { return lo; } if (x > hi) { return hi; } return x; }\n"
+    "func lerp(a: int, b: int, t: int): int { return a + (b - a) * t / 256; }\n"
+    "func mix(h: int, x: int): int { return (h ^ x) * 16777619 & 4294967295; }\n"
+    "func kernel(n: int): int {\n"
+    "    h := 2166136261;\n"
+    "    for (i := 0; i < n; i++) { h = mix(h, clamp(lerp(i, sq(i & 255), i & 255), 0, 60000)); }\n"
+    "    return h;\n"
+    "}\n"
+    "func gcd(a: int, b: int): int { if (b == 0) { return a; } return gcd(b, a % b); }\n"
+    "func sum_to(n: int, acc: int): int { if (n == 0) { return acc; } return sum_to(n - 1, acc + n); }\n"
+    "func is_even(n: int): int { if (n == 0) { return 1; } return is_odd(n - 1); }\n"
+    "func is_odd(n: int): int { if (n == 0) { return 0; } return is_even(n - 1); }\n"
+    "func main(): int {\n"
+    "    r := kernel(100000);\n"
+    "    for (i := 1; i < 20000; i++) { r += gcd(i * 7919, 104729 + i); }\n"
+    "    for (i := 0; i < 100; i++) { r += sum_to(5000 + i, 0) + is_even(5000 + i); }\n"
+    "    return r;\n"
+    "}\n"
+    "func deep(): int { return sum_to(1000000, 0) + is_even(1000001); }\n";
+
+// Runs the call-heavy programs without and with inlining and tail calls, then
+// recursion far deeper than the interpreter's stack, which only tail calls allow.
+void inline_bench(void) {
+    init_stream("bench", inline_bench_source);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    int threshold = inline_threshold;
+    inline_threshold = 0;
+    tail_call_elim = false;
+    IrBench before = ir_bench_run(decls, num_decls, OPT_FULL, "calls");
+    inline_threshold = threshold;
+    tail_call_elim = true;
+    IrBench after = ir_bench_run(decls, num_decls, OPT_FULL, "inlined");
+    ir_bench_compare(before, after);
+    printf("max call depth: %d without, %d with\n", before.max_depth, after.max_depth);
+    IrModule *module = lower_module(decls, num_decls);
+    optimize_module(module, OPT_FULL);
+    IrRun run;
+    int64_t result = ir_run(module, "deep", &run);
+    printf("deep tail recursion: result %" PRId64 ", max call depth %d\n", result, run.max_depth);
+    ir_free(module);
+    xfree(module, sizeof(IrModule), ALLOC_IR);
+}
+
+// Array-walking kernels in the shape of numeric scripts: counted loops over
+// global arrays with invariant factors, strided and two-dimensional indexing.
+const char *loop_bench_source =
+    "const N = 4096;\n"
+    "const W = 64;\n"
+    "var a: int[N];\n"
+    "var b: int[N];\n"
+    "var m: int[W * W];\n"
+    "func fill(seed: int) {\n"
+    "    for (i := 0; i < N; i++) { a[i] = (i * seed) & 1023; b[i] = N - i; }\n"
+    "    for (i := 0; i < W; i++) { for (j := 0; j < W; j++) { m[i * W + j] = i ^ j; } }\n"
+    "}\n"
+    "func scale(k: int) { i := 0; while (i < N) { a[i] = a[i] * (k * k + 1) + (k << 3) & 65535; i++; } }\n"
+    "func strided(): int { s := 0; for (i := 0; i < N / 4; i++) { s += a[i * 4] + a[i * 4 + 1]; } return s; }\n"
+    "func dot(): int { s := 0; i := 0; do { s += a[i] * b[N - 1 - i]; i++; } while (i < N); return s; }\n"
+    "func matsum(n: int): int {\n"
+    "    s := 0;\n"
+    "    for (i := 0; i < n; i++) { for (j := 0; j < n; j++) { s += m[i * n + j] * (i * n + 1); } }\n"
+    "    return s;\n"
+    "}\n"
+    "func main(): int {\n"
+    "    r := 0;\n"
+    "    for (rep := 0; rep < 10; rep++) { fill(rep + 3); scale(rep); r += strided() + dot() + matsum(W); }\n"
+    "    return r;\n"
+    "}\n";
+
+void loop_bench(void) {
+    init_stream("bench", loop_bench_source);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    loop_opts = false;
+    IrBench before = ir_bench_run(decls, num_decls, OPT_FULL, "loops as lowered");
+    loop_opts = true;
+    IrBench after = ir_bench_run(decls, num_decls, OPT_FULL, "loop optimizations");
+    ir_bench_compare(before, after);
+}
+
+IrModule *ir_test_module(const char *src, OptLevel level) {
+    init_stream(NULL, src);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    IrModule *module = lower_module(decls, num_decls);
+    optimize_module(module, level);
+    return module;
+}
+
+// Lowers src with errors deferred and returns how many there were.
+size_t ir_test_lowering_errors(const char *src) {
+    init_stream(NULL, src);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    bool quiet = defer_errors;
+    defer_errors = true;
+    IrModule *module = lower_module(decls, num_decls);
+    defer_errors = quiet;
+    size_t num_errors = module->num_errors;
+    ir_free(module);
+    xfree(module, sizeof(IrModule), ALLOC_IR);
+    return num_errors;
+}
+
+void ir_test_free(IrModule *module) {
+    ir_free(module);
+    xfree(module, sizeof(IrModule), ALLOC_IR);
+}
+
+size_t ir_count_op(IrModule *module, const char *func_name, Op op) {
+    IrFunc *func = map_get(&module->funcs_by_name, str_intern(func_name));
+    size_t count = 0;
+    for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+        for (Instr **instr = (*block)->instrs; instr != buf_end((*block)->instrs); instr++) {
+            count += (*instr)->op == op;
+        }
+    }
+    return count;
+}
+
+void ir_test(void) {
+    // Control flow, run with and without the optimizer.
+    const char *src =
+        "const K = 3;\n"
+        "enum E { E0, E1, E2 = 10, E3 }\n"
+        "var g = 5;\n"
+        "func classify(x: int): int {\n"
+        "    if (x < 0) { return -1; } else if (x == 0) { return 0; } else if (x < 10) { return 1; } else { return 2; }\n"
+        "}\n"
+        "func pick(x: int): int {\n"
+        "    r := 0;\n"
+        "    switch (x) { case 1, 2: r = 12; case E2: r = 10; break; default: r = -x; }\n"
+        "    return r;\n"
+        "}\n"
+        "func loops(): int {\n"
+        "    sum := 0;\n"
+        "    for (i := 0; i < 10; i++) { if (i == 3) { continue; } if (i == 8) { break; } sum += i; }\n"
+        "    j := 0;\n"
+        "    do { j++; } while (j < 5);\n"
+        "    while (1) { j = j * 2; if (j > 100) { break; } }\n"
+        "    return sum * 1000 + j;\n"
+        "}\n"
+        "func logic(a: int, b: int): int { return (a && b) * 100 + (a || b) * 10 + (a ? b : -b); }\n"
+        "func memory(): int { x := 1; p := &x; *p = 41; x += 1; g = g + x; return g; }\n"
+        "func fact(n: int): int { return n <= 1 ? 1 : n * fact(n - 1); }\n"
+        "func main(): int {\n"
+        "    return classify(-5) + classify(0) * 10 + classify(7) * 100 + classify(K * 10) * 1000;\n"
+        "}\n";
+    struct {
+        const char *name;
+        int64_t result;
+    } runs[] = {
+        {"main", 2100 - 1},
+        {"loops", 25 * 1000 + 160},
+        {"memory", 47},
+        {"fact", 1},
+    };
+    for (OptLevel level = OPT_NONE; level <= OPT_FULL; level++) {
+        IrModule *module = ir_test_module(src, level);
+        for (size_t i = 0; i < sizeof(runs)/sizeof(*runs); i++) {
+            IrRun run;
+            assert(ir_run(module, runs[i].name, &run) == runs[i].result);
+        }
+        IrRun run;
+        IrFunc *pick = map_get(&module->funcs_by_name, str_intern("pick"));
+        IrFunc *logic = map_get(&module->funcs_by_name, str_intern("logic"));
+        IrFunc *fact = map_get(&module->funcs_by_name, str_intern("fact"));
+        int64_t args[][2] = {{1, 0}, {2, 0}, {10, 0}, {11, 0}, {0, 3}, {2, 0}, {2, 3}};
+        int64_t expected[] = {12, 12, 10, -11, 10 - 3, 10 - 0, 100 + 10 + 3};
+        run = (IrRun){.module = module};
+        for (int i = 0; i < 4; i++) {
+            assert(ir_run_func(&run, pick, args[i], 1) == expected[i]);
+        }
+        for (int i = 4; i < 7; i++) {
+            assert(ir_run_func(&run, logic, args[i], 2) == expected[i]);
+        }
+        assert(ir_run_func(&run, fact, (int64_t[]){10}, 1) == 3628800);
+        ir_run_free(&run);
+        ir_test_free(module);
+    }
+
+    // Constants fold through the branch, leaving a single block.
+    IrModule *module = ir_test_module("func f(): int { x := 2 * 3; y := x + 1; if (y > 5) { return y; } return 0; }", OPT_FULL);
+    IrFunc *f = module->funcs[0];
+    assert(buf_len(f->blocks) == 1 && ir_num_instrs(f) == 2);
+    assert(f->blocks[0]->instrs[0]->op == OP_CONST && f->blocks[0]->instrs[0]->imm == 7);
+    ir_test_free(module);
+
+    // A loop-carried constant is found by SCCP but not by folding alone.
+    module = ir_test_module("func f(n: int): int { x := 1; for (i := 0; i < n; i++) { if (x != 1) { x = 2; } } return x; }", OPT_FULL);
+    assert(ir_count_op(module, "f", OP_PHI) == 1);
+    ir_test_free(module);
+
+    // A dead branch feeding several phis: SCCP turns the constant one into a
+    // const ahead of the others before the branch's edge is removed.
+    const char *dead = "func f(p: int): int { a := p; b := 1; if (0) { a = 2; b = 5; } return a + b; }";
+    for (OptLevel level = OPT_NONE; level <= OPT_FULL; level++) {
+        module = ir_test_module(dead, level);
+        IrRun run = {.module = module};
+        assert(ir_run_func(&run, module->funcs[0], (int64_t[]){100}, 1) == 101);
+        ir_run_free(&run);
+        ir_test_free(module);
+    }
+
+    // Common subexpressions, also across commuted operands, and dead code.
+    const char *cse = "func f(a: int, b: int): int { c := a * b; d := (a + b) * (b + a); e := c * 3; return d; }";
+    module = ir_test_module(cse, OPT_NONE);
+    assert(ir_count_op(module, "f", OP_ADD) == 2 && ir_count_op(module, "f", OP_MUL) == 3);
+    ir_test_free(module);
+    module = ir_test_module(cse, OPT_FULL);
+    assert(ir_count_op(module, "f", OP_ADD) == 1 && ir_count_op(module, "f", OP_MUL) == 1);
+    ir_test_free(module);
+
+    // Every switch strategy agrees with plain compare chains.
+    const char *switches =
+        "const BIG = 9223372036854775807;\n"
+        "func dense(x: int): int { switch (x) { case 0: return 10; case 1, 2: return 11; case 4: return 12;\n"
+        "    case 5: return 13; case 6, 7, 8: return 14; default: return -1; } return 0; }\n"
+        "func sparse(x: int): int { r := 0; switch (x) { case -100000: r = 1; case -5: r = 2; case 7: r = 3;\n"
+        "    case 1000: r = 4; case 2000, 2001: r = 5; case 90000: r = 6; case BIG: r = 7; case -BIG - 1: r = 8; } return r; }\n"
+        "func bits(x: int): int { switch (x) { case 1, 5, 20, 40, 60: return 1; case 30, 50: return 2; } return 0; }\n"
+        "func mixed(x: int): int { switch (x) { case -3, -2, -1, 0, 1, 2: return 1; case 100: return 2;\n"
+        "    case 200, 201, 202, 203, 204: return 3; case 250, 260, 270, 290: return 4; case 400: break;\n"
+        "    default: return 5; } return 6; }\n";
+    const char *switch_funcs[] = {"dense", "sparse", "bits", "mixed"};
+    IrModule *linear = (switch_lowering = SWITCH_LINEAR, ir_test_module(switches, OPT_FULL));
+    switch_lowering = SWITCH_AUTO;
+    for (OptLevel level = OPT_NONE; level <= OPT_FULL; level++) {
+        IrModule *clustered = ir_test_module(switches, level);
+        assert(clustered->switch_clusters[CLUSTER_TABLE] == 1 && clustered->switch_clusters[CLUSTER_BITS] == 2);
+        assert(ir_count_op(clustered, "dense", OP_SWITCH) == 1 && ir_count_op(clustered, "sparse", OP_SWITCH) == 0);
+        IrRun run_linear = {.module = linear};
+        IrRun run_clustered = {.module = clustered};
+        for (size_t i = 0; i < sizeof(switch_funcs)/sizeof(*switch_funcs); i++) {
+            IrFunc *a = map_get(&linear->funcs_by_name, str_intern(switch_funcs[i]));
+            IrFunc *b = map_get(&clustered->funcs_by_name, str_intern(switch_funcs[i]));
+            int64_t extremes[] = {INT64_MIN, INT64_MIN + 1, -100000, 89999, 90000, 90001, INT64_MAX - 1, INT64_MAX};
+            for (int64_t x = -70; x < 310 + (int64_t)(sizeof(extremes)/sizeof(*extremes)); x++) {
+                int64_t arg = x < 310 ? x : extremes[x - 310];
+                assert(ir_run_func(&run_linear, a, &arg, 1) == ir_run_func(&run_clustered, b, &arg, 1));
+            }
+        }
+        ir_run_free(&run_linear);
+        ir_run_free(&run_clustered);
+        ir_test_free(clustered);
+    }
+    ir_test_free(linear);
+
+    // Duplicate case values are errors with either lowering, also next to
+    // values that are not constants.
+    const char *duplicates[] = {
+        "func f(x: int, y: int): int { switch (x) { case 1: return 1; case y: return 2; } return 0; }",
+        "func f(x: int): int { switch (x) { case 1, 2: return 1; case 3, 2: return 2; } return 0; }",
+        "func f(x: int, y: int): int { switch (x) { case 1: return 1; case y: return 2; case 1: return 3; } return 0; }",
+        "const K = 4; func f(x: int): int { switch (x) { case K, 1: return 1; case 2 + 2, 1: return 2; } return 0; }",
+    };
+    size_t num_duplicates[] = {0, 1, 1, 2};
+    for (int lowering = SWITCH_AUTO; lowering <= SWITCH_LINEAR; lowering++) {
+        switch_lowering = lowering;
+        for (size_t i = 0; i < sizeof(duplicates)/sizeof(*duplicates); i++) {
+            assert(ir_test_lowering_errors(duplicates[i]) == num_duplicates[i]);
+        }
+    }
+    switch_lowering = SWITCH_AUTO;
+
+    // With lazy bodies only the functions main reaches are lowered.
+    lazy_func_bodies = true;
+    module = ir_test_module("func a(): int { return 1; } func b(): int { return a() + 1; } func main(): int { return b(); }\n"
+                            "func unused(): int { return a(); }", OPT_NONE);
+    lazy_func_bodies = false;
+    assert(buf_len(module->funcs) == 3 && !map_get(&module->funcs_by_name, str_intern("unused")));
+    IrRun lazy_run;
+    assert(ir_run(module, "main", &lazy_run) == 2);
+    ir_test_free(module);
+
+    // Stores and calls stay even when their results are unused.
+    inline_threshold = 0;
+    module = ir_test_module("var g = 0; func h(): int { return 1; } func f() { x := h(); g = 2; }", OPT_FULL);
+    assert(ir_count_op(module, "f", OP_CALL) == 1 && ir_count_op(module, "f", OP_STORE) == 1);
+    ir_test_free(module);
+    inline_threshold = INLINE_THRESHOLD;
+
+    // Small callees are inlined, and so are large ones whose parameters are
+    // constants; a recursive callee is inlined one level.
+    const char *calls =
+        "var g = 0;\n"
+        "func add(a: int, b: int): int { return a + b; }\n"
+        "func sign(x: int): int { if (x < 0) { return -1; } else if (x > 0) { return 1; } return 0; }\n"
+        "func bump() { g = g + 1; }\n"
+        "func spin(): int { while (1) { g = g + 1; if (g > 10) { return g; } } return 0; }\n"
+        "func fact(n: int): int { return n <= 1 ? 1 : n * fact(n - 1); }\n"
+        "func big(x: int): int { return x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x*x; }\n"
+        "func f(x: int): int { bump(); return add(2, 3) + sign(x) * 10 + sign(-4) * 100 + spin() + fact(5) + big(x & 1) + big(1); }\n";
+    for (OptLevel level = OPT_NONE; level <= OPT_FULL; level++) {
+        module = ir_test_module(calls, level);
+        IrFunc *func = map_get(&module->funcs_by_name, str_intern("f"));
+        IrRun run = {.module = module};
+        assert(ir_run_func(&run, func, (int64_t[]){7}, 1) == 5 + 10 - 100 + 11 + 120 + 1 + 1);
+        assert(ir_run_func(&run, func, (int64_t[]){0}, 1) == 5 - 100 + 13 + 120 + 0 + 1);
+        ir_run_free(&run);
+        if (level == OPT_FULL) {
+            assert(ir_count_op(module, "f", OP_CALL) == 2);
+            assert(ir_count_op(module, "fact", OP_CALL) == 1);
+        }
+        ir_test_free(module);
+    }
+
+    // A constant argument decides a branch in the inlined body that feeds
+    // several phis, at the default threshold and at more generous ones.
+    const char *folded =
+        "var g = 4;\n"
+        "func mix(p: int, q: int, flag: int): int {\n"
+        "    a := p; b := 1; c := q;\n"
+        "    if (flag) { a = 2; b = 5; c = c * 3; }\n"
+        "    return a * 100 + b * 10 + c;\n"
+        "}\n"
+        "func main(): int { return mix(g, g + 1, 0) + mix(g, 3, 1) * 1000; }\n";
+    int thresholds[] = {INLINE_THRESHOLD, 100, 200, 400};
+    for (size_t i = 0; i < sizeof(thresholds)/sizeof(*thresholds); i++) {
+        inline_threshold = thresholds[i];
+        module = ir_test_module(folded, OPT_FULL);
+        assert(ir_count_op(module, "main", OP_CALL) == 0);
+        IrRun run;
+        assert(ir_run(module, "main", &run) == 259415);
+        ir_test_free(module);
+    }
+    inline_threshold = INLINE_THRESHOLD;
+
+    // Self and mutual tail calls run in constant stack, far past the interpreter's depth limit.
+    const char *tails =
+        "func sum_to(n: int, acc: int): int { if (n == 0) { return acc; } return sum_to(n - 1, acc + n); }\n"
+        "func is_even(n: int): int { if (n == 0) { return 1; } return is_odd(n - 1); }\n"
+        "func is_odd(n: int): int { if (n == 0) { return 0; } return is_even(n - 1); }\n"
+        "func count(n: int) { if (n > 0) { count(n - 1); } }\n"
+        "func addr(n: int): int { x := n; if (n == 0) { return 0; } return addr(*&x - 1); }\n"
+        "func main(): int { count(100000); return sum_to(100000, 0) + is_even(100001) * 7; }\n";
+    module = ir_test_module(tails, OPT_FULL);
+    assert(ir_count_op(module, "sum_to", OP_CALL) == 0 && ir_count_op(module, "sum_to", OP_TAILCALL) == 0);
+    assert(ir_count_op(module, "is_even", OP_TAILCALL) == 1 && ir_count_op(module, "count", OP_CALL) == 0);
+    // A function with address-taken locals keeps its frame.
+    assert(ir_count_op(module, "addr", OP_CALL) == 1);
+    IrRun run;
+    assert(ir_run(module, "main", &run) == 5000050000);
+    assert(run.max_depth <= 2);
+    ir_test_free(module);
+
+    // Invariant code leaves loops, index arithmetic becomes pointer bumps,
+    // and the results do not change.
+    const char *kernels =
+        "var a: int[256];\n"
+        "func scale(n: int, k: int) { for (i := 0; i < n; i++) { a[i] = i * (k * k + 1); } }\n"
+        "func strided(n: int): int { s := 0; i := 0; while (i < n) { s += a[i * 4]; i++; } return s; }\n"
+        "func grid(n: int): int { s := 0; for (i := 0; i < n; i++) { j := n; do { j--; s += a[i * n + j] - j; } while (j > 0); } return s; }\n"
+        "func down(): int { s := 0; for (i := 200; i > 0; i -= 3) { s = s * 3 + a[i + 5]; } return s; }\n"
+        "func main(): int { scale(256, 3); return strided(64) + grid(16) * 3 + down(); }\n";
+    int64_t expected_result = 0;
+    for (OptLevel level = OPT_NONE; level <= OPT_FULL; level++) {
+        module = ir_test_module(kernels, level);
+        IrRun run;
+        int64_t result = ir_run(module, "main", &run);
+        if (level == OPT_NONE) {
+            expected_result = result;
+        }
+        assert(result == expected_result);
+        ir_test_free(module);
+    }
+    loop_opts = false;
+    module = ir_test_module(kernels, OPT_FULL);
+    assert(ir_count_op(module, "strided", OP_MUL) == 1);
+    ir_test_free(module);
+    loop_opts = true;
+    module = ir_test_module(kernels, OPT_FULL);
+    IrFunc *scale = map_get(&module->funcs_by_name, str_intern("scale"));
+    for (Block **block = scale->blocks; block != buf_end(scale->blocks); block++) {
+        for (Instr **instr = (*block)->instrs; instr != buf_end((*block)->instrs); instr++) {
+            assert((*instr)->op != OP_MUL || (*block)->rpo == 0);
+        }
+    }
+    assert(ir_count_op(module, "strided", OP_MUL) == 0 && ir_count_op(module, "grid", OP_MUL) == 0);
+    ir_test_free(module);
+}
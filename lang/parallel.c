@@ -0,0 +1,279 @@
+// Parallel parsing of one file
+//
+// A quick pass over the bytes of the file finds places where a top-level
+// declaration starts: a declaration keyword at bracket depth 0 right after a
+// ';' or '}'. The file is cut at some of them into chunks of roughly equal
+// size, and worker threads parse whole chunks, each into its own arenas and
+// scratch stack. Names go to the shared interner. The lists are then joined
+// in source order and the workers' arenas handed to the calling thread's.
+//
+// A chunk whose parse reports an error, or does not end exactly at the next
+// cut, makes the main thread reparse everything from that chunk on. That both
+// reports errors the way a sequential parse does and guarantees the same
+// declarations as parse_file when the byte scan guessed wrong.
+typedef struct ParseChunk {
+    const char *begin;
+    const char *end;
+    Decl **decls;
+    size_t num_decls;
+    bool failed;
+} ParseChunk;
+
+typedef struct ParseWork {
+    const char *text_start;
+    const char *text_end;
+    SrcPos text_pos;
+    ParseChunk *chunks;
+    size_t num_chunks;
+    size_t next_chunk;
+    pthread_mutex_t lock;
+    // What the workers leave behind for the starting thread.
+    Arena *ast_arenas;
+    Arena *str_arenas;
+    Stats *stats;
+} ParseWork;
+
+bool is_decl_keyword_range(const char *start, const char *end) {
+    size_t len = end - start;
+    const char *keywords[] = {"typedef", "enum", "struct", "union", "var", "const", "func"};
+    for (size_t i = 0; i < sizeof(keywords)/sizeof(*keywords); i++) {
+        if (strlen(keywords[i]) == len && memcmp(keywords[i], start, len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns the starts of the chunks: the start of the text and then the first
+// declaration start at or after each multiple of chunk_size.
+const char **find_decl_cuts(const char *text, size_t len, size_t chunk_size) {
+    const char **cuts = NULL;
+    buf_push(cuts, text);
+    const char *end = text + len;
+    const char *next_cut = text + chunk_size;
+    int depth = 0;
+    char last = ';';
+    // A declaration right after a doc comment is not a cut, or the comment
+    // would end up in the chunk before the declaration's.
+    bool after_doc = false;
+    const char *p = text;
+    while (p < end) {
+        char c = *p;
+        if (c == '/' && (p[1] == '/' || p[1] == '*')) {
+            after_doc = after_doc || is_doc_comment(p);
+            p = skip_comment(p);
+            continue;
+        }
+        if (c == '"' || c == '\'') {
+            p = skip_quoted(p);
+            last = c;
+            after_doc = false;
+        } else if (isalpha(c) || c == '_') {
+            const char *start = p;
+            while (p < end && (isalnum(*p) || *p == '_')) {
+                p++;
+            }
+            if (depth == 0 && (last == ';' || last == '}') && !after_doc && start >= next_cut &&
+                is_decl_keyword_range(start, p)) {
+                buf_push(cuts, start);
+                next_cut = start + chunk_size;
+            }
+            last = 'a';
+            after_doc = false;
+        } else if (isdigit(c)) {
+            while (p < end && (isalnum(*p) || *p == '_' || *p == '.')) {
+                p++;
+            }
+            last = '0';
+            after_doc = false;
+        } else {
+            if (c == '(' || c == '[' || c == '{') {
+                depth++;
+            } else if (c == ')' || c == ']' || c == '}') {
+                depth--;
+            }
+            if (!isspace(c)) {
+                last = c;
+                after_doc = false;
+            }
+            p++;
+        }
+    }
+    return cuts;
+}
+
+void parse_chunk(ParseWork *work, ParseChunk *chunk) {
+    stream_start = work->text_start;
+    stream_pos = work->text_pos;
+    stream = chunk->begin;
+    deferred_error = false;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    if (setjmp(recover) == 0) {
+        next_token();
+        ScratchMark mark = scratch_mark();
+        while (!is_token(TOKEN_EOF) && token.start < chunk->end) {
+            scratch_push(Decl *, parse_decl());
+        }
+        chunk->num_decls = scratch_count(Decl *, mark);
+        chunk->decls = ast_finish_list(mark);
+        bool at_end = chunk->end == work->text_end ? is_token(TOKEN_EOF) : token.start == chunk->end;
+        chunk->failed = deferred_error || !at_end;
+    } else {
+        scratch_release(0);
+        chunk->failed = true;
+    }
+    fatal_jmp = NULL;
+}
+
+void *parse_worker(void *arg) {
+    ParseWork *work = arg;
+    defer_errors = true;
+    for (;;) {
+        pthread_mutex_lock(&work->lock);
+        size_t i = work->next_chunk++;
+        pthread_mutex_unlock(&work->lock);
+        if (i >= work->num_chunks) {
+            break;
+        }
+        parse_chunk(work, &work->chunks[i]);
+    }
+    scratch_free();
+    pthread_mutex_lock(&work->lock);
+    buf_push(work->ast_arenas, ast_arena);
+    buf_push(work->str_arenas, str_arena);
+#if STATS
+    buf_push(work->stats, stats);
+#endif
+    pthread_mutex_unlock(&work->lock);
+    return NULL;
+}
+
+// Parses the rest of the current stream like parse_file, using up to
+// num_threads threads for chunks of at least min_chunk bytes.
+Decl **parse_file_parallel(int num_threads, size_t min_chunk, size_t *num_decls) {
+    // Chunk 0 scans the current token again, so it starts at the token's doc
+    // comments to find them again too.
+    const char *text = token.doc ? token.doc : token.start;
+    size_t len = strlen(text);
+    size_t chunk_size = MAX(min_chunk, len / (4 * (size_t)MAX(num_threads, 1)) + 1);
+    if (num_threads <= 1 || len < 2 * chunk_size) {
+        return parse_file(num_decls);
+    }
+    const char **cuts = find_decl_cuts(text, len, chunk_size);
+    ParseWork work = {.text_start = stream_start, .text_end = text + len, .text_pos = stream_pos};
+    work.num_chunks = buf_len(cuts);
+    work.chunks = xcalloc(work.num_chunks, sizeof(ParseChunk), ALLOC_MISC);
+    for (size_t i = 0; i < work.num_chunks; i++) {
+        work.chunks[i].begin = cuts[i];
+        work.chunks[i].end = i + 1 < work.num_chunks ? cuts[i + 1] : text + len;
+    }
+    buf_free(cuts);
+    pthread_mutex_init(&work.lock, NULL);
+    num_threads = (int)MIN((size_t)num_threads, work.num_chunks);
+    pthread_t *threads = xcalloc(num_threads, sizeof(pthread_t), ALLOC_MISC);
+    threads_active = true;
+    int started = 0;
+    for (; started < num_threads; started++) {
+        if (pthread_create(&threads[started], NULL, parse_worker, &work) != 0) {
+            break;
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    threads_active = false;
+    pthread_mutex_destroy(&work.lock);
+    xfree(threads, num_threads * sizeof(pthread_t), ALLOC_MISC);
+    if (started == 0) {
+        // No thread could be started, so nothing has been parsed yet.
+        xfree(work.chunks, work.num_chunks * sizeof(ParseChunk), ALLOC_MISC);
+        return parse_file(num_decls);
+    }
+    // Keep the outcome of every chunk up to the first failed one.
+    for (Arena *it = work.ast_arenas; it != buf_end(work.ast_arenas); it++) {
+        arena_adopt(&ast_arena, it);
+    }
+    for (Arena *it = work.str_arenas; it != buf_end(work.str_arenas); it++) {
+        arena_adopt(&str_arena, it);
+    }
+    buf_free(work.ast_arenas);
+    buf_free(work.str_arenas);
+#if STATS
+    for (Stats *it = work.stats; it != buf_end(work.stats); it++) {
+        stats_merge(&stats, it);
+    }
+    buf_free(work.stats);
+#endif
+    ScratchMark mark = scratch_mark();
+    ParseChunk *chunk = work.chunks;
+    for (; chunk != work.chunks + work.num_chunks && !chunk->failed; chunk++) {
+        for (size_t i = 0; i < chunk->num_decls; i++) {
+            scratch_push(Decl *, chunk->decls[i]);
+        }
+    }
+    const char *reparse = chunk != work.chunks + work.num_chunks ? chunk->begin : NULL;
+    xfree(work.chunks, work.num_chunks * sizeof(ParseChunk), ALLOC_MISC);
+    if (reparse) {
+        stream = reparse;
+        next_token();
+        while (!is_token(TOKEN_EOF)) {
+            scratch_push(Decl *, parse_decl());
+        }
+    }
+    *num_decls = scratch_count(Decl *, mark);
+    return ast_finish_list(mark);
+}
+
+bool decls_match(Decl **a, Decl **b, size_t num_decls) {
+    for (size_t i = 0; i < num_decls; i++) {
+        if (a[i]->kind != b[i]->kind || a[i]->name != b[i]->name || a[i]->pos != b[i]->pos || a[i]->doc != b[i]->doc) {
+            return false;
+        }
+        if (a[i]->kind == DECL_FUNC) {
+            StmtBlock x = func_body(a[i]);
+            StmtBlock y = func_body(b[i]);
+            if (x.num_stmts != y.num_stmts || (x.num_stmts && x.stmts[x.num_stmts - 1]->pos != y.stmts[y.num_stmts - 1]->pos)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void parallel_test(void) {
+    const char *chunks[] = {
+        "/// Documents a, and the file starts with it.\nvar a = {1, 2}; const b = a[0];\n",
+        "func f(x: int): int { s := \"} func g() {\"; c := '}'; if (x) { return (x); } return 0; }\n",
+        "struct S { x: int; y: char*; }\n",
+        "enum E { A, B = 2 }\n",
+        "typedef T = func(int): S*;\n",
+        "union U { i: int; f: float; }\n",
+        "/// Documents h, which doesn't { or ' its comments.\nfunc h() { /* } func k() { */ }\n",
+        "// A plain comment that isn't documentation.\n/* var z = {; */\n",
+    };
+    char *src = NULL;
+    for (int i = 0; i < 200; i++) {
+        const char *text = chunks[i % (sizeof(chunks)/sizeof(*chunks))];
+        buf_pushn(src, text, strlen(text));
+    }
+    buf_push(src, 0);
+
+    init_stream("parallel", src);
+    size_t num_expected;
+    Decl **expected = parse_file(&num_expected);
+    const char **cuts = find_decl_cuts(src, strlen(src), 1);
+    // Every declaration is a cut but the documented ones, and the start of
+    // the text is one for the first, documented, declaration.
+    assert(expected[0]->doc == src);
+    assert(buf_len(cuts) == num_expected - 2 * (200 / 8) + 1);
+    buf_free(cuts);
+    for (int threads = 1; threads <= 4; threads++) {
+        rewind_stream();
+        size_t num_decls;
+        Decl **decls = parse_file_parallel(threads, 100, &num_decls);
+        assert(num_decls == num_expected);
+        assert(decls_match(decls, expected, num_decls));
+    }
+    buf_free(src);
+}
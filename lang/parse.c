@@ -0,0 +1,805 @@
+Typespec *parse_type(void);
+Expr *parse_expr(void);
+Stmt *parse_stmt(void);
+
+// Nested types, expressions and statements are parsed by recursion, so nesting
+// deeper than this is a syntax error rather than a stack overflow. Parser
+// worker threads have the same stack as any other.
+#define MAX_PARSE_DEPTH 1000
+
+_Thread_local int parse_depth;
+
+void enter_nesting(void) {
+    if (++parse_depth > MAX_PARSE_DEPTH) {
+        parse_depth = 0;
+        syntax_error("Nesting deeper than %d levels", MAX_PARSE_DEPTH);
+        fatal_exit();
+    }
+}
+
+void leave_nesting(void) {
+    parse_depth--;
+}
+
+const char *parse_name(void) {
+    const char *name = token.name;
+    if (is_keyword_name(name)) {
+        syntax_error("Expected name, got keyword '%s'", name);
+    }
+    expect_token(TOKEN_NAME);
+    return name;
+}
+
+Typespec *parse_type_func(void) {
+    SrcPos pos = token.pos;
+    ScratchMark mark = scratch_mark();
+    expect_token('(');
+    if (!is_token(')')) {
+        scratch_push(Typespec *, parse_type());
+        while (match_token(',')) {
+            scratch_push(Typespec *, parse_type());
+        }
+    }
+    expect_token(')');
+    size_t num_args = scratch_count(Typespec *, mark);
+    Typespec **args = ast_finish_list(mark);
+    Typespec *ret = NULL;
+    if (match_token(':')) {
+        ret = parse_type();
+    }
+    return typespec_func(pos, args, num_args, ret);
+}
+
+Typespec *parse_type_base(void) {
+    SrcPos pos = token.pos;
+    if (is_token(TOKEN_NAME) && !is_keyword_name(token.name)) {
+        const char *name = token.name;
+        next_token();
+        return typespec_name(pos, name);
+    } else if (match_keyword(func_keyword)) {
+        return parse_type_func();
+    } else if (match_token('(')) {
+        Typespec *type = parse_type();
+        expect_token(')');
+        return type;
+    } else {
+        fatal_at(pos, "Unexpected token %s in type", token_kind_str(token.kind));
+        return NULL;
+    }
+}
+
+Typespec *parse_type(void) {
+    enter_nesting();
+    Typespec *type = parse_type_base();
+    for (;;) {
+        SrcPos pos = token.pos;
+        if (match_token('[')) {
+            Expr *size = NULL;
+            if (!is_token(']')) {
+                size = parse_expr();
+            }
+            expect_token(']');
+            type = typespec_array(pos, type, size);
+        } else if (match_token('*')) {
+            type = typespec_ptr(pos, type);
+        } else {
+            leave_nesting();
+            return type;
+        }
+    }
+}
+
+Expr *parse_expr_compound(SrcPos pos, Typespec *type) {
+    ScratchMark mark = scratch_mark();
+    expect_token('{');
+    if (!is_token('}')) {
+        scratch_push(Expr *, parse_expr());
+        while (match_token(',')) {
+            if (is_token('}')) {
+                break;
+            }
+            scratch_push(Expr *, parse_expr());
+        }
+    }
+    expect_token('}');
+    size_t num_args = scratch_count(Expr *, mark);
+    return expr_compound(pos, type, ast_finish_list(mark), num_args);
+}
+
+Expr *parse_expr_operand(void) {
+    SrcPos pos = token.pos;
+    if (is_token(TOKEN_INT)) {
+        uint64_t val = token.intval;
+        next_token();
+        return expr_int(pos, val);
+    } else if (is_token(TOKEN_FLOAT)) {
+        double val = token.floatval;
+        next_token();
+        return expr_float(pos, val);
+    } else if (is_token(TOKEN_STR)) {
+        const char *val = token.strval;
+        next_token();
+        return expr_str(pos, val);
+    } else if (match_keyword(cast_keyword)) {
+        expect_token('(');
+        Typespec *type = parse_type();
+        expect_token(',');
+        Expr *expr = parse_expr();
+        expect_token(')');
+        return expr_cast(pos, type, expr);
+    } else if (is_token(TOKEN_NAME)) {
+        const char *name = parse_name();
+        if (is_token('{')) {
+            return parse_expr_compound(pos, typespec_name(pos, name));
+        } else {
+            return expr_name(pos, name);
+        }
+    } else if (is_token('{')) {
+        return parse_expr_compound(pos, NULL);
+    } else if (match_token('(')) {
+        Expr *expr = parse_expr();
+        expect_token(')');
+        return expr;
+    } else {
+        fatal_at(pos, "Unexpected token %s in expression", token_kind_str(token.kind));
+        return NULL;
+    }
+}
+
+Expr *parse_expr_base(void) {
+    Expr *expr = parse_expr_operand();
+    for (;;) {
+        SrcPos pos = token.pos;
+        if (match_token('(')) {
+            ScratchMark mark = scratch_mark();
+            if (!is_token(')')) {
+                scratch_push(Expr *, parse_expr());
+                while (match_token(',')) {
+                    scratch_push(Expr *, parse_expr());
+                }
+            }
+            expect_token(')');
+            size_t num_args = scratch_count(Expr *, mark);
+            expr = expr_call(pos, expr, ast_finish_list(mark), num_args);
+        } else if (match_token('[')) {
+            Expr *index = parse_expr();
+            expect_token(']');
+            expr = expr_index(pos, expr, index);
+        } else if (match_token('.')) {
+            expr = expr_field(pos, expr, parse_name());
+        } else {
+            return expr;
+        }
+    }
+}
+
+bool is_unary_op(void) {
+    return is_token('+') || is_token('-') || is_token('*') || is_token('&') || is_token('!') || is_token('~');
+}
+
+Expr *parse_expr_unary(void) {
+    if (is_unary_op()) {
+        SrcPos pos = token.pos;
+        TokenKind op = token.kind;
+        next_token();
+        enter_nesting();
+        Expr *expr = expr_unary(pos, op, parse_expr_unary());
+        leave_nesting();
+        return expr;
+    } else {
+        return parse_expr_base();
+    }
+}
+
+bool is_mul_op(void) {
+    return is_token('*') || is_token('/') || is_token('%') || is_token('&') ||
+           is_token(TOKEN_LSHIFT) || is_token(TOKEN_RSHIFT);
+}
+
+Expr *parse_expr_mul(void) {
+    Expr *expr = parse_expr_unary();
+    while (is_mul_op()) {
+        SrcPos pos = token.pos;
+        TokenKind op = token.kind;
+        next_token();
+        expr = expr_binary(pos, op, expr, parse_expr_unary());
+    }
+    return expr;
+}
+
+bool is_add_op(void) {
+    return is_token('+') || is_token('-') || is_token('|') || is_token('^');
+}
+
+Expr *parse_expr_add(void) {
+    Expr *expr = parse_expr_mul();
+    while (is_add_op()) {
+        SrcPos pos = token.pos;
+        TokenKind op = token.kind;
+        next_token();
+        expr = expr_binary(pos, op, expr, parse_expr_mul());
+    }
+    return expr;
+}
+
+bool is_cmp_op(void) {
+    return is_token(TOKEN_EQ) || is_token(TOKEN_NOTEQ) || is_token('<') || is_token('>') ||
+           is_token(TOKEN_LTEQ) || is_token(TOKEN_GTEQ);
+}
+
+Expr *parse_expr_cmp(void) {
+    Expr *expr = parse_expr_add();
+    while (is_cmp_op()) {
+        SrcPos pos = token.pos;
+        TokenKind op = token.kind;
+        next_token();
+        expr = expr_binary(pos, op, expr, parse_expr_add());
+    }
+    return expr;
+}
+
+Expr *parse_expr_and(void) {
+    Expr *expr = parse_expr_cmp();
+    while (is_token(TOKEN_AND)) {
+        SrcPos pos = token.pos;
+        next_token();
+        expr = expr_binary(pos, TOKEN_AND, expr, parse_expr_cmp());
+    }
+    return expr;
+}
+
+Expr *parse_expr_or(void) {
+    Expr *expr = parse_expr_and();
+    while (is_token(TOKEN_OR)) {
+        SrcPos pos = token.pos;
+        next_token();
+        expr = expr_binary(pos, TOKEN_OR, expr, parse_expr_and());
+    }
+    return expr;
+}
+
+Expr *parse_expr_ternary(void) {
+    SrcPos pos = token.pos;
+    Expr *expr = parse_expr_or();
+    if (match_token('?')) {
+        Expr *if_true = parse_expr_ternary();
+        expect_token(':');
+        Expr *if_false = parse_expr_ternary();
+        expr = expr_ternary(pos, expr, if_true, if_false);
+    }
+    return expr;
+}
+
+Expr *parse_expr(void) {
+    enter_nesting();
+    Expr *expr = parse_expr_ternary();
+    leave_nesting();
+    return expr;
+}
+
+Expr *parse_paren_expr(void) {
+    expect_token('(');
+    Expr *expr = parse_expr();
+    expect_token(')');
+    return expr;
+}
+
+StmtBlock parse_stmt_block(void) {
+    enter_nesting();
+    ScratchMark mark = scratch_mark();
+    expect_token('{');
+    while (!is_token(TOKEN_EOF) && !is_token('}')) {
+        scratch_push(Stmt *, parse_stmt());
+    }
+    expect_token('}');
+    size_t num_stmts = scratch_count(Stmt *, mark);
+    leave_nesting();
+    return (StmtBlock){ast_finish_list(mark), num_stmts};
+}
+
+Stmt *parse_stmt_if(SrcPos pos) {
+    Expr *cond = parse_paren_expr();
+    StmtBlock then_block = parse_stmt_block();
+    StmtBlock else_block = {0};
+    ScratchMark mark = scratch_mark();
+    while (match_keyword(else_keyword)) {
+        if (!match_keyword(if_keyword)) {
+            else_block = parse_stmt_block();
+            break;
+        }
+        Expr *elseif_cond = parse_paren_expr();
+        StmtBlock elseif_block = parse_stmt_block();
+        scratch_push(ElseIf, ((ElseIf){elseif_cond, elseif_block}));
+    }
+    size_t num_elseifs = scratch_count(ElseIf, mark);
+    return stmt_if(pos, cond, then_block, ast_finish_list(mark), num_elseifs, else_block);
+}
+
+Stmt *parse_stmt_while(SrcPos pos) {
+    Expr *cond = parse_paren_expr();
+    return stmt_while(pos, cond, parse_stmt_block());
+}
+
+Stmt *parse_stmt_do_while(SrcPos pos) {
+    StmtBlock block = parse_stmt_block();
+    if (!match_keyword(while_keyword)) {
+        fatal_at(token.pos, "Expected 'while' after 'do' block");
+        return NULL;
+    }
+    Stmt *stmt = stmt_do_while(pos, parse_paren_expr(), block);
+    expect_token(';');
+    return stmt;
+}
+
+bool is_assign_op(void) {
+    switch ((int)token.kind) {
+    case '=':
+    case TOKEN_ADD_ASSIGN: case TOKEN_SUB_ASSIGN:
+    case TOKEN_MUL_ASSIGN: case TOKEN_DIV_ASSIGN: case TOKEN_MOD_ASSIGN:
+    case TOKEN_AND_ASSIGN: case TOKEN_OR_ASSIGN: case TOKEN_XOR_ASSIGN:
+    case TOKEN_LSHIFT_ASSIGN: case TOKEN_RSHIFT_ASSIGN:
+        return true;
+    default:
+        return false;
+    }
+}
+
+Stmt *parse_simple_stmt(void) {
+    SrcPos pos = token.pos;
+    Expr *expr = parse_expr();
+    if (match_token(TOKEN_COLON_ASSIGN)) {
+        if (expr->kind != EXPR_NAME) {
+            fatal_at(pos, ":= must be preceded by a name");
+            return NULL;
+        }
+        return stmt_auto_assign(pos, expr->name, parse_expr());
+    } else if (is_assign_op()) {
+        TokenKind op = token.kind;
+        next_token();
+        return stmt_assign(pos, op, expr, parse_expr());
+    } else if (is_token(TOKEN_INC) || is_token(TOKEN_DEC)) {
+        TokenKind op = token.kind;
+        next_token();
+        return stmt_assign(pos, op, expr, NULL);
+    } else {
+        return stmt_expr(pos, expr);
+    }
+}
+
+StmtBlock parse_simple_stmt_list(TokenKind terminator) {
+    ScratchMark mark = scratch_mark();
+    if (!is_token(terminator)) {
+        scratch_push(Stmt *, parse_simple_stmt());
+        while (match_token(',')) {
+            scratch_push(Stmt *, parse_simple_stmt());
+        }
+    }
+    size_t num_stmts = scratch_count(Stmt *, mark);
+    return (StmtBlock){ast_finish_list(mark), num_stmts};
+}
+
+Stmt *parse_stmt_for(SrcPos pos) {
+    expect_token('(');
+    StmtBlock init = parse_simple_stmt_list(';');
+    expect_token(';');
+    Expr *cond = NULL;
+    if (!is_token(';')) {
+        cond = parse_expr();
+    }
+    expect_token(';');
+    StmtBlock next = parse_simple_stmt_list(')');
+    expect_token(')');
+    return stmt_for(pos, init, cond, next, parse_stmt_block());
+}
+
+SwitchCase parse_stmt_switch_case(void) {
+    ScratchMark exprs_mark = scratch_mark();
+    bool is_default = false;
+    while (is_keyword(case_keyword) || is_keyword(default_keyword)) {
+        if (match_keyword(case_keyword)) {
+            scratch_push(Expr *, parse_expr());
+            while (match_token(',')) {
+                scratch_push(Expr *, parse_expr());
+            }
+        } else {
+            if (is_default) {
+                syntax_error("Duplicate default labels in same switch case");
+            }
+            next_token();
+            is_default = true;
+        }
+        expect_token(':');
+    }
+    size_t num_exprs = scratch_count(Expr *, exprs_mark);
+    Expr **exprs = ast_finish_list(exprs_mark);
+    ScratchMark stmts_mark = scratch_mark();
+    while (!is_token(TOKEN_EOF) && !is_token('}') && !is_keyword(case_keyword) && !is_keyword(default_keyword)) {
+        scratch_push(Stmt *, parse_stmt());
+    }
+    size_t num_stmts = scratch_count(Stmt *, stmts_mark);
+    StmtBlock block = {ast_finish_list(stmts_mark), num_stmts};
+    return (SwitchCase){exprs, num_exprs, is_default, block};
+}
+
+Stmt *parse_stmt_switch(SrcPos pos) {
+    Expr *expr = parse_paren_expr();
+    enter_nesting();
+    ScratchMark mark = scratch_mark();
+    expect_token('{');
+    while (!is_token(TOKEN_EOF) && !is_token('}')) {
+        if (!is_keyword(case_keyword) && !is_keyword(default_keyword)) {
+            fatal_at(token.pos, "Expected 'case' or 'default' in switch, got %s", token_kind_str(token.kind));
+        }
+        scratch_push(SwitchCase, parse_stmt_switch_case());
+    }
+    expect_token('}');
+    size_t num_cases = scratch_count(SwitchCase, mark);
+    leave_nesting();
+    return stmt_switch(pos, expr, ast_finish_list(mark), num_cases);
+}
+
+Stmt *parse_stmt(void) {
+    SrcPos pos = token.pos;
+    if (match_keyword(if_keyword)) {
+        return parse_stmt_if(pos);
+    } else if (match_keyword(while_keyword)) {
+        return parse_stmt_while(pos);
+    } else if (match_keyword(do_keyword)) {
+        return parse_stmt_do_while(pos);
+    } else if (match_keyword(for_keyword)) {
+        return parse_stmt_for(pos);
+    } else if (match_keyword(switch_keyword)) {
+        return parse_stmt_switch(pos);
+    } else if (is_token('{')) {
+        return stmt_block(pos, parse_stmt_block());
+    } else if (match_keyword(return_keyword)) {
+        Expr *expr = NULL;
+        if (!is_token(';')) {
+            expr = parse_expr();
+        }
+        expect_token(';');
+        return stmt_return(pos, expr);
+    } else if (match_keyword(break_keyword)) {
+        expect_token(';');
+        return stmt_break(pos);
+    } else if (match_keyword(continue_keyword)) {
+        expect_token(';');
+        return stmt_continue(pos);
+    } else {
+        Stmt *stmt = parse_simple_stmt();
+        expect_token(';');
+        return stmt;
+    }
+}
+
+Decl *parse_decl_enum(SrcPos pos) {
+    const char *name = parse_name();
+    ScratchMark mark = scratch_mark();
+    expect_token('{');
+    while (!is_token(TOKEN_EOF) && !is_token('}')) {
+        const char *item_name = parse_name();
+        Expr *init = NULL;
+        if (match_token('=')) {
+            init = parse_expr();
+        }
+        scratch_push(EnumItem, ((EnumItem){item_name, init}));
+        if (!match_token(',')) {
+            break;
+        }
+    }
+    expect_token('}');
+    size_t num_items = scratch_count(EnumItem, mark);
+    return decl_enum(pos, name, ast_finish_list(mark), num_items);
+}
+
+AggregateItem parse_decl_aggregate_item(void) {
+    ScratchMark mark = scratch_mark();
+    scratch_push(const char *, parse_name());
+    while (match_token(',')) {
+        scratch_push(const char *, parse_name());
+    }
+    size_t num_names = scratch_count(const char *, mark);
+    const char **names = ast_finish_list(mark);
+    expect_token(':');
+    Typespec *type = parse_type();
+    expect_token(';');
+    return (AggregateItem){names, num_names, type};
+}
+
+Decl *parse_decl_aggregate(SrcPos pos, DeclKind kind) {
+    const char *name = parse_name();
+    ScratchMark mark = scratch_mark();
+    expect_token('{');
+    while (!is_token(TOKEN_EOF) && !is_token('}')) {
+        scratch_push(AggregateItem, parse_decl_aggregate_item());
+    }
+    expect_token('}');
+    size_t num_items = scratch_count(AggregateItem, mark);
+    return decl_aggregate(pos, kind, name, ast_finish_list(mark), num_items);
+}
+
+Decl *parse_decl_var(SrcPos pos) {
+    const char *name = parse_name();
+    Typespec *type = NULL;
+    Expr *expr = NULL;
+    if (match_token(':')) {
+        type = parse_type();
+    }
+    if (match_token('=')) {
+        expr = parse_expr();
+    }
+    if (!type && !expr) {
+        fatal_at(pos, "Variable '%s' needs a type or an initializer", name);
+    }
+    expect_token(';');
+    return decl_var(pos, name, type, expr);
+}
+
+Decl *parse_decl_const(SrcPos pos) {
+    const char *name = parse_name();
+    expect_token('=');
+    Expr *expr = parse_expr();
+    expect_token(';');
+    return decl_const(pos, name, expr);
+}
+
+Decl *parse_decl_typedef(SrcPos pos) {
+    const char *name = parse_name();
+    expect_token('=');
+    Typespec *type = parse_type();
+    expect_token(';');
+    return decl_typedef(pos, name, type);
+}
+
+FuncParam parse_decl_func_param(void) {
+    const char *name = parse_name();
+    expect_token(':');
+    Typespec *type = parse_type();
+    return (FuncParam){name, type};
+}
+
+// Skip function bodies with a brace match and parse them on first use.
+bool lazy_func_bodies;
+
+Decl *parse_decl_func(SrcPos pos) {
+    const char *name = parse_name();
+    ScratchMark mark = scratch_mark();
+    expect_token('(');
+    if (!is_token(')')) {
+        scratch_push(FuncParam, parse_decl_func_param());
+        while (match_token(',')) {
+            scratch_push(FuncParam, parse_decl_func_param());
+        }
+    }
+    expect_token(')');
+    size_t num_params = scratch_count(FuncParam, mark);
+    FuncParam *params = ast_finish_list(mark);
+    Typespec *ret_type = NULL;
+    if (match_token(':')) {
+        ret_type = parse_type();
+    }
+    if (lazy_func_bodies && is_token('{')) {
+        const char *body = token.start;
+        SrcPos body_pos = token.pos;
+        if (token_ring) {
+            // The lexer thread is already past the body, so skip its tokens.
+            for (int depth = 0; !is_token(TOKEN_EOF);) {
+                depth += is_token('{') - is_token('}');
+                next_token();
+                if (depth == 0) {
+                    break;
+                }
+            }
+        } else {
+            stream = skip_braces(body);
+            next_token();
+        }
+        STAT_INC(lazy_bodies);
+        Decl *decl = decl_func(pos, name, params, num_params, ret_type, (StmtBlock){0});
+        decl->func.lazy_body = body;
+        decl->func.lazy_body_pos = body_pos;
+        return decl;
+    }
+    StmtBlock block = parse_stmt_block();
+    return decl_func(pos, name, params, num_params, ret_type, block);
+}
+
+// Parses a skipped function body the first time it is asked for. The body is
+// allocated in the current AST arena, and its source text must still be alive.
+// Errors in a skipped body are only reported at this point.
+StmtBlock func_body(Decl *decl) {
+    assert(decl->kind == DECL_FUNC);
+    if (decl->func.lazy_body) {
+        Token outer_token = token;
+        const char *outer_stream = stream;
+        const char *outer_stream_start = stream_start;
+        SrcPos outer_stream_pos = stream_pos;
+        TokenRing *outer_token_ring = token_ring;
+        int outer_parse_depth = parse_depth;
+        token_ring = NULL;
+        parse_depth = 0;
+        stream = stream_start = decl->func.lazy_body;
+        stream_pos = decl->func.lazy_body_pos;
+        next_token();
+        decl->func.block = parse_stmt_block();
+        decl->func.lazy_body = NULL;
+        STAT_INC(lazy_bodies_parsed);
+        token = outer_token;
+        stream = outer_stream;
+        stream_start = outer_stream_start;
+        stream_pos = outer_stream_pos;
+        token_ring = outer_token_ring;
+        parse_depth = outer_parse_depth;
+    }
+    return decl->func.block;
+}
+
+Decl *parse_decl(void) {
+    // A fatal error longjmps out of nested parses without leaving them.
+    parse_depth = 0;
+    SrcPos pos = token.pos;
+    const char *doc = token.doc;
+    const char *doc_end = token.doc_end;
+    Decl *decl = NULL;
+    if (match_keyword(enum_keyword)) {
+        decl = parse_decl_enum(pos);
+    } else if (match_keyword(struct_keyword)) {
+        decl = parse_decl_aggregate(pos, DECL_STRUCT);
+    } else if (match_keyword(union_keyword)) {
+        decl = parse_decl_aggregate(pos, DECL_UNION);
+    } else if (match_keyword(var_keyword)) {
+        decl = parse_decl_var(pos);
+    } else if (match_keyword(const_keyword)) {
+        decl = parse_decl_const(pos);
+    } else if (match_keyword(typedef_keyword)) {
+        decl = parse_decl_typedef(pos);
+    } else if (match_keyword(func_keyword)) {
+        decl = parse_decl_func(pos);
+    } else {
+        fatal_at(pos, "Expected declaration keyword, got %s", token_kind_str(token.kind));
+        return NULL;
+    }
+    decl->doc = doc;
+    decl->doc_end = doc_end;
+    return decl;
+}
+
+Decl **parse_file(size_t *num_decls) {
+    ScratchMark mark = scratch_mark();
+    while (!is_token(TOKEN_EOF)) {
+        scratch_push(Decl *, parse_decl());
+    }
+    *num_decls = scratch_count(Decl *, mark);
+    return ast_finish_list(mark);
+}
+
+void parse_and_print_decl(const char *str) {
+    init_stream(NULL, str);
+    Decl *decl = parse_decl();
+    assert(is_token(TOKEN_EOF));
+    print_decl(decl);
+    printf("\n");
+}
+
+// Parses text as a declaration with errors deferred, and returns whether it
+// parsed without any.
+bool parse_decl_quietly(const char *text) {
+    bool quiet = defer_errors;
+    defer_errors = true;
+    deferred_error = false;
+    jmp_buf *outer = fatal_jmp;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    bool ok = false;
+    if (setjmp(recover) == 0) {
+        init_stream(NULL, text);
+        parse_decl();
+        ok = !deferred_error && is_token(TOKEN_EOF);
+    } else {
+        scratch_release(0);
+    }
+    fatal_jmp = outer;
+    defer_errors = quiet;
+    deferred_error = false;
+    return ok;
+}
+
+// Parses head, then depth times open, then inner, then depth times close, then
+// tail, as a declaration, and returns whether it parsed without errors.
+bool parse_nested_decl(const char *head, const char *open, const char *inner, const char *close, const char *tail,
+                       int depth) {
+    char *text = NULL;
+    buf_pushn(text, head, strlen(head));
+    for (int i = 0; i < depth; i++) {
+        buf_pushn(text, open, strlen(open));
+    }
+    buf_pushn(text, inner, strlen(inner));
+    for (int i = 0; i < depth; i++) {
+        buf_pushn(text, close, strlen(close));
+    }
+    buf_pushn(text, tail, strlen(tail) + 1);
+    bool ok = parse_decl_quietly(text);
+    buf_free(text);
+    return ok;
+}
+
+void parse_test(void) {
+    const char *decls[] = {
+        "const n = sizeof_int * (1 + 2) << 3;",
+        "var x: int[16] = {1, 2, 3};",
+        "var v = Vector{x.y, -z, *p};",
+        "typedef callback = func(int, char*): int;",
+        "enum Color { RED = 3, GREEN, BLUE = GREEN + 1, }",
+        "struct Vector { x, y: float; next: Vector*; }",
+        "union IntOrFloat { i: int; f: float; }",
+        "func fact(n: int): int { if (n == 0) { return 1; } else { return n * fact(n - 1); } }",
+        "func f(a: int, b: int) {"
+        "  i := a;"
+        "  for (i = 0, j := b; i < 10; i++, j -= 2) { if (i < j) { continue; } }"
+        "  while (a && !b) { a = a >> 1; }"
+        "  do { b++; } while (b < a);"
+        "  if (a) { g(a, h(b, 1), cast(int*, b)); } else if (b) { x[i].y = 2; } else if (c) { } else { break; }"
+        "  switch (a) { case 1, 2: b = 3; case 4: default: b = a ? 1 : 2; }"
+        "}",
+    };
+    for (const char **it = decls; it != decls + sizeof(decls)/sizeof(*decls); it++) {
+        parse_and_print_decl(*it);
+    }
+
+    init_stream(NULL, "const a = 1; func b() {} var c = a;");
+    size_t num_decls;
+    Decl **file = parse_file(&num_decls);
+    assert(num_decls == 3);
+    assert(file[0]->kind == DECL_CONST && file[1]->kind == DECL_FUNC && file[2]->kind == DECL_VAR);
+    assert(file[2]->var.expr->name == str_intern("a"));
+
+    init_stream(NULL, "func a(x: int) { s := \"}\"; c := '{'; if (x) { return; } } func b() {} const k = 1;");
+    Decl **eager = parse_file(&num_decls);
+    lazy_func_bodies = true;
+    rewind_stream();
+    Decl **lazy = parse_file(&num_decls);
+    lazy_func_bodies = false;
+    assert(num_decls == 3 && lazy[2]->kind == DECL_CONST);
+    assert(lazy[0]->func.lazy_body && lazy[1]->func.lazy_body);
+    StmtBlock block = func_body(lazy[0]);
+    assert(!lazy[0]->func.lazy_body && block.num_stmts == 3);
+    assert(block.stmts[2]->pos == eager[0]->func.block.stmts[2]->pos);
+    assert(func_body(lazy[0]).stmts == block.stmts);
+    assert(func_body(lazy[1]).num_stmts == 0);
+
+    // Doc comments stay in the text and are attached to the next declaration;
+    // other comments are dropped, even inside lazily skipped bodies.
+    const char *commented =
+        "// A file header. /* not nested in a line comment\n"
+        "/// Adds\n"
+        "/// two numbers.\n"
+        "func add(a: int, b: int): int { /* } */ return a + b; // don't }\n"
+        "}\n"
+        "/** A /* nested */ counter. */ var n = 0;\n"
+        "/**/ //// ruler\n"
+        "const k = 1; /* trailing */";
+    for (int lazy_bodies = 0; lazy_bodies < 2; lazy_bodies++) {
+        lazy_func_bodies = lazy_bodies;
+        init_stream(NULL, commented);
+        Decl **docs = parse_file(&num_decls);
+        lazy_func_bodies = false;
+        assert(num_decls == 3 && func_body(docs[0]).num_stmts == 1);
+        assert(docs[0]->doc == strstr(commented, "/// Adds"));
+        assert(docs[0]->doc_end == strstr(commented, "\nfunc"));
+        assert(docs[1]->doc == strstr(commented, "/** A") && docs[1]->doc_end == strstr(commented, " var"));
+        assert(docs[2]->doc == NULL && docs[2]->doc_end == NULL);
+    }
+
+    // Nesting up to MAX_PARSE_DEPTH parses, and past it is a syntax error
+    // rather than a stack overflow, however deep it goes.
+    int depths[] = {MAX_PARSE_DEPTH - 1, MAX_PARSE_DEPTH, 100000};
+    for (int i = 0; i < 3; i++) {
+        bool ok = depths[i] < MAX_PARSE_DEPTH;
+        assert(parse_nested_decl("const c = ", "(", "1", ")", ";", depths[i]) == ok);
+        assert(parse_nested_decl("const c = ", "- ", "1", "", ";", depths[i]) == ok);
+        assert(parse_nested_decl("const c = ", "f(", "1", ")", ";", depths[i]) == ok);
+        assert(parse_nested_decl("var v: ", "(", "int", ")", ";", depths[i]) == ok);
+        assert(parse_nested_decl("func f() { ", "{", "", "}", " }", depths[i]) == ok);
+        assert(parse_nested_decl("func f() { ", "switch (1) { default: ", "", "}", " }", depths[i]) == ok);
+    }
+}
@@ -0,0 +1,261 @@
+// Pipelined lexing
+//
+// A lexer thread scans ahead of the parser into a single-producer,
+// single-consumer ring of tokens. Each side owns one index and publishes it
+// with release ordering only once per batch of tokens, so the two cores
+// rarely touch the same cache line. A full ring holds the lexer back and an
+// empty one holds the parser; the waiting side spins briefly and then yields.
+// The end-of-file token is the last one the lexer writes, and the parser
+// keeps reading it from then on.
+//
+// The lexer thread does not report errors. A token it had trouble with is
+// flagged, and the parser scans that token again on its own thread, so the
+// messages come out exactly where the synchronous lexer prints them.
+#define TOKEN_RING_SIZE 4096
+#define TOKEN_RING_BATCH 64
+#define TOKEN_RING_SPINS 1000
+
+typedef struct TokenSlot {
+    Token token;
+    bool error;
+} TokenSlot;
+
+struct TokenRing {
+    TokenSlot *slots;
+    uint64_t mask;
+    uint64_t batch;
+    // Slots below tail hold tokens; written by the lexer thread.
+    _Alignas(64) _Atomic uint64_t tail;
+    // Slots below head have been read; written by the parser.
+    _Alignas(64) _Atomic uint64_t head;
+    // Set by the parser when it is done, even if the lexer is not.
+    _Atomic bool stop;
+    // The parser's side: the next slot to read and the last tail it saw.
+    _Alignas(64) uint64_t next;
+    uint64_t ready;
+    // The lexer thread's input and what it leaves behind.
+    const char *text;
+    const char *text_start;
+    SrcPos text_pos;
+    Arena str_arena;
+#if STATS
+    Stats stats;
+#endif
+};
+
+void token_ring_wait(int *spins) {
+    if (++*spins > TOKEN_RING_SPINS) {
+        sched_yield();
+    }
+}
+
+void token_ring_next(void) {
+    TokenRing *ring = token_ring;
+    if (token.kind == TOKEN_EOF) {
+        return;
+    }
+    if (ring->next == ring->ready) {
+        // Hand back the slots read so far before waiting on the lexer.
+        atomic_store_explicit(&ring->head, ring->next, memory_order_release);
+        int spins = 0;
+        while ((ring->ready = atomic_load_explicit(&ring->tail, memory_order_acquire)) == ring->next) {
+            token_ring_wait(&spins);
+        }
+    }
+    TokenSlot *slot = &ring->slots[ring->next & ring->mask];
+    // The scan of a token starts where the one before it ended, so an error
+    // in the comments before the token is found again too.
+    const char *scan_start = token.end;
+    token = slot->token;
+    if (slot->error) {
+        stream = scan_start;
+        scan_token();
+    }
+    ring->next++;
+    if ((ring->next & (ring->batch - 1)) == 0) {
+        atomic_store_explicit(&ring->head, ring->next, memory_order_release);
+    }
+}
+
+void *lex_thread(void *arg) {
+    TokenRing *ring = arg;
+    stream = ring->text;
+    stream_start = ring->text_start;
+    stream_pos = ring->text_pos;
+    defer_errors = true;
+    uint64_t size = ring->mask + 1;
+    uint64_t tail = 0;
+    uint64_t limit = size;
+    for (bool done = false; !done;) {
+        int spins = 0;
+        while (tail + ring->batch > limit) {
+            limit = atomic_load_explicit(&ring->head, memory_order_acquire) + size;
+            if (atomic_load_explicit(&ring->stop, memory_order_relaxed)) {
+                done = true;
+                break;
+            }
+            token_ring_wait(&spins);
+        }
+        for (uint64_t i = 0; i < ring->batch && !done; i++) {
+            deferred_error = false;
+            scan_token();
+            ring->slots[tail++ & ring->mask] = (TokenSlot){token, deferred_error};
+            done = token.kind == TOKEN_EOF;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+    scratch_free();
+    ring->str_arena = str_arena;
+#if STATS
+    ring->stats = stats;
+#endif
+    return NULL;
+}
+
+// Parses the rest of the current stream like parse_file, with the tokens
+// after the current one scanned on a second thread. ring_size is a power of
+// two of at least two batches.
+Decl **parse_file_pipelined(uint64_t ring_size, size_t *num_decls) {
+    assert(ring_size >= 4 && (ring_size & (ring_size - 1)) == 0);
+    TokenRing ring = {
+        .mask = ring_size - 1,
+        .batch = MIN(TOKEN_RING_BATCH, ring_size / 2),
+        .text = stream,
+        .text_start = stream_start,
+        .text_pos = stream_pos,
+    };
+    ring.slots = xcalloc(ring_size, sizeof(TokenSlot), ALLOC_MISC);
+    threads_active = true;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, lex_thread, &ring) != 0) {
+        threads_active = false;
+        xfree(ring.slots, ring_size * sizeof(TokenSlot), ALLOC_MISC);
+        return parse_file(num_decls);
+    }
+    token_ring = &ring;
+    Decl **decls = NULL;
+    bool failed = false;
+    jmp_buf *outer = fatal_jmp;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    if (setjmp(recover) == 0) {
+        decls = parse_file(num_decls);
+    } else {
+        failed = true;
+    }
+    fatal_jmp = outer;
+    token_ring = NULL;
+    atomic_store_explicit(&ring.stop, true, memory_order_relaxed);
+    pthread_join(thread, NULL);
+    threads_active = false;
+    arena_adopt(&str_arena, &ring.str_arena);
+#if STATS
+    stats_merge(&stats, &ring.stats);
+#endif
+    xfree(ring.slots, ring_size * sizeof(TokenSlot), ALLOC_MISC);
+    stream = token.end;
+    if (failed) {
+        fatal_exit();
+    }
+    return decls;
+}
+
+// A few kinds of declarations over and over, with a literal or two that the
+// lexer must decode.
+char *pipeline_source(size_t min_len) {
+    const char *decls[] = {
+        "func f%d(a: int, b: int): int { s := \"text %d\"; c := 'x'; if (a < b * 2 + %d) { return a << 3 | b; }\n"
+        "    for (i := 0; i < a; i++) { b = b * 31 + i % 7; } while (b > 100) { b = b / 2 - 1; } return a ^ b; }\n",
+        "struct S%d { x, y: float; next: S%d*; data: int[%d]; }\n",
+        "/// A global, %d of them.\nvar g%d: int = 0x%x + /* decimal */ 1.5e3 * %d;\n",
+        "enum E%d { A%d = %d, B%d, C%d = B%d + 1 }\n",
+    };
+    char *src = NULL;
+    char line[512];
+    for (int i = 0; buf_len(src) < min_len; i++) {
+        int n = snprintf(line, sizeof(line), decls[i % 4], i, i, i, i, i, i);
+        buf_pushn(src, line, n);
+    }
+    buf_push(src, 0);
+    return src;
+}
+
+double pipeline_bench_parse(const char *src, bool pipelined, size_t *num_decls) {
+    Session session = {0};
+    session_begin(&session);
+    init_stream("bench", src);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (pipelined) {
+        parse_file_pipelined(TOKEN_RING_SIZE, num_decls);
+    } else {
+        parse_file(num_decls);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    session_end(&session);
+    session_free(&session);
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9;
+}
+
+// Times one big file parsed with the lexer inline and on its own thread,
+// taking the best of several runs of each. With a single core the two
+// threads take turns and the pipeline cannot win.
+void pipeline_bench(void) {
+    char *src = pipeline_source(16 << 20);
+    double mb = (buf_len(src) - 1) / (1024.0 * 1024.0);
+    double best[2] = {1e9, 1e9};
+    size_t num_decls[2];
+    for (int run = 0; run < 5; run++) {
+        for (int pipelined = 0; pipelined < 2; pipelined++) {
+            best[pipelined] = MIN(best[pipelined], pipeline_bench_parse(src, pipelined, &num_decls[pipelined]));
+        }
+    }
+    printf("%.1f MB, %zu declarations, %ld cores online\n", mb, num_decls[0], sysconf(_SC_NPROCESSORS_ONLN));
+    printf("lexer inline:      %.1f ms, %.1f MB/s\n", best[0] * 1e3, mb / best[0]);
+    printf("lexer on a thread: %.1f ms, %.1f MB/s\n", best[1] * 1e3, mb / best[1]);
+    printf("speed-up: %.2fx\n", best[0] / best[1]);
+    if (num_decls[0] != num_decls[1]) {
+        printf("MISMATCH: the parses found different declarations\n");
+    }
+    buf_free(src);
+}
+
+void pipeline_test(void) {
+    char *src = pipeline_source(64 << 10);
+    init_stream("pipeline", src);
+    size_t num_expected;
+    Decl **expected = parse_file(&num_expected);
+    // Small rings make both sides wait on each other.
+    for (uint64_t size = 4; size <= TOKEN_RING_SIZE; size *= 8) {
+        rewind_stream();
+        size_t num_decls;
+        Decl **decls = parse_file_pipelined(size, &num_decls);
+        assert(num_decls == num_expected && decls_match(decls, expected, num_decls));
+        assert(is_token(TOKEN_EOF));
+    }
+    // Bodies skipped by the lazy parser are skipped in the token stream.
+    lazy_func_bodies = true;
+    rewind_stream();
+    size_t num_decls;
+    Decl **decls = parse_file_pipelined(64, &num_decls);
+    lazy_func_bodies = false;
+    assert(num_decls == num_expected && decls_match(decls, expected, num_decls));
+    buf_free(src);
+
+    // An error in the parser stops the lexer thread and reaches the caller.
+    init_stream("pipeline", "func f() {} var x = ; func g() {}");
+    jmp_buf *outer = fatal_jmp;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    bool failed = false;
+    bool quiet = defer_errors;
+    defer_errors = true;
+    if (setjmp(recover) == 0) {
+        parse_file_pipelined(4, &num_decls);
+    } else {
+        failed = true;
+    }
+    defer_errors = quiet;
+    fatal_jmp = outer;
+    assert(failed);
+}
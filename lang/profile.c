@@ -0,0 +1,390 @@
+// Interpreter profiler
+//
+// With a profile attached, ir_run_func reports every call, return and block
+// it enters. A block runs all of its instructions once it is entered, so the
+// counts per opcode and per source statement follow from the block counts and
+// the IR when the report is made. Calls are timed with the monotonic clock to
+// split each function's time into total time, callees included, and self
+// time. A tail call ends the caller's frame, so the callee's time is not part
+// of the caller's total.
+//
+// Sampling is driven by a CPU-time interval timer. The signal handler only
+// sets a flag; the interpreter notices it at the next block and records the
+// call stack. The samples are written as collapsed stacks ("main;f;g 12"),
+// the input format of flame graph tools. Without a profile the interpreter
+// pays one predictable branch per block and per call.
+#define PROFILE_SAMPLE_USEC 1000
+#define PROFILE_TOP_STMTS 20
+
+struct ProfileFunc {
+    IrFunc *func;
+    uint64_t calls;
+    double total;
+    double self;
+    // Frames of this function on the stack; only the outermost adds to total.
+    int active;
+    uint64_t *block_counts;
+    size_t num_blocks;
+};
+
+typedef struct ProfileFrame {
+    ProfileFunc *func;
+    double start;
+    double callees;
+} ProfileFrame;
+
+typedef struct ProfileSample {
+    const char *stack;
+    uint64_t count;
+} ProfileSample;
+
+struct IrProfile {
+    bool sampling;
+    ProfileFunc **funcs;
+    Map funcs_by_ir;
+    ProfileFrame *stack;
+    // Collapsed stacks, interned, with the index + 1 of their sample by stack.
+    ProfileSample *samples;
+    Map samples_by_stack;
+    uint64_t num_samples;
+    char *stack_text;
+};
+
+volatile sig_atomic_t profile_tick;
+
+void profile_signal(int sig) {
+    (void)sig;
+    profile_tick = 1;
+}
+
+double profile_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+ProfileFunc *profile_enter(IrProfile *profile, IrFunc *func) {
+    ProfileFunc *profiled = map_get(&profile->funcs_by_ir, func);
+    if (!profiled) {
+        profiled = xcalloc(1, sizeof(ProfileFunc), ALLOC_MISC);
+        profiled->func = func;
+        profiled->num_blocks = func->next_block_id;
+        profiled->block_counts = xcalloc(profiled->num_blocks, sizeof(uint64_t), ALLOC_MISC);
+        buf_push(profile->funcs, profiled);
+        map_put(&profile->funcs_by_ir, func, profiled);
+    }
+    profiled->calls++;
+    profiled->active++;
+    buf_push(profile->stack, (ProfileFrame){profiled, profile_now(), 0});
+    return profiled;
+}
+
+void profile_exit(IrProfile *profile) {
+    ProfileFrame frame = buf_pop(profile->stack);
+    double elapsed = profile_now() - frame.start;
+    frame.func->self += elapsed - frame.callees;
+    if (--frame.func->active == 0) {
+        frame.func->total += elapsed;
+    }
+    if (buf_len(profile->stack)) {
+        buf_end(profile->stack)[-1].callees += elapsed;
+    }
+}
+
+void profile_sample(IrProfile *profile) {
+    buf_truncate(profile->stack_text, 0);
+    for (ProfileFrame *it = profile->stack; it != buf_end(profile->stack); it++) {
+        if (it != profile->stack) {
+            buf_push(profile->stack_text, ';');
+        }
+        buf_pushn(profile->stack_text, it->func->func->name, strlen(it->func->func->name));
+    }
+    const char *stack = str_intern_range(profile->stack_text, buf_end(profile->stack_text));
+    uint64_t index = map_get_uint64(&profile->samples_by_stack, (uint64_t)(uintptr_t)stack);
+    if (!index) {
+        buf_push(profile->samples, (ProfileSample){stack, 0});
+        index = buf_len(profile->samples);
+        map_put_uint64(&profile->samples_by_stack, (uint64_t)(uintptr_t)stack, index);
+    }
+    profile->samples[index - 1].count++;
+    profile->num_samples++;
+}
+
+void profile_block(IrProfile *profile, ProfileFunc *func, Block *block) {
+    func->block_counts[block->id]++;
+    if (profile_tick) {
+        profile_tick = 0;
+        profile_sample(profile);
+    }
+}
+
+void profile_set_timer(long usec) {
+    struct itimerval timer = {{0, usec}, {0, usec}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Runs a function like ir_run, with the profile attached and sampling while it runs.
+int64_t profile_run(IrModule *module, const char *name, IrRun *run, IrProfile *profile) {
+    struct sigaction outer_action;
+    if (profile->sampling) {
+        struct sigaction action = {.sa_handler = profile_signal};
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = SA_RESTART;
+        sigaction(SIGPROF, &action, &outer_action);
+        profile_tick = 0;
+        profile_set_timer(PROFILE_SAMPLE_USEC);
+    }
+    jmp_buf *outer = fatal_jmp;
+    jmp_buf recover;
+    fatal_jmp = &recover;
+    bool failed = false;
+    int64_t result = 0;
+    if (setjmp(recover) == 0) {
+        result = ir_run_profiled(module, name, run, profile);
+    } else {
+        failed = true;
+    }
+    fatal_jmp = outer;
+    if (profile->sampling) {
+        profile_set_timer(0);
+        sigaction(SIGPROF, &outer_action, NULL);
+    }
+    // The frames of a failed run never returned.
+    while (buf_len(profile->stack)) {
+        profile_exit(profile);
+    }
+    if (failed) {
+        fatal_exit();
+    }
+    return result;
+}
+
+typedef struct ProfileStmt {
+    SrcPos pos;
+    uint64_t runs;
+    uint64_t instrs;
+    // Runs are the most any one instruction of the statement ran, taken per
+    // function since inlining copies a statement into several.
+    IrFunc *func;
+    uint64_t func_runs;
+} ProfileStmt;
+
+typedef struct ProfileOp {
+    Op op;
+    uint64_t count;
+} ProfileOp;
+
+int profile_func_cmp(const void *a, const void *b) {
+    const ProfileFunc *x = *(const ProfileFunc **)a;
+    const ProfileFunc *y = *(const ProfileFunc **)b;
+    if (x->self != y->self) {
+        return x->self < y->self ? 1 : -1;
+    }
+    return x->calls < y->calls ? 1 : x->calls > y->calls ? -1 : 0;
+}
+
+int profile_op_cmp(const void *a, const void *b) {
+    const ProfileOp *x = a;
+    const ProfileOp *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : (int)x->op - (int)y->op;
+}
+
+int profile_stmt_cmp(const void *a, const void *b) {
+    const ProfileStmt *x = a;
+    const ProfileStmt *y = b;
+    if (x->instrs != y->instrs) {
+        return x->instrs < y->instrs ? 1 : -1;
+    }
+    return x->pos < y->pos ? -1 : x->pos > y->pos;
+}
+
+// Adds up the block counts into counts per opcode, indexed by Op, and per
+// statement. Returns the statements, which the caller frees.
+ProfileStmt *profile_counts(IrProfile *profile, uint64_t *op_counts) {
+    memset(op_counts, 0, NUM_OPS * sizeof(uint64_t));
+    ProfileStmt *stmts = NULL;
+    Map stmts_by_pos = {0};
+    for (ProfileFunc **it = profile->funcs; it != buf_end(profile->funcs); it++) {
+        IrFunc *func = (*it)->func;
+        for (Block **block = func->blocks; block != buf_end(func->blocks); block++) {
+            uint64_t count = (*it)->block_counts[(*block)->id];
+            if (!count) {
+                continue;
+            }
+            for (Instr **instr = (*block)->instrs; instr != buf_end((*block)->instrs); instr++) {
+                op_counts[(*instr)->op] += count;
+                if (!(*instr)->pos) {
+                    continue;
+                }
+                uint64_t index = map_get_uint64(&stmts_by_pos, (*instr)->pos);
+                if (!index) {
+                    buf_push(stmts, (ProfileStmt){.pos = (*instr)->pos});
+                    index = buf_len(stmts);
+                    map_put_uint64(&stmts_by_pos, (*instr)->pos, index);
+                }
+                ProfileStmt *stmt = &stmts[index - 1];
+                if (stmt->func != func) {
+                    stmt->runs += stmt->func_runs;
+                    stmt->func = func;
+                    stmt->func_runs = 0;
+                }
+                stmt->func_runs = MAX(stmt->func_runs, count);
+                stmt->instrs += count;
+            }
+        }
+    }
+    for (ProfileStmt *it = stmts; it != buf_end(stmts); it++) {
+        it->runs += it->func_runs;
+        it->func_runs = 0;
+    }
+    map_free(&stmts_by_pos);
+    return stmts;
+}
+
+void profile_report(IrProfile *profile, IrRun *run) {
+    double total = run->seconds > 0 ? run->seconds : 1;
+    qsort(profile->funcs, buf_len(profile->funcs), sizeof(ProfileFunc *), profile_func_cmp);
+    printf("%-32s %12s %12s %12s %7s\n", "function", "calls", "total ms", "self ms", "self %");
+    for (ProfileFunc **it = profile->funcs; it != buf_end(profile->funcs); it++) {
+        printf("%-32s %12" PRIu64 " %12.3f %12.3f %6.1f%%\n", (*it)->func->name, (*it)->calls,
+               (*it)->total * 1e3, (*it)->self * 1e3, 100 * (*it)->self / total);
+    }
+
+    uint64_t op_counts[NUM_OPS];
+    ProfileStmt *stmts = profile_counts(profile, op_counts);
+    ProfileOp ops[NUM_OPS];
+    for (int op = 0; op < NUM_OPS; op++) {
+        ops[op] = (ProfileOp){op, op_counts[op]};
+    }
+    qsort(ops, NUM_OPS, sizeof(ProfileOp), profile_op_cmp);
+    uint64_t instrs = run->instrs ? run->instrs : 1;
+    printf("\n%-32s %12s %7s\n", "opcode", "count", "%");
+    for (int i = 0; i < NUM_OPS && ops[i].count; i++) {
+        printf("%-32s %12" PRIu64 " %6.1f%%\n", op_info[ops[i].op].name, ops[i].count, 100.0 * ops[i].count / instrs);
+    }
+
+    qsort(stmts, buf_len(stmts), sizeof(ProfileStmt), profile_stmt_cmp);
+    printf("\n%-32s %12s %12s\n", "statement", "runs", "instrs");
+    for (size_t i = 0; i < buf_len(stmts) && i < PROFILE_TOP_STMTS; i++) {
+        SrcLoc loc = srcpos_loc(stmts[i].pos);
+        char where[256];
+        snprintf(where, sizeof(where), "%s:%d:%d", loc.name ? loc.name : "?", loc.line, loc.col);
+        printf("%-32s %12" PRIu64 " %12" PRIu64 "\n", where, stmts[i].runs, stmts[i].instrs);
+    }
+    buf_free(stmts);
+    if (profile->sampling) {
+        printf("\n%" PRIu64 " samples every %d us of CPU time\n", profile->num_samples, PROFILE_SAMPLE_USEC);
+    }
+}
+
+// Writes the samples as collapsed stacks, one "caller;callee count" per line.
+bool profile_write_stacks(IrProfile *profile, const char *path) {
+    FILE *file = fopen(path, "w");
+    if (!file) {
+        printf("Cannot write samples to '%s': %s\n", path, strerror(errno));
+        return false;
+    }
+    for (ProfileSample *it = profile->samples; it != buf_end(profile->samples); it++) {
+        fprintf(file, "%s %" PRIu64 "\n", it->stack, it->count);
+    }
+    return fclose(file) == 0;
+}
+
+void profile_free(IrProfile *profile) {
+    for (ProfileFunc **it = profile->funcs; it != buf_end(profile->funcs); it++) {
+        xfree((*it)->block_counts, (*it)->num_blocks * sizeof(uint64_t), ALLOC_MISC);
+        xfree(*it, sizeof(ProfileFunc), ALLOC_MISC);
+    }
+    buf_free(profile->funcs);
+    map_free(&profile->funcs_by_ir);
+    buf_free(profile->stack);
+    buf_free(profile->samples);
+    map_free(&profile->samples_by_stack);
+    buf_free(profile->stack_text);
+}
+
+ProfileFunc *profile_find(IrProfile *profile, const char *name) {
+    for (ProfileFunc **it = profile->funcs; it != buf_end(profile->funcs); it++) {
+        if ((*it)->func->name == str_intern(name)) {
+            return *it;
+        }
+    }
+    return NULL;
+}
+
+void profile_test(void) {
+    const char *src =
+        "func fact(n: int): int { if (n <= 1) { return 1; } return n * fact(n - 1); }\n"
+        "func square(x: int): int { return x * x; }\n"
+        "func main(): int {\n"
+        "    s := 0;\n"
+        "    for (i := 0; i < 10; i++) {\n"
+        "        s += fact(i) + square(i);\n"
+        "    }\n"
+        "    return s;\n"
+        "}\n";
+    IrModule *module = ir_test_module(src, OPT_NONE);
+    IrProfile profile = {0};
+    IrRun run;
+    int64_t result = profile_run(module, "main", &run, &profile);
+    IrRun plain;
+    assert(result == ir_run(module, "main", &plain) && run.instrs == plain.instrs);
+    assert(buf_len(profile.stack) == 0);
+
+    ProfileFunc *fact = profile_find(&profile, "fact");
+    ProfileFunc *square = profile_find(&profile, "square");
+    ProfileFunc *main_func = profile_find(&profile, "main");
+    // fact(0) and fact(1) are one call each; fact(i) is i calls otherwise.
+    assert(fact->calls == 2 + (2 + 3 + 4 + 5 + 6 + 7 + 8 + 9) && square->calls == 10 && main_func->calls == 1);
+    assert(fact->active == 0 && main_func->total >= fact->total && main_func->total >= main_func->self);
+    assert(fact->self <= fact->total + 1e-9);
+
+    // Every instruction run is counted once, under its opcode.
+    uint64_t op_counts[NUM_OPS];
+    ProfileStmt *stmts = profile_counts(&profile, op_counts);
+    uint64_t sum = 0;
+    for (int op = 0; op < NUM_OPS; op++) {
+        sum += op_counts[op];
+    }
+    assert(sum == run.instrs && op_counts[OP_CALL] == run.calls - 1 && op_counts[OP_RET] == run.calls);
+    // The statement in the loop body runs ten times.
+    bool found = false;
+    for (ProfileStmt *it = stmts; it != buf_end(stmts); it++) {
+        SrcLoc loc = srcpos_loc(it->pos);
+        if (loc.line == 6) {
+            assert(it->runs == 10 && it->instrs > 10);
+            found = true;
+        }
+    }
+    assert(found);
+    buf_free(stmts);
+
+    // A pending tick records the stack at the next block.
+    profile_enter(&profile, main_func->func);
+    profile_tick = 1;
+    profile_block(&profile, main_func, main_func->func->blocks[0]);
+    profile_enter(&profile, fact->func);
+    profile_tick = 1;
+    profile_block(&profile, fact, fact->func->blocks[0]);
+    profile_exit(&profile);
+    profile_exit(&profile);
+    assert(profile.num_samples == 2 && buf_len(profile.samples) == 2);
+    assert(profile.samples[1].stack == str_intern("main;fact") && profile.samples[1].count == 1);
+    profile_free(&profile);
+    ir_test_free(module);
+
+    // Sampling, tail calls and the optimizer together keep the counts whole.
+    module = ir_test_module(src, OPT_FULL);
+    profile = (IrProfile){.sampling = true};
+    assert(profile_run(module, "main", &run, &profile) == result);
+    buf_free(stmts);
+    stmts = profile_counts(&profile, op_counts);
+    sum = 0;
+    for (int op = 0; op < NUM_OPS; op++) {
+        sum += op_counts[op];
+    }
+    assert(sum == run.instrs);
+    buf_free(stmts);
+    profile_free(&profile);
+    ir_test_free(module);
+}
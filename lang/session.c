@@ -0,0 +1,199 @@
+// Compilation sessions
+//
+// A session owns what one compile request allocates: AST nodes and node
+// lists, string literals, names first interned during the request and its
+// entries in the source file table. While a session is active those go to
+// the session instead of the global tier. Freeing a session releases its
+// arenas block by block, so the cost does not depend on how many objects
+// were allocated. Keywords and anything interned outside a session persist.
+//
+// Only one session is active at a time. Positions handed out inside a
+// session are only meaningful until it ends, since the source ranges are
+// reused by the next session, unless the session keeps its source files.
+typedef struct Session {
+    Arena ast_arena;
+    Arena str_arena;
+    InternMap interns;
+    // Intern names in the global tier instead, so they outlive the session and
+    // are shared with other sessions. Used by the compile server's file cache.
+    bool shared_interns;
+    // Keep the session's entries in the source file table until session_free,
+    // so that positions in its AST can still be reported after it ends. Their
+    // text belongs to the caller, so their lines are found when it ends. Kept
+    // files may take the positions of files that earlier sessions gave back.
+    bool keep_src_files;
+    // The bases of the kept source files.
+    SrcPos *src_bases;
+    // Global state swapped out while the session is active.
+    Arena outer_ast_arena;
+    Arena outer_str_arena;
+    size_t outer_num_src_files;
+    SrcPos outer_src_next_base;
+} Session;
+
+Session *current_session;
+
+void session_begin(Session *session) {
+    assert(!current_session);
+    session->outer_ast_arena = ast_arena;
+    session->outer_str_arena = str_arena;
+    session->outer_num_src_files = buf_len(src_files);
+    session->outer_src_next_base = src_next_base;
+    ast_arena = session->ast_arena.tag ? session->ast_arena : (Arena){.tag = ALLOC_AST};
+    str_arena = session->str_arena.tag ? session->str_arena : (Arena){.tag = ALLOC_STR};
+    session->interns.arena.tag = ALLOC_INTERN;
+    session_interns = session->shared_interns ? NULL : &session->interns;
+    src_owner = session->keep_src_files ? &session->src_bases : NULL;
+    current_session = session;
+}
+
+// Deactivates the session. Its memory stays valid until session_free.
+void session_end(Session *session) {
+    assert(current_session == session);
+    session->ast_arena = ast_arena;
+    session->str_arena = str_arena;
+    ast_arena = session->outer_ast_arena;
+    str_arena = session->outer_str_arena;
+    if (session->keep_src_files) {
+        for (SrcPos *it = session->src_bases; it != buf_end(session->src_bases); it++) {
+            SrcFile *file = srcpos_file(*it);
+            if (!file->line_starts) {
+                src_file_build_lines(file);
+            }
+            file->text = NULL;
+        }
+    } else {
+        for (SrcFile *it = src_files + session->outer_num_src_files; it != buf_end(src_files); it++) {
+            buf_free(it->line_starts);
+        }
+        if (src_files) {
+            buf__hdr(src_files)->len = session->outer_num_src_files;
+        }
+        src_next_base = session->outer_src_next_base;
+    }
+    session_interns = NULL;
+    src_owner = NULL;
+    current_session = NULL;
+}
+
+void session_free_src_files(Session *session) {
+    if (session->src_bases) {
+        assert(!current_session);
+        for (SrcPos *it = session->src_bases; it != buf_end(session->src_bases); it++) {
+            src_file_remove(*it);
+        }
+        buf_free(session->src_bases);
+    }
+}
+
+// Rewinds an ended session so the next request can reuse it without going
+// back to malloc: its arenas and intern table keep their first block.
+void session_reset(Session *session) {
+    assert(current_session != session);
+    session_free_src_files(session);
+    arena_reset(&session->ast_arena);
+    arena_reset(&session->str_arena);
+    intern_map_reset(&session->interns);
+}
+
+void session_free(Session *session) {
+    assert(current_session != session);
+    session_free_src_files(session);
+    arena_free(&session->ast_arena);
+    arena_free(&session->str_arena);
+    intern_map_free(&session->interns);
+}
+
+void session_test(void) {
+    bool enabled = alloc_telemetry;
+    alloc_telemetry = true;
+    const char *kw = str_intern("while");
+    size_t global_len = global_interns.len;
+    uint64_t live = alloc_stats.live;
+    for (int i = 0; i < 3; i++) {
+        Session session = {0};
+        session_begin(&session);
+        init_stream("session", "func session_only(x: int) { while (x) { s := \"literal\"; } }");
+        size_t num_decls;
+        Decl **decls = parse_file(&num_decls);
+        assert(num_decls == 1 && decls[0]->name == str_intern("session_only"));
+        assert(str_intern("while") == kw);
+        session_end(&session);
+        assert(global_interns.len == global_len);
+        assert(session.interns.len >= 1);
+        session_free(&session);
+        assert(alloc_stats.live == live);
+    }
+
+    // A rewound session serves the same request again from the blocks it
+    // already has.
+    Session reused = {0};
+    uint64_t allocs = 0;
+    for (int i = 0; i < 3; i++) {
+        session_begin(&reused);
+        init_stream("reused", "func reused(x: int) { while (x) { s := \"literal\"; } }");
+        size_t num_decls;
+        Decl **decls = parse_file(&num_decls);
+        assert(num_decls == 1 && decls[0]->name == str_intern("reused"));
+        session_end(&reused);
+        session_reset(&reused);
+        uint64_t session_allocs = alloc_stats.tags[ALLOC_AST].allocs + alloc_stats.tags[ALLOC_STR].allocs +
+                                  alloc_stats.tags[ALLOC_INTERN].allocs;
+        assert(i == 0 || session_allocs == allocs);
+        allocs = session_allocs;
+    }
+    assert(global_interns.len == global_len);
+    session_free(&reused);
+    assert(alloc_stats.live == live);
+    alloc_telemetry = enabled;
+
+    // Kept source files still give positions their lines after the session
+    // ends and their text is gone, and other sessions do not reuse them.
+    SrcPos next_base = src_next_base;
+    Session kept = {.keep_src_files = true};
+    session_begin(&kept);
+    char text[] = "var k = 1;\n  var l = 2;\n";
+    init_stream("kept", text);
+    size_t num_decls;
+    Decl **decls = parse_file(&num_decls);
+    session_end(&kept);
+    memset(text, '\n', sizeof(text) - 1);
+    Session other = {0};
+    session_begin(&other);
+    init_stream("other", "var m = 3;");
+    assert(srcpos_file(token.pos)->base > kept.src_bases[0]);
+    session_end(&other);
+    session_free(&other);
+    SrcPos pos = decls[1]->pos;
+    SrcLoc loc = srcpos_loc(pos);
+    assert(num_decls == 2 && loc.line == 2 && loc.col == 3 && strcmp(loc.name, "kept") == 0);
+    session_free(&kept);
+    assert(src_next_base == next_base && srcpos_file(pos) == NULL);
+
+    // Positions given back below the top are handed out again to kept files
+    // that fit, and the top comes down once everything above is free.
+    const char *texts[] = {"var a = 1;", "var b = 2;", "var c = 3;", "var d = 4;"};
+    Session files[4];
+    for (int i = 0; i < 4; i++) {
+        files[i] = (Session){.keep_src_files = true};
+        session_begin(&files[i]);
+        init_stream(texts[i], texts[i]);
+        session_end(&files[i]);
+    }
+    SrcPos top = src_next_base;
+    SrcPos first = files[0].src_bases[0];
+    SrcPos second = files[1].src_bases[0];
+    session_free(&files[1]);
+    session_free(&files[0]);
+    assert(srcpos_file(first) == NULL && srcpos_file(second) == NULL);
+    Session refill = {.keep_src_files = true};
+    session_begin(&refill);
+    init_stream("refill", "var refilled = 12345;");
+    session_end(&refill);
+    assert(refill.src_bases[0] == first && src_next_base == top);
+    assert(strcmp(srcpos_loc(first + 4).name, "refill") == 0);
+    session_free(&files[3]);
+    session_free(&refill);
+    session_free(&files[2]);
+    assert(src_next_base == next_base && buf_len(src_free_ranges) == 0);
+}
@@ -0,0 +1,186 @@
+#if STATS
+
+const char *phase_names[NUM_PHASES] = {
+    [PHASE_LOAD] = "load",
+    [PHASE_LEX] = "lex",
+    [PHASE_INTERN] = "intern",
+    [PHASE_PARSE] = "parse",
+    [PHASE_RESOLVE] = "resolve",
+    [PHASE_CHECK] = "check",
+    [PHASE_LOWER] = "lower",
+    [PHASE_OPT] = "opt",
+};
+
+const char *typespec_kind_names[STATS_MAX_KINDS] = {
+    [TYPESPEC_NAME] = "name",
+    [TYPESPEC_FUNC] = "func",
+    [TYPESPEC_ARRAY] = "array",
+    [TYPESPEC_PTR] = "ptr",
+};
+
+const char *expr_kind_names[STATS_MAX_KINDS] = {
+    [EXPR_INT] = "int",
+    [EXPR_FLOAT] = "float",
+    [EXPR_STR] = "str",
+    [EXPR_NAME] = "name",
+    [EXPR_CAST] = "cast",
+    [EXPR_CALL] = "call",
+    [EXPR_INDEX] = "index",
+    [EXPR_FIELD] = "field",
+    [EXPR_COMPOUND] = "compound",
+    [EXPR_UNARY] = "unary",
+    [EXPR_BINARY] = "binary",
+    [EXPR_TERNARY] = "ternary",
+};
+
+const char *stmt_kind_names[STATS_MAX_KINDS] = {
+    [STMT_RETURN] = "return",
+    [STMT_BREAK] = "break",
+    [STMT_CONTINUE] = "continue",
+    [STMT_BLOCK] = "block",
+    [STMT_IF] = "if",
+    [STMT_WHILE] = "while",
+    [STMT_FOR] = "for",
+    [STMT_DO] = "do",
+    [STMT_SWITCH] = "switch",
+    [STMT_ASSIGN] = "assign",
+    [STMT_AUTO_ASSIGN] = "auto_assign",
+    [STMT_EXPR] = "expr",
+};
+
+const char *decl_kind_names[STATS_MAX_KINDS] = {
+    [DECL_ENUM] = "enum",
+    [DECL_STRUCT] = "struct",
+    [DECL_UNION] = "union",
+    [DECL_VAR] = "var",
+    [DECL_CONST] = "const",
+    [DECL_TYPEDEF] = "typedef",
+    [DECL_FUNC] = "func",
+};
+
+typedef struct NodeCounts {
+    const char *name;
+    const uint64_t *counts;
+    const char **kind_names;
+} NodeCounts;
+
+// The phase whose time includes the given one, or NULL. Lexing is part of
+// parsing unless nothing was parsed.
+const char *phase_part_of(int phase) {
+    switch (phase) {
+    case PHASE_INTERN:
+        return "lex";
+    case PHASE_LEX:
+        return stats.phases[PHASE_PARSE].wall > 0 ? "parse" : NULL;
+    case PHASE_RESOLVE:
+        return "check";
+    default:
+        return NULL;
+    }
+}
+
+// Interning, and lexing for the parser, are timed call by call with the wall
+// clock only, since the process CPU clock is a system call.
+bool phase_wall_only(int phase) {
+    return phase == PHASE_INTERN || (phase == PHASE_LEX && phase_part_of(phase));
+}
+
+double per_sec(uint64_t n, double secs) {
+    return secs > 0 ? n / secs : 0;
+}
+
+void print_stats(bool json) {
+    assert(EXPR_TERNARY < STATS_MAX_KINDS && STMT_EXPR < STATS_MAX_KINDS);
+    assert(DECL_FUNC < STATS_MAX_KINDS && TYPESPEC_PTR < STATS_MAX_KINDS);
+    NodeCounts nodes[] = {
+        {"typespec", stats.typespecs, typespec_kind_names},
+        {"expr", stats.exprs, expr_kind_names},
+        {"stmt", stats.stmts, stmt_kind_names},
+        {"decl", stats.decls, decl_kind_names},
+    };
+    size_t num_nodes = sizeof(nodes)/sizeof(*nodes);
+    double lex_wall = stats.phases[PHASE_LEX].wall;
+    double hit_rate = stats.intern_lookups ? (double)stats.intern_hits / stats.intern_lookups : 0;
+    uint64_t num_interns = stats.intern_entries;
+    if (json) {
+        printf("{\"files\": %" PRIu64 ", \"files_cached\": %" PRIu64 ", \"checks_cached\": %" PRIu64
+               ", \"bytes\": %" PRIu64 ", \"tokens\": %" PRIu64 ",\n",
+               stats.files, stats.files_cached, stats.checks_cached, stats.bytes, stats.tokens);
+        printf(" \"phases\": {");
+        for (int i = 0; i < NUM_PHASES; i++) {
+            printf("%s\"%s\": {\"wall_ms\": %.3f, ", i ? ", " : "", phase_names[i], stats.phases[i].wall * 1e3);
+            if (phase_wall_only(i)) {
+                printf("\"cpu_ms\": null");
+            } else {
+                printf("\"cpu_ms\": %.3f", stats.phases[i].cpu * 1e3);
+            }
+            if (phase_part_of(i)) {
+                printf(", \"part_of\": \"%s\"", phase_part_of(i));
+            }
+            printf("}");
+        }
+        printf("},\n");
+        printf(" \"lex_bytes_per_sec\": %.0f, \"lex_tokens_per_sec\": %.0f,\n",
+               per_sec(stats.bytes, lex_wall), per_sec(stats.tokens, lex_wall));
+        printf(" \"lazy_bodies\": {\"skipped\": %" PRIu64 ", \"parsed\": %" PRIu64 "},\n",
+               stats.lazy_bodies, stats.lazy_bodies_parsed);
+        printf(" \"interner\": {\"entries\": %" PRIu64 ", \"lookups\": %" PRIu64 ", \"hits\": %" PRIu64 ", \"hit_rate\": %.4f},\n",
+               num_interns, stats.intern_lookups, stats.intern_hits, hit_rate);
+        printf(" \"ast\": {");
+        for (size_t i = 0; i < num_nodes; i++) {
+            printf("%s\"%s\": {", i ? ", " : "", nodes[i].name);
+            bool first = true;
+            for (int kind = 0; kind < STATS_MAX_KINDS; kind++) {
+                if (nodes[i].kind_names[kind]) {
+                    printf("%s\"%s\": %" PRIu64, first ? "" : ", ", nodes[i].kind_names[kind], nodes[i].counts[kind]);
+                    first = false;
+                }
+            }
+            printf("}");
+        }
+        printf("},\n");
+        printf(" \"arena\": {\"reserved\": %" PRIu64 ", \"used\": %" PRIu64 "}}\n",
+               stats.arena_reserved, stats.arena_used);
+        return;
+    }
+    printf("files %" PRIu64 ", %" PRIu64 " bytes, %" PRIu64 " tokens\n", stats.files, stats.bytes, stats.tokens);
+    if (stats.files_cached) {
+        printf("cached files %" PRIu64 " (not reparsed)\n", stats.files_cached);
+    }
+    if (stats.checks_cached) {
+        printf("cached checks %" PRIu64 " (not rechecked)\n", stats.checks_cached);
+    }
+    printf("%-8s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (int i = 0; i < NUM_PHASES; i++) {
+        printf("%-8s %12.3f ", phase_names[i], stats.phases[i].wall * 1e3);
+        if (phase_wall_only(i)) {
+            printf("%12s", "-");
+        } else {
+            printf("%12.3f", stats.phases[i].cpu * 1e3);
+        }
+        if (phase_part_of(i)) {
+            printf("  (part of %s)", phase_part_of(i));
+        }
+        printf("\n");
+    }
+    printf("lex throughput: %.2f MB/s, %.0f tokens/s\n",
+           per_sec(stats.bytes, lex_wall) / (1024 * 1024), per_sec(stats.tokens, lex_wall));
+    if (stats.lazy_bodies) {
+        printf("lazy bodies: %" PRIu64 " skipped, %" PRIu64 " parsed on use\n", stats.lazy_bodies, stats.lazy_bodies_parsed);
+    }
+    printf("interner: %" PRIu64 " entries, %" PRIu64 " lookups, %.1f%% hits\n",
+           num_interns, stats.intern_lookups, 100 * hit_rate);
+    for (size_t i = 0; i < num_nodes; i++) {
+        printf("%s nodes:", nodes[i].name);
+        for (int kind = 0; kind < STATS_MAX_KINDS; kind++) {
+            if (nodes[i].counts[kind]) {
+                printf(" %s=%" PRIu64, nodes[i].kind_names[kind], nodes[i].counts[kind]);
+            }
+        }
+        printf("\n");
+    }
+    printf("arena: %" PRIu64 " bytes reserved, %" PRIu64 " used (%.1f%%)\n", stats.arena_reserved, stats.arena_used,
+           stats.arena_reserved ? 100.0 * stats.arena_used / stats.arena_reserved : 0);
+}
+
+#endif
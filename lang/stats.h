@@ -0,0 +1,149 @@
+// Pipeline statistics for --stats
+//
+// Counters cost a single increment and phase timers two clock reads. Both
+// compile out completely when STATS is 0, which is the default whenever
+// NDEBUG is defined (release builds).
+#ifndef STATS
+#ifdef NDEBUG
+#define STATS 0
+#else
+#define STATS 1
+#endif
+#endif
+
+typedef enum Phase {
+    PHASE_LOAD,
+    PHASE_LEX,
+    PHASE_INTERN,
+    PHASE_PARSE,
+    PHASE_RESOLVE,
+    PHASE_CHECK,
+    PHASE_LOWER,
+    PHASE_OPT,
+    NUM_PHASES,
+} Phase;
+
+#define STATS_MAX_KINDS 16
+
+typedef struct Timer {
+    double wall;
+    double cpu;
+} Timer;
+
+typedef struct Stats {
+    Timer phases[NUM_PHASES];
+    uint64_t files;
+    // Files whose parse was reused from the compile server's cache.
+    uint64_t files_cached;
+    // Files whose check diagnostics were reused from the same cache.
+    uint64_t checks_cached;
+    // Function bodies skipped by the parser, and how many of them were parsed later.
+    uint64_t lazy_bodies;
+    uint64_t lazy_bodies_parsed;
+    uint64_t bytes;
+    uint64_t tokens;
+    uint64_t intern_lookups;
+    uint64_t intern_hits;
+    uint64_t intern_entries;
+    uint64_t typespecs[STATS_MAX_KINDS];
+    uint64_t exprs[STATS_MAX_KINDS];
+    uint64_t stmts[STATS_MAX_KINDS];
+    uint64_t decls[STATS_MAX_KINDS];
+    uint64_t arena_reserved;
+    uint64_t arena_used;
+} Stats;
+
+#if STATS
+
+// Each parser thread counts into its own copy, merged by the thread that started it.
+_Thread_local Stats stats;
+// Lexing and interning happen a token and a name at a time inside other
+// phases. Two clock reads cost about as much as lexing a token, so only one
+// token or name in STATS_SAMPLE_PERIOD is timed, less the cost of a clock
+// read, and the sample is scaled up. This only happens while a report is wanted.
+#define STATS_SAMPLE_PERIOD 64
+bool stats_timing;
+double stats_clock_cost;
+_Thread_local uint32_t stats_lex_samples;
+_Thread_local uint32_t stats_intern_samples;
+
+double timer_wall(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+Timer timer_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (Timer){timer_wall(), ts.tv_sec + ts.tv_nsec * 1e-9};
+}
+
+// Starts timing lexing and interning, measuring the cost of a clock read the first time.
+void stats_timing_begin(void) {
+    if (!stats_clock_cost) {
+        double best = 1;
+        for (int i = 0; i < 256; i++) {
+            double start = timer_wall();
+            double cost = timer_wall() - start;
+            best = cost < best ? cost : best;
+        }
+        stats_clock_cost = best;
+    }
+    stats_timing = true;
+}
+
+// Returns the start of a sample, or 0 for a token or name that is not timed.
+double stats_sample_begin(uint32_t *count) {
+    return stats_timing && ++*count % STATS_SAMPLE_PERIOD == 0 ? timer_wall() : 0;
+}
+
+void stats_sample_end(Phase phase, double start) {
+    if (start) {
+        double elapsed = timer_wall() - start - stats_clock_cost;
+        stats.phases[phase].wall += elapsed > 0 ? elapsed * STATS_SAMPLE_PERIOD : 0;
+    }
+}
+
+void stats_phase_add(Phase phase, Timer start) {
+    Timer end = timer_now();
+    stats.phases[phase].wall += end.wall - start.wall;
+    stats.phases[phase].cpu += end.cpu - start.cpu;
+}
+
+// Adds the counters of a worker thread's stats. Workers only time lexing and
+// interning, which are parts of the phase that started them.
+void stats_merge(Stats *into, const Stats *from) {
+    into->phases[PHASE_LEX].wall += from->phases[PHASE_LEX].wall;
+    into->phases[PHASE_INTERN].wall += from->phases[PHASE_INTERN].wall;
+    // Everything after the phase timers is a uint64_t counter.
+    uint64_t *dest = &into->files;
+    const uint64_t *src = &from->files;
+    size_t count = (sizeof(Stats) - offsetof(Stats, files)) / sizeof(uint64_t);
+    for (size_t i = 0; i < count; i++) {
+        dest[i] += src[i];
+    }
+}
+
+#define STAT_ADD(field, n) (stats.field += (n))
+#define STAT_INC(field) STAT_ADD(field, 1)
+#define STATS_PHASE_BEGIN(timer) Timer timer = timer_now()
+#define STATS_PHASE_END(timer, phase) stats_phase_add(phase, timer)
+// Sampled with the wall clock only; the process CPU clock is a system call.
+#define STATS_INTERN_BEGIN(start) double start = stats_sample_begin(&stats_intern_samples)
+#define STATS_INTERN_END(start) stats_sample_end(PHASE_INTERN, start)
+#define STATS_LEX_BEGIN(start) double start = stats_sample_begin(&stats_lex_samples)
+#define STATS_LEX_END(start) stats_sample_end(PHASE_LEX, start)
+
+#else
+
+#define STAT_ADD(field, n) ((void)0)
+#define STAT_INC(field) ((void)0)
+#define STATS_PHASE_BEGIN(timer)
+#define STATS_PHASE_END(timer, phase) ((void)0)
+#define STATS_INTERN_BEGIN(start)
+#define STATS_INTERN_END(start) ((void)0)
+#define STATS_LEX_BEGIN(start)
+#define STATS_LEX_END(start) ((void)0)
+
+#endif
@@ -0,0 +1,409 @@
+// Conway's Game of Life, 64 cells to a machine word
+//
+// Each row of the board is a run of 64-bit words with cell x in bit x % 64
+// of word x / 64, and the bits past the width kept clear. A generation never
+// looks at a single cell. Shifting a row one bit either way, wrapped around at
+// its ends, lines every cell up with its west and east neighbours, and a
+// bitwise full adder over the three gives each cell the 2-bit count of live
+// cells in the three-wide strip centred on it. Adding the strips of the row
+// above, the row itself and the row below counts the 3x3 block around each
+// cell, which is all the rule needs: a cell is alive next if its block holds
+// 3 live cells, or holds 4 and the cell is alive itself. Each step is the same
+// bitwise operation on every word of a row, so the compiler turns the loops
+// into 128- or 256-bit vector operations where the target has them.
+//
+// Threads take bands of rows. Each keeps the strip sums of three rows in a
+// rolling window, and all of them meet at a barrier between generations,
+// since the next one reads the rows at the edges of the neighbouring bands.
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "life.h"
+
+#define MIN(x, y) ((x) <= (y) ? (x) : (y))
+#define MAX(x, y) ((x) >= (y) ? (x) : (y))
+
+// Fewer rows than this per thread cost more in barrier waits than they save.
+#define LIFE_MIN_BAND 8
+
+struct Life {
+    int width;
+    int height;
+    // Words per row, and the cells of the last word that are on the board.
+    size_t words;
+    uint64_t last_mask;
+    // The current board is cells[current]; a step writes the other.
+    uint64_t *cells[2];
+    int current;
+    uint64_t generation;
+};
+
+Life *life_new(int width, int height) {
+    if (width <= 0 || height <= 0) {
+        return NULL;
+    }
+    Life *life = calloc(1, sizeof(Life));
+    if (!life) {
+        return NULL;
+    }
+    life->width = width;
+    life->height = height;
+    life->words = ((size_t)width + 63) / 64;
+    life->last_mask = width % 64 ? (1ull << (width % 64)) - 1 : ~0ull;
+    for (int i = 0; i < 2; i++) {
+        life->cells[i] = calloc(life->words * (size_t)height, sizeof(uint64_t));
+        if (!life->cells[i]) {
+            life_free(life);
+            return NULL;
+        }
+    }
+    return life;
+}
+
+void life_free(Life *life) {
+    if (life) {
+        free(life->cells[0]);
+        free(life->cells[1]);
+        free(life);
+    }
+}
+
+int life_width(const Life *life) {
+    return life->width;
+}
+
+int life_height(const Life *life) {
+    return life->height;
+}
+
+uint64_t life_generation(const Life *life) {
+    return life->generation;
+}
+
+uint64_t *life_row(const Life *life, int buffer, int y) {
+    return life->cells[buffer] + (size_t)y * life->words;
+}
+
+bool life_get(const Life *life, int x, int y) {
+    return (life_row(life, life->current, y)[x / 64] >> (x % 64)) & 1;
+}
+
+void life_set(Life *life, int x, int y, bool alive) {
+    uint64_t *word = &life_row(life, life->current, y)[x / 64];
+    uint64_t bit = 1ull << (x % 64);
+    *word = alive ? *word | bit : *word & ~bit;
+}
+
+void life_get_cells(const Life *life, uint8_t *cells) {
+    for (int y = 0; y < life->height; y++) {
+        const uint64_t *row = life_row(life, life->current, y);
+        for (int x = 0; x < life->width; x++) {
+            *cells++ = (row[x / 64] >> (x % 64)) & 1;
+        }
+    }
+}
+
+void life_set_cells(Life *life, const uint8_t *cells) {
+    for (int y = 0; y < life->height; y++) {
+        uint64_t *row = life_row(life, life->current, y);
+        memset(row, 0, life->words * sizeof(uint64_t));
+        for (int x = 0; x < life->width; x++) {
+            row[x / 64] |= (uint64_t)(*cells++ != 0) << (x % 64);
+        }
+    }
+}
+
+// splitmix64, which is good for any seed including 0.
+uint64_t life_random(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+void life_randomize(Life *life, uint64_t seed) {
+    for (int y = 0; y < life->height; y++) {
+        uint64_t *row = life_row(life, life->current, y);
+        for (size_t w = 0; w < life->words; w++) {
+            row[w] = life_random(&seed);
+        }
+        row[life->words - 1] &= life->last_mask;
+    }
+}
+
+uint64_t life_population(const Life *life) {
+    uint64_t count = 0;
+    const uint64_t *cells = life->cells[life->current];
+    for (size_t i = 0; i < life->words * (size_t)life->height; i++) {
+        count += __builtin_popcountll(cells[i]);
+    }
+    return count;
+}
+
+// Sums each cell of a row with its west and east neighbours into the 2-bit
+// count sum1:sum0. west and east are scratch rows.
+void life_strip_sums(const Life *life, const uint64_t *restrict row, uint64_t *restrict west,
+                     uint64_t *restrict east, uint64_t *restrict sum0, uint64_t *restrict sum1) {
+    size_t n = life->words;
+    int top = (life->width - 1) % 64;
+    west[0] = (row[0] << 1) | ((row[n - 1] >> top) & 1);
+    for (size_t w = 1; w < n; w++) {
+        west[w] = (row[w] << 1) | (row[w - 1] >> 63);
+    }
+    for (size_t w = 0; w + 1 < n; w++) {
+        east[w] = (row[w] >> 1) | (row[w + 1] << 63);
+    }
+    east[n - 1] = (row[n - 1] >> 1) | ((row[0] & 1) << top);
+    for (size_t w = 0; w < n; w++) {
+        uint64_t a = west[w], b = row[w], c = east[w];
+        sum0[w] = a ^ b ^ c;
+        sum1[w] = (a & b) | (c & (a ^ b));
+    }
+}
+
+// Adds the strip sums of the rows above, at and below a row into the count
+// of each 3x3 block, and writes the next state of the row.
+void life_next_row(const Life *life, uint64_t *sums[3][2], const uint64_t *restrict alive,
+                   uint64_t *restrict next) {
+    const uint64_t *restrict t0 = sums[0][0], *restrict t1 = sums[0][1];
+    const uint64_t *restrict m0 = sums[1][0], *restrict m1 = sums[1][1];
+    const uint64_t *restrict b0 = sums[2][0], *restrict b1 = sums[2][1];
+    for (size_t w = 0; w < life->words; w++) {
+        // The ones of the count, and the carry of adding them up.
+        uint64_t ones = t0[w] ^ m0[w] ^ b0[w];
+        uint64_t carry = (t0[w] & m0[w]) | (b0[w] & (t0[w] ^ m0[w]));
+        // The twos: the three strips' twos and the carry, four bits summed
+        // to twos_lo + 2 * (twos_hi + twos_carry).
+        uint64_t strips = t1[w] ^ m1[w] ^ b1[w];
+        uint64_t twos_hi = (t1[w] & m1[w]) | (b1[w] & (t1[w] ^ m1[w]));
+        uint64_t twos_lo = strips ^ carry;
+        uint64_t twos_carry = strips & carry;
+        uint64_t three = ones & twos_lo & ~(twos_hi | twos_carry);
+        uint64_t four = ~ones & ~twos_lo & (twos_hi ^ twos_carry);
+        next[w] = three | (four & alive[w]);
+    }
+    next[life->words - 1] &= life->last_mask;
+}
+
+typedef struct LifeRun {
+    Life *life;
+    int generations;
+    int num_bands;
+    pthread_barrier_t barrier;
+    // The threads wait here until the bands are laid out.
+    pthread_mutex_t lock;
+    pthread_cond_t start;
+    bool ready;
+} LifeRun;
+
+typedef struct LifeBand {
+    LifeRun *run;
+    int index;
+    uint64_t *scratch;
+} LifeBand;
+
+// Rows of words of scratch per band: the shifted neighbours of a row and the
+// strip sums of three rows.
+#define LIFE_SCRATCH_ROWS 8
+
+// Steps rows [begin, end) generation after generation, meeting the other
+// bands at the barrier in between.
+void life_run_band(LifeRun *run, uint64_t *scratch, int begin, int end) {
+    Life *life = run->life;
+    size_t n = life->words;
+    int height = life->height;
+    uint64_t *west = scratch, *east = scratch + n;
+    uint64_t *window[3][2];
+    for (int i = 0; i < 3; i++) {
+        window[i][0] = scratch + (2 + 2 * i) * n;
+        window[i][1] = scratch + (3 + 2 * i) * n;
+    }
+    for (int gen = 0; gen < run->generations; gen++) {
+        int from = (life->current + gen) & 1;
+        uint64_t *sums[3][2];
+        memcpy(sums, window, sizeof(sums));
+        life_strip_sums(life, life_row(life, from, (begin + height - 1) % height), west, east, sums[0][0], sums[0][1]);
+        life_strip_sums(life, life_row(life, from, begin), west, east, sums[1][0], sums[1][1]);
+        for (int y = begin; y < end; y++) {
+            life_strip_sums(life, life_row(life, from, (y + 1) % height), west, east, sums[2][0], sums[2][1]);
+            life_next_row(life, sums, life_row(life, from, y), life_row(life, !from, y));
+            // The row below becomes the middle one and the top one is reused.
+            uint64_t *top0 = sums[0][0], *top1 = sums[0][1];
+            memmove(sums[0], sums[1], 2 * sizeof(sums[0]));
+            sums[2][0] = top0;
+            sums[2][1] = top1;
+        }
+        if (run->num_bands > 1) {
+            pthread_barrier_wait(&run->barrier);
+        }
+    }
+}
+
+void life_band_rows(LifeRun *run, int index, int *begin, int *end) {
+    int height = run->life->height;
+    *begin = (int)((int64_t)height * index / run->num_bands);
+    *end = (int)((int64_t)height * (index + 1) / run->num_bands);
+}
+
+void *life_band_thread(void *arg) {
+    LifeBand *band = arg;
+    LifeRun *run = band->run;
+    pthread_mutex_lock(&run->lock);
+    while (!run->ready) {
+        pthread_cond_wait(&run->start, &run->lock);
+    }
+    pthread_mutex_unlock(&run->lock);
+    // Threads past the bands that could be set up have nothing to do.
+    if (band->index < run->num_bands) {
+        int begin, end;
+        life_band_rows(run, band->index, &begin, &end);
+        life_run_band(run, band->scratch, begin, end);
+    }
+    return NULL;
+}
+
+bool life_step(Life *life, int generations, int threads) {
+    if (generations <= 0) {
+        return true;
+    }
+    LifeRun run = {.life = life, .generations = generations};
+    threads = MAX(1, MIN(threads, life->height / LIFE_MIN_BAND));
+    size_t band_words = LIFE_SCRATCH_ROWS * life->words;
+    // Every band's scratch is had before any thread starts. Without room for
+    // all of them, the calling thread steps the whole board alone.
+    uint64_t *scratch = malloc(threads * band_words * sizeof(uint64_t));
+    if (!scratch && threads > 1) {
+        threads = 1;
+        scratch = malloc(band_words * sizeof(uint64_t));
+    }
+    if (!scratch) {
+        return false;
+    }
+    pthread_t *handles = threads > 1 ? calloc(threads, sizeof(pthread_t)) : NULL;
+    LifeBand *bands = threads > 1 ? calloc(threads, sizeof(LifeBand)) : NULL;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.start, NULL);
+    // The calling thread takes band 0. The bands are laid out once it is known
+    // how many threads could be started.
+    int started = 0;
+    if (handles && bands) {
+        for (; started < threads - 1; started++) {
+            bands[started] = (LifeBand){&run, started + 1, scratch + (started + 1) * band_words};
+            if (pthread_create(&handles[started], NULL, life_band_thread, &bands[started]) != 0) {
+                break;
+            }
+        }
+    }
+    run.num_bands = started + 1;
+    if (run.num_bands > 1 && pthread_barrier_init(&run.barrier, NULL, run.num_bands) != 0) {
+        run.num_bands = 1;
+    }
+    pthread_mutex_lock(&run.lock);
+    run.ready = true;
+    pthread_cond_broadcast(&run.start);
+    pthread_mutex_unlock(&run.lock);
+    int begin, end;
+    life_band_rows(&run, 0, &begin, &end);
+    life_run_band(&run, scratch, begin, end);
+    for (int i = 0; i < started; i++) {
+        pthread_join(handles[i], NULL);
+    }
+    if (run.num_bands > 1) {
+        pthread_barrier_destroy(&run.barrier);
+    }
+    pthread_cond_destroy(&run.start);
+    pthread_mutex_destroy(&run.lock);
+    free(handles);
+    free(bands);
+    free(scratch);
+    life->current = (life->current + generations) & 1;
+    life->generation += generations;
+    return true;
+}
+
+#define LIFE_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            abort(); \
+        } \
+    } while (0)
+
+// One generation of a byte-per-cell board, one cell at a time.
+void life_reference_step(int width, int height, const uint8_t *cells, uint8_t *next) {
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            int count = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    if (dx || dy) {
+                        count += cells[(y + dy + height) % height * width + (x + dx + width) % width];
+                    }
+                }
+            }
+            next[y * width + x] = count == 3 || (count == 2 && cells[y * width + x]);
+        }
+    }
+}
+
+void life_test(void) {
+    // Widths on either side of the word size, thin and single-cell boards,
+    // and enough rows for several bands.
+    const int sizes[][2] = {{1, 1}, {1, 9}, {3, 5}, {63, 7}, {64, 3}, {65, 9}, {130, 40}, {200, 1}, {129, 100}};
+    for (size_t i = 0; i < sizeof(sizes)/sizeof(*sizes); i++) {
+        int width = sizes[i][0], height = sizes[i][1];
+        size_t num_cells = (size_t)width * height;
+        uint8_t *expected = malloc(num_cells);
+        uint8_t *scratch = malloc(num_cells);
+        uint8_t *cells = malloc(num_cells);
+        for (int threads = 1; threads <= 8; threads += 3) {
+            Life *life = life_new(width, height);
+            life_randomize(life, i * 10 + threads);
+            life_get_cells(life, expected);
+            for (int gens = 1; gens <= 3; gens++) {
+                LIFE_CHECK(life_step(life, gens, threads));
+                for (int gen = 0; gen < gens; gen++) {
+                    life_reference_step(width, height, expected, scratch);
+                    memcpy(expected, scratch, num_cells);
+                }
+                life_get_cells(life, cells);
+                LIFE_CHECK(memcmp(cells, expected, num_cells) == 0);
+            }
+            LIFE_CHECK(life_generation(life) == 6);
+            uint64_t population = 0;
+            for (size_t c = 0; c < num_cells; c++) {
+                population += cells[c];
+            }
+            LIFE_CHECK(life_population(life) == population);
+            life_set_cells(life, expected);
+            life_get_cells(life, cells);
+            LIFE_CHECK(memcmp(cells, expected, num_cells) == 0);
+            life_free(life);
+        }
+        free(expected);
+        free(scratch);
+        free(cells);
+    }
+
+    // A glider crosses every edge of a 70x8 torus and comes back where it
+    // started after 4 generations per cell of travel.
+    Life *life = life_new(70, 8);
+    const int glider[][2] = {{1, 0}, {2, 1}, {0, 2}, {1, 2}, {2, 2}};
+    for (int i = 0; i < 5; i++) {
+        life_set(life, glider[i][0] + 66, glider[i][1] + 5, true);
+    }
+    life_step(life, 4, 1);
+    LIFE_CHECK(life_get(life, 67, 0) && life_get(life, 69, 7) && life_population(life) == 5);
+    life_step(life, 4 * 280 - 4, 1);
+    for (int i = 0; i < 5; i++) {
+        LIFE_CHECK(life_get(life, glider[i][0] + 66, glider[i][1] + 5));
+    }
+    LIFE_CHECK(life_population(life) == 5);
+    life_set(life, 67, 5, false);
+    LIFE_CHECK(!life_get(life, 67, 5) && life_population(life) == 4);
+    life_free(life);
+
+    LIFE_CHECK(life_new(0, 5) == NULL && life_new(5, -1) == NULL);
+}
@@ -0,0 +1,43 @@
+// Conway's Game of Life on a toroidal board, packed 64 cells to a word.
+//
+// The board wraps around at every edge: the cell past the right end of a
+// row is the first cell of the same row, and the row below the last is the
+// first. Cells are addressed as (x, y) with 0 <= x < width and 0 <= y < height.
+#ifndef LIFE_H
+#define LIFE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct Life Life;
+
+// Returns an empty board, or NULL if the size is not positive or the memory
+// cannot be had.
+Life *life_new(int width, int height);
+void life_free(Life *life);
+
+int life_width(const Life *life);
+int life_height(const Life *life);
+// Generations stepped since the board was made.
+uint64_t life_generation(const Life *life);
+
+bool life_get(const Life *life, int x, int y);
+void life_set(Life *life, int x, int y, bool alive);
+// Copies the board to or from width * height bytes, row by row, one byte
+// per cell, nonzero for alive.
+void life_get_cells(const Life *life, uint8_t *cells);
+void life_set_cells(Life *life, const uint8_t *cells);
+// Makes each cell alive with probability one half, from a seeded generator.
+void life_randomize(Life *life, uint64_t seed);
+uint64_t life_population(const Life *life);
+
+// Steps the board by the given number of generations, with the rows split
+// into bands across up to the given number of threads. Returns false, with
+// the board unchanged, if the memory for a single band cannot be had.
+bool life_step(Life *life, int generations, int threads);
+
+// Checks the stepper against a cell-by-cell reference; asserts on failure.
+void life_test(void);
+
+#endif
@@ -0,0 +1,170 @@
+// life: runs the engine in life.c on a random board, drawn in the terminal
+// or timed without drawing.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "life.h"
+
+typedef struct Options {
+    int width;
+    int height;
+    int generations;
+    int threads;
+    uint64_t seed;
+    int pause_ms;
+    bool bench;
+    bool test;
+} Options;
+
+void usage(void) {
+    printf("Usage: life [options]\n"
+           "  --width=N           cells per row (default: the terminal's width, or 4096 with --bench)\n"
+           "  --height=N          rows (default: the terminal's height, or 4096 with --bench)\n"
+           "  --generations=N     generations to run (default 100)\n"
+           "  --threads=N         split the rows into bands over up to N threads (default: one per core)\n"
+           "  --seed=N            seed for the random starting board (default 1)\n"
+           "  --pause=MS          delay between drawn generations (default 250)\n"
+           "  --bench             time the generations without drawing, on one thread and on --threads\n"
+           "  --test              run the built-in tests\n");
+}
+
+// Parses a positive int option value, or returns 0 if there is none.
+int option_int(const char *arg, const char *name) {
+    size_t len = strlen(name);
+    if (strncmp(arg, name, len) != 0 || arg[len] != '=') {
+        return 0;
+    }
+    int value = atoi(arg + len + 1);
+    return value > 0 ? value : 0;
+}
+
+double now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+void draw(const Life *life, uint8_t *cells, int generation) {
+    int width = life_width(life);
+    life_get_cells(life, cells);
+    // Home the cursor and clear, then the rows and a status line.
+    printf("\x1b[H\x1b[2J");
+    char *line = malloc(width + 1);
+    for (int y = 0; y < life_height(life); y++) {
+        for (int x = 0; x < width; x++) {
+            line[x] = cells[y * width + x] ? '*' : ' ';
+        }
+        line[width] = 0;
+        puts(line);
+    }
+    free(line);
+    printf("generation %d, %llu alive. Press Ctrl-C to quit.", generation,
+           (unsigned long long)life_population(life));
+    fflush(stdout);
+}
+
+double bench_run(const Options *options, int threads) {
+    Life *life = life_new(options->width, options->height);
+    if (!life) {
+        printf("Cannot make a %dx%d board\n", options->width, options->height);
+        exit(1);
+    }
+    life_randomize(life, options->seed);
+    double start = now();
+    if (!life_step(life, options->generations, threads)) {
+        printf("Cannot step a %dx%d board\n", options->width, options->height);
+        exit(1);
+    }
+    double seconds = now() - start;
+    printf("%d thread%s: %.1f ms, %.2f billion cell updates/s, %llu alive at the end\n", threads,
+           threads == 1 ? "" : "s", seconds * 1e3,
+           (double)options->width * options->height * options->generations / seconds * 1e-9,
+           (unsigned long long)life_population(life));
+    life_free(life);
+    return seconds;
+}
+
+int main(int argc, char **argv) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    Options options = {.generations = 100, .threads = cores > 0 ? (int)cores : 1, .seed = 1, .pause_ms = 250};
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        int value;
+        if ((value = option_int(arg, "--width")) > 0) {
+            options.width = value;
+        } else if ((value = option_int(arg, "--height")) > 0) {
+            options.height = value;
+        } else if ((value = option_int(arg, "--generations")) > 0) {
+            options.generations = value;
+        } else if ((value = option_int(arg, "--threads")) > 0) {
+            options.threads = value;
+        } else if (strncmp(arg, "--seed=", 7) == 0) {
+            options.seed = strtoull(arg + 7, NULL, 10);
+        } else if (strncmp(arg, "--pause=", 8) == 0) {
+            options.pause_ms = atoi(arg + 8);
+        } else if (strcmp(arg, "--bench") == 0) {
+            options.bench = true;
+        } else if (strcmp(arg, "--test") == 0) {
+            options.test = true;
+        } else if (strcmp(arg, "--help") == 0) {
+            usage();
+            return 0;
+        } else {
+            printf("Unknown option '%s'\n", arg);
+            usage();
+            return 1;
+        }
+    }
+    if (options.test) {
+        life_test();
+        printf("All tests passed\n");
+        return 0;
+    }
+    if (options.bench) {
+        options.width = options.width ? options.width : 4096;
+        options.height = options.height ? options.height : 4096;
+        printf("%dx%d board, %d generations, %ld cores online\n", options.width, options.height,
+               options.generations, cores);
+        double single = bench_run(&options, 1);
+        if (options.threads > 1) {
+            double multi = bench_run(&options, options.threads);
+            printf("speed-up: %.2fx\n", single / multi);
+        }
+        return 0;
+    }
+
+    // Like conway.py, fill the terminal but for a status line.
+    struct winsize size;
+    bool tty = ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) == 0 && size.ws_col > 0 && size.ws_row > 1;
+    options.width = options.width ? options.width : tty ? size.ws_col : 80;
+    options.height = options.height ? options.height : tty ? size.ws_row - 1 : 24;
+    Life *life = life_new(options.width, options.height);
+    if (!life) {
+        printf("Cannot make a %dx%d board\n", options.width, options.height);
+        return 1;
+    }
+    life_randomize(life, options.seed);
+    uint8_t *cells = malloc((size_t)options.width * options.height);
+    struct timespec pause = {options.pause_ms / 1000, options.pause_ms % 1000 * 1000000L};
+    int status = 0;
+    for (int generation = 0;; generation++) {
+        draw(life, cells, generation);
+        if (generation == options.generations) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+        if (!life_step(life, 1, options.threads)) {
+            printf("\nCannot step a %dx%d board", options.width, options.height);
+            status = 1;
+            break;
+        }
+    }
+    printf("\n");
+    free(cells);
+    life_free(life);
+    return status;
+}
@@ -1,4 +1,5 @@
 import bext
+import ctypes, os
 import time, random, sys
 
 PAUSE = 0.05
@@ -6,12 +7,35 @@ MAX_POPULATION = 2000
 MUTATION = 0.02
 DESIRED = "what about longer strings such as this"
 POSSIBLE_CHARACTERS = "abcdefghijklmnopqrstuvwxyz "
+THREADS = os.cpu_count() or 1
+# The native engine built from evolve/, used when it is there.
+EVOLVE_LIB = os.environ.get('EVOLVE_LIB', os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                                                       'evolve', 'build', 'libevolve.so'))
 
 population = []
 next_population = []
 fitness_pool = []
 fittest_index = 0
 generations = 0
+evolver = None
+
+
+def load_evolve():
+    try:
+        lib = ctypes.CDLL(EVOLVE_LIB)
+    except OSError:
+        return None
+    lib.evolve_new.restype = ctypes.c_void_p
+    lib.evolve_new.argtypes = [ctypes.c_char_p, ctypes.c_char_p, ctypes.c_size_t, ctypes.c_double,
+                               ctypes.c_uint64]
+    lib.evolve_run.restype = ctypes.c_bool
+    lib.evolve_run.argtypes = [ctypes.c_void_p, ctypes.c_int, ctypes.c_int]
+    lib.evolve_best.restype = ctypes.c_size_t
+    lib.evolve_best.argtypes = [ctypes.c_void_p, ctypes.c_char_p]
+    return lib
+
+
+evolve = load_evolve()
 
 
 def random_character():
@@ -97,14 +121,24 @@ def generate_new_children():
 
 def update():
     global MAX_POPULATION
+    if evolver:
+        evolve.evolve_run(evolver, 1, THREADS)
+        return
     calculate_fitness_pool()
     generate_new_children()
 
 
+def fittest():
+    if evolver:
+        text = ctypes.create_string_buffer(len(DESIRED) + 1)
+        matches = evolve.evolve_best(evolver, text)
+        return text.value.decode(), pow(matches, 2)
+    return population[fittest_index], fitness_pool[fittest_index]
+
+
 def draw():
     global DESIRED, generations
-    most_fit = population[fittest_index]
-    most_fit_score = fitness_pool[fittest_index]
+    most_fit, most_fit_score = fittest()
     bext.clear()
     # bext.goto(0, 0)
     generations = generations + 1
@@ -114,11 +148,17 @@ def draw():
 
 
 def main():
-    global PAUSE, MAX_POPULATION, population, next_population
+    global PAUSE, MAX_POPULATION, population, next_population, evolver
     step = 0
 
-    for i in range(0, MAX_POPULATION):
-        population.append(generate_random())
+    if evolve:
+        # No mutation, like generate_new_children(), which does not call mutate().
+        evolver = evolve.evolve_new(DESIRED.encode(), POSSIBLE_CHARACTERS.encode(), MAX_POPULATION, 0.0,
+                                    random.getrandbits(64))
+    # Without the library, or if it could not make the population, evolve in Python.
+    if not evolver:
+        for i in range(0, MAX_POPULATION):
+            population.append(generate_random())
 
     while True:
         try: